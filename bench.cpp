@@ -0,0 +1,436 @@
+// Benchmark suite for the object store paths of mygit. It generates a synthetic repository
+// (file count, size distribution and directory depth are configurable), times hashing,
+// compression, blob creation, add, write-tree, tree building, commit, status and checkout on it, and writes
+// the results as JSON so they can be compared between releases.
+//
+// Build it like mygit itself; it compiles main.cpp in, so every internal function is reachable:
+//   g++ -std=c++17 -O2 bench.cpp -o mygit-bench.exe -lws2_32 -lssl -lcrypto -lz -lstdc++fs
+//
+// ./mygit-bench.exe [--files=N] [--min-size=B] [--max-size=B] [--size-dist=log|uniform]
+//                   [--depth=D] [--fanout=F] [--modify=PERCENT] [--seed=S] [-j N]
+//                   [--object-format=sha1|sha256] [--config=section.key=value]...
+//                   [--dir=PATH] [--keep] [--out=results.json]
+
+#define main mygitMain
+#include "main.cpp"
+#undef main
+
+// ============= BENCHMARK OPTIONS =============
+
+struct BenchOptions
+{
+    size_t files = 10000;
+    size_t minSize = 64;
+    size_t maxSize = 64 * 1024;
+    bool logSizes = true;     // Sizes are log-uniform (most files small, as in source trees) or uniform
+    unsigned depth = 3;       // Directory levels below the top
+    unsigned fanout = 8;      // Subdirectories per directory
+    unsigned modifyPercent = 10; // Files changed between the two commits
+    uint64_t seed = 1;
+    unsigned jobs = ThreadPool::defaultJobs();
+    HashAlgorithm format = HashAlgorithm::SHA1;
+    vector<pair<string, string>> config; // Extra repository settings ("core.codec" -> "zstd")
+    string dir = "mygit-bench";
+    bool keep = false;        // Leave the generated repository behind
+    string out;               // JSON output file ("" = stdout)
+};
+
+// Parses the command line; returns false (after printing usage) on anything unknown
+bool parseBenchOptions(int argc, char *argv[], BenchOptions &options)
+{
+    auto value = [](const string &arg, const char *name, string &out)
+    {
+        size_t len = strlen(name);
+        if (arg.compare(0, len, name) != 0)
+            return false;
+        out = arg.substr(len);
+        return true;
+    };
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i], v;
+        if (value(arg, "--files=", v))
+            options.files = static_cast<size_t>(max(1LL, atoll(v.c_str())));
+        else if (value(arg, "--min-size=", v))
+            options.minSize = static_cast<size_t>(max(0LL, atoll(v.c_str())));
+        else if (value(arg, "--max-size=", v))
+            options.maxSize = static_cast<size_t>(max(1LL, atoll(v.c_str())));
+        else if (value(arg, "--size-dist=", v) && (v == "log" || v == "uniform"))
+            options.logSizes = v == "log";
+        else if (value(arg, "--depth=", v))
+            options.depth = static_cast<unsigned>(max(0, atoi(v.c_str())));
+        else if (value(arg, "--fanout=", v))
+            options.fanout = static_cast<unsigned>(max(1, atoi(v.c_str())));
+        else if (value(arg, "--modify=", v))
+            options.modifyPercent = static_cast<unsigned>(min(100, max(0, atoi(v.c_str()))));
+        else if (value(arg, "--seed=", v))
+            options.seed = strtoull(v.c_str(), nullptr, 10);
+        else if (arg == "-j" && i + 1 < argc)
+            options.jobs = static_cast<unsigned>(max(1, atoi(argv[++i])));
+        else if (arg == "--object-format=sha256" || arg == "--object-format=sha1")
+            options.format = arg == "--object-format=sha256" ? HashAlgorithm::SHA256 : HashAlgorithm::SHA1;
+        else if (value(arg, "--config=", v) && v.find('=') != string::npos && v.find('.') < v.find('='))
+            options.config.emplace_back(v.substr(0, v.find('=')), v.substr(v.find('=') + 1));
+        else if (value(arg, "--dir=", v) && !v.empty())
+            options.dir = v;
+        else if (arg == "--keep")
+            options.keep = true;
+        else if (value(arg, "--out=", v))
+            options.out = v;
+        else
+        {
+            cerr << "Usage: mygit-bench [--files=N] [--min-size=B] [--max-size=B] [--size-dist=log|uniform]" << endl
+                 << "                   [--depth=D] [--fanout=F] [--modify=PERCENT] [--seed=S] [-j N]" << endl
+                 << "                   [--object-format=sha1|sha256] [--config=section.key=value]..." << endl
+                 << "                   [--dir=PATH] [--keep] [--out=results.json]" << endl;
+            return false;
+        }
+    }
+    if (options.minSize > options.maxSize)
+        swap(options.minSize, options.maxSize);
+    return true;
+}
+
+// ============= SYNTHETIC REPOSITORY =============
+
+// One generated file
+struct BenchFile
+{
+    string path;
+    size_t size;
+};
+
+// Text the files are cut from: lines of random words, so content compresses like source code
+string makeTextPool(size_t size, mt19937_64 &random)
+{
+    static const char *const WORDS[] = {"int", "return", "if", "else", "for", "while", "const", "string", "vector",
+                                        "size_t", "auto", "void", "class", "struct", "public", "private", "static",
+                                        "true", "false", "nullptr", "template", "typename", "namespace", "std",
+                                        "data", "value", "index", "count", "path", "result", "error", "buffer",
+                                        "=", "==", "+=", "(", ")", "{", "}", ";", "<<", "->", "0", "1", "42"};
+    const size_t wordCount = sizeof(WORDS) / sizeof(WORDS[0]);
+    string pool;
+    pool.reserve(size + 128);
+    while (pool.size() < size)
+    {
+        size_t indent = random() % 4;
+        pool.append(indent * 4, ' ');
+        for (size_t words = 3 + random() % 10; words > 0; words--)
+        {
+            pool += WORDS[random() % wordCount];
+            pool += words > 1 ? ' ' : '\n';
+        }
+    }
+    pool.resize(size);
+    return pool;
+}
+
+// Creates the directories (depth levels of fanout each) and files of the synthetic working tree.
+// Every file starts with a line naming it, so no two are identical and none is deduplicated.
+vector<BenchFile> generateWorkingTree(const BenchOptions &options, uint64_t &totalBytes)
+{
+    mt19937_64 random(options.seed);
+    vector<string> dirs{""};
+    for (size_t level = 0, begin = 0; level < options.depth; level++)
+    {
+        size_t end = dirs.size();
+        for (size_t d = begin; d < end; d++)
+        {
+            for (unsigned k = 0; k < options.fanout; k++)
+            {
+                string name = "d" + to_string(k);
+                dirs.push_back(dirs[d].empty() ? name : dirs[d] + "/" + name);
+                createDirectories(dirs.back());
+            }
+        }
+        begin = end;
+    }
+
+    string pool = makeTextPool(max<size_t>(1 << 20, 2 * options.maxSize), random);
+    double logMin = log(double(max<size_t>(options.minSize, 1))), logMax = log(double(options.maxSize));
+    vector<BenchFile> files;
+    files.reserve(options.files);
+    totalBytes = 0;
+    for (size_t i = 0; i < options.files; i++)
+    {
+        double u = double(random() >> 11) / double(1ull << 53);
+        size_t size = options.logSizes ? static_cast<size_t>(exp(logMin + u * (logMax - logMin)))
+                                       : options.minSize + static_cast<size_t>(u * double(options.maxSize - options.minSize));
+        size = min(max(size, options.minSize), options.maxSize);
+        const string &dir = dirs[random() % dirs.size()];
+        string path = (dir.empty() ? "" : dir + "/") + "file" + to_string(i) + ".txt";
+        string content = path + "\n";
+        if (size > content.size())
+            content.append(pool, random() % (pool.size() - size + 1), size - content.size());
+        ofstream(path, ios::binary) << content;
+        files.push_back(BenchFile{path, content.size()});
+        totalBytes += content.size();
+    }
+    return files;
+}
+
+// ============= MEASUREMENT =============
+
+// One measured operation
+struct BenchResult
+{
+    string name;
+    double seconds;
+    uint64_t items; // Files, objects or buffers processed
+    uint64_t bytes;
+};
+
+// Runs fn once with the commands' normal output discarded; returns the elapsed seconds
+double timeOnce(const function<void()> &fn)
+{
+    streambuf *saved = cout.rdbuf(nullptr);
+    auto start = chrono::steady_clock::now();
+    fn();
+    flushObjectWrites();
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    cout.rdbuf(saved);
+    cout.clear();
+    return seconds;
+}
+
+// Repeats fn until it has run for a measurable time; returns the seconds per run
+double timeRepeated(const function<void()> &fn)
+{
+    size_t runs = 0;
+    auto start = chrono::steady_clock::now();
+    double seconds = 0;
+    do
+    {
+        fn();
+        runs++;
+        seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (seconds < 0.25);
+    return seconds / runs;
+}
+
+// Escapes a string for a JSON document
+string jsonString(const string &s)
+{
+    string out = "\"";
+    for (char c : s)
+    {
+        if (c == '"' || c == '\\')
+            out += string("\\") + c;
+        else if (static_cast<unsigned char>(c) < 0x20)
+        {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else
+            out += c;
+    }
+    return out + "\"";
+}
+
+// Formats the options and results as one JSON document
+string benchReportJson(const BenchOptions &options, const vector<BenchResult> &results)
+{
+    ostringstream json;
+    json << fixed << setprecision(6);
+    json << "{\n  \"version\": 1,\n  \"config\": {\n";
+    json << "    \"files\": " << options.files << ",\n";
+    json << "    \"min_size\": " << options.minSize << ",\n";
+    json << "    \"max_size\": " << options.maxSize << ",\n";
+    json << "    \"size_distribution\": \"" << (options.logSizes ? "log" : "uniform") << "\",\n";
+    json << "    \"depth\": " << options.depth << ",\n";
+    json << "    \"fanout\": " << options.fanout << ",\n";
+    json << "    \"modify_percent\": " << options.modifyPercent << ",\n";
+    json << "    \"seed\": " << options.seed << ",\n";
+    json << "    \"jobs\": " << options.jobs << ",\n";
+    json << "    \"object_format\": \"" << hashAlgorithmName(options.format) << "\",\n";
+    json << "    \"hash_backend\": " << jsonString(activeHashBackend().name) << ",\n";
+    json << "    \"codec\": \"" << CODEC_NAMES[static_cast<int>(compressionSettings().codec)] << "\",\n";
+    json << "    \"settings\": {";
+    for (size_t i = 0; i < options.config.size(); i++)
+        json << (i ? ", " : "") << jsonString(options.config[i].first) << ": " << jsonString(options.config[i].second);
+    json << "},\n";
+#ifdef __VERSION__
+    json << "    \"compiler\": " << jsonString(__VERSION__) << "\n";
+#else
+    json << "    \"compiler\": \"unknown\"\n";
+#endif
+    json << "  },\n  \"results\": [\n";
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const BenchResult &r = results[i];
+        double seconds = max(r.seconds, 1e-9);
+        json << "    {\"name\": " << jsonString(r.name) << ", \"seconds\": " << r.seconds << ", \"items\": " << r.items
+             << ", \"bytes\": " << r.bytes << ", \"items_per_second\": " << r.items / seconds
+             << ", \"mb_per_second\": " << r.bytes / seconds / 1e6 << "}" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+    json << "  ]\n}\n";
+    return json.str();
+}
+
+// ============= MAIN =============
+
+int main(int argc, char *argv[])
+{
+    BenchOptions options;
+    if (!parseBenchOptions(argc, argv, options))
+        return 1;
+    string outPath = options.out.empty() ? "" : fs::absolute(options.out).string();
+
+    // Never delete a directory that is not a previous benchmark repository
+    error_code ec;
+    if (fs::exists(options.dir) && !fs::is_empty(options.dir, ec))
+    {
+        if (!fs::exists(fs::path(options.dir) / REPO_DIR))
+        {
+            cerr << "Error: " << options.dir << " exists and is not a benchmark repository" << endl;
+            return 1;
+        }
+        fs::remove_all(options.dir);
+    }
+    fs::create_directories(options.dir);
+    fs::path startDir = fs::current_path();
+    fs::current_path(options.dir);
+
+    vector<BenchResult> results;
+    auto report = [&results](const string &name, double seconds, uint64_t items, uint64_t bytes)
+    {
+        results.push_back(BenchResult{name, seconds, items, bytes});
+        cerr << left << setw(22) << name << right << fixed << setprecision(3) << setw(10) << seconds * 1000 << " ms"
+             << setw(12) << items << " items" << setw(10) << setprecision(1) << bytes / max(seconds, 1e-9) / 1e6 << " MB/s" << endl;
+    };
+
+    timeOnce([&]
+             { cmdInit(options.format); });
+    {
+        ofstream config(REPO_DIR + "\\config", ios::app);
+        map<string, vector<pair<string, string>>> sections;
+        for (const auto &setting : options.config)
+        {
+            size_t dot = setting.first.find('.');
+            sections[setting.first.substr(0, dot)].emplace_back(setting.first.substr(dot + 1), setting.second);
+        }
+        for (const auto &section : sections)
+        {
+            config << "[" << section.first << "]\n";
+            for (const auto &kv : section.second)
+                config << "\t" << kv.first << " = " << kv.second << "\n";
+        }
+    }
+    if (!loadObjectFormat())
+        return 1;
+
+    uint64_t totalBytes = 0;
+    vector<BenchFile> files;
+    double generateSeconds = timeOnce([&]
+                                      { files = generateWorkingTree(options, totalBytes); });
+    report("generate", generateSeconds, files.size(), totalBytes);
+
+    // In-memory primitives on a sample of the generated content
+    const size_t SAMPLE_BUDGET = 64 * 1024 * 1024;
+    vector<string> sample;
+    uint64_t sampleBytes = 0;
+    for (size_t i = 0; i < files.size() && sampleBytes < SAMPLE_BUDGET; i++)
+    {
+        sample.push_back(readFile(files[i].path));
+        sampleBytes += sample.back().size();
+    }
+    report("hash", timeRepeated([&]
+                                { for (const auto &content : sample)
+                                      computeHash(content); }),
+           sample.size(), sampleBytes);
+    vector<string> compressed(sample.size());
+    report("compress", timeRepeated([&]
+                                    { for (size_t i = 0; i < sample.size(); i++)
+                                          compressed[i] = compressData(sample[i]); }),
+           sample.size(), sampleBytes);
+    report("decompress", timeRepeated([&]
+                                      { for (const auto &data : compressed)
+                                            decompressData(data); }),
+           sample.size(), sampleBytes);
+    sample.clear();
+    compressed.clear();
+
+    // Whole commands on the working tree
+    report("create-blob", timeOnce([&]
+                                   { for (const auto &file : files)
+                                         createBlob(file.path, false); }),
+           files.size(), totalBytes);
+    report("add", timeOnce([]
+                           { cmdAdd({"."}); }),
+           files.size(), totalBytes);
+    report("add-unchanged", timeOnce([]
+                                     { cmdAdd({"."}); }),
+           files.size(), 0);
+    report("status-clean", timeOnce([&options]
+                                    { cmdStatus(true, options.jobs); }),
+           files.size(), 0);
+    report("write-tree", timeOnce([&options]
+                                  { createTree(".", options.jobs); }),
+           files.size(), totalBytes);
+    report("commit", timeOnce([]
+                              { cmdCommit("bench: initial tree"); }),
+           files.size(), 0);
+    {
+        // Every tree of the index built again from an empty cache tree; the objects exist by
+        // now, so this measures serializing and hashing them (items are trees)
+        CacheTree unused;
+        vector<IndexEntry> entries = readSortedIndex(unused);
+        size_t trees = 0;
+        double seconds = timeRepeated([&]
+                                      { CacheTree cacheTree;
+                                        createTreeFromIndex(entries, cacheTree);
+                                        trees = cacheTree.size(); });
+        report("build-trees", seconds, trees, 0);
+    }
+    ObjectId first = getHEAD();
+
+    // A second commit changing modifyPercent of the files
+    mt19937_64 random(options.seed + 1);
+    size_t modified = 0;
+    uint64_t modifiedBytes = 0;
+    for (const auto &file : files)
+    {
+        if (random() % 100 >= options.modifyPercent)
+            continue;
+        ofstream(file.path, ios::app) << "modified\n";
+        modified++;
+        modifiedBytes += file.size + 9;
+    }
+    report("add-modified", timeOnce([]
+                                    { cmdAdd({"."}); }),
+           modified, modifiedBytes);
+    report("commit-incremental", timeOnce([]
+                                          { cmdCommit("bench: modified files"); }),
+           modified, 0);
+    ObjectId second = getHEAD();
+
+    report("checkout-incremental", timeOnce([&]
+                                            { cmdCheckout(first.hex(), options.jobs); }),
+           modified, modifiedBytes);
+    timeOnce([&]
+             { cmdCheckout(second.hex(), options.jobs); });
+
+    // Full checkout: an empty working tree and no current commit
+    string branch = currentBranch();
+    for (const auto &entry : fs::directory_iterator("."))
+    {
+        if (entry.path().filename().string() != REPO_DIR)
+            fs::remove_all(entry.path());
+    }
+    fs::remove(REPO_DIR + "\\refs\\heads\\" + (branch.empty() ? "master" : branch), ec);
+    report("checkout-full", timeOnce([&]
+                                     { cmdCheckout(second.hex(), options.jobs); }),
+           files.size(), totalBytes + modified * 9);
+
+    fs::current_path(startDir);
+    if (!options.keep)
+        fs::remove_all(options.dir, ec);
+
+    string json = benchReportJson(options, results);
+    if (outPath.empty())
+        cout << json;
+    else
+        writeFile(outPath, json);
+    return 0;
+}
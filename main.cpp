@@ -1,922 +1,12143 @@
-#include <iostream>
-#include <fstream>
-#include <sstream>
-#include <string>
-#include <vector>
-#include <iomanip>
-#include <filesystem>
-#include <windows.h>
-#include <algorithm>     // Used for std::sort and std::remove_if
-#include <openssl/sha.h> // Used for SHA-1 hashing
-#include <zlib.h>        // Used for compression/decompression
-
-using namespace std;
-namespace fs = std::filesystem;
-
-const string REPO_DIR = ".mygit";
-const int BUFFER_SIZE = 8192; // Not directly used, but good practice
-
-// Utility function to extract the filename from a full or relative path
-string getFilename(const string &path)
-{
-    size_t pos = path.find_last_of("\\/");
-    if (pos != string::npos)
-    {
-        return path.substr(pos + 1);
-    }
-    return path;
-}
-
-// ============= UTILITY FUNCTIONS =============
-
-// Computes the SHA-1 hash of the given data string
-string computeSHA1(const string &data)
-{
-    unsigned char hash[SHA_DIGEST_LENGTH];
-    SHA1(reinterpret_cast<const unsigned char *>(data.c_str()), data.size(), hash);
-
-    stringstream ss;
-    // Format the hash as a 40-character hexadecimal string
-    for (int i = 0; i < SHA_DIGEST_LENGTH; i++)
-    {
-        ss << hex << setw(2) << setfill('0') << (int)hash[i];
-    }
-    return ss.str();
-}
-
-// Compresses data using the zlib library
-string compressData(const string &data)
-{
-    uLongf compressedSize = compressBound(data.size()); // Estimate max compressed size
-    string compressed(compressedSize, '\0');
-
-    if (compress(reinterpret_cast<Bytef *>(&compressed[0]), &compressedSize,
-                 reinterpret_cast<const Bytef *>(data.c_str()), data.size()) != Z_OK)
-    {
-        cerr << "Error: Compression failed" << endl;
-        return "";
-    }
-
-    compressed.resize(compressedSize); // Truncate to actual size
-    return compressed;
-}
-
-// Decompresses data using the zlib library with dynamic buffer resizing
-string decompressData(const string &compressed)
-{
-    uLongf uncompressedSize = compressed.size() * 10; // Initial size guess
-    string uncompressed;
-
-    while (true)
-    {
-        uncompressed.resize(uncompressedSize);
-        // Attempt decompression
-        int result = uncompress(reinterpret_cast<Bytef *>(&uncompressed[0]), &uncompressedSize,
-                                reinterpret_cast<const Bytef *>(compressed.c_str()), compressed.size());
-
-        if (result == Z_OK)
-        {
-            uncompressed.resize(uncompressedSize); // Truncate to actual size
-            return uncompressed;
-        }
-        else if (result == Z_BUF_ERROR)
-        {
-            uncompressedSize *= 2; // Double the buffer size and try again
-        }
-        else
-        {
-            cerr << "Error: Decompression failed" << endl;
-            return "";
-        }
-    }
-}
-
-// Standard file system utilities
-bool fileExists(const string &path)
-{
-    return fs::exists(path);
-}
-
-bool isDirectory(const string &path)
-{
-    return fs::is_directory(path);
-}
-
-void createDirectories(const string &path)
-{
-    fs::create_directories(path);
-}
-
-// Reads the entire content of a file into a string (binary mode)
-string readFile(const string &path)
-{
-    if (!fs::exists(path))
-    {
-        cerr << "Error: Cannot read file " << path << endl;
-        return "";
-    }
-    ifstream file(path, ios::binary);
-    // Efficiently reads the entire file content using stream iterators
-    return string((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
-}
-
-// Writes data to a file, creating parent directories if necessary (binary mode)
-void writeFile(const string &path, const string &data)
-{
-    fs::create_directories(fs::path(path).parent_path());
-    ofstream file(path, ios::binary);
-    if (!file)
-    {
-        cerr << "Error: Cannot write file " << path << endl;
-        return;
-    }
-    file << data;
-}
-
-// Determines the file mode (permissions) for Tree entries (040000 for tree, 100755 for executable, 100644 otherwise)
-string getPermissions(const string &path)
-{
-    if (!fs::exists(path))
-        return "100644";
-    return fs::is_directory(path) ? "040000" : ((fs::status(path).permissions() & fs::perms::owner_exec) != fs::perms::none) ? "100755"
-                                                                                                                             : "100644";
-}
-
-// ============= OBJECT STORAGE =============
-
-// Returns the full path where the object with the given SHA is stored (e.g., .mygit/objects/aa/bbbb...)
-string getObjectPath(const string &sha)
-{
-    return REPO_DIR + "\\objects\\" + sha.substr(0, 2) + "\\" + sha.substr(2);
-}
-
-// Compresses and writes the raw object content (header + data) to the object database
-void writeObject(const string &sha, const string &content)
-{
-    string path = getObjectPath(sha);
-    string compressed = compressData(content);
-    if (!compressed.empty())
-    {
-        writeFile(path, compressed);
-    }
-}
-
-// Reads, decompresses, and returns the raw object content from the object database
-string readObject(const string &sha)
-{
-    string path = getObjectPath(sha);
-    if (!fileExists(path))
-    {
-        cerr << "Error: Object " << sha << " not found" << endl;
-        return "";
-    }
-    string compressed = readFile(path);
-    return decompressData(compressed);
-}
-
-// ============= BLOB OPERATIONS =============
-
-// Creates a Blob object for the file content
-string createBlob(const string &filepath)
-{
-    string content = readFile(filepath);
-    if (content.empty() && !fileExists(filepath))
-        return "";
-
-    // Blob object format: "blob <size>\0<content>"
-    string blobData = "blob " + to_string(content.size()) + string(1, '\0') + content;
-    string sha = computeSHA1(blobData);
-
-    writeObject(sha, blobData);
-    return sha;
-}
-
-// ============= TREE OPERATIONS =============
-
-// Structure to hold one entry (file or directory) within a Tree object
-struct TreeEntry
-{
-    string mode;
-    string name;
-    string sha;
-    bool isTree;
-};
-
-// Forward declaration for recursion
-string createTree(const string &path);
-
-// Recursively scans a directory, creates Blobs/Trees for its contents, and returns a list of TreeEntry structs
-vector<TreeEntry> listDirectory(const string &path)
-{
-    vector<TreeEntry> entries;
-    for (const auto &entry : fs::directory_iterator(path))
-    {
-        string name = entry.path().filename().string();
-        // Skip . (current), .. (parent), and the repository directory (.mygit)
-        if (name == "." || name == ".." || name == REPO_DIR)
-            continue;
-
-        string fullPath = (path == ".") ? name : path + "\\" + name;
-        TreeEntry te;
-        te.name = name;
-        te.mode = getPermissions(fullPath);
-        te.isTree = isDirectory(fullPath);
-
-        if (te.isTree)
-        {
-            // Recursion: If it's a directory, create a Tree object for it
-            te.sha = createTree(fullPath);
-        }
-        else
-        {
-            // If it's a file, create a Blob object for it
-            te.sha = createBlob(fullPath);
-        }
-
-        if (!te.sha.empty())
-        {
-            entries.push_back(te);
-        }
-    }
-
-    // Sort entries by name (required for consistent Tree SHA-1 hash)
-    sort(entries.begin(), entries.end(),
-         [](const TreeEntry &a, const TreeEntry &b)
-         { return a.name < b.name; });
-
-    return entries;
-}
-
-// Creates a Tree object from the directory contents found by listDirectory
-string createTree(const string &path)
-{
-    vector<TreeEntry> entries = listDirectory(path);
-
-    stringstream treeContent;
-    // Format: mode name\0sha-1 (repeated)
-    for (const auto &entry : entries)
-    {
-        treeContent << entry.mode << " " << entry.name << '\0' << entry.sha;
-    }
-
-    // Tree object format: "tree <size>\0<content>"
-    string treeData = "tree " + to_string(treeContent.str().size()) + '\0' + treeContent.str();
-    string sha = computeSHA1(treeData);
-
-    writeObject(sha, treeData); // Write the new Tree object to the database
-    return sha;
-}
-
-// Parses a Tree object's content into a vector of TreeEntry structs
-vector<TreeEntry> parseTree(const string &treeSha)
-{
-    vector<TreeEntry> entries;
-    string treeData = readObject(treeSha);
-    if (treeData.empty())
-        return entries;
-
-    size_t nullPos = treeData.find('\0');
-    if (nullPos == string::npos)
-        return entries;
-
-    // Skip the "tree <size>" header
-    size_t pos = nullPos + 1;
-
-    while (pos < treeData.size())
-    {
-        size_t spacePos = treeData.find(' ', pos);
-        if (spacePos == string::npos)
-            break;
-
-        TreeEntry entry;
-        entry.mode = treeData.substr(pos, spacePos - pos);
-        pos = spacePos + 1;
-
-        size_t nullPos2 = treeData.find('\0', pos);
-        if (nullPos2 == string::npos)
-            break;
-
-        entry.name = treeData.substr(pos, nullPos2 - pos);
-        pos = nullPos2 + 1;
-
-        if (pos + 40 > treeData.size())
-            break;
-        entry.sha = treeData.substr(pos, 40);
-        pos += 40;
-
-        entry.isTree = (entry.mode == "040000");
-        entries.push_back(entry);
-    }
-
-    return entries;
-}
-
-// ============= COMMIT OPERATIONS =============
-
-// Creates a Commit object
-string createCommit(const string &treeSha, const string &parentSha, const string &message)
-{
-    time_t now = time(nullptr);
-    // string timestamp = ctime(&now);
-    // timestamp.pop_back();
-
-    stringstream commitContent;
-    commitContent << "tree " << treeSha << "\n";
-    if (!parentSha.empty() && parentSha != "0000000000000000000000000000000000000000")
-    {
-        commitContent << "parent " << parentSha << "\n";
-    }
-    commitContent << "author User <user@example.com> " << now << " +0000\n";
-    commitContent << "committer User <user@example.com> " << now << " +0000\n";
-    commitContent << "\n"
-                  << message << "\n";
-
-    // Commit object format: "commit <size>\0<content>"
-    string commitData = "commit " + to_string(commitContent.str().size()) + '\0' + commitContent.str();
-    string sha = computeSHA1(commitData);
-
-    writeObject(sha, commitData);
-    return sha;
-}
-
-struct CommitInfo
-{
-    string treeSha;
-    string parentSha;
-    string author;
-    string committer;
-    string message;
-    string timestamp;
-};
-
-// Parses a Commit object's content into a CommitInfo struct
-CommitInfo parseCommit(const string &commitSha)
-{
-    CommitInfo info;
-    string commitData = readObject(commitSha);
-    // ... (parsing logic) ...
-    if (commitData.empty())
-        return info;
-
-    size_t nullPos = commitData.find('\0');
-    if (nullPos == string::npos)
-        return info;
-
-    string content = commitData.substr(nullPos + 1);
-    istringstream stream(content);
-    string line;
-
-    while (getline(stream, line))
-    {
-        if (line.empty())
-            break;
-
-        if (line.substr(0, 5) == "tree ")
-        {
-            info.treeSha = line.substr(5);
-        }
-        else if (line.substr(0, 7) == "parent ")
-        {
-            info.parentSha = line.substr(7);
-        }
-        else if (line.substr(0, 7) == "author ")
-        {
-            info.author = line.substr(7);
-        }
-        else if (line.substr(0, 10) == "committer ")
-        {
-            info.committer = line.substr(10);
-            size_t timePos = info.committer.rfind(' ');
-            if (timePos != string::npos)
-            {
-                info.timestamp = info.committer.substr(timePos + 1);
-            }
-        }
-    }
-
-    // Read commit message (everything after the blank line)
-    while (getline(stream, line))
-    {
-        info.message += line + "\n";
-    }
-
-    return info;
-}
-
-// ============= INDEX OPERATIONS =============
-
-// Structure representing an entry in the staging area (index file)
-struct IndexEntry
-{
-    string path;
-    string sha;
-    string mode;
-};
-
-// Reads the contents of the plaintext index file into a vector of IndexEntry structs
-vector<IndexEntry> readIndex()
-{
-    vector<IndexEntry> entries;
-    string indexPath = REPO_DIR + "\\index";
-    // ... (reading logic) ...
-    if (!fileExists(indexPath))
-        return entries;
-
-    ifstream file(indexPath);
-    string line;
-    while (getline(file, line))
-    {
-        istringstream iss(line);
-        IndexEntry entry;
-        iss >> entry.mode >> entry.sha >> entry.path;
-        entries.push_back(entry);
-    }
-    return entries;
-}
-
-// Writes the vector of IndexEntry structs back to the plaintext index file
-void writeIndex(const vector<IndexEntry> &entries)
-{
-    string indexPath = REPO_DIR + "\\index";
-    ofstream file(indexPath);
-    for (const auto &entry : entries)
-    {
-        file << entry.mode << " " << entry.sha << " " << entry.path << "\n";
-    }
-}
-
-// Adds a file or directory to the staging area (index)
-void addToIndex(const string &path)
-{
-    if (!fileExists(path))
-    {
-        cerr << "Error: File " << path << " does not exist" << endl;
-        return;
-    }
-
-    vector<IndexEntry> index = readIndex();
-
-    if (isDirectory(path))
-    {
-        // Recursively add all files in a directory
-        for (const auto &entry : fs::directory_iterator(path))
-        {
-            string name = entry.path().filename().string();
-            if (name == "." || name == ".." || name == REPO_DIR)
-                continue;
-
-            string fullPath = (path == ".") ? name : path + "\\" + name;
-            addToIndex(fullPath);
-        }
-        return;
-    }
-
-    // Create blob and add to index
-    string sha = createBlob(path);
-    if (sha.empty())
-        return;
-
-    // Remove existing entry for this path (if updating the file)
-    index.erase(remove_if(index.begin(), index.end(),
-                          [&path](const IndexEntry &e)
-                          { return e.path == path; }),
-                index.end());
-
-    // Add new entry
-    IndexEntry newEntry;
-    newEntry.path = path;
-    newEntry.sha = sha;
-    newEntry.mode = getPermissions(path);
-    index.push_back(newEntry);
-
-    writeIndex(index);
-}
-
-// Creates a Tree object from the staged files in the index (used by 'commit')
-string createTreeFromIndex()
-{
-    vector<IndexEntry> index = readIndex();
-    if (index.empty())
-        return "";
-
-    stringstream treeContent;
-    for (const auto &entry : index)
-    {
-        // Uses just filename, not full path, for the Tree entry name
-        string filename = getFilename(entry.path);
-        treeContent << entry.mode << " " << filename << '\0' << entry.sha;
-    }
-
-    string treeData = "tree " + to_string(treeContent.str().size()) + '\0' + treeContent.str();
-    string sha = computeSHA1(treeData);
-
-    writeObject(sha, treeData);
-    return sha;
-}
-
-// ============= REFERENCE OPERATIONS =============
-
-// Retrieves the SHA of the commit currently pointed to by HEAD (e.g., the commit at refs/heads/master)
-string getHEAD()
-{
-    string headPath = REPO_DIR + "\\HEAD";
-    if (!fileExists(headPath))
-        return "";
-
-    string content = readFile(headPath);
-    if (content.substr(0, 5) == "ref: ")
-    {
-        string refPath = REPO_DIR + "\\" + content.substr(5);
-        if (refPath.back() == '\n')
-            refPath.pop_back();
-        if (fileExists(refPath))
-        {
-            string sha = readFile(refPath);
-            if (sha.back() == '\n')
-                sha.pop_back();
-            return sha;
-        }
-    }
-    return "";
-}
-
-// Updates the reference pointed to by HEAD (e.g., writes new commit SHA to refs/heads/master)
-void updateHEAD(const string &commitSha)
-{
-    string headPath = REPO_DIR + "\\HEAD";
-    string content = readFile(headPath);
-
-    if (content.substr(0, 5) == "ref: ")
-    {
-        string refPath = content.substr(5);
-        if (refPath.back() == '\n')
-            refPath.pop_back();
-        writeFile(REPO_DIR + "\\" + refPath, commitSha + "\n");
-    }
-}
-
-// Appends commit details to the log file (.mygit/logs/HEAD)
-void updateLog(const string &commitSha, const string &parentSha, const string &message)
-{
-    string logPath = REPO_DIR + "\\logs\\HEAD";
-    ofstream file(logPath, ios::app);
-    time_t now = time(nullptr);
-    file << "commit " << commitSha << "\n";
-    if (!parentSha.empty())
-    {
-        file << "parent " << parentSha << "\n";
-    }
-    file << "message " << message << "\n";
-    file << "timestamp " << now << "\n";
-    file << "---\n";
-}
-
-// Recursively restores the working directory based on the contents of a Tree object
-void restoreTree(const string &treeSha, const string &prefix = "")
-{
-    vector<TreeEntry> entries = parseTree(treeSha);
-
-    for (const auto &entry : entries)
-    {
-        if (entry.name.empty())
-        {
-            continue;
-        }
-
-        string fullPath = prefix.empty() ? entry.name : prefix + "\\" + entry.name;
-
-        if (entry.isTree)
-        {
-            try
-            {
-                // Create directory and recurse into it
-                if (!fs::exists(fullPath))
-                {
-                    fs::create_directories(fullPath);
-                }
-                restoreTree(entry.sha, fullPath);
-            }
-            catch (const fs::filesystem_error &e)
-            {
-                cerr << "Error creating directory " << fullPath << ": " << e.what() << endl;
-            }
-        }
-        else
-        {
-            try
-            {
-                // Read Blob content and write to file
-                string blobData = readObject(entry.sha);
-                if (blobData.empty())
-                    continue;
-
-                size_t nullPos = blobData.find('\0');
-                if (nullPos == string::npos)
-                    continue;
-
-                string content = blobData.substr(nullPos + 1);
-
-                fs::path filePath(fullPath);
-                if (filePath.has_parent_path() && !filePath.parent_path().empty())
-                {
-                    fs::create_directories(filePath.parent_path());
-                }
-
-                ofstream outFile(fullPath, ios::binary);
-                if (outFile)
-                {
-                    outFile << content;
-                    outFile.close();
-                }
-            }
-            catch (const exception &e)
-            {
-                cerr << "Error restoring file " << fullPath << ": " << e.what() << endl;
-            }
-        }
-    }
-}
-
-// ============= COMMAND IMPLEMENTATIONS =============
-
-// Initializes the repository structure
-void cmdInit()
-{
-    if (fileExists(REPO_DIR))
-    {
-        cout << "Repository already initialized" << endl;
-        return;
-    }
-
-    fs::create_directories(REPO_DIR + "\\objects");
-    fs::create_directories(REPO_DIR + "\\refs");
-    fs::create_directories(REPO_DIR + "\\refs\\heads");
-    fs::create_directories(REPO_DIR + "\\logs");
-
-    writeFile(REPO_DIR + "\\HEAD", "ref: refs\\heads\\master\n");
-    writeFile(REPO_DIR + "\\index", "");
-
-    cout << "Initialized empty repository in " << REPO_DIR << endl;
-}
-
-// Computes SHA-1 hash and optionally writes a Blob
-void cmdHashObject(const string &filepath, bool write)
-{
-    string sha = createBlob(filepath);
-    if (!sha.empty())
-    {
-        cout << sha << endl;
-    }
-}
-
-// Displays object content or metadata
-void cmdCatFile(const string &sha, char flag)
-{
-    string data = readObject(sha);
-    if (data.empty())
-        return;
-
-    size_t nullPos = data.find('\0');
-    if (nullPos == string::npos)
-        return;
-
-    string header = data.substr(0, nullPos);
-    string content = data.substr(nullPos + 1);
-
-    size_t spacePos = header.find(' ');
-    string type = header.substr(0, spacePos);
-    string sizeStr = header.substr(spacePos + 1);
-
-    if (flag == 'p') // Print content
-    {
-        cout << content;
-    }
-    else if (flag == 's') // Print size
-    {
-        cout << sizeStr << endl;
-    }
-    else if (flag == 't') // Print type
-    {
-        cout << type << endl;
-    }
-}
-
-// Creates a Tree object from the current working directory's state
-void cmdWriteTree()
-{
-    string treeSha = createTree(".");
-    cout << treeSha << endl;
-}
-
-// Lists the contents of a Tree object
-void cmdLsTree(const string &treeSha, bool nameOnly)
-{
-    vector<TreeEntry> entries = parseTree(treeSha);
-
-    for (const auto &entry : entries)
-    {
-        if (nameOnly)
-        {
-            cout << entry.name << endl;
-        }
-        else
-        {
-            string type = entry.isTree ? "tree" : "blob";
-            cout << entry.mode << " " << type << " " << entry.sha << "\t" << entry.name << endl;
-        }
-    }
-}
-
-// Adds paths to the staging area (index)
-void cmdAdd(const vector<string> &paths)
-{
-    for (const auto &path : paths)
-    {
-        addToIndex(path);
-    }
-}
-
-// Creates a new commit
-void cmdCommit(const string &message)
-{
-    string treeSha = createTreeFromIndex(); // Create Tree from staged files
-    if (treeSha.empty())
-    {
-        cout << "Nothing to commit" << endl;
-        return;
-    }
-
-    string parentSha = getHEAD();
-    string commitSha = createCommit(treeSha, parentSha, message);
-
-    updateHEAD(commitSha);
-    updateLog(commitSha, parentSha, message);
-
-    // Clear index after a successful commit (optional but common practice)
-    writeFile(REPO_DIR + "\\index", "");
-
-    cout << commitSha << endl;
-}
-
-// Displays commit history from the log file
-void cmdLog()
-{
-    string logPath = REPO_DIR + "\\logs\\HEAD";
-    if (!fileExists(logPath))
-    {
-        cout << "No commits yet" << endl;
-        return;
-    }
-
-    ifstream file(logPath);
-    string line;
-    while (getline(file, line))
-    {
-        cout << line << endl;
-    }
-}
-
-// Restores the working directory to the state of a specific commit
-void cmdCheckout(const string &commitSha)
-{
-    CommitInfo info = parseCommit(commitSha);
-    if (info.treeSha.empty())
-    {
-        cerr << "Error: Invalid commit " << commitSha << endl;
-        return;
-    }
-
-    // REVISED CLEANUP STEP: Implements file deletion (Case 3) to achieve "exact snapshot" restoration
-    // This loops through the working directory and deletes all files/folders not explicitly excluded.
-    for (const auto &entry : fs::directory_iterator("."))
-    {
-        string name = entry.path().filename().string();
-
-        // CRITICAL EXCLUSION: Skip internal repo, executable, source, and makefile to prevent self-deletion and stability issues.
-        if (name == "." || name == ".." || name == REPO_DIR ||
-            name == "mygit.exe" || name == "main.cpp" || name == "makefile")
-            continue;
-
-        try
-        {
-            // Recursively delete files and directories
-            fs::remove_all(entry.path());
-        }
-        catch (const fs::filesystem_error &e)
-        {
-            cerr << "Warning: Could not remove " << name << " during checkout: " << e.what() << endl;
-        }
-    }
-
-    // RESTORE STEP: Rebuilds the directory structure and files from the target commit's Tree
-    restoreTree(info.treeSha);
-
-    // Update HEAD to point to the checked out commit
-    updateHEAD(commitSha);
-
-    cout << "Checked out commit " << commitSha << endl;
-}
-
-// ============= MAIN =============
-
-int main(int argc, char *argv[])
-{
-    // ... (argument parsing logic) ...
-    if (argc < 2)
-    {
-        cerr << "Usage: mygit <command> [options]" << endl;
-        return 1;
-    }
-
-    string command = argv[1];
-
-    if (command == "init")
-    {
-        cmdInit();
-    }
-    else if (command == "hash-object")
-    {
-        bool write = false;
-        string filepath;
-        for (int i = 2; i < argc; i++)
-        {
-            string arg = argv[i];
-            if (arg == "-w")
-                write = true;
-            else
-                filepath = arg;
-        }
-        cmdHashObject(filepath, write);
-    }
-    else if (command == "cat-file")
-    {
-        if (argc < 4)
-        {
-            cerr << "Usage: mygit cat-file <-p|-s|-t> <sha>" << endl;
-            return 1;
-        }
-        string flag = argv[2];
-        string sha = argv[3];
-        cmdCatFile(sha, flag[1]);
-    }
-    else if (command == "write-tree")
-    {
-        cmdWriteTree();
-    }
-    else if (command == "ls-tree")
-    {
-        bool nameOnly = false;
-        string sha;
-        for (int i = 2; i < argc; i++)
-        {
-            string arg = argv[i];
-            if (arg == "--name-only")
-                nameOnly = true;
-            else
-                sha = arg;
-        }
-        cmdLsTree(sha, nameOnly);
-    }
-    else if (command == "add")
-    {
-        vector<string> paths;
-        for (int i = 2; i < argc; i++)
-        {
-            paths.push_back(argv[i]);
-        }
-        cmdAdd(paths);
-    }
-    else if (command == "commit")
-    {
-        string message = "Initial commit";
-        for (int i = 2; i < argc; i++)
-        {
-            if (string(argv[i]) == "-m" && i + 1 < argc)
-            {
-                message = argv[i + 1];
-                break;
-            }
-        }
-        cmdCommit(message);
-    }
-    else if (command == "log")
-    {
-        cmdLog();
-    }
-    else if (command == "checkout")
-    {
-        if (argc < 3)
-        {
-            cerr << "Usage: mygit checkout <commit-sha>" << endl;
-            return 1;
-        }
-        cmdCheckout(argv[2]);
-    }
-    else
-    {
-        cerr << "Unknown command: " << command << endl;
-        return 1;
-    }
-
-    return 0;
-}
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <list>
+#include <queue>
+#include <iomanip>
+#include <utility>
+#include <filesystem>
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#include <fcntl.h> // _O_BINARY for batch output
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/inotify.h> // File system monitor daemon
+#endif
+#endif
+#include <algorithm>     // Used for std::sort and std::remove_if
+#include <atomic>
+#include <random>
+#include <memory>
+#include <deque>
+#include <functional>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <unordered_set>
+#include <memory_resource> // Arenas for tree building
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <openssl/sha.h> // Digest lengths
+#include <openssl/evp.h> // Used for SHA-1 / SHA-256 hashing where there is no faster backend
+#include <zlib.h>        // Used for compression/decompression
+#ifdef MYGIT_USE_LIBDEFLATE
+#include <libdeflate.h> // Faster one-shot deflate and inflate (optional: -DMYGIT_USE_LIBDEFLATE -ldeflate)
+#endif
+#ifdef MYGIT_USE_ZSTD
+#include <zstd.h>  // zstd codec for loose objects (optional: -DMYGIT_USE_ZSTD -lzstd)
+#include <zdict.h> // Dictionary training
+#endif
+
+using namespace std;
+namespace fs = std::filesystem;
+
+const string REPO_DIR = ".mygit";
+const int BUFFER_SIZE = 8192; // Not directly used, but good practice
+const size_t STREAM_CHUNK_SIZE = 64 * 1024; // Chunk size for streaming file ingestion
+bool showStats = false; // --stats: print performance counters to stderr when the command finishes
+
+// Utility function to extract the filename from a full or relative path
+string getFilename(const string &path)
+{
+    size_t pos = path.find_last_of("\\/");
+    if (pos != string::npos)
+    {
+        return path.substr(pos + 1);
+    }
+    return path;
+}
+
+// ============= UTILITY FUNCTIONS =============
+
+const char HEX_DIGITS[] = "0123456789abcdef";
+
+// ASCII -> hex digit value (-1 for anything that is not a hex digit), built at compile time
+struct HexDecodeTable
+{
+    signed char value[256];
+    constexpr HexDecodeTable() : value()
+    {
+        for (int i = 0; i < 256; i++)
+            value[i] = -1;
+        for (int i = 0; i < 10; i++)
+            value['0' + i] = static_cast<signed char>(i);
+        for (int i = 0; i < 6; i++)
+        {
+            value['a' + i] = static_cast<signed char>(10 + i);
+            value['A' + i] = static_cast<signed char>(10 + i);
+        }
+    }
+};
+constexpr HexDecodeTable HEX_DECODE;
+
+// Writes len raw bytes as 2 * len lowercase hex characters (no terminator)
+void bytesToHex(const unsigned char *bytes, size_t len, char *out)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        out[2 * i] = HEX_DIGITS[bytes[i] >> 4];
+        out[2 * i + 1] = HEX_DIGITS[bytes[i] & 0x0f];
+    }
+}
+
+// Parses 2 * len hex characters into raw bytes; returns false on any non-hex character
+bool hexToBytes(const char *hex, unsigned char *out, size_t len)
+{
+    for (size_t i = 0; i < len; i++)
+    {
+        int hi = HEX_DECODE.value[static_cast<unsigned char>(hex[2 * i])];
+        int lo = HEX_DECODE.value[static_cast<unsigned char>(hex[2 * i + 1])];
+        if ((hi | lo) < 0)
+            return false;
+        out[i] = static_cast<unsigned char>((hi << 4) | lo);
+    }
+    return true;
+}
+
+// The hash function that names objects. SHA-1 is git's format; a repository created with
+// init --object-format=sha256 (extensions.objectformat = sha256) uses SHA-256 throughout.
+enum class HashAlgorithm
+{
+    SHA1,
+    SHA256
+};
+
+const size_t MAX_OBJECT_ID_LENGTH = SHA256_DIGEST_LENGTH;
+HashAlgorithm objectFormat = HashAlgorithm::SHA1;
+// Raw length of this repository's object IDs (20 or 32 bytes), wherever an ID is stored or printed
+size_t objectIdLength = SHA_DIGEST_LENGTH;
+
+void setObjectFormat(HashAlgorithm algorithm)
+{
+    objectFormat = algorithm;
+    objectIdLength = algorithm == HashAlgorithm::SHA256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+}
+
+// A raw object ID of objectIdLength bytes. It is a plain value: copying, comparing and hashing it
+// never allocates. Hex is only produced for output; the all-zero ID is the "no object" value.
+struct ObjectId
+{
+    unsigned char bytes[MAX_OBJECT_ID_LENGTH] = {};
+
+    static ObjectId fromRaw(const void *raw)
+    {
+        ObjectId id;
+        memcpy(id.bytes, raw, objectIdLength);
+        return id;
+    }
+
+    // Parses a full hex name (40 digits, or 64 for SHA-256); returns false for anything else
+    static bool fromHex(const string &hex, ObjectId &id)
+    {
+        return hex.size() == 2 * objectIdLength && hexToBytes(hex.data(), id.bytes, objectIdLength);
+    }
+
+    string hex() const
+    {
+        string out(2 * objectIdLength, '\0');
+        bytesToHex(bytes, objectIdLength, &out[0]);
+        return out;
+    }
+
+    const char *raw() const { return reinterpret_cast<const char *>(bytes); }
+
+    bool isNull() const
+    {
+        static const unsigned char zero[MAX_OBJECT_ID_LENGTH] = {};
+        return memcmp(bytes, zero, objectIdLength) == 0;
+    }
+
+    bool operator==(const ObjectId &o) const { return memcmp(bytes, o.bytes, objectIdLength) == 0; }
+    bool operator!=(const ObjectId &o) const { return !(*this == o); }
+    bool operator<(const ObjectId &o) const { return memcmp(bytes, o.bytes, objectIdLength) < 0; }
+};
+
+ostream &operator<<(ostream &os, const ObjectId &id)
+{
+    char hex[2 * MAX_OBJECT_ID_LENGTH];
+    bytesToHex(id.bytes, objectIdLength, hex);
+    return os.write(hex, 2 * objectIdLength);
+}
+
+namespace std
+{
+    // Hash output is uniformly distributed, so its first bytes already make a good hash
+    template <>
+    struct hash<ObjectId>
+    {
+        size_t operator()(const ObjectId &id) const
+        {
+            size_t h;
+            memcpy(&h, id.bytes, sizeof(h));
+            return h;
+        }
+    };
+}
+
+// Big-endian (network order) integer encoding used by the binary on-disk formats
+void appendU32(string &out, uint32_t v)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<char>((v >> shift) & 0xff));
+}
+
+void appendU64(string &out, uint64_t v)
+{
+    appendU32(out, static_cast<uint32_t>(v >> 32));
+    appendU32(out, static_cast<uint32_t>(v));
+}
+
+uint32_t readU32(const char *p)
+{
+    const unsigned char *b = reinterpret_cast<const unsigned char *>(p);
+    return (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) | (uint32_t(b[2]) << 8) | uint32_t(b[3]);
+}
+
+uint64_t readU64(const char *p)
+{
+    return (uint64_t(readU32(p)) << 32) | readU32(p + 4);
+}
+
+// ============= TRACING =============
+
+// --trace (or MYGIT_TRACE) instruments the I/O, hashing, compression, object and tree-walk
+// functions with scoped timers. Each point counts calls, bytes, time and the file system calls
+// it issues itself; the totals are printed as a table when the command finishes, or every scope
+// is written as a Chrome trace-event file (chrome://tracing, Perfetto). A scope nested in one of
+// the same point (recursive tree walks, compressData under encodeLooseObject) is folded into the
+// outer one in the totals. When tracing is off a scope costs one test of a global flag.
+enum TracePoint
+{
+    TRACE_READ_FILE,
+    TRACE_WRITE_FILE,
+    TRACE_READ_DIRECTORY,
+    TRACE_HASH,
+    TRACE_COMPRESS,
+    TRACE_DECOMPRESS,
+    TRACE_READ_OBJECT,
+    TRACE_WRITE_OBJECT,
+    TRACE_WRITE_TREE,
+    TRACE_RESTORE_TREE,
+    TRACE_DIFF_TREES,
+    TRACE_POINT_COUNT
+};
+const char *const TRACE_POINT_NAMES[TRACE_POINT_COUNT] = {"read-file", "write-file", "read-directory", "hash",
+                                                            "compress", "decompress", "read-object", "write-object",
+                                                            "write-tree", "restore-tree", "diff-trees"};
+
+bool tracing = false;  // Set by --trace / MYGIT_TRACE before the command runs
+string traceEventFile; // Chrome trace destination ("" = summary table on stderr)
+const size_t TRACE_EVENT_LIMIT = 1 << 20; // Per thread; later scopes are only counted
+
+// Totals of one trace point over all threads
+struct TraceCounter
+{
+    atomic<uint64_t> calls{0};
+    atomic<uint64_t> bytes{0};
+    atomic<uint64_t> nanoseconds{0};
+    atomic<uint64_t> syscalls{0};
+};
+TraceCounter traceCounters[TRACE_POINT_COUNT];
+
+// One completed scope, for the Chrome trace
+struct TraceEvent
+{
+    uint64_t start; // ns since traceEpoch
+    uint64_t duration;
+    uint64_t bytes;
+    TracePoint point;
+};
+
+// Events of one thread, appended without locking; owned by traceBuffers so they outlive the thread
+struct TraceBuffer
+{
+    unsigned tid;
+    vector<TraceEvent> events;
+    uint64_t dropped = 0;
+};
+mutex traceBuffersMutex;
+vector<unique_ptr<TraceBuffer>> traceBuffers;
+chrono::steady_clock::time_point traceEpoch;
+
+// The calling thread's event buffer, registered on first use
+TraceBuffer &threadTraceBuffer()
+{
+    thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer)
+    {
+        lock_guard<mutex> lk(traceBuffersMutex);
+        traceBuffers.push_back(make_unique<TraceBuffer>());
+        buffer = traceBuffers.back().get();
+        buffer->tid = static_cast<unsigned>(traceBuffers.size());
+    }
+    return *buffer;
+}
+
+// Times the enclosing block as one call of a trace point
+class TraceScope
+{
+public:
+    explicit TraceScope(TracePoint point, uint64_t bytes = 0) : point(point), bytes(bytes)
+    {
+        if (tracing)
+            begin();
+    }
+    ~TraceScope()
+    {
+        if (active)
+            end();
+    }
+    TraceScope(const TraceScope &) = delete;
+    TraceScope &operator=(const TraceScope &) = delete;
+
+    // Adds to the bytes processed (for sizes only known at the end)
+    void addBytes(uint64_t n) { bytes += n; }
+    // Adds to the estimated file system calls of the traced function: the calls its code path
+    // normally makes (e.g. open, read and close), counted by hand rather than measured
+    void addSyscalls(uint64_t n) { syscalls += n; }
+
+private:
+    static uint64_t now() { return static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceEpoch).count()); }
+    static unsigned *depths()
+    {
+        thread_local unsigned depth[TRACE_POINT_COUNT] = {};
+        return depth;
+    }
+
+    void begin()
+    {
+        active = true;
+        depths()[point]++;
+        start = now();
+    }
+    void end()
+    {
+        uint64_t duration = now() - start;
+        TraceCounter &counter = traceCounters[point];
+        counter.syscalls.fetch_add(syscalls, memory_order_relaxed);
+        if (--depths()[point] == 0)
+        {
+            counter.calls.fetch_add(1, memory_order_relaxed);
+            counter.bytes.fetch_add(bytes, memory_order_relaxed);
+            counter.nanoseconds.fetch_add(duration, memory_order_relaxed);
+        }
+        if (traceEventFile.empty())
+            return;
+        TraceBuffer &buffer = threadTraceBuffer();
+        if (buffer.events.size() < TRACE_EVENT_LIMIT)
+            buffer.events.push_back(TraceEvent{start, duration, bytes, point});
+        else
+            buffer.dropped++;
+    }
+
+    TracePoint point;
+    bool active = false;
+    uint64_t bytes;
+    uint64_t syscalls = 0;
+    uint64_t start = 0;
+};
+
+// Turns tracing on: option is "" (summary table) or the Chrome trace file to write
+void startTracing(const string &option)
+{
+    tracing = true;
+    traceEventFile = option == "1" || option == "summary" ? "" : option;
+    traceEpoch = chrono::steady_clock::now();
+}
+
+// Prints the per-point totals as a table on stderr
+void printTraceSummary(uint64_t elapsed)
+{
+    cerr << left << setw(16) << "trace" << right << setw(10) << "calls" << setw(12) << "ms" << setw(10) << "avg us"
+         << setw(14) << "bytes" << setw(10) << "MB/s" << setw(10) << "~syscalls" << endl;
+    for (int i = 0; i < TRACE_POINT_COUNT; i++)
+    {
+        const TraceCounter &counter = traceCounters[i];
+        uint64_t calls = counter.calls, bytes = counter.bytes, ns = counter.nanoseconds;
+        if (calls == 0)
+            continue;
+        cerr << left << setw(16) << TRACE_POINT_NAMES[i] << right << setw(10) << calls << fixed << setprecision(2)
+             << setw(12) << ns / 1e6 << setprecision(1) << setw(10) << ns / 1e3 / calls << setw(14) << bytes
+             << setw(10) << (ns ? bytes * 1e3 / ns : 0.0) << setw(10) << counter.syscalls << endl;
+    }
+    cerr << left << setw(16) << "total (wall)" << right << setw(10) << "" << fixed << setprecision(2) << setw(12)
+         << elapsed / 1e6 << endl;
+    cerr << "(~syscalls are estimated from the calls each traced path makes, not measured)" << endl;
+}
+
+// Writes every recorded scope as a Chrome trace-event ("X" complete events, microseconds)
+void writeTraceEvents(uint64_t elapsed)
+{
+    ofstream out(traceEventFile, ios::binary);
+    if (!out)
+    {
+        cerr << "Error: Cannot write trace file " << traceEventFile << endl;
+        return;
+    }
+    out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+    out << "{\"name\":\"mygit\",\"cat\":\"command\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":0,\"dur\":"
+        << fixed << setprecision(3) << elapsed / 1e3 << "}";
+    lock_guard<mutex> lk(traceBuffersMutex);
+    uint64_t dropped = 0;
+    for (const auto &buffer : traceBuffers)
+    {
+        for (const TraceEvent &event : buffer->events)
+        {
+            out << ",\n{\"name\":\"" << TRACE_POINT_NAMES[event.point] << "\",\"cat\":\"mygit\",\"ph\":\"X\",\"pid\":1,\"tid\":"
+                << buffer->tid << ",\"ts\":" << event.start / 1e3 << ",\"dur\":" << event.duration / 1e3
+                << ",\"args\":{\"bytes\":" << event.bytes << "}}";
+        }
+        dropped += buffer->dropped;
+    }
+    out << "\n],\"otherData\":{\"droppedEvents\":" << dropped << "}}\n";
+}
+
+// Reports the trace when the command finishes (once; later calls do nothing)
+void finishTracing()
+{
+    if (!tracing)
+        return;
+    tracing = false;
+    uint64_t elapsed = static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - traceEpoch).count());
+    if (traceEventFile.empty())
+        printTraceSummary(elapsed);
+    else
+        writeTraceEvents(elapsed);
+}
+
+// Reports the trace when it goes out of scope, so commands that return early are traced too
+struct TraceReport
+{
+    ~TraceReport()
+    {
+        finishTracing();
+    }
+};
+
+// ============= HASHING =============
+
+// Object IDs are the hash of "<type> <size>\0<content>" under the repository's object format.
+// Each algorithm has a list of backends; the first one the CPU supports (and that passes a
+// self-test against OpenSSL) is used for every hash the process computes:
+//  - sha-ni:  the x86 SHA extensions, called directly (no per-object context setup), with a
+//             two-lane variant that hashes two small objects side by side
+//  - openssl: EVP digests; OpenSSL dispatches to its own assembly (e.g. the ARMv8 crypto
+//             extensions) where the CPU has it
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define MYGIT_X86_HASH 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define SHA_NI_TARGET
+#else
+#include <cpuid.h>
+#define SHA_NI_TARGET __attribute__((target("sha,sse4.1")))
+#endif
+#endif
+
+const size_t HASH_BLOCK_SIZE = 64; // Both SHA-1 and SHA-256 work on 64-byte blocks
+
+// One implementation of an algorithm's block function. compress folds whole blocks into the
+// state words; compress2 does the same for two independent messages in one pass (null if the
+// backend has no multi-buffer variant). Backends without a block function go through EVP.
+struct HashBackend
+{
+    const char *name;
+    HashAlgorithm algorithm;
+    bool (*supported)();
+    void (*compress)(uint32_t *state, const unsigned char *data, size_t blocks);
+    void (*compress2)(uint32_t *stateA, const unsigned char *a, uint32_t *stateB, const unsigned char *b, size_t blocks);
+};
+
+#ifdef MYGIT_X86_HASH
+// True if the CPU has the SHA extensions and SSE4.1
+bool cpuHasShaNi()
+{
+#ifdef _MSC_VER
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+        return false;
+    __cpuid(regs, 1);
+    bool sse41 = (regs[2] >> 19) & 1;
+    __cpuidex(regs, 7, 0);
+    return sse41 && ((regs[1] >> 29) & 1);
+#else
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !((ecx >> 19) & 1))
+        return false;
+    return __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) && ((ebx >> 29) & 1);
+#endif
+}
+
+// Working registers of one message in the SHA-1 kernel
+struct Sha1NiLane
+{
+    __m128i abcd, e[2], msg[4], abcdSave, eSave;
+};
+
+SHA_NI_TARGET inline void sha1LoadStateShaNi(Sha1NiLane &lane, const uint32_t *state)
+{
+    lane.abcd = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0x1B);
+    lane.e[0] = _mm_set_epi32(static_cast<int>(state[4]), 0, 0, 0);
+}
+
+SHA_NI_TARGET inline void sha1StoreStateShaNi(const Sha1NiLane &lane, uint32_t *state)
+{
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_shuffle_epi32(lane.abcd, 0x1B));
+    state[4] = static_cast<uint32_t>(_mm_extract_epi32(lane.e[0], 3));
+}
+
+SHA_NI_TARGET inline void sha1BeginBlockShaNi(Sha1NiLane &lane, const unsigned char *block)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    lane.abcdSave = lane.abcd;
+    lane.eSave = lane.e[0];
+    for (int i = 0; i < 4; i++)
+        lane.msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i)), byteSwap);
+}
+
+SHA_NI_TARGET inline void sha1EndBlockShaNi(Sha1NiLane &lane)
+{
+    lane.e[0] = _mm_sha1nexte_epu32(lane.e[0], lane.eSave);
+    lane.abcd = _mm_add_epi32(lane.abcd, lane.abcdSave);
+}
+
+// Four SHA-1 rounds (sha1rnds4), expanding the message schedule for later steps on the way
+// (sha1msg1/sha1msg2 and a xor); msg[Step % 4] holds the words this step consumes
+template <int Step>
+SHA_NI_TARGET inline void sha1StepShaNi(Sha1NiLane &lane)
+{
+    __m128i w = lane.msg[Step % 4];
+    __m128i &current = lane.e[Step % 2];
+    current = Step == 0 ? _mm_add_epi32(current, w) : _mm_sha1nexte_epu32(current, w);
+    lane.e[(Step + 1) % 2] = lane.abcd;
+    if (Step >= 3 && Step <= 18)
+        lane.msg[(Step + 1) % 4] = _mm_sha1msg2_epu32(lane.msg[(Step + 1) % 4], w);
+    lane.abcd = _mm_sha1rnds4_epu32(lane.abcd, current, Step / 5);
+    if (Step >= 1 && Step <= 16)
+        lane.msg[(Step + 3) % 4] = _mm_sha1msg1_epu32(lane.msg[(Step + 3) % 4], w);
+    if (Step >= 2 && Step <= 17)
+        lane.msg[(Step + 2) % 4] = _mm_xor_si128(lane.msg[(Step + 2) % 4], w);
+}
+
+template <int Step, size_t... L>
+SHA_NI_TARGET inline void sha1StepLanesShaNi(Sha1NiLane *lanes)
+{
+    (sha1StepShaNi<Step>(lanes[L]), ...);
+}
+
+// SHA-1 block function for sizeof...(L) messages of the same number of blocks. Every lane index
+// is a compile-time constant, so the lanes stay in registers, and running each step for all
+// lanes before the next lets one lane's rounds execute while another's are still in flight.
+template <size_t... L, int... Steps>
+SHA_NI_TARGET void sha1BlocksShaNi(uint32_t *const *state, const unsigned char *const *data, size_t blocks, index_sequence<L...>, integer_sequence<int, Steps...>)
+{
+    Sha1NiLane lanes[sizeof...(L)];
+    (sha1LoadStateShaNi(lanes[L], state[L]), ...);
+    for (size_t b = 0; b < blocks; b++)
+    {
+        (sha1BeginBlockShaNi(lanes[L], data[L] + b * HASH_BLOCK_SIZE), ...);
+        (sha1StepLanesShaNi<Steps, L...>(lanes), ...);
+        (sha1EndBlockShaNi(lanes[L]), ...);
+    }
+    (sha1StoreStateShaNi(lanes[L], state[L]), ...);
+}
+
+alignas(16) const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+// Working registers of one message in the SHA-256 kernel. The instructions keep the state as
+// ABEF/CDGH halves, so it is rearranged on the way in and out.
+struct Sha256NiLane
+{
+    __m128i state0, state1, msg[4], save0, save1;
+};
+
+SHA_NI_TARGET inline void sha256LoadStateShaNi(Sha256NiLane &lane, const uint32_t *state)
+{
+    __m128i dcba = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state)), 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(state + 4)), 0x1B);
+    lane.state0 = _mm_alignr_epi8(dcba, efgh, 8);
+    lane.state1 = _mm_blend_epi16(efgh, dcba, 0xF0);
+}
+
+SHA_NI_TARGET inline void sha256StoreStateShaNi(const Sha256NiLane &lane, uint32_t *state)
+{
+    __m128i feba = _mm_shuffle_epi32(lane.state0, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(lane.state1, 0xB1);
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state), _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(state + 4), _mm_alignr_epi8(dchg, feba, 8));
+}
+
+SHA_NI_TARGET inline void sha256BeginBlockShaNi(Sha256NiLane &lane, const unsigned char *block)
+{
+    const __m128i byteSwap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+    lane.save0 = lane.state0;
+    lane.save1 = lane.state1;
+    for (int i = 0; i < 4; i++)
+        lane.msg[i] = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(block + 16 * i)), byteSwap);
+}
+
+SHA_NI_TARGET inline void sha256EndBlockShaNi(Sha256NiLane &lane)
+{
+    lane.state0 = _mm_add_epi32(lane.state0, lane.save0);
+    lane.state1 = _mm_add_epi32(lane.state1, lane.save1);
+}
+
+// Four SHA-256 rounds (two sha256rnds2), expanding the message schedule for later steps
+// (sha256msg1, then the alignr/add/sha256msg2 that completes a group of four words)
+template <int Step>
+SHA_NI_TARGET inline void sha256StepShaNi(Sha256NiLane &lane)
+{
+    __m128i w = lane.msg[Step % 4];
+    __m128i t = _mm_add_epi32(w, _mm_load_si128(reinterpret_cast<const __m128i *>(SHA256_K + 4 * Step)));
+    lane.state1 = _mm_sha256rnds2_epu32(lane.state1, lane.state0, t);
+    if (Step >= 3 && Step <= 14)
+    {
+        __m128i &next = lane.msg[(Step + 1) % 4];
+        next = _mm_add_epi32(next, _mm_alignr_epi8(w, lane.msg[(Step + 3) % 4], 4));
+        next = _mm_sha256msg2_epu32(next, w);
+    }
+    lane.state0 = _mm_sha256rnds2_epu32(lane.state0, lane.state1, _mm_shuffle_epi32(t, 0x0E));
+    if (Step >= 1 && Step <= 12)
+        lane.msg[(Step + 3) % 4] = _mm_sha256msg1_epu32(lane.msg[(Step + 3) % 4], w);
+}
+
+template <int Step, size_t... L>
+SHA_NI_TARGET inline void sha256StepLanesShaNi(Sha256NiLane *lanes)
+{
+    (sha256StepShaNi<Step>(lanes[L]), ...);
+}
+
+// SHA-256 block function for sizeof...(L) messages of the same number of blocks (see sha1BlocksShaNi)
+template <size_t... L, int... Steps>
+SHA_NI_TARGET void sha256BlocksShaNi(uint32_t *const *state, const unsigned char *const *data, size_t blocks, index_sequence<L...>, integer_sequence<int, Steps...>)
+{
+    Sha256NiLane lanes[sizeof...(L)];
+    (sha256LoadStateShaNi(lanes[L], state[L]), ...);
+    for (size_t b = 0; b < blocks; b++)
+    {
+        (sha256BeginBlockShaNi(lanes[L], data[L] + b * HASH_BLOCK_SIZE), ...);
+        (sha256StepLanesShaNi<Steps, L...>(lanes), ...);
+        (sha256EndBlockShaNi(lanes[L]), ...);
+    }
+    (sha256StoreStateShaNi(lanes[L], state[L]), ...);
+}
+
+void sha1CompressShaNi(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    sha1BlocksShaNi(&state, &data, blocks, make_index_sequence<1>(), make_integer_sequence<int, 20>());
+}
+
+void sha1Compress2ShaNi(uint32_t *stateA, const unsigned char *a, uint32_t *stateB, const unsigned char *b, size_t blocks)
+{
+    uint32_t *state[2] = {stateA, stateB};
+    const unsigned char *data[2] = {a, b};
+    sha1BlocksShaNi(state, data, blocks, make_index_sequence<2>(), make_integer_sequence<int, 20>());
+}
+
+void sha256CompressShaNi(uint32_t *state, const unsigned char *data, size_t blocks)
+{
+    sha256BlocksShaNi(&state, &data, blocks, make_index_sequence<1>(), make_integer_sequence<int, 16>());
+}
+
+void sha256Compress2ShaNi(uint32_t *stateA, const unsigned char *a, uint32_t *stateB, const unsigned char *b, size_t blocks)
+{
+    uint32_t *state[2] = {stateA, stateB};
+    const unsigned char *data[2] = {a, b};
+    sha256BlocksShaNi(state, data, blocks, make_index_sequence<2>(), make_integer_sequence<int, 16>());
+}
+#endif
+
+bool alwaysSupported()
+{
+    return true;
+}
+
+// Every backend, in order of preference within each algorithm
+const HashBackend HASH_BACKENDS[] = {
+#ifdef MYGIT_X86_HASH
+    {"sha-ni", HashAlgorithm::SHA1, cpuHasShaNi, sha1CompressShaNi, sha1Compress2ShaNi},
+    {"sha-ni", HashAlgorithm::SHA256, cpuHasShaNi, sha256CompressShaNi, sha256Compress2ShaNi},
+#endif
+    {"openssl", HashAlgorithm::SHA1, alwaysSupported, nullptr, nullptr},
+    {"openssl", HashAlgorithm::SHA256, alwaysSupported, nullptr, nullptr},
+};
+
+const char *hashAlgorithmName(HashAlgorithm algorithm)
+{
+    return algorithm == HashAlgorithm::SHA256 ? "sha256" : "sha1";
+}
+
+size_t hashDigestLength(HashAlgorithm algorithm)
+{
+    return algorithm == HashAlgorithm::SHA256 ? SHA256_DIGEST_LENGTH : SHA_DIGEST_LENGTH;
+}
+
+// The OpenSSL digest for an algorithm, fetched once (OpenSSL 3 would otherwise look the
+// implementation up again on every EVP_DigestInit_ex)
+const EVP_MD *evpDigest(HashAlgorithm algorithm)
+{
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+    static EVP_MD *sha1 = EVP_MD_fetch(nullptr, "SHA1", nullptr);
+    static EVP_MD *sha256 = EVP_MD_fetch(nullptr, "SHA256", nullptr);
+    return algorithm == HashAlgorithm::SHA256 ? sha256 : sha1;
+#else
+    return algorithm == HashAlgorithm::SHA256 ? EVP_sha256() : EVP_sha1();
+#endif
+}
+
+// Incremental hash for data that arrives in chunks (e.g. large files streamed from disk)
+class ObjectHasher
+{
+public:
+    explicit ObjectHasher(const HashBackend &backend);
+    ObjectHasher();
+    ~ObjectHasher()
+    {
+        if (ctx)
+            EVP_MD_CTX_free(ctx);
+    }
+    ObjectHasher(const ObjectHasher &) = delete;
+    ObjectHasher &operator=(const ObjectHasher &) = delete;
+
+    void update(const char *data, size_t len)
+    {
+        TraceScope trace(TRACE_HASH, len);
+        if (ctx)
+        {
+            EVP_DigestUpdate(ctx, data, len);
+            return;
+        }
+        const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+        total += len;
+        if (buffered > 0)
+        {
+            size_t take = min(len, HASH_BLOCK_SIZE - buffered);
+            memcpy(buffer + buffered, p, take);
+            buffered += take;
+            p += take;
+            len -= take;
+            if (buffered < HASH_BLOCK_SIZE)
+                return;
+            backend.compress(state, buffer, 1);
+            buffered = 0;
+        }
+        if (len >= HASH_BLOCK_SIZE)
+        {
+            backend.compress(state, p, len / HASH_BLOCK_SIZE);
+            p += len - len % HASH_BLOCK_SIZE;
+            len %= HASH_BLOCK_SIZE;
+        }
+        memcpy(buffer, p, len);
+        buffered = len;
+    }
+
+    // Finishes the digest
+    ObjectId final()
+    {
+        ObjectId id;
+        if (ctx)
+        {
+            unsigned int len = 0;
+            EVP_DigestFinal_ex(ctx, id.bytes, &len);
+            return id;
+        }
+        unsigned char tail[2 * HASH_BLOCK_SIZE];
+        size_t blocks = padMessage(buffer, buffered, total, tail);
+        backend.compress(state, tail, blocks);
+        storeDigest(backend.algorithm, state, id);
+        return id;
+    }
+
+    // Initial state words of an algorithm
+    static void initState(HashAlgorithm algorithm, uint32_t *state)
+    {
+        static const uint32_t sha1Init[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+        static const uint32_t sha256Init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                               0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        if (algorithm == HashAlgorithm::SHA256)
+            memcpy(state, sha256Init, sizeof(sha256Init));
+        else
+            memcpy(state, sha1Init, sizeof(sha1Init));
+    }
+
+    // Builds the final block(s) of a message from its last partial block: 0x80, zero padding and
+    // the message length in bits. Returns the number of blocks written to tail (1 or 2).
+    static size_t padMessage(const unsigned char *rest, size_t restLen, uint64_t totalLen, unsigned char *tail)
+    {
+        size_t blocks = restLen + 9 <= HASH_BLOCK_SIZE ? 1 : 2;
+        memcpy(tail, rest, restLen);
+        memset(tail + restLen, 0, blocks * HASH_BLOCK_SIZE - restLen);
+        tail[restLen] = 0x80;
+        uint64_t bits = totalLen * 8;
+        for (int i = 0; i < 8; i++)
+            tail[blocks * HASH_BLOCK_SIZE - 1 - i] = static_cast<unsigned char>(bits >> (8 * i));
+        return blocks;
+    }
+
+    static void storeDigest(HashAlgorithm algorithm, const uint32_t *state, ObjectId &id)
+    {
+        for (size_t i = 0; i < hashDigestLength(algorithm) / 4; i++)
+            for (int b = 0; b < 4; b++)
+                id.bytes[4 * i + b] = static_cast<unsigned char>(state[i] >> (24 - 8 * b));
+    }
+
+private:
+    const HashBackend &backend;
+    EVP_MD_CTX *ctx = nullptr; // Only for backends without a block function
+    uint32_t state[8];
+    unsigned char buffer[HASH_BLOCK_SIZE];
+    size_t buffered = 0;
+    uint64_t total = 0;
+};
+
+ObjectHasher::ObjectHasher(const HashBackend &backend) : backend(backend)
+{
+    if (backend.compress)
+        initState(backend.algorithm, state);
+    else
+    {
+        ctx = EVP_MD_CTX_new();
+        EVP_DigestInit_ex(ctx, evpDigest(backend.algorithm), nullptr);
+    }
+}
+
+// Hashes data with a specific backend
+ObjectId hashWithBackend(const HashBackend &backend, const char *data, size_t len)
+{
+    if (!backend.compress)
+    {
+        TraceScope trace(TRACE_HASH, len);
+        ObjectId id;
+        unsigned int outLen = 0;
+        EVP_Digest(data, len, id.bytes, &outLen, evpDigest(backend.algorithm), nullptr);
+        return id;
+    }
+    ObjectHasher hasher(backend);
+    hasher.update(data, len);
+    return hasher.final();
+}
+
+// Hashes two messages in lockstep with a two-lane block function. Each message is its whole
+// blocks followed by one or two padding blocks; runs of blocks that are contiguous in both are
+// passed in one call, and whatever remains of the longer message is finished on its own.
+void hashPair(const HashBackend &backend, string_view a, string_view b, ObjectId &idA, ObjectId &idB)
+{
+    TraceScope trace(TRACE_HASH, a.size() + b.size());
+    struct Lane
+    {
+        uint32_t state[8];
+        unsigned char tail[2 * HASH_BLOCK_SIZE];
+        const unsigned char *data;
+        size_t wholeBlocks, tailBlocks, done = 0;
+
+        void init(const HashBackend &backend, string_view message)
+        {
+            ObjectHasher::initState(backend.algorithm, state);
+            data = reinterpret_cast<const unsigned char *>(message.data());
+            wholeBlocks = message.size() / HASH_BLOCK_SIZE;
+            tailBlocks = ObjectHasher::padMessage(data + wholeBlocks * HASH_BLOCK_SIZE, message.size() % HASH_BLOCK_SIZE, message.size(), tail);
+        }
+        size_t remaining() const { return wholeBlocks + tailBlocks - done; }
+        // Consecutive blocks available from the current position, and where they start
+        size_t run() const { return done < wholeBlocks ? wholeBlocks - done : remaining(); }
+        const unsigned char *next() const
+        {
+            return done < wholeBlocks ? data + done * HASH_BLOCK_SIZE : tail + (done - wholeBlocks) * HASH_BLOCK_SIZE;
+        }
+    } lanes[2];
+    lanes[0].init(backend, a);
+    lanes[1].init(backend, b);
+    while (lanes[0].remaining() > 0 && lanes[1].remaining() > 0)
+    {
+        size_t n = min(lanes[0].run(), lanes[1].run());
+        backend.compress2(lanes[0].state, lanes[0].next(), lanes[1].state, lanes[1].next(), n);
+        lanes[0].done += n;
+        lanes[1].done += n;
+    }
+    for (auto &lane : lanes)
+    {
+        while (lane.remaining() > 0)
+        {
+            size_t n = lane.run();
+            backend.compress(lane.state, lane.next(), n);
+            lane.done += n;
+        }
+    }
+    ObjectHasher::storeDigest(backend.algorithm, lanes[0].state, idA);
+    ObjectHasher::storeDigest(backend.algorithm, lanes[1].state, idB);
+}
+
+// Checks a block-function backend against OpenSSL on messages that exercise one- and two-block
+// padding and the multi-buffer path with lanes of different lengths
+bool hashBackendWorks(const HashBackend &backend)
+{
+    if (!backend.compress)
+        return true;
+    HashBackend openssl = {"openssl", backend.algorithm, alwaysSupported, nullptr, nullptr};
+    string sample(301, '\0');
+    for (size_t i = 0; i < sample.size(); i++)
+        sample[i] = static_cast<char>(i * 7 + 1);
+    const size_t lengths[] = {0, 3, 55, 56, 64, 119, 300};
+    for (size_t len : lengths)
+        if (hashWithBackend(backend, sample.data(), len) != hashWithBackend(openssl, sample.data(), len))
+            return false;
+    if (!backend.compress2)
+        return true;
+    for (size_t a : lengths)
+    {
+        for (size_t b : lengths)
+        {
+            ObjectId idA, idB;
+            hashPair(backend, string_view(sample.data(), a), string_view(sample.data() + 1, b), idA, idB);
+            if (idA != hashWithBackend(openssl, sample.data(), a) || idB != hashWithBackend(openssl, sample.data() + 1, b))
+                return false;
+        }
+    }
+    return true;
+}
+
+// The backend used for the repository's object format: the first entry of HASH_BACKENDS that the
+// CPU supports and that passes the self-test. The order is fixed (SHA-NI ahead of OpenSSL) rather
+// than measured at startup; hash-bench shows whether that choice is the fast one on this machine.
+const HashBackend &activeHashBackend()
+{
+    static const HashBackend *selected[2] = {nullptr, nullptr};
+    const HashBackend *&backend = selected[objectFormat == HashAlgorithm::SHA256];
+    if (!backend)
+    {
+        for (const auto &candidate : HASH_BACKENDS)
+        {
+            if (candidate.algorithm == objectFormat && candidate.supported() && hashBackendWorks(candidate))
+            {
+                backend = &candidate;
+                break;
+            }
+        }
+    }
+    return *backend;
+}
+
+ObjectHasher::ObjectHasher() : ObjectHasher(activeHashBackend())
+{
+}
+
+// Computes the object ID (hash under the repository's object format) of the given data
+ObjectId computeHash(const string &data)
+{
+    return hashWithBackend(activeHashBackend(), data.data(), data.size());
+}
+
+// Multi-buffer hashing: computes the IDs of count independent objects, two at a time if the
+// backend has a two-lane block function. Meant for batches of small objects, where a single
+// message cannot keep the hash units busy.
+void computeHashes(const HashBackend &backend, const string_view *inputs, size_t count, ObjectId *out)
+{
+    size_t i = 0;
+    if (backend.compress2)
+    {
+        for (; i + 1 < count; i += 2)
+            hashPair(backend, inputs[i], inputs[i + 1], out[i], out[i + 1]);
+    }
+    for (; i < count; i++)
+        out[i] = hashWithBackend(backend, inputs[i].data(), inputs[i].size());
+}
+
+void computeHashes(const string_view *inputs, size_t count, ObjectId *out)
+{
+    computeHashes(activeHashBackend(), inputs, count, out);
+}
+
+// Compresses data using the zlib library (level 0-9, or Z_DEFAULT_COMPRESSION)
+string compressData(const string &data, int level = Z_DEFAULT_COMPRESSION)
+{
+    TraceScope trace(TRACE_COMPRESS, data.size());
+    uLongf compressedSize = compressBound(data.size()); // Estimate max compressed size
+    string compressed(compressedSize, '\0');
+
+    if (compress2(reinterpret_cast<Bytef *>(&compressed[0]), &compressedSize,
+                  reinterpret_cast<const Bytef *>(data.c_str()), data.size(), level) != Z_OK)
+    {
+        cerr << "Error: Compression failed" << endl;
+        return "";
+    }
+
+    compressed.resize(compressedSize); // Truncate to actual size
+    return compressed;
+}
+
+// Parses an object header ("type size\0") at the start of data.
+// On success headerLen is the header length including the NUL.
+bool parseObjectHeader(const char *data, size_t len, string &type, uint64_t &size, size_t &headerLen)
+{
+    const char *nul = static_cast<const char *>(memchr(data, '\0', len));
+    const char *space = static_cast<const char *>(memchr(data, ' ', nul ? nul - data : 0));
+    if (!nul || !space || space + 1 == nul)
+        return false;
+    size = 0;
+    for (const char *p = space + 1; p < nul; p++)
+    {
+        if (*p < '0' || *p > '9')
+            return false;
+        size = size * 10 + (*p - '0');
+    }
+    type.assign(data, space - data);
+    headerLen = nul - data + 1;
+    return true;
+}
+
+const size_t OBJECT_HEADER_PROBE = 64; // Longer than any "type size\0" header
+
+// Decompresses a zlib stream holding an object. A small first inflate yields the "type size\0"
+// header, which gives the exact output size, so the buffer is allocated once and the rest is
+// inflated in place. Data without such a header is inflated with a growing buffer (never restarted).
+string decompressData(const char *compressed, size_t len)
+{
+    TraceScope trace(TRACE_DECOMPRESS, len);
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK)
+        return "";
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(compressed));
+    stream.avail_in = static_cast<uInt>(len);
+
+    string out(OBJECT_HEADER_PROBE, '\0');
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(out.size());
+    int result = inflate(&stream, Z_NO_FLUSH);
+
+    string type;
+    uint64_t size;
+    size_t headerLen;
+    if ((result == Z_OK || result == Z_STREAM_END) && parseObjectHeader(out.data(), stream.total_out, type, size, headerLen))
+    {
+        size_t total = headerLen + static_cast<size_t>(size);
+        if (stream.total_out > total)
+            result = Z_DATA_ERROR;
+        out.resize(total);
+        if (result == Z_OK)
+        {
+            stream.next_out = reinterpret_cast<Bytef *>(&out[0] + stream.total_out);
+            stream.avail_out = static_cast<uInt>(total - stream.total_out);
+            result = inflate(&stream, Z_FINISH);
+        }
+    }
+    else
+    {
+        while (result == Z_OK || (result == Z_BUF_ERROR && stream.avail_out == 0))
+        {
+            size_t used = stream.total_out;
+            out.resize(out.size() * 2); // Grow and keep inflating where we stopped
+            stream.next_out = reinterpret_cast<Bytef *>(&out[0] + used);
+            stream.avail_out = static_cast<uInt>(out.size() - used);
+            result = inflate(&stream, Z_NO_FLUSH);
+        }
+        out.resize(stream.total_out);
+    }
+    inflateEnd(&stream);
+
+    if (result != Z_STREAM_END || stream.total_out != out.size())
+    {
+        cerr << "Error: Decompression failed" << endl;
+        return "";
+    }
+    return out;
+}
+
+string decompressData(const string &compressed)
+{
+    return decompressData(compressed.data(), compressed.size());
+}
+
+// Inflates just the first bytes of a zlib stream (up to maxOut), e.g. to read a header
+string inflatePrefix(const char *src, size_t srcLen, size_t maxOut)
+{
+    string out(maxOut, '\0');
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK)
+        return "";
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    stream.avail_in = static_cast<uInt>(min<size_t>(srcLen, UINT32_MAX));
+    stream.next_out = reinterpret_cast<Bytef *>(&out[0]);
+    stream.avail_out = static_cast<uInt>(maxOut);
+    int result = inflate(&stream, Z_SYNC_FLUSH);
+    out.resize((result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR) ? stream.total_out : 0);
+    inflateEnd(&stream);
+    return out;
+}
+
+// Streams data through zlib's deflate straight into a file, so the compressed
+// output never has to be held in memory as a whole
+class DeflateFileWriter
+{
+public:
+    explicit DeflateFileWriter(const string &path, int level = Z_DEFAULT_COMPRESSION) : file(path, ios::binary), out(STREAM_CHUNK_SIZE)
+    {
+        stream.zalloc = Z_NULL;
+        stream.zfree = Z_NULL;
+        stream.opaque = Z_NULL;
+        ok = file && deflateInit(&stream, level) == Z_OK;
+        initialized = ok;
+    }
+    ~DeflateFileWriter()
+    {
+        if (initialized)
+            deflateEnd(&stream);
+    }
+    DeflateFileWriter(const DeflateFileWriter &) = delete;
+    DeflateFileWriter &operator=(const DeflateFileWriter &) = delete;
+
+    bool good() const { return ok; }
+
+    void write(const char *data, size_t len)
+    {
+        stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+        stream.avail_in = static_cast<uInt>(len);
+        pump(Z_NO_FLUSH);
+    }
+
+    // Flushes the remaining compressed data and closes the file
+    bool finish()
+    {
+        stream.next_in = Z_NULL;
+        stream.avail_in = 0;
+        pump(Z_FINISH);
+        file.close();
+        return ok && !file.fail();
+    }
+
+private:
+    void pump(int flush)
+    {
+        while (ok)
+        {
+            stream.next_out = reinterpret_cast<Bytef *>(out.data());
+            stream.avail_out = static_cast<uInt>(out.size());
+            int result = deflate(&stream, flush);
+            if (result == Z_STREAM_ERROR)
+            {
+                ok = false;
+                break;
+            }
+            file.write(out.data(), out.size() - stream.avail_out);
+            if (!file)
+                ok = false;
+            // Done once deflate stops filling the whole output buffer
+            if (stream.avail_out != 0 || result == Z_STREAM_END)
+                break;
+        }
+    }
+
+    ofstream file;
+    vector<char> out;
+    z_stream stream{};
+    bool ok = false;
+    bool initialized = false;
+};
+
+// Inflates one zlib stream of known output size that starts at src and may be followed by unrelated
+// bytes (as inside a pack file). On success consumed is set to the number of compressed bytes used.
+bool inflateKnownSize(const char *src, size_t srcLen, size_t outSize, string &out, size_t &consumed)
+{
+    out.resize(outSize);
+#ifdef MYGIT_USE_LIBDEFLATE
+    // Whole-buffer inflate; the decompressor is reusable but not thread-safe
+    thread_local unique_ptr<libdeflate_decompressor, void (*)(libdeflate_decompressor *)> decompressor(libdeflate_alloc_decompressor(), libdeflate_free_decompressor);
+    if (decompressor)
+    {
+        char dummy;
+        size_t produced = 0;
+        libdeflate_result result = libdeflate_zlib_decompress_ex(decompressor.get(), src, srcLen, outSize ? &out[0] : &dummy, outSize,
+                                                                 &consumed, &produced);
+        return result == LIBDEFLATE_SUCCESS && produced == outSize;
+    }
+#endif
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(src));
+    stream.avail_in = static_cast<uInt>(min<size_t>(srcLen, UINT32_MAX));
+    stream.next_out = reinterpret_cast<Bytef *>(outSize ? &out[0] : nullptr);
+    stream.avail_out = static_cast<uInt>(outSize);
+    // A zero-length output still needs a buffer for inflate to make progress
+    char dummy;
+    if (outSize == 0)
+    {
+        stream.next_out = reinterpret_cast<Bytef *>(&dummy);
+        stream.avail_out = 1;
+    }
+    int result = inflate(&stream, Z_FINISH);
+    bool ok = result == Z_STREAM_END && stream.total_out == outSize;
+    consumed = stream.total_in;
+    inflateEnd(&stream);
+    return ok;
+}
+
+// Standard file system utilities
+bool fileExists(const string &path)
+{
+    return fs::exists(path);
+}
+
+bool isDirectory(const string &path)
+{
+    return fs::is_directory(path);
+}
+
+void createDirectories(const string &path)
+{
+    fs::create_directories(path);
+}
+
+// Read-only memory mapping of an entire file. An empty file yields a valid, empty view.
+class MappedFile
+{
+public:
+    explicit MappedFile(const string &path)
+    {
+#ifdef _WIN32
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE)
+            return;
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize))
+            return;
+        len = static_cast<size_t>(fileSize.QuadPart);
+        if (len > 0)
+        {
+            mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (mapping == NULL)
+                return;
+            ptr = static_cast<const char *>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+            if (ptr == nullptr)
+                return;
+        }
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            return;
+        struct stat st;
+        if (fstat(fd, &st) != 0)
+        {
+            close(fd);
+            return;
+        }
+        len = static_cast<size_t>(st.st_size);
+        if (len > 0)
+        {
+            void *p = mmap(nullptr, len, PROT_READ, MAP_PRIVATE, fd, 0);
+            close(fd);
+            if (p == MAP_FAILED)
+                return;
+            ptr = static_cast<const char *>(p);
+        }
+        else
+        {
+            close(fd);
+        }
+#endif
+        ok = true;
+    }
+    ~MappedFile()
+    {
+#ifdef _WIN32
+        if (ptr)
+            UnmapViewOfFile(ptr);
+        if (mapping)
+            CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+#else
+        if (ptr)
+            munmap(const_cast<char *>(ptr), len);
+#endif
+    }
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    bool valid() const { return ok; }
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+    const char *ptr = nullptr;
+    size_t len = 0;
+    bool ok = false;
+};
+
+// File metadata cached in the index to detect unchanged files without rehashing them
+struct FileStat
+{
+    uint64_t ctime = 0; // ns (POSIX inode change time; creation time on Windows)
+    uint64_t mtime = 0; // ns
+    uint64_t size = 0;
+    uint64_t ino = 0; // inode number, or NTFS file index on Windows
+};
+
+// Reads stat data for a path; returns false if the file cannot be queried
+bool getFileStat(const string &path, FileStat &st)
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), FILE_READ_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL ok = GetFileInformationByHandle(h, &info);
+    CloseHandle(h);
+    if (!ok)
+        return false;
+    // FILETIME counts 100 ns intervals
+    auto toNs = [](const FILETIME &ft)
+    { return ((uint64_t(ft.dwHighDateTime) << 32) | ft.dwLowDateTime) * 100; };
+    st.ctime = toNs(info.ftCreationTime);
+    st.mtime = toNs(info.ftLastWriteTime);
+    st.size = (uint64_t(info.nFileSizeHigh) << 32) | info.nFileSizeLow;
+    st.ino = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+#else
+    struct stat sb;
+    if (stat(path.c_str(), &sb) != 0)
+        return false;
+#ifdef __APPLE__
+    st.ctime = uint64_t(sb.st_ctimespec.tv_sec) * 1000000000ull + sb.st_ctimespec.tv_nsec;
+    st.mtime = uint64_t(sb.st_mtimespec.tv_sec) * 1000000000ull + sb.st_mtimespec.tv_nsec;
+#else
+    st.ctime = uint64_t(sb.st_ctim.tv_sec) * 1000000000ull + sb.st_ctim.tv_nsec;
+    st.mtime = uint64_t(sb.st_mtim.tv_sec) * 1000000000ull + sb.st_mtim.tv_nsec;
+#endif
+    st.size = uint64_t(sb.st_size);
+    st.ino = uint64_t(sb.st_ino);
+#endif
+    return true;
+}
+
+// One entry of a directory listing
+struct DirEntry
+{
+    string name;
+    bool isDirectory;
+};
+
+// Lists a directory (without "." and ".."). The entry types come from the directory itself, so
+// unlike fs::directory_iterator no entry is stat'ed; only file systems that do not record types
+// (and symbolic links, which are followed) need a stat call. Returns false if it cannot be read.
+bool readDirectory(const string &path, vector<DirEntry> &entries)
+{
+    TraceScope trace(TRACE_READ_DIRECTORY);
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE h = FindFirstFileA((path + "\\*").c_str(), &data);
+    trace.addSyscalls(1);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    do
+    {
+        trace.addSyscalls(1);
+        string name = data.cFileName;
+        if (name != "." && name != "..")
+            entries.push_back(DirEntry{move(name), (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0});
+    } while (FindNextFileA(h, &data));
+    FindClose(h);
+#else
+    DIR *dir = opendir(path.c_str());
+    trace.addSyscalls(1);
+    if (!dir)
+        return false;
+    while (dirent *d = readdir(dir))
+    {
+        if (d->d_name[0] == '.' && (d->d_name[1] == '\0' || (d->d_name[1] == '.' && d->d_name[2] == '\0')))
+            continue;
+        bool isDir = d->d_type == DT_DIR;
+        if (d->d_type == DT_UNKNOWN || d->d_type == DT_LNK)
+        {
+            struct stat sb;
+            isDir = stat((path + "/" + d->d_name).c_str(), &sb) == 0 && S_ISDIR(sb.st_mode);
+            trace.addSyscalls(1);
+        }
+        entries.push_back(DirEntry{d->d_name, isDir});
+    }
+    closedir(dir);
+    trace.addSyscalls(2); // getdents (at least once) and close
+#endif
+    return true;
+}
+
+// Reads the entire content of a file into a string (binary mode) with one read of its size
+string readFile(const string &path)
+{
+    TraceScope trace(TRACE_READ_FILE);
+    trace.addSyscalls(1);
+    error_code ec;
+    uintmax_t size = fs::file_size(path, ec);
+    ifstream file;
+    if (!ec)
+        file.open(path, ios::binary);
+    if (ec || !file)
+    {
+        cerr << "Error: Cannot read file " << path << endl;
+        return "";
+    }
+    string content(static_cast<size_t>(size), '\0');
+    file.read(&content[0], static_cast<streamsize>(size));
+    content.resize(static_cast<size_t>(file.gcount()));
+    if (content.size() == size && file.peek() != char_traits<char>::eof())
+        content.append(istreambuf_iterator<char>(file), istreambuf_iterator<char>()); // Grew meanwhile
+    trace.addSyscalls(4); // open, read, the read that finds the end and close
+    trace.addBytes(content.size());
+    return content;
+}
+
+// Files of this size and more are memory-mapped by FileView; below it a mapping costs more
+// (page faults, unmapping) than copying the bytes
+const size_t MMAP_THRESHOLD = 256 * 1024;
+
+// Read-only view of a whole file for callers that do not need a copy of their own (loose
+// objects, working-tree files being hashed): large files are memory-mapped, small ones read
+// into a buffer. valid() is false if the file cannot be read.
+class FileView
+{
+public:
+    explicit FileView(const string &path)
+    {
+        TraceScope trace(TRACE_READ_FILE);
+        trace.addSyscalls(1);
+        error_code ec;
+        uintmax_t size = fs::file_size(path, ec);
+        if (ec)
+            return;
+        if (size >= MMAP_THRESHOLD)
+        {
+            mapping = make_unique<MappedFile>(path);
+            trace.addSyscalls(4); // open, fstat, mmap and close
+            ok = mapping->valid();
+            ptr = mapping->data();
+            len = mapping->size();
+            return;
+        }
+        ifstream file(path, ios::binary);
+        buffer.resize(static_cast<size_t>(size));
+        file.read(&buffer[0], static_cast<streamsize>(size));
+        trace.addSyscalls(3);
+        trace.addBytes(size);
+        ok = file && static_cast<uintmax_t>(file.gcount()) == size;
+        ptr = buffer.data();
+        len = buffer.size();
+    }
+    FileView(const FileView &) = delete;
+    FileView &operator=(const FileView &) = delete;
+
+    bool valid() const { return ok; }
+    const char *data() const { return ptr; }
+    size_t size() const { return len; }
+
+private:
+    unique_ptr<MappedFile> mapping;
+    string buffer;
+    const char *ptr = nullptr;
+    size_t len = 0;
+    bool ok = false;
+};
+
+// Writes data to a file, creating parent directories if necessary (binary mode); returns false
+// if the file cannot be written
+bool writeFile(const string &path, const string &data)
+{
+    TraceScope trace(TRACE_WRITE_FILE, data.size());
+    error_code ec;
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    ofstream file(path, ios::binary);
+    trace.addSyscalls(4); // stat of the parent directory, open, write and close
+    if (file)
+    {
+        file << data;
+        file.close();
+    }
+    if (!file)
+    {
+        cerr << "Error: Cannot write file " << path << endl;
+        return false;
+    }
+    return true;
+}
+
+// Exclusive "<target>.lock" file guarding a read-modify-write of <target>. The lock is created with
+// O_EXCL, so a second process fails to acquire it instead of racing; commit() fills the lock file
+// and renames it over the target, so readers see either the old or the new content, never a mix.
+// An uncommitted lock is removed on destruction, leaving the target untouched.
+class LockFile
+{
+public:
+    explicit LockFile(const string &targetPath) : target(targetPath), lockPath(targetPath + ".lock")
+    {
+#ifdef _WIN32
+        fd = _open(lockPath.c_str(), _O_CREAT | _O_EXCL | _O_WRONLY | _O_BINARY, _S_IREAD | _S_IWRITE);
+#else
+        fd = open(lockPath.c_str(), O_CREAT | O_EXCL | O_WRONLY, 0666);
+#endif
+        if (fd < 0)
+        {
+            cerr << "Error: Unable to create " << lockPath << ": " << strerror(errno) << endl;
+            if (errno == EEXIST)
+                cerr << "Another mygit process seems to be running; if not, remove the lock file and retry" << endl;
+        }
+    }
+    ~LockFile()
+    {
+        if (fd >= 0)
+        {
+            closeFd();
+            error_code ec;
+            fs::remove(lockPath, ec);
+        }
+    }
+    LockFile(const LockFile &) = delete;
+    LockFile &operator=(const LockFile &) = delete;
+
+    bool locked() const { return fd >= 0; }
+
+    // Writes data to the lock file and atomically renames it over the target
+    bool commit(const string &data)
+    {
+        if (fd < 0)
+            return false;
+        size_t written = 0;
+        while (written < data.size())
+        {
+#ifdef _WIN32
+            int n = _write(fd, data.data() + written, static_cast<unsigned int>(min<size_t>(data.size() - written, 1 << 30)));
+#else
+            ssize_t n = ::write(fd, data.data() + written, data.size() - written);
+#endif
+            if (n <= 0)
+            {
+                cerr << "Error: Cannot write " << lockPath << endl;
+                return false;
+            }
+            written += static_cast<size_t>(n);
+        }
+        closeFd();
+        error_code ec;
+        fs::rename(lockPath, target, ec);
+        if (ec)
+        {
+            cerr << "Error: Cannot replace " << target << ": " << ec.message() << endl;
+            fs::remove(lockPath, ec);
+            return false;
+        }
+        return true;
+    }
+
+private:
+    void closeFd()
+    {
+#ifdef _WIN32
+        _close(fd);
+#else
+        close(fd);
+#endif
+        fd = -1;
+    }
+
+    string target;
+    string lockPath;
+    int fd = -1;
+};
+
+// Determines the file mode (permissions) for Tree entries (040000 for tree, 100755 for executable, 100644 otherwise)
+string getPermissions(const string &path)
+{
+    if (!fs::exists(path))
+        return "100644";
+    return fs::is_directory(path) ? "040000" : ((fs::status(path).permissions() & fs::perms::owner_exec) != fs::perms::none) ? "100755"
+                                                                                                                             : "100644";
+}
+
+// ============= PARALLEL EXECUTION =============
+
+// Work-stealing thread pool. Every worker owns a deque: it pushes and pops its own tasks at the
+// back (LIFO, good locality for recursive work) and steals from the front of other workers' deques
+// when it runs dry. Threads blocked in TaskGroup::wait() keep executing queued tasks, so tasks may
+// wait on sub-tasks they spawned without deadlocking the pool.
+class ThreadPool
+{
+public:
+    // jobs is the total parallelism including the calling thread; jobs <= 1 runs everything inline
+    explicit ThreadPool(unsigned jobs)
+    {
+        unsigned workers = jobs > 1 ? jobs - 1 : 0;
+        for (unsigned i = 0; i <= workers; i++)
+            queues.push_back(make_unique<Queue>()); // Last queue receives tasks from outside the pool
+        for (unsigned i = 0; i < workers; i++)
+            threads.emplace_back([this, i]
+                                 { workerLoop(i); });
+    }
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> lk(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (auto &t : threads)
+            t.join();
+    }
+    ThreadPool(const ThreadPool &) = delete;
+    ThreadPool &operator=(const ThreadPool &) = delete;
+
+    // Number of threads to use when the user does not pass -j
+    static unsigned defaultJobs()
+    {
+        unsigned n = thread::hardware_concurrency();
+        return n == 0 ? 1 : n;
+    }
+
+    void submit(function<void()> task)
+    {
+        Queue &q = (currentPool == this) ? *queues[currentWorker] : *queues.back();
+        queued++; // Counted before it becomes visible so take() never drives the count negative
+        {
+            lock_guard<mutex> lk(q.m);
+            q.tasks.push_back(move(task));
+        }
+        {
+            lock_guard<mutex> lk(sleepMutex);
+        }
+        wake.notify_one();
+    }
+
+    // Runs one queued task on the calling thread; returns false if there was none
+    bool runOne()
+    {
+        function<void()> task;
+        if (!take(currentPool == this ? currentWorker : queues.size() - 1, task))
+            return false;
+        task();
+        return true;
+    }
+
+private:
+    struct Queue
+    {
+        mutex m;
+        deque<function<void()>> tasks;
+    };
+
+    bool take(size_t self, function<void()> &task)
+    {
+        {
+            Queue &own = *queues[self];
+            lock_guard<mutex> lk(own.m);
+            if (!own.tasks.empty())
+            {
+                task = move(own.tasks.back());
+                own.tasks.pop_back();
+                queued--;
+                return true;
+            }
+        }
+        for (size_t k = 1; k < queues.size(); k++)
+        {
+            Queue &victim = *queues[(self + k) % queues.size()];
+            lock_guard<mutex> lk(victim.m);
+            if (!victim.tasks.empty())
+            {
+                task = move(victim.tasks.front());
+                victim.tasks.pop_front();
+                queued--;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void workerLoop(size_t index)
+    {
+        currentPool = this;
+        currentWorker = index;
+        while (true)
+        {
+            if (runOne())
+                continue;
+            unique_lock<mutex> lk(sleepMutex);
+            wake.wait(lk, [this]
+                      { return stopping || queued > 0; });
+            if (stopping && queued == 0)
+                return;
+        }
+    }
+
+    vector<unique_ptr<Queue>> queues;
+    vector<thread> threads;
+    atomic<size_t> queued{0};
+    mutex sleepMutex;
+    condition_variable wake;
+    bool stopping = false;
+
+    static thread_local ThreadPool *currentPool;
+    static thread_local size_t currentWorker;
+};
+
+thread_local ThreadPool *ThreadPool::currentPool = nullptr;
+thread_local size_t ThreadPool::currentWorker = 0;
+
+// A set of tasks submitted to a pool that can be waited on as a unit
+class TaskGroup
+{
+public:
+    explicit TaskGroup(ThreadPool &p) : pool(p) {}
+    ~TaskGroup() { wait(); }
+
+    void run(function<void()> task)
+    {
+        pending++;
+        pool.submit([this, task = move(task)]
+                    {
+                        task();
+                        pending--; });
+    }
+
+    // Blocks until every task in the group finished, executing queued work meanwhile
+    void wait()
+    {
+        while (pending > 0)
+        {
+            if (!pool.runOne())
+                this_thread::yield();
+        }
+    }
+
+private:
+    ThreadPool &pool;
+    atomic<size_t> pending{0};
+};
+
+// Blocking FIFO with a fixed capacity: push waits while full, pop waits while empty.
+// After close(), pop drains the remaining items and then returns false.
+template <typename T>
+class BoundedQueue
+{
+public:
+    explicit BoundedQueue(size_t cap) : capacity(cap == 0 ? 1 : cap) {}
+
+    void push(T item)
+    {
+        unique_lock<mutex> lk(m);
+        notFull.wait(lk, [this]
+                     { return items.size() < capacity; });
+        items.push_back(move(item));
+        notEmpty.notify_one();
+    }
+
+    bool pop(T &item)
+    {
+        unique_lock<mutex> lk(m);
+        notEmpty.wait(lk, [this]
+                      { return !items.empty() || closed; });
+        if (items.empty())
+            return false;
+        item = move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> lk(m);
+        closed = true;
+        notEmpty.notify_all();
+    }
+
+private:
+    size_t capacity;
+    deque<T> items;
+    bool closed = false;
+    mutex m;
+    condition_variable notFull;
+    condition_variable notEmpty;
+};
+
+// Waits a little longer on every call: spins first, then yields, then sleeps (up to 640 us), so an
+// idle stage costs next to nothing while a busy one reacts within microseconds
+inline void backoff(unsigned &attempt)
+{
+    if (attempt >= 64)
+        this_thread::sleep_for(chrono::microseconds(10u << min(attempt - 64, 6u)));
+    else if (attempt >= 16)
+        this_thread::yield();
+    attempt++;
+}
+
+// Bounded multi-producer multi-consumer ring without locks (Vyukov's algorithm): every cell has a
+// sequence number that tells producers and consumers whose turn it is, so push and pop are a
+// compare-and-swap on the head or tail index plus a copy. The capacity is rounded up to a power of
+// two. push and pop wait with backoff while the ring is full or empty; after close(), pop drains
+// the remaining items and then returns false.
+template <typename T>
+class LockFreeQueue
+{
+public:
+    explicit LockFreeQueue(size_t capacity)
+    {
+        size_t n = 2;
+        while (n < capacity)
+            n <<= 1;
+        cells.reset(new Cell[n]);
+        mask = n - 1;
+        for (size_t i = 0; i < n; i++)
+            cells[i].sequence.store(i, memory_order_relaxed);
+    }
+
+    bool tryPush(T &item)
+    {
+        size_t pos = tail.load(memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+            if (diff == 0)
+            {
+                if (tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    cell.value = move(item);
+                    cell.sequence.store(pos + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // Full
+            else
+                pos = tail.load(memory_order_relaxed);
+        }
+    }
+
+    bool tryPop(T &item)
+    {
+        size_t pos = head.load(memory_order_relaxed);
+        for (;;)
+        {
+            Cell &cell = cells[pos & mask];
+            size_t seq = cell.sequence.load(memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0)
+            {
+                if (head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+                {
+                    item = move(cell.value);
+                    cell.sequence.store(pos + mask + 1, memory_order_release);
+                    return true;
+                }
+            }
+            else if (diff < 0)
+                return false; // Empty
+            else
+                pos = head.load(memory_order_relaxed);
+        }
+    }
+
+    // Returns true if it had to wait for space
+    bool push(T item)
+    {
+        unsigned attempt = 0;
+        while (!tryPush(item))
+            backoff(attempt);
+        return attempt > 0;
+    }
+
+    bool pop(T &item)
+    {
+        unsigned attempt = 0;
+        while (!tryPop(item))
+        {
+            if (closed.load(memory_order_acquire))
+                return tryPop(item); // Items pushed before close() are still delivered
+            backoff(attempt);
+        }
+        return true;
+    }
+
+    void close() { closed.store(true, memory_order_release); }
+
+private:
+    struct Cell
+    {
+        atomic<size_t> sequence;
+        T value;
+    };
+    unique_ptr<Cell[]> cells;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0};
+    alignas(64) atomic<size_t> tail{0};
+    atomic<bool> closed{false};
+};
+
+// ============= CONFIGURATION =============
+
+// Reads .mygit\config, a git-style INI file:
+//   [core]
+//       treeformat = binary
+// Keys are looked up as "section.key" (lowercase). Blank lines and '#' / ';' comments are ignored.
+map<string, string> readConfig()
+{
+    map<string, string> values;
+    ifstream file(REPO_DIR + "\\config");
+    string line, section;
+    auto trim = [](const string &s)
+    {
+        size_t begin = s.find_first_not_of(" \t\r");
+        size_t end = s.find_last_not_of(" \t\r");
+        return begin == string::npos ? string() : s.substr(begin, end - begin + 1);
+    };
+    auto lower = [](string s)
+    {
+        transform(s.begin(), s.end(), s.begin(), [](unsigned char c)
+                  { return static_cast<char>(tolower(c)); });
+        return s;
+    };
+    while (getline(file, line))
+    {
+        line = trim(line);
+        if (line.empty() || line[0] == '#' || line[0] == ';')
+            continue;
+        if (line[0] == '[' && line.back() == ']')
+        {
+            // [remote "origin"] is section remote.origin; the subsection keeps its case, as in git
+            section = trim(line.substr(1, line.size() - 2));
+            size_t quote = section.find('"');
+            if (quote != string::npos && section.back() == '"' && quote + 1 < section.size())
+                section = lower(trim(section.substr(0, quote))) + "." + section.substr(quote + 1, section.size() - quote - 2);
+            else
+                section = lower(section);
+            continue;
+        }
+        size_t eq = line.find('=');
+        if (eq == string::npos)
+            continue;
+        values[section + "." + lower(trim(line.substr(0, eq)))] = trim(line.substr(eq + 1));
+    }
+    return values;
+}
+
+// Returns a configuration value, or fallback if it is not set. The file is read once per process.
+string getConfig(const string &key, const string &fallback = "")
+{
+    static const map<string, string> config = readConfig();
+    auto it = config.find(key);
+    return it == config.end() ? fallback : it->second;
+}
+
+// Reads a size setting with an optional k, m or g suffix (as in git: "512k", "1m")
+uint64_t getConfigSize(const string &key, uint64_t fallback)
+{
+    string value = getConfig(key);
+    if (value.empty())
+        return fallback;
+    char *end = nullptr;
+    uint64_t n = strtoull(value.c_str(), &end, 10);
+    switch (tolower(static_cast<unsigned char>(*end)))
+    {
+    case 'g':
+        n <<= 10;
+        // fall through
+    case 'm':
+        n <<= 10;
+        // fall through
+    case 'k':
+        n <<= 10;
+        end++;
+        break;
+    }
+    if (end == value.c_str() || *end != '\0')
+    {
+        cerr << "Warning: Ignoring " << key << " = " << value << " (expected a size such as 512k or 64m)" << endl;
+        return fallback;
+    }
+    return n;
+}
+
+// Tree entries reference objects by their raw ID bytes, as in git. Repositories created before
+// this was the default have hex characters instead and no core.treeformat setting.
+bool binaryTreeIds()
+{
+    static const bool binary = getConfig("core.treeformat", "hex") == "binary";
+    return binary;
+}
+
+// Sets the object format from extensions.objectformat ("sha1" if unset). Returns false for a
+// format this version cannot read.
+bool loadObjectFormat()
+{
+    string format = getConfig("extensions.objectformat", "sha1");
+    if (format == "sha256")
+        setObjectFormat(HashAlgorithm::SHA256);
+    else if (format != "sha1")
+    {
+        cerr << "Error: Unsupported object format " << format << endl;
+        return false;
+    }
+    return true;
+}
+
+// ============= COMPRESSION =============
+
+// Loose objects are stored in one of two formats, told apart by their first bytes:
+//   zlib: a plain zlib stream, as in git. Written by the zlib and libdeflate codecs, and at
+//         level 0 (stored deflate blocks) for data that store mode finds incompressible.
+//   zstd: "MGZS" | dictionary ID (u32, 0 = none) | zstd frame
+// A zlib stream starts with a byte whose low nibble is 8, which 'M' is not, so every object
+// reads correctly whatever the repository is configured to write now. Pack entries are always
+// zlib streams (only the level and the compressor are configurable), so packs stay git-compatible.
+//
+// Settings (git's names where git has them):
+//   [core]
+//       codec = zlib | libdeflate | zstd
+//       compression = <level>         ; -1 = the codec's default; zlib 0-9, libdeflate 0-12, zstd 1-22
+//       looseCompression = <level>    ; loose objects only (default: core.compression)
+//       zstdDictionary = <id>         ; from train-dictionary, for new zstd objects
+//       storeIncompressible = true    ; sample data and store what does not compress
+//   [pack]
+//       compression = <level>         ; pack entries (default: core.compression)
+// libdeflate and zstd are only available in builds with -DMYGIT_USE_LIBDEFLATE / -DMYGIT_USE_ZSTD.
+enum class Codec
+{
+    ZLIB,
+    LIBDEFLATE,
+    ZSTD
+};
+
+const char ZSTD_OBJECT_MAGIC[] = "MGZS";
+const size_t ZSTD_OBJECT_HEADER_SIZE = 8;
+const char *const CODEC_NAMES[] = {"zlib", "libdeflate", "zstd"};
+
+struct CompressionSettings
+{
+    Codec codec = Codec::ZLIB;
+    int looseLevel = -1; // -1 = the codec's default
+    int packLevel = -1;
+    uint32_t zstdDictionary = 0;
+    bool storeIncompressible = true;
+};
+
+// Reads the compression settings once. Unknown codecs, codecs this build lacks and levels out of
+// range fall back to the defaults with a warning.
+const CompressionSettings &compressionSettings()
+{
+    static const CompressionSettings settings = []
+    {
+        CompressionSettings s;
+        string codec = getConfig("core.codec", "zlib");
+        if (codec == "libdeflate")
+            s.codec = Codec::LIBDEFLATE;
+        else if (codec == "zstd")
+            s.codec = Codec::ZSTD;
+        else if (codec != "zlib")
+            cerr << "Warning: Unknown core.codec " << codec << ", using zlib" << endl;
+#ifndef MYGIT_USE_LIBDEFLATE
+        if (s.codec == Codec::LIBDEFLATE)
+        {
+            cerr << "Warning: This build has no libdeflate support, using zlib" << endl;
+            s.codec = Codec::ZLIB;
+        }
+#endif
+#ifndef MYGIT_USE_ZSTD
+        if (s.codec == Codec::ZSTD)
+        {
+            cerr << "Warning: This build has no zstd support, using zlib" << endl;
+            s.codec = Codec::ZLIB;
+        }
+#endif
+        // Reads key, or core.compression if useBase and key is not set
+        unordered_set<string> warned;
+        auto level = [&warned](string key, int maxLevel, bool useBase)
+        {
+            string value = getConfig(key);
+            if (value.empty() && useBase)
+                value = getConfig(key = "core.compression");
+            if (value.empty())
+                return -1;
+            int n = atoi(value.c_str());
+            if (n < -1 || n > maxLevel)
+            {
+                if (warned.insert(key).second)
+                    cerr << "Warning: Ignoring " << key << " = " << value << " (expected -1 to " << maxLevel << ")" << endl;
+                return -1;
+            }
+            return n;
+        };
+        int deflateMax = s.codec == Codec::LIBDEFLATE ? 12 : 9;
+        s.looseLevel = level("core.loosecompression", s.codec == Codec::ZSTD ? 22 : deflateMax, true);
+        // A zstd level means nothing to the zlib streams in packs
+        s.packLevel = level("pack.compression", deflateMax, s.codec != Codec::ZSTD);
+        s.zstdDictionary = static_cast<uint32_t>(strtoul(getConfig("core.zstddictionary", "0").c_str(), nullptr, 10));
+        s.storeIncompressible = getConfig("core.storeincompressible", "true") != "false";
+        return s;
+    }();
+    return settings;
+}
+
+// Counters for the compression path, printed with --stats
+struct CompressionStats
+{
+    atomic<uint64_t> rawBytes{0};
+    atomic<uint64_t> compressedBytes{0};
+    atomic<uint64_t> stored{0};     // Objects found incompressible and stored
+    atomic<uint64_t> nanoseconds{0}; // Time spent compressing (summed over threads)
+};
+CompressionStats compressionStats;
+
+// Adds one compression to the counters, timed from start
+void recordCompression(chrono::steady_clock::time_point start, size_t rawSize, size_t compressedSize)
+{
+    compressionStats.rawBytes += rawSize;
+    compressionStats.compressedBytes += compressedSize;
+    compressionStats.nanoseconds += static_cast<uint64_t>(chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count());
+}
+
+// Store mode sampling: data below this size is always compressed (trying costs as much as doing)
+const size_t SAMPLE_MIN_SIZE = 16 * 1024;
+const size_t SAMPLE_WINDOW = 4096;
+
+// True if the sampled windows (start, middle and end of the data) do not shrink by at least 1/16
+// at the fastest zlib level, e.g. for media files or archives
+bool windowsIncompressible(const string &sample)
+{
+    uLongf outSize = compressBound(sample.size());
+    string out(outSize, '\0');
+    if (compress2(reinterpret_cast<Bytef *>(&out[0]), &outSize, reinterpret_cast<const Bytef *>(sample.data()), sample.size(), 1) != Z_OK)
+        return false;
+    return outSize >= sample.size() - sample.size() / 16;
+}
+
+bool looksIncompressible(const char *data, size_t size)
+{
+    if (!compressionSettings().storeIncompressible || size < SAMPLE_MIN_SIZE)
+        return false;
+    size_t middle = (size - SAMPLE_WINDOW) / 2;
+    string sample(data, SAMPLE_WINDOW);
+    sample.append(data + middle, SAMPLE_WINDOW);
+    sample.append(data + size - SAMPLE_WINDOW, SAMPLE_WINDOW);
+    return windowsIncompressible(sample);
+}
+
+bool looksIncompressible(const string &data)
+{
+    return looksIncompressible(data.data(), data.size());
+}
+
+#ifdef MYGIT_USE_LIBDEFLATE
+// libdeflate compressors are bound to a level and must not be shared between threads
+libdeflate_compressor *libdeflateCompressor(int level)
+{
+    struct Compressors
+    {
+        libdeflate_compressor *byLevel[13] = {};
+        ~Compressors()
+        {
+            for (auto *c : byLevel)
+                if (c)
+                    libdeflate_free_compressor(c);
+        }
+    };
+    thread_local Compressors compressors;
+    libdeflate_compressor *&c = compressors.byLevel[level];
+    if (!c)
+        c = libdeflate_alloc_compressor(level);
+    return c;
+}
+#endif
+
+// Deflates data into a zlib stream at the given level (-1 = default) with the configured compressor
+string deflateData(const string &data, int level)
+{
+#ifdef MYGIT_USE_LIBDEFLATE
+    if (compressionSettings().codec == Codec::LIBDEFLATE)
+    {
+        libdeflate_compressor *c = libdeflateCompressor(level < 0 ? 6 : level);
+        string out(libdeflate_zlib_compress_bound(c, data.size()), '\0');
+        size_t n = c ? libdeflate_zlib_compress(c, data.data(), data.size(), &out[0], out.size()) : 0;
+        if (n == 0)
+        {
+            cerr << "Error: Compression failed" << endl;
+            return "";
+        }
+        out.resize(n);
+        return out;
+    }
+#endif
+    return compressData(data, level);
+}
+
+#ifdef MYGIT_USE_ZSTD
+string getZstdDictionaryPath(uint32_t id)
+{
+    return REPO_DIR + "\\objects\\info\\zstd-" + to_string(id) + ".dict";
+}
+
+// Dictionaries, loaded on first use and kept for the life of the process. Objects remember which
+// dictionary compressed them, so old dictionaries stay readable after a new one is configured.
+mutex zstdDictionariesMutex;
+map<uint32_t, unique_ptr<ZSTD_DDict, size_t (*)(ZSTD_DDict *)>> zstdDecodeDictionaries;
+
+const ZSTD_DDict *zstdDecodeDictionary(uint32_t id)
+{
+    lock_guard<mutex> lk(zstdDictionariesMutex);
+    auto it = zstdDecodeDictionaries.find(id);
+    if (it != zstdDecodeDictionaries.end())
+        return it->second.get();
+    string dict = readFile(getZstdDictionaryPath(id));
+    ZSTD_DDict *ddict = dict.empty() ? nullptr : ZSTD_createDDict(dict.data(), dict.size());
+    if (!ddict)
+        cerr << "Error: Cannot load zstd dictionary " << getZstdDictionaryPath(id) << endl;
+    zstdDecodeDictionaries.emplace(id, unique_ptr<ZSTD_DDict, size_t (*)(ZSTD_DDict *)>(ddict, ZSTD_freeDDict));
+    return ddict;
+}
+
+// The configured dictionary, prepared for the loose object level
+const ZSTD_CDict *zstdEncodeDictionary()
+{
+    static const unique_ptr<ZSTD_CDict, size_t (*)(ZSTD_CDict *)> cdict([]() -> ZSTD_CDict *
+    {
+        const auto &settings = compressionSettings();
+        if (settings.zstdDictionary == 0)
+            return nullptr;
+        string dict = readFile(getZstdDictionaryPath(settings.zstdDictionary));
+        ZSTD_CDict *d = dict.empty() ? nullptr : ZSTD_createCDict(dict.data(), dict.size(), settings.looseLevel < 0 ? ZSTD_CLEVEL_DEFAULT : settings.looseLevel);
+        if (!d)
+            cerr << "Warning: Cannot load zstd dictionary " << settings.zstdDictionary << ", compressing without it" << endl;
+        return d;
+    }(), ZSTD_freeCDict);
+    return cdict.get();
+}
+
+// Compression and decompression contexts are reusable but not thread-safe: one per thread
+ZSTD_CCtx *zstdCompressContext()
+{
+    thread_local unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+    return ctx.get();
+}
+
+ZSTD_DCtx *zstdDecompressContext()
+{
+    thread_local unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+    return ctx.get();
+}
+
+// The "MGZS" | dictionary ID prefix of a zstd loose object
+string zstdObjectHeader(uint32_t dictionary)
+{
+    string header(ZSTD_OBJECT_MAGIC, 4);
+    appendU32(header, dictionary);
+    return header;
+}
+
+// Sets up the thread's compression context for a new loose object
+ZSTD_CCtx *startZstdObject(uint64_t pledgedSize, uint32_t &dictionary)
+{
+    const auto &settings = compressionSettings();
+    ZSTD_CCtx *cctx = zstdCompressContext();
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_and_parameters);
+    const ZSTD_CDict *cdict = zstdEncodeDictionary();
+    dictionary = cdict ? settings.zstdDictionary : 0;
+    if (cdict)
+        ZSTD_CCtx_refCDict(cctx, cdict); // The dictionary carries the level
+    else
+        ZSTD_CCtx_setParameter(cctx, ZSTD_c_compressionLevel, settings.looseLevel < 0 ? ZSTD_CLEVEL_DEFAULT : settings.looseLevel);
+    ZSTD_CCtx_setPledgedSrcSize(cctx, pledgedSize);
+    return cctx;
+}
+
+string zstdEncodeObject(const string &content)
+{
+    uint32_t dictionary;
+    ZSTD_CCtx *cctx = startZstdObject(content.size(), dictionary);
+    string out = zstdObjectHeader(dictionary);
+    out.resize(ZSTD_OBJECT_HEADER_SIZE + ZSTD_compressBound(content.size()));
+    size_t n = ZSTD_compress2(cctx, &out[ZSTD_OBJECT_HEADER_SIZE], out.size() - ZSTD_OBJECT_HEADER_SIZE, content.data(), content.size());
+    if (ZSTD_isError(n))
+    {
+        cerr << "Error: Compression failed: " << ZSTD_getErrorName(n) << endl;
+        return "";
+    }
+    out.resize(ZSTD_OBJECT_HEADER_SIZE + n);
+    return out;
+}
+
+// Prepares the thread's decompression context for a zstd object; false if its dictionary is missing
+ZSTD_DCtx *startZstdDecode(const char *header)
+{
+    ZSTD_DCtx *dctx = zstdDecompressContext();
+    ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+    uint32_t dictionary = readU32(header + 4);
+    if (dictionary == 0)
+        return dctx;
+    const ZSTD_DDict *ddict = zstdDecodeDictionary(dictionary);
+    if (!ddict)
+        return nullptr;
+    ZSTD_DCtx_refDDict(dctx, ddict);
+    return dctx;
+}
+
+string zstdDecodeObject(const char *stored, size_t len)
+{
+    ZSTD_DCtx *dctx = startZstdDecode(stored);
+    const char *frame = stored + ZSTD_OBJECT_HEADER_SIZE;
+    size_t frameSize = len - ZSTD_OBJECT_HEADER_SIZE;
+    unsigned long long size = ZSTD_getFrameContentSize(frame, frameSize);
+    if (!dctx || size == ZSTD_CONTENTSIZE_ERROR || size == ZSTD_CONTENTSIZE_UNKNOWN)
+        return "";
+    string out(static_cast<size_t>(size), '\0');
+    size_t n = ZSTD_decompressDCtx(dctx, out.empty() ? nullptr : &out[0], out.size(), frame, frameSize);
+    if (ZSTD_isError(n) || n != out.size())
+        return "";
+    return out;
+}
+#endif
+
+bool isZstdObject(const char *data, size_t len)
+{
+    return len >= ZSTD_OBJECT_HEADER_SIZE && memcmp(data, ZSTD_OBJECT_MAGIC, 4) == 0;
+}
+
+// Compresses object content (header + data) for a loose object file, as configured
+string encodeLooseObject(const string &content)
+{
+    TraceScope trace(TRACE_COMPRESS, content.size());
+    const auto &settings = compressionSettings();
+    auto start = chrono::steady_clock::now();
+    string out;
+    if (looksIncompressible(content))
+    {
+        out = compressData(content, 0);
+        compressionStats.stored++;
+    }
+#ifdef MYGIT_USE_ZSTD
+    else if (settings.codec == Codec::ZSTD)
+        out = zstdEncodeObject(content);
+#endif
+    else
+        out = deflateData(content, settings.looseLevel);
+    recordCompression(start, content.size(), out.size());
+    return out;
+}
+
+// Compresses a pack entry's data (an object or a delta) into a zlib stream at the pack level
+string encodePackData(const string &data)
+{
+    TraceScope trace(TRACE_COMPRESS, data.size());
+    auto start = chrono::steady_clock::now();
+    string out;
+    if (looksIncompressible(data))
+    {
+        out = compressData(data, 0);
+        compressionStats.stored++;
+    }
+    else
+        out = deflateData(data, compressionSettings().packLevel);
+    recordCompression(start, data.size(), out.size());
+    return out;
+}
+
+// Decompresses a loose object file in either format
+string decodeLooseObject(const char *stored, size_t len)
+{
+    TraceScope trace(TRACE_DECOMPRESS, len);
+    if (!isZstdObject(stored, len))
+        return decompressData(stored, len);
+#ifdef MYGIT_USE_ZSTD
+    string object = zstdDecodeObject(stored, len);
+    if (object.empty())
+        cerr << "Error: Decompression failed" << endl;
+    return object;
+#else
+    cerr << "Error: Object is zstd-compressed, but this build has no zstd support" << endl;
+    return "";
+#endif
+}
+
+// Decompresses just the first bytes (up to maxOut) of a zstd object whose 8-byte prefix has
+// already been read from file, e.g. to read the object header
+string zstdObjectPrefix(ifstream &file, const char *header, size_t maxOut)
+{
+#ifdef MYGIT_USE_ZSTD
+    ZSTD_DCtx *dctx = startZstdDecode(header);
+    if (!dctx)
+        return "";
+    string out(maxOut, '\0');
+    ZSTD_outBuffer output{&out[0], maxOut, 0};
+    char in[4096];
+    while (output.pos < output.size && file)
+    {
+        file.read(in, sizeof(in));
+        ZSTD_inBuffer input{in, static_cast<size_t>(file.gcount()), 0};
+        size_t result = ZSTD_decompressStream(dctx, &output, &input);
+        if (ZSTD_isError(result) || result == 0)
+            break;
+    }
+    out.resize(output.pos);
+    return out;
+#else
+    (void)file;
+    (void)header;
+    (void)maxOut;
+    cerr << "Error: Object is zstd-compressed, but this build has no zstd support" << endl;
+    return "";
+#endif
+}
+
+// Streams the decompressed bytes of a loose object file (header included), in either format, so
+// objects of any size can be read in fixed-size chunks
+class LooseObjectReader
+{
+public:
+    explicit LooseObjectReader(const string &path) : file(path, ios::binary), in(STREAM_CHUNK_SIZE)
+    {
+        if (!file)
+            return;
+        char prefix[ZSTD_OBJECT_HEADER_SIZE];
+        file.read(prefix, sizeof(prefix));
+        if (isZstdObject(prefix, static_cast<size_t>(file.gcount())))
+        {
+#ifdef MYGIT_USE_ZSTD
+            dctx = startZstdDecode(prefix);
+            ok = dctx != nullptr;
+#else
+            cerr << "Error: Object is zstd-compressed, but this build has no zstd support" << endl;
+#endif
+            return;
+        }
+        file.clear();
+        file.seekg(0);
+        ok = inflateInit(&stream) == Z_OK;
+        initialized = ok;
+    }
+    ~LooseObjectReader()
+    {
+        if (initialized)
+            inflateEnd(&stream);
+    }
+    LooseObjectReader(const LooseObjectReader &) = delete;
+    LooseObjectReader &operator=(const LooseObjectReader &) = delete;
+
+    bool good() const { return ok; }
+    bool done() const { return finished; }
+
+    // Decompresses up to len bytes into out and returns how many; fewer only at the end of the
+    // object or on an error (see good())
+    size_t read(char *out, size_t len)
+    {
+        size_t produced = 0;
+        while (ok && !finished && produced < len)
+        {
+            if (inPos == inLen && !eof)
+            {
+                file.read(in.data(), in.size());
+                inLen = static_cast<size_t>(file.gcount());
+                inPos = 0;
+                eof = inLen == 0;
+            }
+            size_t before = produced, consumedBefore = inPos;
+#ifdef MYGIT_USE_ZSTD
+            if (dctx)
+            {
+                ZSTD_inBuffer input{in.data(), inLen, inPos};
+                ZSTD_outBuffer output{out, len, produced};
+                size_t result = ZSTD_decompressStream(dctx, &output, &input);
+                ok = !ZSTD_isError(result);
+                inPos = input.pos;
+                produced = output.pos;
+                finished = ok && result == 0;
+            }
+            else
+#endif
+            {
+                stream.next_in = reinterpret_cast<Bytef *>(in.data() + inPos);
+                stream.avail_in = static_cast<uInt>(inLen - inPos);
+                stream.next_out = reinterpret_cast<Bytef *>(out + produced);
+                stream.avail_out = static_cast<uInt>(len - produced);
+                int result = inflate(&stream, Z_NO_FLUSH);
+                ok = result == Z_OK || result == Z_STREAM_END || result == Z_BUF_ERROR;
+                inPos = inLen - stream.avail_in;
+                produced = len - stream.avail_out;
+                finished = result == Z_STREAM_END;
+            }
+            // A stream that stops making progress at the end of the file is truncated
+            if (!finished && eof && produced == before && inPos == consumedBefore)
+                ok = false;
+        }
+        return produced;
+    }
+
+private:
+    ifstream file;
+    vector<char> in;
+    size_t inPos = 0, inLen = 0;
+    bool eof = false;
+    z_stream stream{};
+#ifdef MYGIT_USE_ZSTD
+    ZSTD_DCtx *dctx = nullptr;
+#endif
+    bool initialized = false;
+    bool ok = false;
+    bool finished = false;
+};
+
+// Streams a loose object to a file in the configured format (zlib, or store mode, or zstd), so
+// the compressed output never has to be held in memory as a whole. totalSize is the exact number
+// of bytes that will be written (zstd records it in the frame).
+class LooseObjectWriter
+{
+public:
+    LooseObjectWriter(const string &path, uint64_t totalSize, bool store) : path(path)
+    {
+        const auto &settings = compressionSettings();
+        start = chrono::steady_clock::now();
+        if (store)
+            compressionStats.stored++;
+#ifdef MYGIT_USE_ZSTD
+        if (!store && settings.codec == Codec::ZSTD)
+        {
+            file.open(path, ios::binary);
+            uint32_t dictionary;
+            cctx = startZstdObject(totalSize, dictionary);
+            out.resize(ZSTD_CStreamOutSize());
+            string header = zstdObjectHeader(dictionary);
+            file.write(header.data(), header.size());
+            ok = static_cast<bool>(file);
+            return;
+        }
+#endif
+        // libdeflate has no streaming interface; zlib writes the same format
+        deflater = make_unique<DeflateFileWriter>(path, store ? 0 : settings.looseLevel);
+        ok = deflater->good();
+        (void)totalSize;
+    }
+    LooseObjectWriter(const LooseObjectWriter &) = delete;
+    LooseObjectWriter &operator=(const LooseObjectWriter &) = delete;
+
+    bool good() const { return ok; }
+
+    void write(const char *data, size_t len)
+    {
+        rawBytes += len;
+        if (deflater)
+        {
+            deflater->write(data, len);
+            return;
+        }
+#ifdef MYGIT_USE_ZSTD
+        ZSTD_inBuffer in{data, len, 0};
+        while (ok && in.pos < in.size)
+            ok = pump(in, ZSTD_e_continue);
+#endif
+    }
+
+    // Flushes the remaining compressed data and closes the file
+    bool finish()
+    {
+        bool result = ok;
+        if (deflater)
+            result = deflater->finish() && result;
+#ifdef MYGIT_USE_ZSTD
+        else
+        {
+            ZSTD_inBuffer in{nullptr, 0, 0};
+            while (result && !finished)
+                result = pump(in, ZSTD_e_end);
+            file.close();
+            result = result && !file.fail();
+        }
+#endif
+        error_code ec;
+        uintmax_t compressedSize = fs::file_size(path, ec);
+        recordCompression(start, rawBytes, ec ? 0 : static_cast<size_t>(compressedSize));
+        return result;
+    }
+
+private:
+#ifdef MYGIT_USE_ZSTD
+    // Runs the compressor once and writes what it produced
+    bool pump(ZSTD_inBuffer &in, ZSTD_EndDirective mode)
+    {
+        ZSTD_outBuffer output{out.data(), out.size(), 0};
+        size_t remaining = ZSTD_compressStream2(cctx, &output, &in, mode);
+        if (ZSTD_isError(remaining))
+            return false;
+        file.write(out.data(), output.pos);
+        finished = mode == ZSTD_e_end && remaining == 0;
+        return static_cast<bool>(file);
+    }
+
+    ofstream file;
+    ZSTD_CCtx *cctx = nullptr;
+    vector<char> out;
+    bool finished = false;
+#endif
+    string path;
+    unique_ptr<DeflateFileWriter> deflater;
+    chrono::steady_clock::time_point start;
+    uint64_t rawBytes = 0;
+    bool ok = false;
+};
+
+// ============= OBJECT STORAGE =============
+
+// Returns the full path where the object with the given SHA is stored (e.g., .mygit/objects/aa/bbbb...)
+string getObjectPath(const ObjectId &sha)
+{
+    static const string objectsDir = REPO_DIR + "\\objects\\";
+    char hex[2 * MAX_OBJECT_ID_LENGTH];
+    size_t hexLen = 2 * objectIdLength;
+    bytesToHex(sha.bytes, objectIdLength, hex);
+    string path;
+    path.reserve(objectsDir.size() + hexLen + 1);
+    path.append(objectsDir).append(hex, 2).append(1, '\\').append(hex + 2, hexLen - 2);
+    return path;
+}
+
+// Returns a unique scratch path inside the object database for an object that is still being written
+string getTempObjectPath()
+{
+    static atomic<unsigned long long> counter{0};
+    static const unsigned long long seed = random_device{}() ^ (static_cast<unsigned long long>(random_device{}()) << 32);
+    return REPO_DIR + "\\objects\\tmp_obj_" + to_string(seed) + "_" + to_string(counter++);
+}
+
+// Counters for the object write path, printed with --stats
+struct ObjectWriteStats
+{
+    atomic<uint64_t> written{0};
+    atomic<uint64_t> skipped{0};
+};
+ObjectWriteStats objectStats;
+
+// Pack storage lookups (defined in PACK STORAGE below)
+bool hasPackedObject(const ObjectId &sha);
+bool readPackedObject(const ObjectId &sha, string &object);
+bool readPackedObjectHeader(const ObjectId &sha, string &type, uint64_t &size);
+
+// Objects written in batch mode that are waiting for the final flush (sha -> temp path)
+mutex pendingObjectsMutex;
+unordered_map<ObjectId, string> pendingObjects;
+
+// Path to read a loose object from: its temp file while a batch-mode write is still pending,
+// otherwise its place in the object database
+string looseObjectPath(const ObjectId &sha)
+{
+    {
+        lock_guard<mutex> lk(pendingObjectsMutex);
+        auto it = pendingObjects.find(sha);
+        if (it != pendingObjects.end())
+            return it->second;
+    }
+    return getObjectPath(sha);
+}
+
+// True if the object is already stored in the object database (packed, loose or pending)
+bool objectExists(const ObjectId &sha)
+{
+    return hasPackedObject(sha) || fileExists(looseObjectPath(sha));
+}
+
+// Durability of new objects, from MYGIT_FSYNC_OBJECTS:
+//   unset/"0"  - no fsync; temp+rename still guarantees no truncated object after a process crash
+//   "1"        - fsync every object before it is renamed into place
+//   "batch"    - objects are written to temp files, and at the end of the command all of them are
+//                flushed in one go and only then renamed, so an OS crash never exposes a torn object
+enum class FsyncMode
+{
+    Off,
+    Always,
+    Batch
+};
+
+FsyncMode getFsyncMode()
+{
+    static const FsyncMode mode = []
+    {
+        const char *env = getenv("MYGIT_FSYNC_OBJECTS");
+        string value = env ? env : "";
+        if (value == "batch")
+            return FsyncMode::Batch;
+        if (!value.empty() && value != "0" && value != "false")
+            return FsyncMode::Always;
+        return FsyncMode::Off;
+    }();
+    return mode;
+}
+
+// Flushes a file's data to stable storage
+bool fsyncFile(const string &path)
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    BOOL ok = FlushFileBuffers(h);
+    CloseHandle(h);
+    return ok != 0;
+#else
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+    int result = fsync(fd);
+    close(fd);
+    return result == 0;
+#endif
+}
+
+// Renames a temp object into place, unless another writer already stored it
+bool renameTempObject(const string &tempPath, const ObjectId &sha)
+{
+    string path = getObjectPath(sha);
+    error_code ec;
+    if (fs::exists(path))
+    {
+        fs::remove(tempPath, ec);
+        return true;
+    }
+    fs::create_directories(fs::path(path).parent_path(), ec);
+    fs::rename(tempPath, path, ec);
+    if (ec)
+    {
+        cerr << "Error: Cannot write object " << sha << ": " << ec.message() << endl;
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    return true;
+}
+
+// Moves a fully written temporary object file to its final location (honouring the fsync mode);
+// drops it if the object already exists
+bool finalizeObject(const string &tempPath, const ObjectId &sha)
+{
+    error_code ec;
+    if (objectExists(sha))
+    {
+        fs::remove(tempPath, ec);
+        objectStats.skipped++;
+        return true;
+    }
+
+    FsyncMode mode = getFsyncMode();
+    if (mode == FsyncMode::Batch)
+    {
+        // Another writer may have queued the same object since the check above
+        lock_guard<mutex> lk(pendingObjectsMutex);
+        if (pendingObjects.emplace(sha, tempPath).second)
+            objectStats.written++;
+        else
+        {
+            fs::remove(tempPath, ec);
+            objectStats.skipped++;
+        }
+        return true;
+    }
+    objectStats.written++;
+    if (mode == FsyncMode::Always && !fsyncFile(tempPath))
+    {
+        cerr << "Error: Cannot fsync object " << sha << endl;
+        fs::remove(tempPath, ec);
+        return false;
+    }
+    return renameTempObject(tempPath, sha);
+}
+
+// Completes batch-mode object writes: one flush for all pending temp files, then the renames
+void flushObjectWrites()
+{
+    lock_guard<mutex> lk(pendingObjectsMutex);
+    if (pendingObjects.empty())
+        return;
+#if defined(__linux__)
+    // A single syncfs covers every temp file on the object database's file system
+    int fd = open((REPO_DIR + "\\objects").c_str(), O_RDONLY);
+    if (fd >= 0)
+    {
+        syncfs(fd);
+        close(fd);
+    }
+#else
+    for (const auto &pending : pendingObjects)
+        fsyncFile(pending.second);
+#endif
+    for (const auto &pending : pendingObjects)
+        renameTempObject(pending.second, pending.first);
+    pendingObjects.clear();
+}
+
+// Flushes batch-mode object writes when it goes out of scope, so every exit path of a command
+// renames its pending objects instead of leaving tmp_obj_* files behind
+struct PendingObjectFlush
+{
+    ~PendingObjectFlush()
+    {
+        flushObjectWrites();
+    }
+};
+
+// Compresses and writes the raw object content (header + data) to the object database.
+// Existing objects are left alone; new ones go to a temp file that is renamed into place.
+bool writeObject(const ObjectId &sha, const string &content)
+{
+    TraceScope trace(TRACE_WRITE_OBJECT, content.size());
+    trace.addSyscalls(1);
+    if (objectExists(sha))
+    {
+        objectStats.skipped++;
+        return true;
+    }
+    string compressed = encodeLooseObject(content);
+    if (compressed.empty())
+        return false;
+
+    string tempPath = getTempObjectPath();
+    {
+        ofstream file(tempPath, ios::binary);
+        file.write(compressed.data(), compressed.size());
+        file.close();
+        trace.addSyscalls(4); // open, write, close and the rename (or link) into place
+        if (!file)
+        {
+            cerr << "Error: Cannot write object " << sha << endl;
+            error_code ec;
+            fs::remove(tempPath, ec);
+            return false;
+        }
+    }
+    return finalizeObject(tempPath, sha);
+}
+
+// Chunked blobs (core.chunkThreshold): a large file is split into content-defined chunks, each
+// stored as a blob object of its own, and the loose object file under the file's blob ID holds
+// a manifest of them instead of the compressed content. The blob keeps its git ID; only the way
+// it is stored differs, so unchanged chunks are shared between versions of the file.
+// Manifest file: "MGCK" | chunk count u32 | blob size u64 | (chunk length u32 | chunk ID)...
+const char CHUNKED_OBJECT_MAGIC[] = "MGCK";
+const size_t CHUNKED_OBJECT_HEADER_SIZE = 16;
+
+struct ChunkManifest
+{
+    uint64_t size = 0;
+    vector<pair<uint32_t, ObjectId>> chunks; // Length and blob ID of each chunk, in file order
+};
+
+bool isChunkedObject(const char *data, size_t len)
+{
+    return len >= CHUNKED_OBJECT_HEADER_SIZE && memcmp(data, CHUNKED_OBJECT_MAGIC, 4) == 0;
+}
+
+// True if the loose object file of sha is a chunk manifest
+bool isChunkedLooseObject(const ObjectId &sha)
+{
+    char prefix[CHUNKED_OBJECT_HEADER_SIZE];
+    ifstream file(looseObjectPath(sha), ios::binary);
+    file.read(prefix, sizeof(prefix));
+    return isChunkedObject(prefix, static_cast<size_t>(file.gcount()));
+}
+
+string serializeChunkManifest(const ChunkManifest &manifest)
+{
+    string out(CHUNKED_OBJECT_MAGIC, 4);
+    appendU32(out, static_cast<uint32_t>(manifest.chunks.size()));
+    appendU64(out, manifest.size);
+    for (const auto &chunk : manifest.chunks)
+    {
+        appendU32(out, chunk.first);
+        out.append(reinterpret_cast<const char *>(chunk.second.bytes), objectIdLength);
+    }
+    return out;
+}
+
+// Parses a manifest file; the chunk lengths must add up to the blob size
+bool parseChunkManifest(const char *data, size_t len, ChunkManifest &manifest)
+{
+    if (!isChunkedObject(data, len))
+        return false;
+    uint32_t count = readU32(data + 4);
+    manifest.size = readU64(data + 8);
+    if (len != CHUNKED_OBJECT_HEADER_SIZE + uint64_t(count) * (4 + objectIdLength))
+        return false;
+    manifest.chunks.clear();
+    manifest.chunks.reserve(count);
+    uint64_t total = 0;
+    for (const char *p = data + CHUNKED_OBJECT_HEADER_SIZE; count > 0; count--, p += 4 + objectIdLength)
+    {
+        manifest.chunks.emplace_back(readU32(p), ObjectId::fromRaw(p + 4));
+        total += manifest.chunks.back().first;
+    }
+    return total == manifest.size;
+}
+
+// Reads an object like readObject, except that a chunked blob is not reassembled: its manifest
+// is returned instead (chunked == true, object empty), so callers can stream the chunks
+bool readObjectOrManifest(const ObjectId &sha, string &object, ChunkManifest &manifest, bool &chunked)
+{
+    chunked = false;
+    if (readPackedObject(sha, object))
+        return true;
+
+    FileView stored(looseObjectPath(sha));
+    if (!stored.valid())
+    {
+        cerr << "Error: Object " << sha << " not found" << endl;
+        return false;
+    }
+    if (isChunkedObject(stored.data(), stored.size()))
+    {
+        chunked = true;
+        if (parseChunkManifest(stored.data(), stored.size(), manifest))
+            return true;
+        cerr << "Error: Corrupt chunk manifest " << sha << endl;
+        return false;
+    }
+    object = decodeLooseObject(stored.data(), stored.size());
+    return !object.empty();
+}
+
+// Passes the content of a chunked blob to sink one chunk at a time, checking every chunk
+bool streamChunkedObject(const ChunkManifest &manifest, const function<bool(const char *, size_t)> &sink)
+{
+    for (const auto &chunk : manifest.chunks)
+    {
+        string type;
+        uint64_t size;
+        size_t headerLen;
+        string object;
+        if (!readPackedObject(chunk.second, object))
+        {
+            FileView stored(looseObjectPath(chunk.second));
+            if (!stored.valid())
+            {
+                cerr << "Error: Chunk " << chunk.second << " not found" << endl;
+                return false;
+            }
+            object = decodeLooseObject(stored.data(), stored.size());
+        }
+        if (!parseObjectHeader(object.data(), object.size(), type, size, headerLen) || type != "blob" ||
+            size != chunk.first || object.size() != headerLen + size)
+        {
+            cerr << "Error: Corrupt chunk " << chunk.second << endl;
+            return false;
+        }
+        if (!sink(object.data() + headerLen, chunk.first))
+            return false;
+    }
+    return true;
+}
+
+// Reads, decompresses, and returns the raw object content from the object database.
+// Packs are searched first; loose objects are the fallback. Chunked blobs are reassembled.
+string readObject(const ObjectId &sha)
+{
+    TraceScope trace(TRACE_READ_OBJECT);
+    string object;
+    ChunkManifest manifest;
+    bool chunked;
+    if (!readObjectOrManifest(sha, object, manifest, chunked))
+        return "";
+    if (chunked)
+    {
+        object = "blob " + to_string(manifest.size) + string(1, '\0');
+        object.reserve(object.size() + manifest.size);
+        if (!streamChunkedObject(manifest, [&object](const char *p, size_t n)
+                                 { object.append(p, n);
+                                   return true; }))
+            return "";
+    }
+    trace.addBytes(object.size());
+    return object;
+}
+
+// Reads only an object's type and size. Packed objects need no inflating at all (deltas only
+// their first bytes); loose objects are read and inflated just far enough to see the header.
+bool readObjectHeader(const ObjectId &sha, string &type, uint64_t &size)
+{
+    if (readPackedObjectHeader(sha, type, size))
+        return true;
+
+    ifstream file(looseObjectPath(sha), ios::binary);
+    if (!file)
+    {
+        cerr << "Error: Object " << sha << " not found" << endl;
+        return false;
+    }
+    size_t headerLen;
+    char prefix[CHUNKED_OBJECT_HEADER_SIZE];
+    file.read(prefix, sizeof(prefix));
+    size_t prefixLen = static_cast<size_t>(file.gcount());
+    if (isChunkedObject(prefix, prefixLen))
+    {
+        type = "blob";
+        size = readU64(prefix + 8);
+        return true;
+    }
+    if (isZstdObject(prefix, prefixLen))
+    {
+        file.clear();
+        file.seekg(ZSTD_OBJECT_HEADER_SIZE);
+        string out = zstdObjectPrefix(file, prefix, OBJECT_HEADER_PROBE);
+        if (parseObjectHeader(out.data(), out.size(), type, size, headerLen))
+            return true;
+        cerr << "Error: Corrupt object " << sha << endl;
+        return false;
+    }
+    file.clear();
+    file.seekg(0);
+
+    z_stream stream{};
+    if (inflateInit(&stream) != Z_OK)
+        return false;
+    char in[4096];
+    char out[OBJECT_HEADER_PROBE];
+    stream.next_out = reinterpret_cast<Bytef *>(out);
+    stream.avail_out = sizeof(out);
+    bool found = false;
+    while (!found && stream.avail_out > 0 && file)
+    {
+        file.read(in, sizeof(in));
+        stream.next_in = reinterpret_cast<Bytef *>(in);
+        stream.avail_in = static_cast<uInt>(file.gcount());
+        // Stop as soon as the output buffer is full or the input chunk is used up
+        int result = inflate(&stream, Z_SYNC_FLUSH);
+        if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+            break;
+        found = parseObjectHeader(out, stream.total_out, type, size, headerLen);
+        if (result == Z_STREAM_END)
+            break;
+    }
+    inflateEnd(&stream);
+    if (!found)
+        cerr << "Error: Corrupt object " << sha << endl;
+    return found;
+}
+
+// Streams a loose object's data (without its header) to sink in chunks, so memory use does not
+// depend on the object size. Returns false if the object is missing or corrupt, or sink fails.
+bool streamLooseObject(const ObjectId &sha, string &type, uint64_t &size, const function<bool(const char *, size_t)> &sink)
+{
+    TraceScope trace(TRACE_READ_OBJECT);
+    if (isChunkedLooseObject(sha))
+    {
+        ChunkManifest manifest;
+        FileView stored(looseObjectPath(sha));
+        if (!parseChunkManifest(stored.data(), stored.size(), manifest))
+        {
+            cerr << "Error: Corrupt chunk manifest " << sha << endl;
+            return false;
+        }
+        type = "blob";
+        size = manifest.size;
+        trace.addBytes(size);
+        return streamChunkedObject(manifest, sink);
+    }
+    LooseObjectReader reader(looseObjectPath(sha));
+    if (!reader.good())
+    {
+        if (!fileExists(looseObjectPath(sha)))
+            cerr << "Error: Object " << sha << " not found" << endl;
+        return false;
+    }
+    vector<char> buffer(STREAM_CHUNK_SIZE);
+    size_t n = reader.read(buffer.data(), buffer.size());
+    size_t headerLen;
+    if (!parseObjectHeader(buffer.data(), n, type, size, headerLen))
+    {
+        cerr << "Error: Corrupt object " << sha << endl;
+        return false;
+    }
+    uint64_t total = n - headerLen;
+    bool ok = sink(buffer.data() + headerLen, n - headerLen);
+    while (ok && reader.good() && !reader.done())
+    {
+        n = reader.read(buffer.data(), buffer.size());
+        total += n;
+        ok = sink(buffer.data(), n);
+    }
+    if (ok && (!reader.good() || total != size))
+    {
+        cerr << "Error: Corrupt object " << sha << endl;
+        return false;
+    }
+    trace.addBytes(total);
+    return ok;
+}
+
+// Byte-budgeted LRU cache of parsed objects (trees and commits) keyed by object ID. History walks
+// and tree diffs revisit the same objects constantly; a hit skips the read, inflate and parse.
+// Values are immutable and shared, so a hit costs a reference count increment.
+class ObjectCache
+{
+public:
+    enum Kind
+    {
+        TREE,
+        COMMIT
+    };
+
+    explicit ObjectCache(size_t budgetBytes) : budget(budgetBytes) {}
+
+    template <typename T>
+    shared_ptr<const T> get(const ObjectId &sha, Kind kind)
+    {
+        lock_guard<mutex> lk(m);
+        auto it = index.find(sha);
+        if (it == index.end() || it->second->kind != kind)
+        {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        return static_pointer_cast<const T>(it->second->value);
+    }
+
+    void put(const ObjectId &sha, Kind kind, shared_ptr<const void> value, size_t cost)
+    {
+        lock_guard<mutex> lk(m);
+        if (cost > budget || index.count(sha))
+            return;
+        lru.push_front(Slot{sha, kind, move(value), cost});
+        index[sha] = lru.begin();
+        bytes += cost;
+        while (bytes > budget)
+        {
+            bytes -= lru.back().cost;
+            index.erase(lru.back().sha);
+            lru.pop_back();
+            evictions++;
+        }
+    }
+
+    void report() const
+    {
+        lock_guard<mutex> lk(m);
+        cerr << "object cache: " << hits << " hits, " << misses << " misses, " << evictions << " evictions, "
+             << bytes << "/" << budget << " bytes" << endl;
+    }
+
+private:
+    struct Slot
+    {
+        ObjectId sha;
+        Kind kind;
+        shared_ptr<const void> value;
+        size_t cost;
+    };
+    size_t budget;
+    size_t bytes = 0;
+    list<Slot> lru;
+    unordered_map<ObjectId, list<Slot>::iterator> index;
+    uint64_t hits = 0, misses = 0, evictions = 0;
+    mutable mutex m;
+};
+
+// Cache budget in bytes; MYGIT_OBJECT_CACHE_LIMIT (in MiB) overrides the default of 64 MiB
+size_t objectCacheBudget()
+{
+    const char *env = getenv("MYGIT_OBJECT_CACHE_LIMIT");
+    long mb = env ? atol(env) : 64;
+    return static_cast<size_t>(max(0L, mb)) << 20;
+}
+ObjectCache objectCache(objectCacheBudget());
+
+// Lists the SHAs of all loose objects (objects/xx/yyyy...)
+vector<ObjectId> listLooseObjects()
+{
+    vector<ObjectId> shas;
+    error_code ec;
+    for (const auto &dir : fs::directory_iterator(REPO_DIR + "\\objects", ec))
+    {
+        string prefix = dir.path().filename().string();
+        if (prefix.size() != 2 || !dir.is_directory() || !isxdigit((unsigned char)prefix[0]) || !isxdigit((unsigned char)prefix[1]))
+            continue;
+        for (const auto &file : fs::directory_iterator(dir.path(), ec))
+        {
+            ObjectId id;
+            if (ObjectId::fromHex(prefix + file.path().filename().string(), id))
+                shas.push_back(id);
+        }
+    }
+    sort(shas.begin(), shas.end());
+    return shas;
+}
+
+// ============= DELTA COMPRESSION =============
+
+// Deltas use git's encoding: source size and target size as little-endian base-128 varints,
+// followed by instructions that rebuild the target:
+//   copy:   1xxxxxxx + up to 4 offset bytes and 3 size bytes (selected by the x bits) from the source
+//   insert: 0nnnnnnn + n literal bytes (1..127)
+const size_t DELTA_BLOCK = 16;           // Source is indexed in blocks of this many bytes
+const uint32_t DELTA_HASH_BASE = 0x01000193;
+const size_t DELTA_MAX_CANDIDATES = 64;  // Bucket entries probed per target position
+const size_t DELTA_MAX_COPY = 0xffffff;  // Largest size one copy instruction can carry
+
+void appendVarint(string &out, uint64_t v)
+{
+    while (v >= 0x80)
+    {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
+}
+
+bool readVarint(const char *data, size_t len, size_t &pos, uint64_t &v)
+{
+    v = 0;
+    for (int shift = 0; pos < len && shift < 64; shift += 7)
+    {
+        unsigned char c = static_cast<unsigned char>(data[pos++]);
+        v |= uint64_t(c & 0x7f) << shift;
+        if (!(c & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Hash of DELTA_BLOCK bytes; rolling updates of the same polynomial give identical values
+uint32_t deltaBlockHash(const unsigned char *p)
+{
+    uint32_t h = 0;
+    for (size_t i = 0; i < DELTA_BLOCK; i++)
+        h = h * DELTA_HASH_BASE + p[i];
+    return h;
+}
+
+// Positions of every DELTA_BLOCK-aligned block of a delta source, bucketed by block hash
+struct DeltaIndex
+{
+    const string *source = nullptr;
+    uint32_t mask = 0;
+    vector<uint32_t> heads; // bucket -> first entry + 1 (0 = empty)
+    vector<uint32_t> next;  // entry -> next entry + 1 in the same bucket
+    vector<uint32_t> pos;   // entry -> block offset in the source
+
+    explicit DeltaIndex(const string &src) : source(&src)
+    {
+        size_t blocks = src.size() / DELTA_BLOCK;
+        size_t buckets = 1;
+        while (buckets < blocks)
+            buckets <<= 1;
+        mask = static_cast<uint32_t>(buckets - 1);
+        heads.assign(buckets, 0);
+        next.resize(blocks);
+        pos.resize(blocks);
+        const unsigned char *data = reinterpret_cast<const unsigned char *>(src.data());
+        // Insert back to front so each bucket lists earlier offsets first
+        for (size_t b = blocks; b-- > 0;)
+        {
+            uint32_t bucket = deltaBlockHash(data + b * DELTA_BLOCK) & mask;
+            pos[b] = static_cast<uint32_t>(b * DELTA_BLOCK);
+            next[b] = heads[bucket];
+            heads[bucket] = static_cast<uint32_t>(b + 1);
+        }
+    }
+};
+
+// Appends literal bytes as insert instructions
+void emitDeltaInsert(string &delta, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = min<size_t>(len, 127);
+        delta.push_back(static_cast<char>(n));
+        delta.append(data, n);
+        data += n;
+        len -= n;
+    }
+}
+
+// Appends copy instructions for source[offset, offset + len)
+void emitDeltaCopy(string &delta, uint64_t offset, size_t len)
+{
+    while (len > 0)
+    {
+        size_t n = min(len, DELTA_MAX_COPY);
+        string op;
+        unsigned char cmd = 0x80;
+        for (int i = 0; i < 4; i++)
+        {
+            unsigned char b = (offset >> (8 * i)) & 0xff;
+            if (b)
+            {
+                cmd |= 1 << i;
+                op.push_back(static_cast<char>(b));
+            }
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            unsigned char b = (n >> (8 * i)) & 0xff;
+            if (b)
+            {
+                cmd |= 0x10 << i;
+                op.push_back(static_cast<char>(b));
+            }
+        }
+        delta.push_back(static_cast<char>(cmd));
+        delta += op;
+        offset += n;
+        len -= n;
+    }
+}
+
+// Encodes target as a delta against the indexed source. Returns "" if the delta would not be
+// smaller than maxSize, so callers can bail out early on dissimilar pairs.
+string createDelta(const DeltaIndex &index, const string &target, size_t maxSize)
+{
+    const string &source = *index.source;
+    if (source.size() > UINT32_MAX || index.pos.empty())
+        return "";
+    string delta;
+    appendVarint(delta, source.size());
+    appendVarint(delta, target.size());
+
+    const unsigned char *src = reinterpret_cast<const unsigned char *>(source.data());
+    const unsigned char *tgt = reinterpret_cast<const unsigned char *>(target.data());
+    size_t n = target.size();
+    uint32_t topPower = 1; // DELTA_HASH_BASE^(DELTA_BLOCK-1), to roll the oldest byte out
+    for (size_t i = 1; i < DELTA_BLOCK; i++)
+        topPower *= DELTA_HASH_BASE;
+
+    size_t insertStart = 0; // Start of the pending literal run
+    size_t i = 0;
+    uint32_t h = n >= DELTA_BLOCK ? deltaBlockHash(tgt) : 0;
+    while (i + DELTA_BLOCK <= n)
+    {
+        size_t bestLen = 0;
+        size_t bestSrc = 0;
+        size_t bestBack = 0;
+        size_t probes = 0;
+        for (uint32_t e = index.heads[h & index.mask]; e && probes < DELTA_MAX_CANDIDATES; e = index.next[e - 1], probes++)
+        {
+            size_t sp = index.pos[e - 1];
+            if (memcmp(src + sp, tgt + i, DELTA_BLOCK) != 0)
+                continue;
+            size_t len = DELTA_BLOCK;
+            while (i + len < n && sp + len < source.size() && src[sp + len] == tgt[i + len])
+                len++;
+            // Extend backwards into the pending literals
+            size_t back = 0;
+            while (back < i - insertStart && back < sp && src[sp - back - 1] == tgt[i - back - 1])
+                back++;
+            if (len + back > bestLen + bestBack)
+            {
+                bestLen = len;
+                bestSrc = sp;
+                bestBack = back;
+            }
+        }
+
+        if (bestLen == 0)
+        {
+            // Roll the hash one byte forward
+            if (i + DELTA_BLOCK < n)
+                h = (h - tgt[i] * topPower) * DELTA_HASH_BASE + tgt[i + DELTA_BLOCK];
+            i++;
+            continue;
+        }
+
+        emitDeltaInsert(delta, target.data() + insertStart, i - bestBack - insertStart);
+        emitDeltaCopy(delta, bestSrc - bestBack, bestLen + bestBack);
+        if (delta.size() >= maxSize)
+            return "";
+        i += bestLen;
+        insertStart = i;
+        if (i + DELTA_BLOCK <= n)
+            h = deltaBlockHash(tgt + i);
+    }
+    emitDeltaInsert(delta, target.data() + insertStart, n - insertStart);
+    return delta.size() < maxSize ? delta : "";
+}
+
+// Rebuilds the target from a base and a delta; returns false on a malformed delta
+bool applyDelta(const string &base, const char *delta, size_t len, string &out)
+{
+    size_t pos = 0;
+    uint64_t srcSize, tgtSize;
+    if (!readVarint(delta, len, pos, srcSize) || !readVarint(delta, len, pos, tgtSize) || srcSize != base.size())
+        return false;
+    out.clear();
+    out.reserve(static_cast<size_t>(tgtSize));
+    while (pos < len)
+    {
+        unsigned char cmd = static_cast<unsigned char>(delta[pos++]);
+        if (cmd & 0x80)
+        {
+            uint64_t offset = 0;
+            size_t size = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                if (cmd & (1 << i))
+                {
+                    if (pos >= len)
+                        return false;
+                    offset |= uint64_t(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+                }
+            }
+            for (int i = 0; i < 3; i++)
+            {
+                if (cmd & (0x10 << i))
+                {
+                    if (pos >= len)
+                        return false;
+                    size |= size_t(static_cast<unsigned char>(delta[pos++])) << (8 * i);
+                }
+            }
+            if (size == 0)
+                size = 0x10000;
+            if (offset + size > base.size())
+                return false;
+            out.append(base, static_cast<size_t>(offset), size);
+        }
+        else if (cmd)
+        {
+            if (pos + cmd > len)
+                return false;
+            out.append(delta + pos, cmd);
+            pos += cmd;
+        }
+        else
+        {
+            return false; // Opcode 0 is reserved
+        }
+    }
+    return out.size() == tgtSize;
+}
+
+// ============= PACK STORAGE =============
+
+// A pack bundles many objects into one file, so the object database does not need an inode per
+// object. Both files follow git's version 2 layout (integers big-endian):
+//   .pack: "PACK" | version (u32) | object count (u32) | entries | SHA-1 of all preceding bytes
+//          entry = type/size varint header followed by the zlib-deflated object body
+//   .idx:  "\377tOc" | version (u32) | fanout[256] (u32: number of SHAs with first byte <= i)
+//          | sorted SHAs | CRC-32 per entry | u32 offset per entry (MSB set: index into the u64
+//          offset table) | u64 offsets | pack checksum | idx checksum
+// A pack only becomes visible once its .idx exists, so the .idx is always written last.
+const uint32_t PACK_VERSION = 2;
+const char PACK_IDX_MAGIC[] = "\377tOc";
+const size_t PACK_IDX_HEADER_SIZE = 8 + 256 * 4;
+
+enum PackObjectType
+{
+    OBJ_COMMIT = 1,
+    OBJ_TREE = 2,
+    OBJ_BLOB = 3,
+    OBJ_TAG = 4,
+    OBJ_OFS_DELTA = 6,
+    OBJ_REF_DELTA = 7
+};
+
+// Maps an object type name to its pack type code (0 if unknown)
+int packTypeCode(const string &type)
+{
+    if (type == "commit")
+        return OBJ_COMMIT;
+    if (type == "tree")
+        return OBJ_TREE;
+    if (type == "blob")
+        return OBJ_BLOB;
+    if (type == "tag")
+        return OBJ_TAG;
+    return 0;
+}
+
+string packTypeName(int code)
+{
+    switch (code)
+    {
+    case OBJ_COMMIT:
+        return "commit";
+    case OBJ_TREE:
+        return "tree";
+    case OBJ_BLOB:
+        return "blob";
+    case OBJ_TAG:
+        return "tag";
+    }
+    return "";
+}
+
+// Encodes a pack entry header: 3-bit type and the size as a little-endian base-128 varint
+string encodePackEntryHeader(int type, uint64_t size)
+{
+    string header;
+    unsigned char c = static_cast<unsigned char>((type << 4) | (size & 0x0f));
+    size >>= 4;
+    while (size)
+    {
+        header.push_back(static_cast<char>(c | 0x80));
+        c = size & 0x7f;
+        size >>= 7;
+    }
+    header.push_back(static_cast<char>(c));
+    return header;
+}
+
+// Parses a pack entry header at pos; returns false if it runs past end
+bool decodePackEntryHeader(const char *data, size_t end, size_t &pos, int &type, uint64_t &size)
+{
+    if (pos >= end)
+        return false;
+    unsigned char c = static_cast<unsigned char>(data[pos++]);
+    type = (c >> 4) & 7;
+    size = c & 0x0f;
+    int shift = 4;
+    while (c & 0x80)
+    {
+        if (pos >= end || shift > 57)
+            return false;
+        c = static_cast<unsigned char>(data[pos++]);
+        size |= uint64_t(c & 0x7f) << shift;
+        shift += 7;
+    }
+    return true;
+}
+
+// One memory-mapped pack and its index
+struct PackFile
+{
+    string packPath;
+    unique_ptr<MappedFile> idx;
+    unique_ptr<MappedFile> pack;
+    uint32_t count = 0;
+    const char *fanout = nullptr;
+    const char *shas = nullptr;
+    const char *offsets32 = nullptr;
+    const char *offsets64 = nullptr;
+
+    // Maps both files and validates the index layout
+    bool open(const string &idxPath)
+    {
+        packPath = idxPath.substr(0, idxPath.size() - 4) + ".pack";
+        idx = make_unique<MappedFile>(idxPath);
+        pack = make_unique<MappedFile>(packPath);
+        if (!idx->valid() || !pack->valid() || idx->size() < PACK_IDX_HEADER_SIZE + 2 * objectIdLength || pack->size() < 12 + objectIdLength)
+            return false;
+        const char *d = idx->data();
+        if (memcmp(d, PACK_IDX_MAGIC, 4) != 0 || readU32(d + 4) != PACK_VERSION || memcmp(pack->data(), "PACK", 4) != 0)
+            return false;
+        fanout = d + 8;
+        count = readU32(fanout + 255 * 4);
+        size_t minSize = PACK_IDX_HEADER_SIZE + size_t(count) * (objectIdLength + 4 + 4) + 2 * objectIdLength;
+        if (idx->size() < minSize || readU32(pack->data() + 8) != count)
+            return false;
+        shas = d + PACK_IDX_HEADER_SIZE;
+        offsets32 = shas + size_t(count) * (objectIdLength + 4);
+        offsets64 = offsets32 + size_t(count) * 4;
+        return true;
+    }
+
+    uint64_t offsetAt(uint32_t i) const
+    {
+        uint32_t off = readU32(offsets32 + size_t(i) * 4);
+        if (off & 0x80000000u)
+            return readU64(offsets64 + size_t(off & 0x7fffffffu) * 8);
+        return off;
+    }
+
+    ObjectId shaAt(uint32_t i) const { return ObjectId::fromRaw(shas + size_t(i) * objectIdLength); }
+
+    // Binary search restricted to the fanout bucket of the SHA's first byte; position is the
+    // object's index in the (sorted) idx
+    bool position(const ObjectId &sha, uint32_t &index) const
+    {
+        unsigned char first = sha.bytes[0];
+        uint32_t lo = first == 0 ? 0 : readU32(fanout + (first - 1) * 4);
+        uint32_t hi = readU32(fanout + first * 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(shas + size_t(mid) * objectIdLength, sha.bytes, objectIdLength);
+            if (cmp == 0)
+            {
+                index = mid;
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
+    }
+
+    bool find(const ObjectId &sha, uint64_t &offset) const
+    {
+        uint32_t index;
+        if (!position(sha, index))
+            return false;
+        offset = offsetAt(index);
+        return true;
+    }
+};
+
+// Byte-budgeted LRU cache of inflated delta bases, keyed by (pack, offset). Long delta chains
+// share their bases, so without it every object in a chain would re-inflate the whole chain.
+const size_t DELTA_BASE_CACHE_LIMIT = 96 << 20;
+
+class DeltaBaseCache
+{
+public:
+    struct Entry
+    {
+        int type;
+        shared_ptr<const string> data;
+    };
+
+    bool get(const PackFile *pack, uint64_t offset, Entry &entry)
+    {
+        lock_guard<mutex> lk(m);
+        auto it = index.find(Key{pack, offset});
+        if (it == index.end())
+            return false;
+        lru.splice(lru.begin(), lru, it->second);
+        entry = it->second->second;
+        return true;
+    }
+
+    void put(const PackFile *pack, uint64_t offset, const Entry &entry)
+    {
+        size_t cost = entry.data->size();
+        if (cost > DELTA_BASE_CACHE_LIMIT / 4)
+            return; // A single huge base would flush everything else
+        lock_guard<mutex> lk(m);
+        Key key{pack, offset};
+        if (index.count(key))
+            return;
+        lru.emplace_front(key, entry);
+        index[key] = lru.begin();
+        bytes += cost;
+        while (bytes > DELTA_BASE_CACHE_LIMIT && !lru.empty())
+        {
+            bytes -= lru.back().second.data->size();
+            index.erase(lru.back().first);
+            lru.pop_back();
+        }
+    }
+
+    // Drops everything (packs are about to be unmapped)
+    void clear()
+    {
+        lock_guard<mutex> lk(m);
+        lru.clear();
+        index.clear();
+        bytes = 0;
+    }
+
+private:
+    struct Key
+    {
+        const PackFile *pack;
+        uint64_t offset;
+        bool operator==(const Key &o) const { return pack == o.pack && offset == o.offset; }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key &k) const { return hash<const void *>()(k.pack) ^ hash<uint64_t>()(k.offset * 0x9e3779b97f4a7c15ull); }
+    };
+    mutex m;
+    list<pair<Key, Entry>> lru;
+    unordered_map<Key, list<pair<Key, Entry>>::iterator, KeyHash> index;
+    size_t bytes = 0;
+};
+DeltaBaseCache deltaBaseCache;
+
+typedef vector<shared_ptr<PackFile>> PackList;
+shared_ptr<const PackList> loadedPacks;
+mutex packsMutex;
+atomic<bool> packsScanned{false};
+
+// (Re)scans objects/pack for .idx files
+void reloadPacks()
+{
+    auto packs = make_shared<PackList>();
+    error_code ec;
+    for (const auto &entry : fs::directory_iterator(REPO_DIR + "\\objects\\pack", ec))
+    {
+        string path = entry.path().string();
+        if (entry.path().extension() != ".idx")
+            continue;
+        auto pack = make_shared<PackFile>();
+        if (pack->open(path))
+            packs->push_back(pack);
+        else
+            cerr << "Warning: Ignoring corrupt pack index " << path << endl;
+    }
+    deltaBaseCache.clear();
+    atomic_store(&loadedPacks, shared_ptr<const PackList>(packs));
+}
+
+// Unmaps every pack, so pack files can be deleted (Windows refuses to delete mapped files); the
+// next lookup scans the pack directory again
+void forgetPacks()
+{
+    lock_guard<mutex> lk(packsMutex);
+    deltaBaseCache.clear();
+    atomic_store(&loadedPacks, shared_ptr<const PackList>());
+    packsScanned = false;
+}
+
+// Returns the current list of packs, scanning the pack directory on first use
+shared_ptr<const PackList> getPacks()
+{
+    if (!packsScanned)
+    {
+        lock_guard<mutex> lk(packsMutex);
+        if (!packsScanned)
+        {
+            reloadPacks();
+            packsScanned = true;
+        }
+    }
+    return atomic_load(&loadedPacks);
+}
+
+const int MAX_DELTA_CHAIN = 10000; // Guards against cyclic or corrupt chains
+
+// Decodes the distance of an OFS_DELTA base (big-endian base-128, +1 per continuation byte)
+bool decodeOfsDeltaDistance(const char *data, size_t end, size_t &pos, uint64_t &dist)
+{
+    if (pos >= end)
+        return false;
+    unsigned char c = static_cast<unsigned char>(data[pos++]);
+    dist = c & 0x7f;
+    while (c & 0x80)
+    {
+        if (pos >= end || dist > (UINT64_MAX >> 8))
+            return false;
+        c = static_cast<unsigned char>(data[pos++]);
+        dist = ((dist + 1) << 7) | (c & 0x7f);
+    }
+    return true;
+}
+
+string encodeOfsDeltaDistance(uint64_t dist)
+{
+    unsigned char buf[16];
+    int pos = sizeof(buf) - 1;
+    buf[pos] = dist & 0x7f;
+    while (dist >>= 7)
+        buf[--pos] = static_cast<unsigned char>(0x80 | (--dist & 0x7f));
+    return string(reinterpret_cast<const char *>(buf + pos), sizeof(buf) - pos);
+}
+
+// Splits a raw object ("type size\0content") into its type and content
+bool splitObject(const string &object, string &type, string &content);
+
+// Reads the object stored at offset, resolving delta chains. OFS_DELTA bases are followed inside
+// the pack; a REF_DELTA base is looked up through readObject, so it may live anywhere.
+bool readPackEntry(const PackFile &pack, uint64_t offset, int &type, string &data)
+{
+    const char *bytes = pack.pack->data();
+    size_t end = pack.pack->size() - objectIdLength;
+
+    // Walk down the chain until a full object or a cached base, remembering the deltas on the way
+    vector<pair<uint64_t, string>> deltas;
+    DeltaBaseCache::Entry base;
+    uint64_t cur = offset;
+    while (true)
+    {
+        if (deltas.size() > static_cast<size_t>(MAX_DELTA_CHAIN))
+            return false;
+        if (!deltas.empty() && deltaBaseCache.get(&pack, cur, base))
+            break;
+
+        size_t pos = static_cast<size_t>(cur);
+        int entryType;
+        uint64_t size;
+        if (cur >= end || !decodePackEntryHeader(bytes, end, pos, entryType, size))
+            return false;
+
+        size_t consumed;
+        if (entryType >= OBJ_COMMIT && entryType <= OBJ_TAG)
+        {
+            auto content = make_shared<string>();
+            if (!inflateKnownSize(bytes + pos, end - pos, static_cast<size_t>(size), *content, consumed))
+                return false;
+            base.type = entryType;
+            base.data = content;
+            if (!deltas.empty())
+                deltaBaseCache.put(&pack, cur, base);
+            break;
+        }
+        if (entryType == OBJ_OFS_DELTA)
+        {
+            uint64_t dist;
+            if (!decodeOfsDeltaDistance(bytes, end, pos, dist) || dist == 0 || dist > cur)
+                return false;
+            string delta;
+            if (!inflateKnownSize(bytes + pos, end - pos, static_cast<size_t>(size), delta, consumed))
+                return false;
+            deltas.emplace_back(cur, move(delta));
+            cur -= dist;
+            continue;
+        }
+        if (entryType == OBJ_REF_DELTA)
+        {
+            if (pos + objectIdLength > end)
+                return false;
+            ObjectId baseSha = ObjectId::fromRaw(bytes + pos);
+            pos += objectIdLength;
+            string delta;
+            if (!inflateKnownSize(bytes + pos, end - pos, static_cast<size_t>(size), delta, consumed))
+                return false;
+            deltas.emplace_back(cur, move(delta));
+            string baseType, baseContent;
+            if (!splitObject(readObject(baseSha), baseType, baseContent))
+                return false;
+            base.type = packTypeCode(baseType);
+            base.data = make_shared<string>(move(baseContent));
+            break;
+        }
+        cerr << "Error: Unsupported pack entry type " << entryType << " in " << pack.packPath << endl;
+        return false;
+    }
+
+    // Apply the deltas from the innermost outwards; intermediate results are bases of later ones
+    for (size_t k = deltas.size(); k-- > 0;)
+    {
+        auto result = make_shared<string>();
+        if (!applyDelta(*base.data, deltas[k].second.data(), deltas[k].second.size(), *result))
+            return false;
+        base.data = result;
+        if (k > 0)
+            deltaBaseCache.put(&pack, deltas[k].first, base);
+    }
+    type = base.type;
+    data = *base.data;
+    return true;
+}
+
+// Type and size of the pack entry at offset. Whole objects carry both in their entry header;
+// for a delta the size is the target size at the start of the delta data, and the type is that
+// of the chain's base.
+bool readPackEntryHeader(const PackFile &pack, uint64_t offset, int &type, uint64_t &size)
+{
+    const char *bytes = pack.pack->data();
+    size_t end = pack.pack->size() - objectIdLength;
+    uint64_t cur = offset;
+    for (int depth = 0; depth <= MAX_DELTA_CHAIN; depth++)
+    {
+        size_t pos = static_cast<size_t>(cur);
+        int entryType;
+        uint64_t entrySize;
+        if (cur >= end || !decodePackEntryHeader(bytes, end, pos, entryType, entrySize))
+            return false;
+        if (entryType >= OBJ_COMMIT && entryType <= OBJ_TAG)
+        {
+            type = entryType;
+            if (depth == 0)
+                size = entrySize;
+            return true;
+        }
+
+        uint64_t dist = 0;
+        ObjectId baseSha; // Set for REF_DELTA
+        if (entryType == OBJ_OFS_DELTA)
+        {
+            if (!decodeOfsDeltaDistance(bytes, end, pos, dist) || dist == 0 || dist > cur)
+                return false;
+        }
+        else if (entryType == OBJ_REF_DELTA && pos + objectIdLength <= end)
+        {
+            baseSha = ObjectId::fromRaw(bytes + pos);
+            pos += objectIdLength;
+        }
+        else
+        {
+            return false;
+        }
+
+        if (depth == 0)
+        {
+            // Two varints (source size, target size) fit in 20 bytes
+            string prefix = inflatePrefix(bytes + pos, end - pos, 20);
+            size_t p = 0;
+            uint64_t srcSize;
+            if (!readVarint(prefix.data(), prefix.size(), p, srcSize) || !readVarint(prefix.data(), prefix.size(), p, size))
+                return false;
+        }
+
+        if (entryType == OBJ_REF_DELTA)
+        {
+            string typeName;
+            uint64_t baseSize;
+            if (!readObjectHeader(baseSha, typeName, baseSize))
+                return false;
+            type = packTypeCode(typeName);
+            return type != 0;
+        }
+        cur -= dist;
+    }
+    return false;
+}
+
+bool readPackedObjectHeader(const ObjectId &sha, string &type, uint64_t &size)
+{
+    uint64_t offset;
+    for (const auto &pack : *getPacks())
+    {
+        int code;
+        if (pack->find(sha, offset) && readPackEntryHeader(*pack, offset, code, size))
+        {
+            type = packTypeName(code);
+            return true;
+        }
+    }
+    return false;
+}
+
+bool hasPackedObject(const ObjectId &sha)
+{
+    uint64_t offset;
+    for (const auto &pack : *getPacks())
+    {
+        if (pack->find(sha, offset))
+            return true;
+    }
+    return false;
+}
+
+// Looks the object up in every pack; on success object holds "type size\0content" like a loose object
+bool readPackedObject(const ObjectId &sha, string &object)
+{
+    uint64_t offset;
+    for (const auto &pack : *getPacks())
+    {
+        if (!pack->find(sha, offset))
+            continue;
+        int type;
+        string data;
+        if (!readPackEntry(*pack, offset, type, data))
+        {
+            cerr << "Error: Corrupt packed object " << sha << " in " << pack->packPath << endl;
+            return false;
+        }
+        object = packTypeName(type) + " " + to_string(data.size()) + '\0' + data;
+        return true;
+    }
+    return false;
+}
+
+// Splits a raw object ("type size\0content") into its type and content
+bool splitObject(const string &object, string &type, string &content)
+{
+    size_t nullPos = object.find('\0');
+    if (nullPos == string::npos)
+        return false;
+    size_t spacePos = object.find(' ');
+    if (spacePos == string::npos || spacePos > nullPos)
+        return false;
+    type = object.substr(0, spacePos);
+    content = object.substr(nullPos + 1);
+    return true;
+}
+
+// Index entry collected for every object written to a pack
+struct PackIndexEntry
+{
+    ObjectId sha;
+    uint32_t crc;
+    uint64_t offset;
+};
+
+// Streams pack entries to an output stream while computing the trailing checksum
+class PackWriter
+{
+public:
+    PackWriter(ostream &output, uint32_t objectCount) : out(output)
+    {
+        string header = "PACK";
+        appendU32(header, PACK_VERSION);
+        appendU32(header, objectCount);
+        emit(header);
+    }
+
+    uint64_t offset() const { return written; }
+    const vector<PackIndexEntry> &entries() const { return index; }
+
+    // Stores a whole object
+    void addObject(const ObjectId &sha, int type, const string &content)
+    {
+        addEntry(sha, encodePackEntryHeader(type, content.size()) + encodePackData(content));
+    }
+
+    // Stores an object as a delta against an earlier entry of this pack
+    void addOfsDelta(const ObjectId &sha, uint64_t baseOffset, const string &delta)
+    {
+        addEntry(sha, encodePackEntryHeader(OBJ_OFS_DELTA, delta.size()) + encodeOfsDeltaDistance(written - baseOffset) + encodePackData(delta));
+    }
+
+    // Stores an object as a delta against an object identified by SHA (which may live outside the pack)
+    void addRefDelta(const ObjectId &sha, const ObjectId &baseSha, const string &delta)
+    {
+        addEntry(sha, encodePackEntryHeader(OBJ_REF_DELTA, delta.size()) + string(baseSha.raw(), objectIdLength) + encodePackData(delta));
+    }
+
+    // Writes the trailing checksum and returns it
+    ObjectId finish()
+    {
+        ObjectId checksum = hasher.final();
+        out.write(checksum.raw(), objectIdLength);
+        return checksum;
+    }
+
+private:
+    void emit(const string &bytes)
+    {
+        out.write(bytes.data(), bytes.size());
+        hasher.update(bytes.data(), bytes.size());
+        written += bytes.size();
+    }
+
+    void addEntry(const ObjectId &sha, const string &entry)
+    {
+        PackIndexEntry e;
+        e.sha = sha;
+        e.offset = written;
+        e.crc = static_cast<uint32_t>(crc32(0, reinterpret_cast<const Bytef *>(entry.data()), static_cast<uInt>(entry.size())));
+        index.push_back(e);
+        emit(entry);
+    }
+
+    ostream &out;
+    ObjectHasher hasher;
+    uint64_t written = 0;
+    vector<PackIndexEntry> index;
+};
+
+// Serializes a version 2 .idx for the given entries
+string buildPackIndex(vector<PackIndexEntry> entries, const ObjectId &packChecksum)
+{
+    sort(entries.begin(), entries.end(), [](const PackIndexEntry &a, const PackIndexEntry &b)
+         { return a.sha < b.sha; });
+    string idx(PACK_IDX_MAGIC, 4);
+    appendU32(idx, PACK_VERSION);
+    uint32_t fanout[256] = {};
+    for (const auto &e : entries)
+        fanout[e.sha.bytes[0]]++;
+    for (int i = 1; i < 256; i++)
+        fanout[i] += fanout[i - 1];
+    for (int i = 0; i < 256; i++)
+        appendU32(idx, fanout[i]);
+    for (const auto &e : entries)
+        idx.append(e.sha.raw(), objectIdLength);
+    for (const auto &e : entries)
+        appendU32(idx, e.crc);
+    vector<uint64_t> largeOffsets;
+    for (const auto &e : entries)
+    {
+        if (e.offset < 0x80000000ull)
+            appendU32(idx, static_cast<uint32_t>(e.offset));
+        else
+        {
+            appendU32(idx, 0x80000000u | static_cast<uint32_t>(largeOffsets.size()));
+            largeOffsets.push_back(e.offset);
+        }
+    }
+    for (uint64_t off : largeOffsets)
+        appendU64(idx, off);
+    idx.append(packChecksum.raw(), objectIdLength);
+    idx.append(computeHash(idx).raw(), objectIdLength);
+    return idx;
+}
+
+// Moves a finished temp pack and its index into objects/pack (index last) and reloads the pack list.
+// Returns the pack name ("pack-<checksum>") or "" on failure.
+string installPack(const string &tempPack, const string &idx, const ObjectId &packChecksum)
+{
+    string packDir = REPO_DIR + "\\objects\\pack";
+    string name = "pack-" + packChecksum.hex();
+    string packPath = packDir + "\\" + name + ".pack";
+    string idxPath = packDir + "\\" + name + ".idx";
+    string tempIdx = tempPack + ".idx";
+    writeFile(tempIdx, idx);
+    error_code ec;
+    fs::rename(tempPack, packPath, ec);
+    if (!ec)
+        fs::rename(tempIdx, idxPath, ec);
+    if (ec)
+    {
+        cerr << "Error: Cannot install pack " << name << ": " << ec.message() << endl;
+        fs::remove(tempPack, ec);
+        fs::remove(tempIdx, ec);
+        return "";
+    }
+
+    lock_guard<mutex> lk(packsMutex);
+    reloadPacks();
+    packsScanned = true;
+    return name;
+}
+
+// An object to be packed. The name (file name of a blob/tree, if known) groups similar objects
+// so they end up next to each other in the delta window.
+struct PackInput
+{
+    ObjectId sha;
+    string name;
+};
+
+// Delta search parameters for writePack
+struct PackOptions
+{
+    int window = 10; // Number of preceding objects tried as delta bases
+    int depth = 50;  // Maximum delta chain length
+};
+
+// Objects the receiver of a thin pack already has, by file name (see PackInput): an object to be
+// sent may be stored as a REF_DELTA against the one of the same name, which the pack then lacks
+typedef unordered_map<string, ObjectId> ThinPackBases;
+
+// Writes the given objects as a pack stream to out and returns its checksum and index entries.
+// Objects are ordered by type, name and decreasing size, and each one is delta-compressed against
+// the best of the previous `window` objects of the same type, if that beats storing it whole.
+// With bases the pack is thin: the receiver's object of the same name is tried as well.
+bool writePackStream(ostream &out, const vector<PackInput> &objects, const PackOptions &options, const ThinPackBases *bases,
+                     ObjectId &checksum, vector<PackIndexEntry> &entries)
+{
+    // Pass 1: learn every object's type and size for the ordering
+    struct Item
+    {
+        const PackInput *input;
+        int type;
+        size_t size;
+    };
+    vector<Item> items;
+    items.reserve(objects.size());
+    for (const auto &obj : objects)
+    {
+        string type;
+        uint64_t size;
+        if (!readObjectHeader(obj.sha, type, size) || packTypeCode(type) == 0)
+        {
+            cerr << "Error: Cannot pack object " << obj.sha << endl;
+            return false;
+        }
+        items.push_back(Item{&obj, packTypeCode(type), static_cast<size_t>(size)});
+    }
+    stable_sort(items.begin(), items.end(), [](const Item &a, const Item &b)
+                {
+                    if (a.type != b.type)
+                        return a.type < b.type;
+                    if (a.input->name != b.input->name)
+                        return a.input->name < b.input->name;
+                    return a.size > b.size; });
+
+    // Pass 2: write, searching the sliding window of recent objects for a delta base
+    struct WindowSlot
+    {
+        int type;
+        int depth;
+        uint64_t offset;
+        shared_ptr<string> content;
+        shared_ptr<DeltaIndex> index;
+    };
+    deque<WindowSlot> window;
+
+    PackWriter writer(out, static_cast<uint32_t>(items.size()));
+    for (const auto &item : items)
+    {
+        string type;
+        auto content = make_shared<string>();
+        splitObject(readObject(item.input->sha), type, *content);
+
+        string bestDelta;
+        const WindowSlot *bestBase = nullptr;
+        for (const auto &slot : window)
+        {
+            if (slot.type != item.type || slot.depth >= options.depth || !slot.index)
+                continue;
+            // A delta must at least halve the object, and bases deep in a chain must pay off more
+            size_t maxSize = (bestBase ? bestDelta.size() : content->size() / 2) * (options.depth - slot.depth) / options.depth;
+            if (maxSize < 16)
+                continue;
+            string delta = createDelta(*slot.index, *content, maxSize);
+            if (!delta.empty())
+            {
+                bestDelta = move(delta);
+                bestBase = &slot;
+            }
+        }
+
+        // The receiver's version of the file is usually the best base of all
+        ObjectId thinBase;
+        auto named = bases ? bases->find(item.input->name) : ThinPackBases::const_iterator();
+        if (bases && named != bases->end() && named->second != item.input->sha && options.depth > 0)
+        {
+            string baseType, baseContent;
+            size_t maxSize = bestBase ? bestDelta.size() : content->size() / 2;
+            if (maxSize >= 16 && splitObject(readObject(named->second), baseType, baseContent) &&
+                packTypeCode(baseType) == item.type && baseContent.size() >= DELTA_BLOCK * 2)
+            {
+                string delta = createDelta(DeltaIndex(baseContent), *content, maxSize);
+                if (!delta.empty())
+                {
+                    bestDelta = move(delta);
+                    thinBase = named->second;
+                }
+            }
+        }
+
+        WindowSlot slot{item.type, 0, writer.offset(), content, nullptr};
+        if (!thinBase.isNull())
+        {
+            slot.depth = 1;
+            writer.addRefDelta(item.input->sha, thinBase, bestDelta);
+        }
+        else if (bestBase)
+        {
+            slot.depth = bestBase->depth + 1;
+            writer.addOfsDelta(item.input->sha, bestBase->offset, bestDelta);
+        }
+        else
+        {
+            writer.addObject(item.input->sha, item.type, *content);
+        }
+
+        if (options.window > 0)
+        {
+            if (content->size() >= DELTA_BLOCK * 2)
+                slot.index = make_shared<DeltaIndex>(*content);
+            window.push_back(move(slot));
+            if (window.size() > static_cast<size_t>(options.window))
+                window.pop_front();
+        }
+    }
+    checksum = writer.finish();
+    entries = writer.entries();
+    return static_cast<bool>(out);
+}
+
+// Writes the given objects into a new pack + idx under objects/pack and makes it visible (see
+// writePackStream). Returns the pack name ("pack-<checksum>") or "" on failure.
+string writePack(const vector<PackInput> &objects, const PackOptions &options = PackOptions())
+{
+    string packDir = REPO_DIR + "\\objects\\pack";
+    fs::create_directories(packDir);
+    string tempPack = packDir + "\\tmp_pack_" + getFilename(getTempObjectPath());
+
+    ObjectId checksum;
+    vector<PackIndexEntry> entries;
+    ofstream out(tempPack, ios::binary);
+    bool ok = writePackStream(out, objects, options, nullptr, checksum, entries);
+    out.close();
+    if (!ok || !out)
+    {
+        if (ok)
+            cerr << "Error: Cannot write pack file" << endl;
+        error_code ec;
+        fs::remove(tempPack, ec);
+        return "";
+    }
+    return installPack(tempPack, buildPackIndex(entries, checksum), checksum);
+}
+
+// ============= BLOB OPERATIONS =============
+
+// Hashes blob content (and compresses it, if out is given) prefixed by the object header, in
+// slices small enough for the compressors' 32-bit lengths
+ObjectId streamBlob(const char *data, size_t size, const string &header, LooseObjectWriter *out)
+{
+    const size_t SLICE = 16 * STREAM_CHUNK_SIZE;
+    ObjectHasher hasher;
+    hasher.update(header.data(), header.size());
+    if (out)
+        out->write(header.data(), header.size());
+    for (size_t pos = 0; pos < size; pos += SLICE)
+    {
+        size_t n = min(SLICE, size - pos);
+        hasher.update(data + pos, n);
+        if (out)
+            out->write(data + pos, n);
+    }
+    return hasher.final();
+}
+
+// Reads a whole (small) file as blob object data: "blob <size>\0<content>". Fails if the file
+// no longer has the expected size.
+bool readBlobData(ifstream &file, const string &filepath, uintmax_t size, string &blobData)
+{
+    blobData = "blob " + to_string(size) + string(1, '\0');
+    size_t headerSize = blobData.size();
+    blobData.resize(headerSize + size);
+    file.read(&blobData[headerSize], static_cast<streamsize>(size));
+    if (static_cast<uintmax_t>(file.gcount()) != size || file.peek() != char_traits<char>::eof())
+    {
+        cerr << "Error: File changed while reading: " << filepath << endl;
+        return false;
+    }
+    return true;
+}
+
+// Content-defined chunking settings: files of at least core.chunkThreshold bytes (0 = never, the
+// default) are stored as chunked blobs, cut by FastCDC around an average of core.chunkSize bytes
+// (a power of two from 64k to 64m, default 1m). Chunks are at least a quarter and at most eight
+// times the average.
+struct ChunkingSettings
+{
+    uint64_t threshold = 0;
+    size_t minSize, avgSize, maxSize;
+    uint64_t maskHard, maskEasy; // Normalized chunking: harder to cut before avgSize, easier after
+};
+
+const ChunkingSettings &chunkingSettings()
+{
+    static const ChunkingSettings settings = []
+    {
+        ChunkingSettings s;
+        s.threshold = getConfigSize("core.chunkthreshold", 0);
+        uint64_t avg = getConfigSize("core.chunksize", 1 << 20);
+        int bits = 16;
+        while (bits < 26 && (uint64_t(1) << bits) < avg)
+            bits++;
+        s.avgSize = size_t(1) << bits;
+        s.minSize = s.avgSize / 4;
+        s.maxSize = s.avgSize * 8;
+        // The gear hash shifts left, so its top bits depend on the last 64 bytes
+        s.maskHard = ~uint64_t(0) << (64 - (bits + 2));
+        s.maskEasy = ~uint64_t(0) << (64 - (bits - 2));
+        return s;
+    }();
+    return settings;
+}
+
+// FastCDC's gear table: 256 fixed pseudo-random values (splitmix64), built at compile time.
+// Changing it would move every chunk boundary, so it is part of the storage format.
+struct GearTable
+{
+    uint64_t value[256];
+    constexpr GearTable() : value()
+    {
+        uint64_t x = 0x6d79676974636463ull;
+        for (int i = 0; i < 256; i++)
+        {
+            uint64_t z = (x += 0x9e3779b97f4a7c15ull);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+            value[i] = z ^ (z >> 31);
+        }
+    }
+};
+constexpr GearTable GEAR;
+
+// Returns the length of the next chunk of the len bytes left at data
+size_t findChunkBoundary(const unsigned char *data, size_t len, const ChunkingSettings &s)
+{
+    if (len <= s.minSize)
+        return len;
+    size_t normal = min(len, s.avgSize), end = min(len, s.maxSize), i = s.minSize;
+    uint64_t hash = 0;
+    for (; i < normal; i++)
+    {
+        hash = (hash << 1) + GEAR.value[data[i]];
+        if (!(hash & s.maskHard))
+            return i + 1;
+    }
+    for (; i < end; i++)
+    {
+        hash = (hash << 1) + GEAR.value[data[i]];
+        if (!(hash & s.maskEasy))
+            return i + 1;
+    }
+    return end;
+}
+
+// Counters for chunked blobs, printed with --stats
+struct ChunkStats
+{
+    atomic<uint64_t> blobs{0};
+    atomic<uint64_t> written{0};
+    atomic<uint64_t> reused{0}; // Chunks already in the object database
+    atomic<uint64_t> reusedBytes{0};
+};
+ChunkStats chunkStats;
+
+// Stores file content as the chunked blob sha: every chunk becomes a blob object (existing ones
+// are reused, not recompressed) and the manifest goes to the blob's loose path. The content is
+// hashed again on the way, so a file that changed since sha was computed is refused.
+bool writeChunkedBlob(const char *content, size_t size, const string &header, const ObjectId &sha)
+{
+    const ChunkingSettings &settings = chunkingSettings();
+    ObjectHasher hasher;
+    hasher.update(header.data(), header.size());
+    ChunkManifest manifest;
+    for (size_t pos = 0; pos < size;)
+    {
+        const char *data = content + pos;
+        size_t len = findChunkBoundary(reinterpret_cast<const unsigned char *>(data), size - pos, settings);
+        hasher.update(data, len);
+
+        string chunk = "blob " + to_string(len) + string(1, '\0');
+        chunk.append(data, len);
+        ObjectId id = computeHash(chunk);
+        if (objectExists(id))
+        {
+            chunkStats.reused++;
+            chunkStats.reusedBytes += len;
+        }
+        else
+        {
+            if (!writeObject(id, chunk))
+                return false;
+            chunkStats.written++;
+        }
+        manifest.chunks.emplace_back(static_cast<uint32_t>(len), id);
+        manifest.size += len;
+        pos += len;
+    }
+    if (hasher.final() != sha)
+        return false;
+
+    string tempPath = getTempObjectPath();
+    string data = serializeChunkManifest(manifest);
+    {
+        ofstream out(tempPath, ios::binary);
+        out.write(data.data(), data.size());
+        out.close();
+        if (!out)
+        {
+            error_code ec;
+            fs::remove(tempPath, ec);
+            return false;
+        }
+    }
+    chunkStats.blobs++;
+    return finalizeObject(tempPath, sha);
+}
+
+// Creates a Blob object for the file content. Small files are read in one piece; larger ones
+// are hashed and compressed straight from a FileView (a memory mapping from MMAP_THRESHOLD on),
+// so the content is never copied. An object that already exists is never recompressed, and
+// with write == false the file is only hashed. Files above core.chunkThreshold are stored as
+// chunked blobs. Returns the null ID on failure.
+ObjectId createBlob(const string &filepath, bool write = true)
+{
+    error_code ec;
+    uintmax_t size = fs::file_size(filepath, ec);
+    if (!ec && size <= STREAM_CHUNK_SIZE)
+    {
+        ifstream file(filepath, ios::binary);
+        if (!file)
+        {
+            cerr << "Error: Cannot read file " << filepath << endl;
+            return ObjectId();
+        }
+        string blobData;
+        if (!readBlobData(file, filepath, size, blobData))
+            return ObjectId();
+        ObjectId sha = computeHash(blobData);
+        if (write && !writeObject(sha, blobData))
+            return ObjectId();
+        return sha;
+    }
+
+    FileView view(filepath);
+    if (ec || !view.valid())
+    {
+        cerr << "Error: Cannot read file " << filepath << endl;
+        return ObjectId();
+    }
+    if (view.size() != size)
+    {
+        cerr << "Error: File changed while reading: " << filepath << endl;
+        return ObjectId();
+    }
+
+    // Blob object format: "blob <size>\0<content>"
+    string header = "blob " + to_string(size) + string(1, '\0');
+
+    // Hash-only pass first: an unchanged large file costs no deflate
+    ObjectId sha = streamBlob(view.data(), view.size(), header, nullptr);
+    if (!write)
+        return sha;
+    if (objectExists(sha))
+    {
+        objectStats.skipped++;
+        return sha;
+    }
+
+    // Compressing pass; the content is re-hashed to make sure the file did not change meanwhile
+    uint64_t chunkThreshold = chunkingSettings().threshold;
+    if (chunkThreshold > 0 && size >= chunkThreshold)
+    {
+        if (!writeChunkedBlob(view.data(), view.size(), header, sha))
+        {
+            cerr << "Error: Cannot write object for " << filepath << " (file changed or disk error)" << endl;
+            return ObjectId();
+        }
+        return sha;
+    }
+    bool store = looksIncompressible(view.data(), view.size());
+    string tempPath = getTempObjectPath();
+    bool ok;
+    {
+        LooseObjectWriter out(tempPath, header.size() + size, store);
+        ok = out.good() && streamBlob(view.data(), view.size(), header, &out) == sha;
+        ok = out.finish() && ok;
+    }
+    if (!ok)
+    {
+        cerr << "Error: Cannot write object for " << filepath << " (file changed or disk error)" << endl;
+        fs::remove(tempPath, ec);
+        return ObjectId();
+    }
+    if (!finalizeObject(tempPath, sha))
+        return ObjectId();
+    return sha;
+}
+
+// ============= OBJECT PIPELINE =============
+
+// add and write-tree store their blobs through a staged pipeline, so reading, hashing and
+// compressing, and writing overlap instead of taking turns for every file:
+//   readers (add.readThreads, default 2)  read small files whole, in parallel with the CPU work
+//   workers (one per hardware thread)     hash them (multi-buffer, several at a time), skip
+//                                         objects that exist, and compress the rest
+//   writer  (one thread)                  writes the compressed objects in batches, one file
+//                                         after the other, and renames them into place
+// The stages are connected by lock-free rings of add.queueDepth items (default 256), and the
+// content between a reader and the writer is limited to add.memoryLimit bytes (default 64m):
+// readers wait while it is exhausted. Files larger than STREAM_CHUNK_SIZE skip the readers and
+// are streamed by a worker (createBlob), which maps them instead of reading them.
+struct PipelineSettings
+{
+    unsigned readers;
+    size_t queueDepth;
+    uint64_t memoryLimit;
+};
+
+const PipelineSettings &pipelineSettings()
+{
+    static const PipelineSettings settings = []
+    {
+        PipelineSettings s;
+        s.readers = static_cast<unsigned>(max<uint64_t>(1, getConfigSize("add.readthreads", 2)));
+        s.queueDepth = static_cast<size_t>(max<uint64_t>(2, getConfigSize("add.queuedepth", 256)));
+        s.memoryLimit = max<uint64_t>(STREAM_CHUNK_SIZE, getConfigSize("add.memorylimit", 64 << 20));
+        return s;
+    }();
+    return settings;
+}
+
+// Counters for the pipeline, printed with --stats
+struct PipelineStats
+{
+    atomic<uint64_t> files{0};
+    atomic<uint64_t> memoryWaits{0}; // Times a reader waited for the memory budget
+    atomic<uint64_t> queueWaits{0};  // Times a stage waited for room in the next queue
+    atomic<uint64_t> batches{0};     // Writer batches
+    atomic<uint64_t> written{0};     // Objects the writer stored
+};
+PipelineStats pipelineStats;
+
+// Hashes and (with write) stores the files as blobs, like createBlob on each of them but with the
+// stages overlapped. Returns the blob IDs in the order of paths; a file that could not be read or
+// stored gets the null ID (and an error message).
+vector<ObjectId> storeBlobs(const vector<string> &paths, unsigned jobs, bool write = true)
+{
+    const PipelineSettings &settings = pipelineSettings();
+    const size_t HASH_BATCH = 8;                     // Files hashed side by side (see computeHashes)
+    const size_t WRITE_BATCH = 64;                   // Objects written per writer wake-up
+    const size_t HEADER_RESERVE = 32;                // Object header, counted against the budget
+    struct Item
+    {
+        size_t index;
+        string object; // "blob <size>\0content", then the compressed loose object
+        ObjectId sha;
+        uint64_t charge = 0; // Bytes held against the memory budget
+        bool large = false;
+    };
+    vector<ObjectId> ids(paths.size());
+    LockFreeQueue<Item> hashQueue(settings.queueDepth), writeQueue(settings.queueDepth);
+    atomic<size_t> nextFile{0};
+    atomic<uint64_t> inFlight{0};
+    atomic<unsigned> readersLeft{settings.readers}, workersLeft{max(1u, jobs)};
+    pipelineStats.files += paths.size();
+
+    auto reader = [&]
+    {
+        for (size_t i = nextFile++; i < paths.size(); i = nextFile++)
+        {
+            Item item;
+            item.index = i;
+            error_code ec;
+            uintmax_t size = fs::file_size(paths[i], ec);
+            if (ec || size > STREAM_CHUNK_SIZE)
+                item.large = true; // createBlob reports unreadable files
+            else
+            {
+                item.charge = size + HEADER_RESERVE;
+                for (unsigned attempt = 0; inFlight.load() > 0 && inFlight.load() + item.charge > settings.memoryLimit;)
+                {
+                    if (attempt == 0)
+                        pipelineStats.memoryWaits++;
+                    backoff(attempt);
+                }
+                inFlight += item.charge;
+                TraceScope trace(TRACE_READ_FILE, size);
+                ifstream file(paths[i], ios::binary);
+                if (!file)
+                    cerr << "Error: Cannot read file " << paths[i] << endl;
+                if (!file || !readBlobData(file, paths[i], size, item.object))
+                {
+                    inFlight -= item.charge;
+                    continue;
+                }
+            }
+            pipelineStats.queueWaits += hashQueue.push(move(item));
+        }
+        if (--readersLeft == 0)
+            hashQueue.close();
+    };
+
+    auto worker = [&]
+    {
+        vector<Item> batch;
+        vector<string_view> views;
+        vector<ObjectId> shas;
+        Item item;
+        while (hashQueue.pop(item))
+        {
+            batch.clear();
+            batch.push_back(move(item));
+            while (batch.size() < HASH_BATCH && hashQueue.tryPop(item))
+                batch.push_back(move(item));
+
+            views.clear();
+            for (const auto &b : batch)
+                if (!b.large)
+                    views.emplace_back(b.object);
+            shas.resize(views.size());
+            computeHashes(views.data(), views.size(), shas.data());
+
+            size_t k = 0;
+            for (auto &b : batch)
+            {
+                if (b.large)
+                {
+                    ids[b.index] = createBlob(paths[b.index], write);
+                    continue;
+                }
+                b.sha = shas[k++];
+                if (!write || objectExists(b.sha))
+                {
+                    if (write)
+                        objectStats.skipped++;
+                    ids[b.index] = b.sha;
+                    inFlight -= b.charge;
+                    continue;
+                }
+                string compressed = encodeLooseObject(b.object);
+                if (compressed.empty())
+                {
+                    cerr << "Error: Cannot write object for " << paths[b.index] << endl;
+                    inFlight -= b.charge;
+                    continue;
+                }
+                // From here on only the compressed copy is held
+                inFlight -= b.charge;
+                b.charge = compressed.size();
+                inFlight += b.charge;
+                b.object = move(compressed);
+                pipelineStats.queueWaits += writeQueue.push(move(b));
+            }
+        }
+        if (--workersLeft == 0)
+            writeQueue.close();
+    };
+
+    auto writer = [&]
+    {
+        vector<Item> batch;
+        Item item;
+        while (writeQueue.pop(item))
+        {
+            batch.clear();
+            batch.push_back(move(item));
+            while (batch.size() < WRITE_BATCH && writeQueue.tryPop(item))
+                batch.push_back(move(item));
+            pipelineStats.batches++;
+            for (auto &b : batch)
+            {
+                TraceScope trace(TRACE_WRITE_OBJECT, b.object.size());
+                string tempPath = getTempObjectPath();
+                bool ok;
+                {
+                    ofstream file(tempPath, ios::binary);
+                    file.write(b.object.data(), b.object.size());
+                    file.close();
+                    ok = static_cast<bool>(file);
+                }
+                trace.addSyscalls(4); // open, write, close and the rename into place
+                inFlight -= b.charge;
+                if (!ok)
+                {
+                    cerr << "Error: Cannot write object " << b.sha << endl;
+                    error_code ec;
+                    fs::remove(tempPath, ec);
+                    continue;
+                }
+                if (finalizeObject(tempPath, b.sha))
+                {
+                    ids[b.index] = b.sha;
+                    pipelineStats.written++;
+                }
+            }
+        }
+    };
+
+    vector<thread> threads;
+    for (unsigned i = 0; i < settings.readers; i++)
+        threads.emplace_back(reader);
+    for (unsigned i = 0; i < max(1u, jobs); i++)
+        threads.emplace_back(worker);
+    threads.emplace_back(writer);
+    for (auto &t : threads)
+        t.join();
+    return ids;
+}
+
+// ============= TREE OPERATIONS =============
+
+// Structure to hold one entry (file or directory) within a Tree object
+struct TreeEntry
+{
+    string mode;
+    string name;
+    ObjectId sha;
+    bool isTree;
+};
+
+// Git's tree entry order: names compare bytewise, with a directory sorting as if its name
+// ended in '/' (so "a.txt" comes before the directory "a", which comes before "a0")
+int compareTreeNames(string_view a, bool aIsTree, string_view b, bool bIsTree)
+{
+    size_t n = min(a.size(), b.size());
+    int cmp = memcmp(a.data(), b.data(), n);
+    if (cmp != 0)
+        return cmp;
+    unsigned char ca = n < a.size() ? static_cast<unsigned char>(a[n]) : (aIsTree ? '/' : '\0');
+    unsigned char cb = n < b.size() ? static_cast<unsigned char>(b[n]) : (bIsTree ? '/' : '\0');
+    return int(ca) - int(cb);
+}
+
+// Sort predicate for TreeEntry in git's tree order
+bool treeEntryLess(const TreeEntry &a, const TreeEntry &b)
+{
+    return compareTreeNames(a.name, a.isTree, b.name, b.isTree) < 0;
+}
+
+// Appends one "mode name\0sha" entry in the repository's tree format. Binary trees use git's
+// spelling of the directory mode ("40000"), which keeps them byte-identical to git's trees.
+void appendTreeEntry(string &content, string_view mode, string_view name, const ObjectId &sha)
+{
+    if (binaryTreeIds())
+    {
+        content.append(mode == "040000" ? string_view("40000") : mode);
+        content += ' ';
+        content.append(name);
+        content += '\0';
+        content.append(sha.raw(), objectIdLength);
+    }
+    else
+    {
+        char hex[2 * MAX_OBJECT_ID_LENGTH];
+        bytesToHex(sha.bytes, objectIdLength, hex);
+        content.append(mode).append(1, ' ').append(name).append(1, '\0').append(hex, 2 * objectIdLength);
+    }
+}
+
+// Number of bytes appendTreeEntry appends for an entry
+size_t treeEntrySize(string_view mode, string_view name)
+{
+    bool binary = binaryTreeIds();
+    size_t modeSize = binary && mode == "040000" ? 5 : mode.size();
+    return modeSize + 1 + name.size() + 1 + (binary ? objectIdLength : 2 * objectIdLength);
+}
+
+// One entry of a tree being built. Mode and name are views into storage that outlives the build
+// (the index entries, or the command's NameArena), so building a directory of any size copies
+// no names.
+struct TreeBuildEntry
+{
+    string_view mode;
+    string_view name;
+    ObjectId sha;
+    bool isTree = false;
+};
+
+// Interns path components for the rest of the command: every distinct name is copied once into
+// a monotonic arena and handed out as a view, so the same name in a thousand directories (or a
+// directory with tens of thousands of entries) costs no allocation per entry. Thread safe.
+class NameArena
+{
+public:
+    string_view intern(string_view name)
+    {
+        lock_guard<mutex> lk(m);
+        auto it = names.find(name);
+        if (it != names.end())
+            return *it;
+        char *copy = static_cast<char *>(arena.allocate(max<size_t>(name.size(), 1), 1));
+        memcpy(copy, name.data(), name.size());
+        return *names.insert(string_view(copy, name.size())).first;
+    }
+
+private:
+    mutex m;
+    pmr::monotonic_buffer_resource arena{64 * 1024};
+    pmr::unordered_set<string_view> names{&arena};
+};
+
+NameArena &pathNames()
+{
+    static NameArena names;
+    return names;
+}
+
+// Serializes entries (in tree order) into a complete tree object, "tree <size>\0" followed by
+// the entries. The size is known before the first byte is written, so the object is built in a
+// single buffer of exactly the right size.
+string serializeTreeObject(const TreeBuildEntry *entries, size_t count)
+{
+    size_t contentSize = 0;
+    for (size_t i = 0; i < count; i++)
+        contentSize += treeEntrySize(entries[i].mode, entries[i].name);
+    char header[32];
+    int headerLen = snprintf(header, sizeof(header), "tree %zu", contentSize);
+    string object;
+    object.reserve(headerLen + 1 + contentSize);
+    object.append(header, headerLen).append(1, '\0');
+    for (size_t i = 0; i < count; i++)
+        appendTreeEntry(object, entries[i].mode, entries[i].name, entries[i].sha);
+    return object;
+}
+
+// Stores a complete tree object and returns its ID, or the null ID if it cannot be written
+ObjectId writeTreeObject(const string &object)
+{
+    ObjectId sha = computeHash(object);
+    if (!writeObject(sha, object))
+        return ObjectId();
+    return sha;
+}
+
+// One directory found by scanWorktree. slots[i] is the index of entries[i] in the file list
+// (blobs) or in the directory list (trees).
+struct ScannedDirectory
+{
+    vector<TreeBuildEntry> entries;
+    vector<size_t> slots;
+};
+
+// Recursively lists a directory into dirs (parents before their subdirectories) and collects
+// the paths of its files; returns the directory's index in dirs
+size_t scanWorktree(const string &path, vector<ScannedDirectory> &dirs, vector<string> &files)
+{
+    vector<DirEntry> dirEntries;
+    readDirectory(path, dirEntries);
+    NameArena &names = pathNames();
+    size_t self = dirs.size();
+    dirs.emplace_back();
+    dirs[self].entries.reserve(dirEntries.size());
+    dirs[self].slots.reserve(dirEntries.size());
+    for (auto &dirEntry : dirEntries)
+    {
+        // Skip the repository directory (.mygit)
+        if (dirEntry.name == REPO_DIR)
+            continue;
+        string fullPath = (path == ".") ? dirEntry.name : path + "\\" + dirEntry.name;
+        TreeBuildEntry te{names.intern(getPermissions(fullPath)), names.intern(dirEntry.name), ObjectId(), dirEntry.isDirectory};
+        size_t slot;
+        if (te.isTree)
+            slot = scanWorktree(fullPath, dirs, files);
+        else
+        {
+            slot = files.size();
+            files.push_back(move(fullPath));
+        }
+        // By index: the recursion may have reallocated dirs
+        dirs[self].entries.push_back(te);
+        dirs[self].slots.push_back(slot);
+    }
+    return self;
+}
+
+// Creates the Tree objects for a directory and everything below it, and returns the top one.
+// The directory is scanned first, then all of its files are stored in one pass through the
+// object pipeline (storeBlobs, with `jobs` workers), and finally the trees are built from the
+// innermost directory outwards, so only blob contents are ever in flight. Returns the null ID if
+// a tree cannot be written.
+ObjectId createTree(const string &path, unsigned jobs)
+{
+    TraceScope trace(TRACE_WRITE_TREE);
+    vector<ScannedDirectory> dirs;
+    vector<string> files;
+    scanWorktree(path, dirs, files);
+    vector<ObjectId> blobs = storeBlobs(files, jobs);
+
+    // A subdirectory always comes after its parent in dirs
+    vector<ObjectId> trees(dirs.size());
+    for (size_t d = dirs.size(); d-- > 0;)
+    {
+        vector<TreeBuildEntry> &entries = dirs[d].entries;
+        for (size_t i = 0; i < entries.size(); i++)
+            entries[i].sha = entries[i].isTree ? trees[dirs[d].slots[i]] : blobs[dirs[d].slots[i]];
+        entries.erase(remove_if(entries.begin(), entries.end(),
+                                [](const TreeBuildEntry &te)
+                                { return te.sha.isNull(); }),
+                      entries.end());
+
+        // Sort entries in git's tree order (required for consistent Tree SHA-1 hash)
+        sort(entries.begin(), entries.end(), [](const TreeBuildEntry &a, const TreeBuildEntry &b)
+             { return compareTreeNames(a.name, a.isTree, b.name, b.isTree) < 0; });
+        trees[d] = writeTreeObject(serializeTreeObject(entries.data(), entries.size()));
+        if (trees[d].isNull())
+            return ObjectId(); // Leaving the directory out would store a different tree
+    }
+    return trees[0];
+}
+
+// One entry of a tree object, pointing into the object's inflated buffer (see TreeView)
+struct TreeEntryView
+{
+    string_view mode; // Directories always read "040000", whatever spelling the tree uses
+    string_view name;
+    ObjectId sha;
+    bool isTree = false;
+
+    TreeEntry toEntry() const
+    {
+        return TreeEntry{string(mode), string(name), sha, isTree};
+    }
+};
+
+// Read-only view of a Tree object ("tree <size>\0entries"). The object is scanned once to
+// validate it and record where each entry starts; entries are then decoded on demand as
+// string_views into the buffer, so walking or searching a tree allocates nothing per entry.
+// Entry IDs are raw bytes or hex characters, depending on the repository's tree format.
+class TreeView
+{
+public:
+    explicit TreeView(string object = string()) : data(move(object)), binary(binaryTreeIds())
+    {
+        size_t nullPos = data.find('\0');
+        if (nullPos == string::npos)
+            return;
+
+        // Skip the "tree <size>" header; a malformed entry ends the tree
+        size_t pos = nullPos + 1;
+        TreeEntryView entry, previous;
+        size_t next;
+        while (pos < data.size() && decodeAt(pos, entry, next))
+        {
+            if (!offsets.empty() && compareTreeNames(previous.name, previous.isTree, entry.name, entry.isTree) >= 0)
+                sorted = false;
+            offsets.push_back(static_cast<uint32_t>(pos));
+            previous = entry;
+            pos = next;
+        }
+    }
+
+    class iterator
+    {
+    public:
+        iterator(const TreeView *v, size_t i) : view(v), index(i) {}
+        TreeEntryView operator*() const { return (*view)[index]; }
+        iterator &operator++()
+        {
+            index++;
+            return *this;
+        }
+        bool operator!=(const iterator &o) const { return index != o.index; }
+
+    private:
+        const TreeView *view;
+        size_t index;
+    };
+
+    iterator begin() const { return iterator(this, 0); }
+    iterator end() const { return iterator(this, offsets.size()); }
+    size_t size() const { return offsets.size(); }
+    bool empty() const { return offsets.empty(); }
+
+    TreeEntryView operator[](size_t i) const
+    {
+        TreeEntryView entry;
+        size_t next;
+        decodeAt(offsets[i], entry, next);
+        return entry;
+    }
+
+    // Looks an entry up by name. Trees in git order are binary-searched, once for a file and once
+    // for a directory of that name (the two sort apart, see treeEntryLess); anything else is scanned.
+    bool find(string_view name, TreeEntryView &entry) const
+    {
+        if (!sorted)
+        {
+            for (TreeEntryView e : *this)
+            {
+                if (e.name == name)
+                {
+                    entry = e;
+                    return true;
+                }
+            }
+            return false;
+        }
+        for (bool asTree : {false, true})
+        {
+            size_t lo = 0, hi = offsets.size();
+            while (lo < hi)
+            {
+                size_t mid = lo + (hi - lo) / 2;
+                TreeEntryView e = (*this)[mid];
+                int cmp = compareTreeNames(e.name, e.isTree, name, asTree);
+                if (cmp == 0)
+                {
+                    entry = e;
+                    return true;
+                }
+                if (cmp < 0)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+        }
+        return false;
+    }
+
+    // Approximate memory held, for the object cache budget
+    size_t cost() const
+    {
+        return sizeof(*this) + data.capacity() + offsets.capacity() * sizeof(uint32_t);
+    }
+
+private:
+    // Decodes the entry starting at pos; next receives the start of the following entry
+    bool decodeAt(size_t pos, TreeEntryView &entry, size_t &next) const
+    {
+        const char *base = data.data();
+        const char *end = base + data.size();
+        const char *space = static_cast<const char *>(memchr(base + pos, ' ', end - (base + pos)));
+        if (!space)
+            return false;
+        const char *nul = static_cast<const char *>(memchr(space + 1, '\0', end - (space + 1)));
+        if (!nul)
+            return false;
+        size_t shaLen = binary ? objectIdLength : 2 * objectIdLength;
+        if (static_cast<size_t>(end - (nul + 1)) < shaLen)
+            return false;
+        if (binary)
+            entry.sha = ObjectId::fromRaw(nul + 1);
+        else if (!hexToBytes(nul + 1, entry.sha.bytes, objectIdLength))
+            return false;
+
+        entry.mode = string_view(base + pos, space - (base + pos));
+        if (entry.mode == "40000")
+            entry.mode = "040000"; // git's spelling of the directory mode
+        entry.isTree = (entry.mode == "040000");
+        entry.name = string_view(space + 1, nul - (space + 1));
+        next = (nul + 1 - base) + shaLen;
+        return true;
+    }
+
+    string data;
+    vector<uint32_t> offsets; // Start of every entry
+    bool binary;
+    bool sorted = true; // Strictly in git order, so find() may binary-search
+};
+
+// Returns a Tree object as a TreeView, from the object cache when possible. A missing or
+// unreadable tree yields an empty view.
+shared_ptr<const TreeView> loadTree(const ObjectId &treeSha)
+{
+    if (auto cached = objectCache.get<TreeView>(treeSha, ObjectCache::TREE))
+        return cached;
+    string treeData = readObject(treeSha);
+    bool found = !treeData.empty();
+    auto view = make_shared<TreeView>(move(treeData));
+    if (found)
+        objectCache.put(treeSha, ObjectCache::TREE, view, view->cost());
+    return view;
+}
+
+// Resolves a '/'-separated path below a tree, one binary search per level. The components
+// are views into path, and cached trees are reused, so deep lookups allocate nothing per entry.
+bool lookupPath(const ObjectId &treeSha, string_view path, TreeEntry &result)
+{
+    ObjectId current = treeSha;
+    TreeEntryView entry;
+    bool found = false;
+    while (!path.empty())
+    {
+        size_t slash = path.find('/');
+        string_view component = path.substr(0, slash);
+        path = slash == string_view::npos ? string_view() : path.substr(slash + 1);
+        if (component.empty())
+            continue;
+        if (found && !entry.isTree)
+            return false; // A file has no children
+        auto tree = loadTree(current);
+        if (!tree->find(component, entry))
+            return false;
+        current = entry.sha;
+        found = true;
+    }
+    if (found)
+        result = entry.toEntry();
+    return found;
+}
+
+// A file-level difference between two trees
+struct TreeChange
+{
+    char status; // 'A' added, 'M' modified (content, mode or file<->directory), 'D' deleted
+    string path;
+    TreeEntry oldEntry;
+    TreeEntry newEntry;
+};
+
+// Lists the entries of a tree sorted by name. Trees written by older versions of this tool, and
+// git's own order around directories, differ from plain name order, so order is not assumed.
+vector<TreeEntryView> sortedTreeEntries(const TreeView &tree)
+{
+    vector<TreeEntryView> entries;
+    entries.reserve(tree.size());
+    for (TreeEntryView entry : tree)
+        entries.push_back(entry);
+    auto byName = [](const TreeEntryView &a, const TreeEntryView &b)
+    { return a.name < b.name; };
+    if (!is_sorted(entries.begin(), entries.end(), byName))
+        sort(entries.begin(), entries.end(), byName);
+    return entries;
+}
+
+// Reports every file that differs between two trees (the null ID stands for the empty tree).
+// Entries with identical SHAs are skipped without being read, so an unchanged subtree costs one
+// comparison regardless of its size. If missing is given, it is set when either side has a tree
+// that cannot be read (which would otherwise look like an empty directory), and the diff stops.
+void diffTrees(const ObjectId &oldTree, const ObjectId &newTree, const string &prefix, vector<TreeChange> &changes,
+               bool *missing = nullptr)
+{
+    TraceScope trace(TRACE_DIFF_TREES);
+    if (oldTree == newTree || (missing && *missing))
+        return;
+    static const auto emptyTree = make_shared<const TreeView>();
+    auto oldView = oldTree.isNull() ? emptyTree : loadTree(oldTree);
+    auto newView = newTree.isNull() ? emptyTree : loadTree(newTree);
+    if (missing && ((oldView->empty() && !oldTree.isNull() && !objectExists(oldTree)) ||
+                    (newView->empty() && !newTree.isNull() && !objectExists(newTree))))
+    {
+        *missing = true;
+        return;
+    }
+    vector<TreeEntryView> oldEntries = sortedTreeEntries(*oldView);
+    vector<TreeEntryView> newEntries = sortedTreeEntries(*newView);
+
+    size_t i = 0, j = 0;
+    while (i < oldEntries.size() || j < newEntries.size())
+    {
+        const TreeEntryView *o = i < oldEntries.size() ? &oldEntries[i] : nullptr;
+        const TreeEntryView *n = j < newEntries.size() ? &newEntries[j] : nullptr;
+        if (o && n && o->name != n->name)
+        {
+            if (o->name < n->name)
+                n = nullptr;
+            else
+                o = nullptr;
+        }
+        if (o)
+            i++;
+        if (n)
+            j++;
+
+        if (o && n && o->sha == n->sha && o->mode == n->mode)
+            continue;
+
+        string_view name = o ? o->name : n->name;
+        string path = prefix.empty() ? string(name) : prefix + "\\" + string(name);
+
+        // Trees are expanded into their files; a file that became a directory (or vice versa)
+        // shows up as the old side deleted and the new side added
+        bool oldTree = o && o->isTree;
+        bool newTree = n && n->isTree;
+        if (oldTree || newTree)
+        {
+            diffTrees(oldTree ? o->sha : ObjectId(), newTree ? n->sha : ObjectId(), path, changes, missing);
+            if (o && !oldTree)
+                changes.push_back(TreeChange{'D', path, o->toEntry(), TreeEntry()});
+            if (n && !newTree)
+                changes.push_back(TreeChange{'A', path, TreeEntry(), n->toEntry()});
+            continue;
+        }
+        if (o && n)
+            changes.push_back(TreeChange{'M', path, o->toEntry(), n->toEntry()});
+        else if (o)
+            changes.push_back(TreeChange{'D', path, o->toEntry(), TreeEntry()});
+        else
+            changes.push_back(TreeChange{'A', path, TreeEntry(), n->toEntry()});
+    }
+}
+
+// ============= COMMIT OPERATIONS =============
+
+// Creates a Commit object (no parents makes a root commit, several a merge); returns the null
+// ID if it cannot be written
+ObjectId createCommit(const ObjectId &treeSha, const vector<ObjectId> &parents, const string &message)
+{
+    time_t now = time(nullptr);
+    // string timestamp = ctime(&now);
+    // timestamp.pop_back();
+
+    stringstream commitContent;
+    commitContent << "tree " << treeSha << "\n";
+    for (const auto &parentSha : parents)
+    {
+        commitContent << "parent " << parentSha << "\n";
+    }
+    commitContent << "author User <user@example.com> " << now << " +0000\n";
+    commitContent << "committer User <user@example.com> " << now << " +0000\n";
+    commitContent << "\n"
+                  << message << "\n";
+
+    // Commit object format: "commit <size>\0<content>"
+    string commitData = "commit " + to_string(commitContent.str().size()) + '\0' + commitContent.str();
+    ObjectId sha = computeHash(commitData);
+
+    if (!writeObject(sha, commitData))
+        return ObjectId();
+    return sha;
+}
+
+struct CommitInfo
+{
+    ObjectId treeSha; // Null if the commit could not be read
+    vector<ObjectId> parents;
+    string author;
+    string committer;
+    string message;
+    string timestamp; // Committer time, seconds since the epoch
+    uint64_t time = 0;
+};
+
+// Parses a raw Commit object ("commit <size>\0...") into a CommitInfo struct
+CommitInfo parseCommitData(const string &commitData)
+{
+    CommitInfo info;
+    if (commitData.empty())
+        return info;
+
+    size_t nullPos = commitData.find('\0');
+    if (nullPos == string::npos)
+        return info;
+
+    string content = commitData.substr(nullPos + 1);
+    istringstream stream(content);
+    string line;
+
+    while (getline(stream, line))
+    {
+        if (line.empty())
+            break;
+
+        if (line.substr(0, 5) == "tree ")
+        {
+            ObjectId::fromHex(line.substr(5), info.treeSha);
+        }
+        else if (line.substr(0, 7) == "parent ")
+        {
+            ObjectId parent;
+            if (ObjectId::fromHex(line.substr(7), parent))
+                info.parents.push_back(parent);
+        }
+        else if (line.substr(0, 7) == "author ")
+        {
+            info.author = line.substr(7);
+        }
+        else if (line.substr(0, 10) == "committer ")
+        {
+            info.committer = line.substr(10);
+            // "Name <email> <time> <zone>"
+            size_t zonePos = info.committer.rfind(' ');
+            size_t timePos = zonePos == string::npos || zonePos == 0 ? string::npos : info.committer.rfind(' ', zonePos - 1);
+            if (timePos != string::npos)
+            {
+                info.timestamp = info.committer.substr(timePos + 1, zonePos - timePos - 1);
+                info.time = strtoull(info.timestamp.c_str(), nullptr, 10);
+            }
+        }
+    }
+
+    // Read commit message (everything after the blank line)
+    while (getline(stream, line))
+    {
+        info.message += line + "\n";
+    }
+
+    return info;
+}
+
+// Returns the parsed Commit object, from the object cache when possible
+shared_ptr<const CommitInfo> loadCommit(const ObjectId &commitSha)
+{
+    if (auto cached = objectCache.get<CommitInfo>(commitSha, ObjectCache::COMMIT))
+        return cached;
+    string commitData = readObject(commitSha);
+    auto info = make_shared<CommitInfo>(parseCommitData(commitData));
+    if (!commitData.empty())
+        objectCache.put(commitSha, ObjectCache::COMMIT, info, sizeof(CommitInfo) + commitData.size());
+    return info;
+}
+
+// Parses a Commit object's content into a CommitInfo struct
+CommitInfo parseCommit(const ObjectId &commitSha)
+{
+    return *loadCommit(commitSha);
+}
+
+// ============= COMMIT GRAPH =============
+
+// The commit graph (objects/info/commit-graph) keeps what history walks need from every commit
+// in fixed-width columns, so log, merge-base and reachability checks read a memory map instead
+// of inflating and parsing commit objects. Integers are big-endian:
+//   header:  "MGCG" | version (u32) | commit count (u32) | extra edge count (u32)
+//   fanout:  256 x u32, number of commits whose ID starts with a byte <= i
+//   ids:     sorted commit IDs (20 bytes each)
+//   data:    per commit, in ID order: root tree (20 bytes) | parent 1 (u32) | parent 2 (u32)
+//            | generation (u32) | commit time (u64)
+//   edges:   the parents after the first of merges with more than two parents (u32 each; the
+//            last one of a commit's list has the top bit set)
+//   trailer: SHA-1 of all preceding bytes
+// Parents are positions in the ID column, GRAPH_NO_PARENT if absent; a parent 2 with the top bit
+// set is instead the start of the commit's list in the edge column. Roots have generation 1 and
+// every other commit one more than the highest of its parents, so a commit can only reach
+// commits of lower generation. The parents of every commit in the graph are in the graph too.
+const char COMMIT_GRAPH_SIGNATURE[] = "MGCG";
+const uint32_t COMMIT_GRAPH_VERSION = 1;
+const size_t COMMIT_GRAPH_HEADER_SIZE = 16 + 256 * 4;
+const uint32_t GRAPH_NO_PARENT = 0xffffffffu;
+const uint32_t GRAPH_EXTRA_EDGES = 0x80000000u;
+const uint32_t GENERATION_UNKNOWN = 0xffffffffu; // Commits not in the graph (newer than all of it)
+
+size_t commitGraphRowSize()
+{
+    return objectIdLength + 4 + 4 + 4 + 8;
+}
+
+string getCommitGraphPath()
+{
+    return REPO_DIR + "\\objects\\info\\commit-graph";
+}
+
+// A memory-mapped commit graph file
+class CommitGraph
+{
+public:
+    // Maps the file and validates its layout
+    bool open(const string &path)
+    {
+        file = make_unique<MappedFile>(path);
+        if (!file->valid() || file->size() < COMMIT_GRAPH_HEADER_SIZE + objectIdLength)
+            return false;
+        const char *d = file->data();
+        if (memcmp(d, COMMIT_GRAPH_SIGNATURE, 4) != 0 || readU32(d + 4) != COMMIT_GRAPH_VERSION)
+            return false;
+        count = readU32(d + 8);
+        edgeCount = readU32(d + 12);
+        fanout = d + 16;
+        if (readU32(fanout + 255 * 4) != count)
+            return false;
+        ids = d + COMMIT_GRAPH_HEADER_SIZE;
+        rows = ids + size_t(count) * objectIdLength;
+        edges = rows + size_t(count) * commitGraphRowSize();
+        return file->size() == size_t(edges - d) + size_t(edgeCount) * 4 + objectIdLength;
+    }
+
+    uint32_t size() const { return count; }
+
+    // Binary search restricted to the fanout bucket of the ID's first byte
+    bool find(const ObjectId &id, uint32_t &pos) const
+    {
+        unsigned char first = id.bytes[0];
+        uint32_t lo = first == 0 ? 0 : readU32(fanout + (first - 1) * 4);
+        uint32_t hi = readU32(fanout + first * 4);
+        while (lo < hi)
+        {
+            uint32_t mid = lo + (hi - lo) / 2;
+            int cmp = memcmp(ids + size_t(mid) * objectIdLength, id.bytes, objectIdLength);
+            if (cmp == 0)
+            {
+                pos = mid;
+                return true;
+            }
+            if (cmp < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return false;
+    }
+
+    ObjectId id(uint32_t pos) const { return ObjectId::fromRaw(ids + size_t(pos) * objectIdLength); }
+    ObjectId tree(uint32_t pos) const { return ObjectId::fromRaw(row(pos)); }
+    uint32_t generation(uint32_t pos) const { return readU32(row(pos) + objectIdLength + 8); }
+    uint64_t time(uint32_t pos) const { return readU64(row(pos) + objectIdLength + 12); }
+
+    // Appends the positions of a commit's parents; false if the file is inconsistent
+    bool parents(uint32_t pos, vector<uint32_t> &out) const
+    {
+        const char *r = row(pos) + objectIdLength;
+        uint32_t first = readU32(r), second = readU32(r + 4);
+        if (first == GRAPH_NO_PARENT)
+            return true;
+        if (first >= count)
+            return false;
+        out.push_back(first);
+        if (second == GRAPH_NO_PARENT)
+            return true;
+        if (!(second & GRAPH_EXTRA_EDGES))
+        {
+            out.push_back(second);
+            return second < count;
+        }
+        for (uint32_t e = second & ~GRAPH_EXTRA_EDGES; e < edgeCount; e++)
+        {
+            uint32_t value = readU32(edges + size_t(e) * 4);
+            if ((value & ~GRAPH_EXTRA_EDGES) >= count)
+                return false;
+            out.push_back(value & ~GRAPH_EXTRA_EDGES);
+            if (value & GRAPH_EXTRA_EDGES)
+                return true;
+        }
+        return false;
+    }
+
+private:
+    const char *row(uint32_t pos) const { return rows + size_t(pos) * commitGraphRowSize(); }
+
+    unique_ptr<MappedFile> file;
+    uint32_t count = 0;
+    uint32_t edgeCount = 0;
+    const char *fanout = nullptr;
+    const char *ids = nullptr;
+    const char *rows = nullptr;
+    const char *edges = nullptr;
+};
+
+shared_ptr<const CommitGraph> loadedCommitGraph;
+bool commitGraphLoaded = false;
+
+// (Re)reads the commit graph file; a missing or corrupt file just means no graph
+void reloadCommitGraph()
+{
+    auto graph = make_shared<CommitGraph>();
+    bool exists = fileExists(getCommitGraphPath());
+    if (exists && !graph->open(getCommitGraphPath()))
+        cerr << "Warning: Ignoring corrupt commit graph " << getCommitGraphPath() << endl;
+    loadedCommitGraph = exists && graph->size() > 0 ? graph : nullptr;
+    commitGraphLoaded = true;
+}
+
+// Returns the commit graph, or nullptr if the repository has none
+shared_ptr<const CommitGraph> getCommitGraph()
+{
+    if (!commitGraphLoaded)
+        reloadCommitGraph();
+    return loadedCommitGraph;
+}
+
+// What history walks need to know about a commit
+struct CommitNode
+{
+    ObjectId id;
+    ObjectId tree;
+    vector<ObjectId> parents;
+    uint64_t time = 0;
+    uint32_t generation = GENERATION_UNKNOWN;
+};
+
+// Describes a commit from the commit graph, or by parsing the commit object if it is not in
+// the graph (its generation is then unknown). Returns false if it is not a readable commit.
+bool lookupCommitNode(const ObjectId &id, CommitNode &node)
+{
+    node.id = id;
+    node.parents.clear();
+    uint32_t pos;
+    auto graph = getCommitGraph();
+    if (graph && graph->find(id, pos))
+    {
+        vector<uint32_t> parents;
+        if (graph->parents(pos, parents))
+        {
+            node.tree = graph->tree(pos);
+            node.time = graph->time(pos);
+            node.generation = graph->generation(pos);
+            for (uint32_t p : parents)
+                node.parents.push_back(graph->id(p));
+            return true;
+        }
+    }
+    string type;
+    uint64_t size;
+    if (!readObjectHeader(id, type, size) || type != "commit")
+        return false;
+    auto info = loadCommit(id);
+    node.tree = info->treeSha;
+    node.parents = info->parents;
+    node.time = info->time;
+    node.generation = GENERATION_UNKNOWN;
+    return !node.tree.isNull();
+}
+
+// Adds every commit reachable from tips that the graph does not have yet, and rewrites the file
+// under its lock. Rows already in the graph are carried over without reading their commits, so
+// after a commit only that one new commit object is parsed. Returns false on failure.
+bool updateCommitGraph(const vector<ObjectId> &tips)
+{
+    struct Row
+    {
+        ObjectId id;
+        ObjectId tree;
+        vector<ObjectId> parents;
+        uint64_t time;
+        uint32_t generation; // 0 = not computed yet
+    };
+    auto old = getCommitGraph();
+    vector<Row> rows;
+
+    // New commits: walk from the tips, stopping at commits the graph already has
+    unordered_set<ObjectId> seen;
+    vector<ObjectId> stack(tips);
+    while (!stack.empty())
+    {
+        ObjectId id = stack.back();
+        stack.pop_back();
+        uint32_t pos;
+        if (id.isNull() || !seen.insert(id).second || (old && old->find(id, pos)))
+            continue;
+        auto info = loadCommit(id);
+        if (info->treeSha.isNull())
+        {
+            cerr << "Error: Cannot read commit " << id << " for the commit graph" << endl;
+            return false;
+        }
+        rows.push_back(Row{id, info->treeSha, info->parents, info->time, 0});
+        for (const auto &parent : info->parents)
+            stack.push_back(parent);
+    }
+    if (rows.empty())
+        return true;
+
+    if (old)
+    {
+        vector<uint32_t> parents;
+        for (uint32_t pos = 0; pos < old->size(); pos++)
+        {
+            Row row{old->id(pos), old->tree(pos), {}, old->time(pos), old->generation(pos)};
+            parents.clear();
+            old->parents(pos, parents);
+            for (uint32_t p : parents)
+                row.parents.push_back(old->id(p));
+            rows.push_back(move(row));
+        }
+    }
+    sort(rows.begin(), rows.end(), [](const Row &a, const Row &b)
+         { return a.id < b.id; });
+    unordered_map<ObjectId, uint32_t> position;
+    position.reserve(rows.size());
+    for (size_t i = 0; i < rows.size(); i++)
+        position[rows[i].id] = static_cast<uint32_t>(i);
+
+    // Generations of the new commits, parents first (iteratively; histories can be deep)
+    for (size_t start = 0; start < rows.size(); start++)
+    {
+        vector<uint32_t> pending{static_cast<uint32_t>(start)};
+        while (!pending.empty())
+        {
+            Row &row = rows[pending.back()];
+            if (row.generation != 0)
+            {
+                pending.pop_back();
+                continue;
+            }
+            uint32_t generation = 1;
+            bool ready = true;
+            for (const auto &parent : row.parents)
+            {
+                uint32_t p = position.at(parent);
+                if (rows[p].generation == 0)
+                {
+                    pending.push_back(p);
+                    ready = false;
+                }
+                else
+                    generation = max(generation, rows[p].generation + 1);
+            }
+            if (ready)
+            {
+                row.generation = min(generation, GENERATION_UNKNOWN - 1);
+                pending.pop_back();
+            }
+        }
+    }
+
+    // Serialize
+    uint32_t fanout[256] = {};
+    for (const auto &row : rows)
+        fanout[row.id.bytes[0]]++;
+    for (int i = 1; i < 256; i++)
+        fanout[i] += fanout[i - 1];
+    string idColumn, dataColumn, edgeColumn;
+    for (const auto &row : rows)
+    {
+        idColumn.append(row.id.raw(), objectIdLength);
+        dataColumn.append(row.tree.raw(), objectIdLength);
+        uint32_t first = row.parents.empty() ? GRAPH_NO_PARENT : position.at(row.parents[0]);
+        uint32_t second = row.parents.size() < 2 ? GRAPH_NO_PARENT : position.at(row.parents[1]);
+        if (row.parents.size() > 2)
+        {
+            second = GRAPH_EXTRA_EDGES | static_cast<uint32_t>(edgeColumn.size() / 4);
+            for (size_t k = 1; k < row.parents.size(); k++)
+                appendU32(edgeColumn, position.at(row.parents[k]) | (k + 1 == row.parents.size() ? GRAPH_EXTRA_EDGES : 0));
+        }
+        appendU32(dataColumn, first);
+        appendU32(dataColumn, second);
+        appendU32(dataColumn, row.generation);
+        appendU64(dataColumn, row.time);
+    }
+    string out(COMMIT_GRAPH_SIGNATURE, 4);
+    appendU32(out, COMMIT_GRAPH_VERSION);
+    appendU32(out, static_cast<uint32_t>(rows.size()));
+    appendU32(out, static_cast<uint32_t>(edgeColumn.size() / 4));
+    for (int i = 0; i < 256; i++)
+        appendU32(out, fanout[i]);
+    out += idColumn;
+    out += dataColumn;
+    out += edgeColumn;
+    out.append(computeHash(out).raw(), objectIdLength);
+
+    fs::create_directories(fs::path(getCommitGraphPath()).parent_path());
+    LockFile lock(getCommitGraphPath());
+    if (!lock.locked() || !lock.commit(out))
+        return false;
+    reloadCommitGraph();
+    return true;
+}
+
+// True if ancestor is reachable from descendant (or is descendant). Generation numbers cut the
+// walk short: a commit of the same or lower generation than the ancestor cannot lead to it.
+bool isAncestor(const ObjectId &ancestor, const ObjectId &descendant)
+{
+    CommitNode target;
+    if (!lookupCommitNode(ancestor, target))
+        return false;
+    unordered_set<ObjectId> seen;
+    vector<ObjectId> stack{descendant};
+    CommitNode node;
+    while (!stack.empty())
+    {
+        ObjectId id = stack.back();
+        stack.pop_back();
+        if (id == ancestor)
+            return true;
+        if (!seen.insert(id).second || !lookupCommitNode(id, node))
+            continue;
+        if (target.generation != GENERATION_UNKNOWN && node.generation <= target.generation)
+            continue;
+        for (const auto &parent : node.parents)
+            stack.push_back(parent);
+    }
+    return false;
+}
+
+// Finds the best common ancestors of two commits: those not reachable from another common
+// ancestor. Commits are visited in decreasing generation order, so each is handled after all of
+// its descendants; the walk stops as soon as every queued commit is below a found ancestor.
+// Commits outside the commit graph are ordered by commit time instead, which skewed clocks can
+// get wrong, so candidates reachable from another candidate are dropped at the end.
+vector<ObjectId> mergeBases(const ObjectId &a, const ObjectId &b)
+{
+    enum
+    {
+        PARENT1 = 1,
+        PARENT2 = 2,
+        STALE = 4
+    };
+    struct Queued
+    {
+        CommitNode node;
+        bool stale;
+    };
+    auto later = [](const Queued &x, const Queued &y)
+    {
+        if (x.node.generation != y.node.generation)
+            return x.node.generation < y.node.generation;
+        return x.node.time < y.node.time;
+    };
+    priority_queue<Queued, vector<Queued>, decltype(later)> queue(later);
+    unordered_map<ObjectId, int> flags;
+    size_t active = 0; // Queued entries that were pushed without STALE
+
+    auto push = [&](const ObjectId &id, int flag)
+    {
+        int &f = flags[id];
+        if ((f & flag) == flag)
+            return;
+        f |= flag;
+        Queued q{CommitNode(), (f & STALE) != 0};
+        if (!lookupCommitNode(id, q.node))
+            return;
+        if (!q.stale)
+            active++;
+        queue.push(move(q));
+    };
+
+    if (a == b)
+        return {a};
+    push(a, PARENT1);
+    push(b, PARENT2);
+    vector<ObjectId> result;
+    while (!queue.empty() && active > 0)
+    {
+        Queued q = queue.top();
+        queue.pop();
+        if (!q.stale)
+            active--;
+        int f = flags[q.node.id];
+        if ((f & (PARENT1 | PARENT2)) == (PARENT1 | PARENT2) && !(f & STALE))
+        {
+            result.push_back(q.node.id);
+            f |= STALE;
+            flags[q.node.id] = f;
+        }
+        for (const auto &parent : q.node.parents)
+            push(parent, f);
+    }
+    if (result.size() < 2)
+        return result;
+    vector<ObjectId> best;
+    for (const auto &candidate : result)
+    {
+        bool redundant = false;
+        for (const auto &other : result)
+            if (other != candidate && isAncestor(candidate, other))
+                redundant = true;
+        if (!redundant)
+            best.push_back(candidate);
+    }
+    return best;
+}
+
+// ============= IGNORE RULES =============
+
+// Matches text against a gitignore-style glob: '*' and '?' do not match '/', "**/" matches any
+// number of leading directories (including none), any other "**" matches everything, "[...]" is
+// a character class ('!' or '^' negates it) and a backslash escapes the next character
+bool globMatch(const char *p, const char *t)
+{
+    while (*p)
+    {
+        if (*p == '*')
+        {
+            if (p[1] == '*')
+            {
+                p += 2;
+                bool directories = *p == '/';
+                if (directories)
+                    p++;
+                for (const char *s = t;; s++)
+                {
+                    if ((!directories || s == t || s[-1] == '/') && globMatch(p, s))
+                        return true;
+                    if (!*s)
+                        return false;
+                }
+            }
+            p++;
+            for (const char *s = t;; s++)
+            {
+                if (globMatch(p, s))
+                    return true;
+                if (!*s || *s == '/')
+                    return false;
+            }
+        }
+        if (!*t)
+            return false;
+        unsigned char c = static_cast<unsigned char>(*t);
+        if (*p == '?')
+        {
+            if (c == '/')
+                return false;
+        }
+        else if (*p == '[')
+        {
+            p++;
+            bool negate = *p == '!' || *p == '^';
+            if (negate)
+                p++;
+            bool match = false;
+            for (bool first = true; *p && (first || *p != ']'); first = false)
+            {
+                unsigned char lo = static_cast<unsigned char>(*p);
+                if (p[1] == '-' && p[2] && p[2] != ']')
+                {
+                    match |= c >= lo && c <= static_cast<unsigned char>(p[2]);
+                    p += 3;
+                }
+                else
+                {
+                    match |= c == lo;
+                    p++;
+                }
+            }
+            if (!*p || match == negate || c == '/')
+                return false; // p is on the closing ']'
+        }
+        else
+        {
+            if (*p == '\\' && p[1])
+                p++;
+            if (*p != *t)
+                return false;
+        }
+        p++;
+        t++;
+    }
+    return !*t;
+}
+
+// One line of .mygitignore
+struct IgnorePattern
+{
+    string glob;
+    bool negated = false;       // "!pattern" re-includes what an earlier pattern excluded
+    bool directoryOnly = false; // "pattern/" only matches directories
+    bool anchored = false;      // A pattern with a '/' is matched against the whole path, others against the name
+};
+
+// Reads a file of gitignore-syntax patterns (also used for sparse checkout patterns)
+vector<IgnorePattern> readIgnorePatterns(const string &path)
+{
+    vector<IgnorePattern> patterns;
+    ifstream file(path);
+    string line;
+    while (getline(file, line))
+    {
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        // Trailing spaces are dropped unless escaped
+        while (!line.empty() && line.back() == ' ' && !(line.size() > 1 && line[line.size() - 2] == '\\'))
+            line.pop_back();
+        if (line.empty() || line[0] == '#')
+            continue;
+        IgnorePattern pattern;
+        if (line[0] == '!')
+        {
+            pattern.negated = true;
+            line.erase(0, 1);
+        }
+        if (!line.empty() && line.back() == '/')
+        {
+            pattern.directoryOnly = true;
+            line.pop_back();
+        }
+        pattern.anchored = line.find('/') != string::npos;
+        if (!line.empty() && line[0] == '/')
+            line.erase(0, 1);
+        if (line.empty())
+            continue;
+        pattern.glob = line;
+        patterns.push_back(pattern);
+    }
+    return patterns;
+}
+
+// The patterns of the .mygitignore file at the top of the working tree, with gitignore syntax:
+//   # comment        build/        *.o        !keep.o        /TODO        doc/**/*.pdf
+// The last matching pattern decides. Files inside an ignored directory are ignored as well, since
+// the directory is never entered; files already in the index are never treated as ignored.
+class IgnoreRules
+{
+public:
+    explicit IgnoreRules(const string &path) : patterns(readIgnorePatterns(path)) {}
+
+    bool empty() const { return patterns.empty(); }
+
+    // True if the path (in index form, relative to the top of the working tree) is ignored
+    bool isIgnored(const string &path, bool isDirectory) const
+    {
+        size_t slash = path.rfind('/');
+        const char *name = path.c_str() + (slash == string::npos ? 0 : slash + 1);
+        for (auto it = patterns.rbegin(); it != patterns.rend(); ++it)
+        {
+            if (it->directoryOnly && !isDirectory)
+                continue;
+            if (globMatch(it->glob.c_str(), it->anchored ? path.c_str() : name))
+                return !it->negated;
+        }
+        return false;
+    }
+
+private:
+    vector<IgnorePattern> patterns;
+};
+
+// The working tree's ignore rules, read once per process
+const IgnoreRules &ignoreRules()
+{
+    static const IgnoreRules rules(".mygitignore");
+    return rules;
+}
+
+// ============= SPARSE CHECKOUT =============
+
+// The patterns of .mygit/info/sparse-checkout (gitignore syntax) select the paths that checkout
+// materializes; everything else stays in the index marked skip-worktree, and add, status and diff
+// leave those entries alone. Without the file (or with no patterns) everything is checked out.
+// As in gitignore, the last matching pattern decides, and a pattern matching a directory covers
+// everything below it:   /src/app/      /docs/*.md      !/src/app/testdata/
+class SparseCheckout
+{
+public:
+    explicit SparseCheckout(const string &path) : patterns(readIgnorePatterns(path)) {}
+
+    bool enabled() const { return !patterns.empty(); }
+
+    // True if the file (in index form) belongs in the working tree
+    bool includes(const string &path) const
+    {
+        if (patterns.empty())
+            return true;
+        for (auto it = patterns.rbegin(); it != patterns.rend(); ++it)
+        {
+            if (matches(*it, path))
+                return !it->negated;
+        }
+        return false;
+    }
+
+    // True if anything below the directory (in index form) can belong in the working tree, so
+    // checkout has to descend into it. Unanchored patterns ("*.md") can match at any depth;
+    // anchored ones only below directories matching their leading components.
+    bool mayIncludeBelow(const string &dir) const
+    {
+        if (patterns.empty())
+            return true;
+        vector<string> components = splitPath(dir);
+        for (const auto &pattern : patterns)
+        {
+            if (pattern.negated)
+                continue;
+            if (!pattern.anchored)
+                return true;
+            vector<string> globs = splitPath(pattern.glob);
+            size_t i = 0;
+            while (i < components.size() && i < globs.size() && globs[i] != "**" && globMatch(globs[i].c_str(), components[i].c_str()))
+                i++;
+            if (i == components.size() || i == globs.size() || globs[i] == "**")
+                return true;
+        }
+        return false;
+    }
+
+private:
+    static vector<string> splitPath(const string &path)
+    {
+        vector<string> parts;
+        size_t start = 0;
+        for (size_t slash = path.find('/'); slash != string::npos; start = slash + 1, slash = path.find('/', start))
+            parts.push_back(path.substr(start, slash - start));
+        parts.push_back(path.substr(start));
+        return parts;
+    }
+
+    // True if the pattern matches the file itself or one of its directories
+    static bool matches(const IgnorePattern &pattern, const string &path)
+    {
+        size_t end = path.size();
+        while (end > 0)
+        {
+            string prefix = path.substr(0, end);
+            size_t slash = prefix.rfind('/');
+            const char *name = prefix.c_str() + (slash == string::npos ? 0 : slash + 1);
+            bool isDirectory = end != path.size();
+            if ((!pattern.directoryOnly || isDirectory) && globMatch(pattern.glob.c_str(), pattern.anchored ? prefix.c_str() : name))
+                return true;
+            end = slash == string::npos ? 0 : slash;
+        }
+        return false;
+    }
+
+    vector<IgnorePattern> patterns;
+};
+
+string getSparseCheckoutPath()
+{
+    return REPO_DIR + "\\info\\sparse-checkout";
+}
+
+// The repository's sparse checkout patterns, read once per process
+const SparseCheckout &sparseCheckout()
+{
+    static const SparseCheckout patterns(getSparseCheckoutPath());
+    return patterns;
+}
+
+// ============= INDEX OPERATIONS =============
+
+// Binary index layout (all integers big-endian):
+//   header: "MGIX" | version (u32) | entry count (u32)
+//   entry:  ctime (u64) | mtime (u64) | size (u64) | ino (u64) | mode (u32) | sha (20 raw bytes)
+//           | path length (u32) | path bytes
+// Entries are sorted by path. Optional extensions follow the entries, each as signature (4 bytes)
+// | length (u32) | data; readers skip signatures they do not know:
+//   "TREE" (cache tree): per directory, path length (u32) | path ("" = root) | entry count (u32)
+//          | tree sha (20 raw bytes)
+//   "FSMN" (file system monitor): token length (u32) | token | flags (u32, 1 = untracked list
+//          complete) | one bit per entry in index order, set if fsmonitorValid (MSB first)
+//          | untracked count (u32) | per path: length (u32) | path
+//   "SKIP" (sparse checkout): one bit per entry in index order, set if skipWorktree (MSB first)
+// Version 1 was the old "mode sha path" text format, which is still read.
+const char INDEX_SIGNATURE[] = "MGIX";
+const uint32_t INDEX_VERSION = 2;
+const size_t INDEX_HEADER_SIZE = 12;
+
+// Size of an index entry without its path
+size_t indexEntryFixedSize()
+{
+    return 8 * 4 + 4 + objectIdLength + 4;
+}
+
+// Structure representing an entry in the staging area (index file)
+struct IndexEntry
+{
+    string path;
+    ObjectId sha;
+    string mode;
+    FileStat stat; // Stat data of the file when it was hashed (all zero = unknown)
+    bool fsmonitorValid = false; // Clean as of the FSMonitorState token (see FILE SYSTEM MONITOR)
+    bool skipWorktree = false;   // Outside the sparse checkout: not in the working tree, never compared with it
+};
+
+// The cache tree: the tree SHA last built for each directory of the index ("" is the root, paths
+// use '/'), with the number of index entries below that directory. Changing, adding or removing
+// an entry drops the nodes of every directory on its path, so any surviving node still describes
+// its directory exactly and commit reuses its SHA instead of rebuilding the subtree.
+struct CacheTreeNode
+{
+    uint32_t entryCount;
+    ObjectId sha;
+};
+typedef map<string, CacheTreeNode> CacheTree;
+
+// Drops the cached trees of every directory containing the index path
+void invalidateCacheTree(CacheTree &cacheTree, const string &path)
+{
+    cacheTree.erase("");
+    for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1))
+        cacheTree.erase(path.substr(0, slash));
+}
+
+const char CACHE_TREE_SIGNATURE[] = "TREE";
+
+// What the file system monitor knew when the index was written: the daemon's token at that time
+// and the untracked paths then. Entries marked fsmonitorValid were clean at the token, so they
+// still are unless the daemon reports a change below their path since.
+struct FSMonitorState
+{
+    string token;                // Empty: no monitor was used
+    bool untrackedValid = false; // untracked lists every untracked path as of the token
+    vector<string> untracked;    // Sorted, as status lists them ("dir/" for untracked directories)
+};
+
+const char FSMONITOR_SIGNATURE[] = "FSMN";
+const char SKIP_WORKTREE_SIGNATURE[] = "SKIP";
+
+// Parses the legacy plaintext index ("mode sha path" per line)
+vector<IndexEntry> parseTextIndex(const char *data, size_t size)
+{
+    vector<IndexEntry> entries;
+    istringstream file(string(data, size));
+    string line;
+    while (getline(file, line))
+    {
+        istringstream iss(line);
+        IndexEntry entry;
+        string sha;
+        iss >> entry.mode >> sha;
+        getline(iss >> ws, entry.path);
+        if (!entry.path.empty() && ObjectId::fromHex(sha, entry.sha))
+            entries.push_back(entry);
+    }
+    return entries;
+}
+
+// Reads the index file through a memory mapping into a vector of IndexEntry structs.
+// The cache tree and file system monitor extensions, if present, are loaded into cacheTree and
+// fsmonitor when they are passed; skip-worktree bits are always read.
+vector<IndexEntry> readIndex(CacheTree *cacheTree = nullptr, FSMonitorState *fsmonitor = nullptr)
+{
+    vector<IndexEntry> entries;
+    string indexPath = REPO_DIR + "\\index";
+    if (!fileExists(indexPath))
+        return entries;
+
+    MappedFile map(indexPath);
+    if (!map.valid() || map.size() == 0)
+        return entries;
+    const char *data = map.data();
+    size_t size = map.size();
+
+    if (size < INDEX_HEADER_SIZE || memcmp(data, INDEX_SIGNATURE, 4) != 0)
+        return parseTextIndex(data, size);
+
+    uint32_t version = readU32(data + 4);
+    if (version != INDEX_VERSION)
+    {
+        cerr << "Error: Unsupported index version " << version << endl;
+        return entries;
+    }
+
+    uint32_t count = readU32(data + 8);
+    entries.reserve(count);
+    size_t pos = INDEX_HEADER_SIZE;
+    for (uint32_t i = 0; i < count; i++)
+    {
+        if (pos + indexEntryFixedSize() > size)
+            break;
+        IndexEntry entry;
+        entry.stat.ctime = readU64(data + pos);
+        entry.stat.mtime = readU64(data + pos + 8);
+        entry.stat.size = readU64(data + pos + 16);
+        entry.stat.ino = readU64(data + pos + 24);
+        pos += 32;
+
+        char modeBuf[16];
+        snprintf(modeBuf, sizeof(modeBuf), "%06o", readU32(data + pos));
+        entry.mode = modeBuf;
+        pos += 4;
+
+        entry.sha = ObjectId::fromRaw(data + pos);
+        pos += objectIdLength;
+
+        uint32_t pathLen = readU32(data + pos);
+        pos += 4;
+        if (pos + pathLen > size)
+            break;
+        entry.path.assign(data + pos, pathLen);
+        pos += pathLen;
+
+        entries.push_back(move(entry));
+    }
+    if (entries.size() != count)
+    {
+        cerr << "Error: Index file is truncated" << endl;
+        return entries;
+    }
+
+    // Extensions
+    while (pos + 8 <= size)
+    {
+        uint32_t len = readU32(data + pos + 4);
+        size_t dataPos = pos + 8;
+        if (dataPos + len > size)
+            break;
+        if (memcmp(data + pos, SKIP_WORKTREE_SIGNATURE, 4) == 0 && len >= (entries.size() + 7) / 8)
+        {
+            for (size_t i = 0; i < entries.size(); i++)
+                entries[i].skipWorktree = (static_cast<unsigned char>(data[dataPos + i / 8]) >> (7 - i % 8)) & 1;
+        }
+        if (fsmonitor && memcmp(data + pos, FSMONITOR_SIGNATURE, 4) == 0)
+        {
+            size_t p = dataPos, end = dataPos + len;
+            size_t bitmapSize = (entries.size() + 7) / 8;
+            uint32_t tokenLen = readU32(data + p);
+            if (p + 4 + tokenLen + 4 + bitmapSize + 4 <= end)
+            {
+                FSMonitorState state;
+                state.token.assign(data + p + 4, tokenLen);
+                p += 4 + tokenLen;
+                state.untrackedValid = (readU32(data + p) & 1) != 0;
+                p += 4;
+                for (size_t i = 0; i < entries.size(); i++)
+                    entries[i].fsmonitorValid = (static_cast<unsigned char>(data[p + i / 8]) >> (7 - i % 8)) & 1;
+                p += bitmapSize;
+                uint32_t untrackedCount = readU32(data + p);
+                p += 4;
+                for (uint32_t i = 0; i < untrackedCount && p + 4 <= end; i++)
+                {
+                    uint32_t pathLen = readU32(data + p);
+                    if (p + 4 + pathLen > end)
+                        break;
+                    state.untracked.emplace_back(data + p + 4, pathLen);
+                    p += 4 + pathLen;
+                }
+                if (state.untracked.size() != untrackedCount)
+                    state.untrackedValid = false;
+                *fsmonitor = move(state);
+            }
+        }
+        if (cacheTree && memcmp(data + pos, CACHE_TREE_SIGNATURE, 4) == 0)
+        {
+            size_t p = dataPos, end = dataPos + len;
+            while (p + 4 <= end)
+            {
+                uint32_t pathLen = readU32(data + p);
+                if (p + 4 + pathLen + 4 + objectIdLength > end)
+                    break;
+                string dir(data + p + 4, pathLen);
+                p += 4 + pathLen;
+                CacheTreeNode node{readU32(data + p), ObjectId::fromRaw(data + p + 4)};
+                p += 4 + objectIdLength;
+                (*cacheTree)[dir] = node;
+            }
+        }
+        pos = dataPos + len;
+    }
+    return entries;
+}
+
+// Serializes the entries (sorted by path), and the cache tree and file system monitor state if
+// given, into the binary index format
+string serializeIndex(const vector<IndexEntry> &entries, const CacheTree *cacheTree = nullptr, const FSMonitorState *fsmonitor = nullptr)
+{
+    vector<const IndexEntry *> sorted;
+    sorted.reserve(entries.size());
+    for (const auto &entry : entries)
+        sorted.push_back(&entry);
+    sort(sorted.begin(), sorted.end(),
+         [](const IndexEntry *a, const IndexEntry *b)
+         { return a->path < b->path; });
+
+    string out(INDEX_SIGNATURE, 4);
+    appendU32(out, INDEX_VERSION);
+    appendU32(out, static_cast<uint32_t>(sorted.size()));
+    for (const IndexEntry *entry : sorted)
+    {
+        appendU64(out, entry->stat.ctime);
+        appendU64(out, entry->stat.mtime);
+        appendU64(out, entry->stat.size);
+        appendU64(out, entry->stat.ino);
+        appendU32(out, static_cast<uint32_t>(stoul(entry->mode, nullptr, 8)));
+        out.append(entry->sha.raw(), objectIdLength);
+        appendU32(out, static_cast<uint32_t>(entry->path.size()));
+        out += entry->path;
+    }
+
+    if (cacheTree && !cacheTree->empty())
+    {
+        string ext;
+        for (const auto &node : *cacheTree)
+        {
+            appendU32(ext, static_cast<uint32_t>(node.first.size()));
+            ext += node.first;
+            appendU32(ext, node.second.entryCount);
+            ext.append(node.second.sha.raw(), objectIdLength);
+        }
+        out.append(CACHE_TREE_SIGNATURE, 4);
+        appendU32(out, static_cast<uint32_t>(ext.size()));
+        out += ext;
+    }
+
+    if (fsmonitor && !fsmonitor->token.empty())
+    {
+        string ext;
+        appendU32(ext, static_cast<uint32_t>(fsmonitor->token.size()));
+        ext += fsmonitor->token;
+        appendU32(ext, fsmonitor->untrackedValid ? 1 : 0);
+        string bitmap((sorted.size() + 7) / 8, '\0');
+        for (size_t i = 0; i < sorted.size(); i++)
+            if (sorted[i]->fsmonitorValid)
+                bitmap[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+        ext += bitmap;
+        appendU32(ext, static_cast<uint32_t>(fsmonitor->untracked.size()));
+        for (const auto &path : fsmonitor->untracked)
+        {
+            appendU32(ext, static_cast<uint32_t>(path.size()));
+            ext += path;
+        }
+        out.append(FSMONITOR_SIGNATURE, 4);
+        appendU32(out, static_cast<uint32_t>(ext.size()));
+        out += ext;
+    }
+
+    string skipBits((sorted.size() + 7) / 8, '\0');
+    bool anySkipped = false;
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        if (sorted[i]->skipWorktree)
+        {
+            skipBits[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+            anySkipped = true;
+        }
+    }
+    if (anySkipped)
+    {
+        out.append(SKIP_WORKTREE_SIGNATURE, 4);
+        appendU32(out, static_cast<uint32_t>(skipBits.size()));
+        out += skipBits;
+    }
+    return out;
+}
+
+// Returns the modification time of the index file itself (0 if it does not exist)
+uint64_t getIndexTimestamp()
+{
+    FileStat st;
+    return getFileStat(REPO_DIR + "\\index", st) ? st.mtime : 0;
+}
+
+// True if the file's current stat data matches the entry, meaning it need not be rehashed.
+// Files modified at or after the index was written are "racy" and always rehashed, since a
+// change within the same timestamp tick would otherwise go unnoticed.
+bool isStatUpToDate(const IndexEntry &entry, const FileStat &st, uint64_t indexTimestamp)
+{
+    if (entry.stat.mtime == 0 || entry.stat.mtime >= indexTimestamp)
+        return false;
+    return entry.stat.mtime == st.mtime && entry.stat.ctime == st.ctime &&
+           entry.stat.size == st.size && entry.stat.ino == st.ino;
+}
+
+// Clears the stat data of entries that were racy against the current index file before the
+// index is rewritten without rehashing them: the newer index timestamp would make them look
+// clean even if they changed right after being hashed
+void smudgeRacyEntries(vector<IndexEntry> &entries, uint64_t indexTimestamp)
+{
+    for (auto &entry : entries)
+    {
+        if (entry.stat.mtime >= indexTimestamp)
+            entry.stat = FileStat();
+    }
+}
+
+// Returns the path in the form stored in the index: '/' separators, no leading "./" or trailing '/'
+string normalizePath(const string &path)
+{
+    string result = path;
+    replace(result.begin(), result.end(), '\\', '/');
+    while (result.size() > 2 && result.compare(0, 2, "./") == 0)
+        result.erase(0, 2);
+    while (result.size() > 1 && result.back() == '/')
+        result.pop_back();
+    return result;
+}
+
+// In-memory index keyed (and therefore sorted) by path, so updates are O(log n) each
+typedef map<string, IndexEntry> IndexMap;
+
+// A file that has to be hashed before it can be staged
+struct FileToAdd
+{
+    string path;
+    string key; // Normalized index path
+    string mode;
+    FileStat stat;
+};
+
+// True if the index has the path itself or anything below it
+bool isTracked(const IndexMap &index, const string &key)
+{
+    if (index.count(key))
+        return true;
+    auto below = index.lower_bound(key + "/");
+    return below != index.end() && below->first.compare(0, key.size() + 1, key + "/") == 0;
+}
+
+// Collects path (or every file below it) unless the index entry is still up to date. Directory
+// contents matching .mygitignore are skipped unless they are already tracked.
+void collectFilesToAdd(const IndexMap &index, const string &path, uint64_t indexTimestamp, vector<FileToAdd> &files)
+{
+    if (isDirectory(path))
+    {
+        // Recursively add all files in a directory
+        for (const auto &entry : fs::directory_iterator(path))
+        {
+            string name = entry.path().filename().string();
+            if (name == "." || name == ".." || name == REPO_DIR)
+                continue;
+
+            string fullPath = (path == ".") ? name : path + "\\" + name;
+            string key = normalizePath(fullPath);
+            if (ignoreRules().isIgnored(key, entry.is_directory()) && !isTracked(index, key))
+                continue;
+            collectFilesToAdd(index, fullPath, indexTimestamp, files);
+        }
+        return;
+    }
+
+    FileToAdd file;
+    file.path = path;
+    file.key = normalizePath(path);
+    // Stat before hashing so a write that races with the hash is caught next time
+    getFileStat(path, file.stat);
+    file.mode = getPermissions(path);
+    auto existing = index.find(file.key);
+    if (existing != index.end() && existing->second.skipWorktree)
+    {
+        cerr << "Warning: " << file.key << " is outside the sparse checkout and was not staged" << endl;
+        return;
+    }
+    // Unchanged since it was last staged: skip rehashing
+    if (existing != index.end() && existing->second.mode == file.mode &&
+        isStatUpToDate(existing->second, file.stat, indexTimestamp))
+        return;
+    files.push_back(move(file));
+}
+
+// Collects what `add` has to look at below a tracked directory (key "" = the whole tree) when the
+// file system monitor state is complete: the entries it does not vouch for, and the untracked paths
+void collectChangedFilesToAdd(const IndexMap &index, const FSMonitorState &fsmonitor, const string &key, uint64_t indexTimestamp,
+                              vector<FileToAdd> &files)
+{
+    string prefix = key.empty() ? key : key + "/";
+    for (auto it = index.lower_bound(prefix); it != index.end() && it->first.compare(0, prefix.size(), prefix) == 0; ++it)
+    {
+        if (!it->second.fsmonitorValid && fileExists(it->first))
+            collectFilesToAdd(index, it->first, indexTimestamp, files);
+    }
+    for (const auto &path : fsmonitor.untracked)
+    {
+        if (path.compare(0, prefix.size(), prefix) == 0)
+            collectFilesToAdd(index, path.back() == '/' ? path.substr(0, path.size() - 1) : path, indexTimestamp, files);
+    }
+}
+
+// Adds (or replaces) the index entry of a hashed file
+void stageFile(IndexMap &index, CacheTree &cacheTree, const FileToAdd &file, const ObjectId &sha)
+{
+    IndexEntry &entry = index[file.key];
+    if (entry.path.empty() || entry.sha != sha || entry.mode != file.mode)
+        invalidateCacheTree(cacheTree, file.key);
+    entry.path = file.key;
+    entry.sha = sha;
+    entry.mode = file.mode;
+    entry.stat = file.stat;
+    entry.fsmonitorValid = true; // Stat'ed after the file system monitor was asked (see cmdAdd)
+}
+
+// Hashes, stores and stages the collected files, all of them in one pass through the object
+// pipeline (see storeBlobs). Returns true if the index changed.
+bool addFilesToIndex(IndexMap &index, CacheTree &cacheTree, const vector<FileToAdd> &files)
+{
+    vector<string> paths;
+    paths.reserve(files.size());
+    for (const auto &file : files)
+        paths.push_back(file.path);
+    vector<ObjectId> ids = storeBlobs(paths, ThreadPool::defaultJobs());
+
+    bool changed = false;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        if (ids[i].isNull())
+            continue;
+        stageFile(index, cacheTree, files[i], ids[i]);
+        changed = true;
+    }
+    return changed;
+}
+
+// Counters for the cache tree, printed with --stats
+struct CacheTreeStats
+{
+    uint64_t built = 0;
+    uint64_t reused = 0;
+};
+CacheTreeStats cacheTreeStats;
+
+// Builds the tree of directory dir ("" = root) from entries[begin, end), which are exactly the
+// index entries below it. A subtree whose cache tree node is intact, and whose tree object is
+// still stored, is reused without being read; a node is only recorded once its tree is written.
+// Entry names are views into the index paths; the per-directory entry lists come from arena,
+// which lives for the whole build, so no directory allocates on its own.
+ObjectId buildIndexTree(const vector<IndexEntry> &entries, size_t begin, size_t end, const string &dir, CacheTree &cacheTree,
+                        pmr::memory_resource *arena)
+{
+    uint32_t count = static_cast<uint32_t>(end - begin);
+    auto cached = cacheTree.find(dir);
+    if (cached != cacheTree.end() && cached->second.entryCount == count && objectExists(cached->second.sha))
+    {
+        cacheTreeStats.reused++;
+        return cached->second.sha;
+    }
+
+    size_t prefixLen = dir.empty() ? 0 : dir.size() + 1;
+    pmr::vector<TreeBuildEntry> children(arena);
+    // Sorting the index by full path already puts every directory's entries in git's tree order
+    for (size_t i = begin; i < end;)
+    {
+        string_view path = entries[i].path;
+        size_t slash = path.find('/', prefixLen);
+        if (slash == string::npos)
+        {
+            children.push_back(TreeBuildEntry{entries[i].mode, path.substr(prefixLen), entries[i].sha, false});
+            i++;
+            continue;
+        }
+        // All entries of a subdirectory are adjacent in the sorted index
+        size_t j = i + 1;
+        while (j < end && entries[j].path.compare(0, slash + 1, path.data(), slash + 1) == 0)
+            j++;
+        string subdir(path.substr(0, slash));
+        ObjectId subtree = buildIndexTree(entries, i, j, subdir, cacheTree, arena);
+        if (subtree.isNull())
+            return subtree;
+        children.push_back(TreeBuildEntry{"040000", path.substr(prefixLen, slash - prefixLen), subtree, true});
+        i = j;
+    }
+    ObjectId sha = writeTreeObject(serializeTreeObject(children.data(), children.size()));
+    if (sha.isNull())
+        return sha;
+    cacheTree[dir] = CacheTreeNode{count, sha};
+    cacheTreeStats.built++;
+    return sha;
+}
+
+// Creates the nested Tree objects for the staged files (used by 'commit') and returns the root
+// tree, or the null ID if nothing is staged or a tree cannot be written. Only directories missing from the cache tree are
+// hashed; the cache tree is updated with the trees that were built.
+ObjectId createTreeFromIndex(vector<IndexEntry> &entries, CacheTree &cacheTree)
+{
+    if (entries.empty())
+        return ObjectId();
+    auto byPath = [](const IndexEntry &a, const IndexEntry &b)
+    { return a.path < b.path; };
+    if (!is_sorted(entries.begin(), entries.end(), byPath))
+        sort(entries.begin(), entries.end(), byPath); // Only legacy text indexes can be unsorted
+    pmr::monotonic_buffer_resource arena(64 * 1024);
+    return buildIndexTree(entries, 0, entries.size(), "", cacheTree, &arena);
+}
+
+// Lists a tree's files as index entries, recording every directory in the cache tree (used
+// after checkout, when the index is replaced by the checked out tree). Stat data is carried over
+// from the previous index for unchanged files and read from the working tree for the others.
+// Returns the number of files below treeSha.
+size_t indexFromTree(const ObjectId &treeSha, const string &dir, const IndexMap &previous, vector<IndexEntry> &entries, CacheTree &cacheTree)
+{
+    size_t count = 0;
+    auto tree = loadTree(treeSha);
+    for (TreeEntryView e : *tree)
+    {
+        string path = dir.empty() ? string(e.name) : dir + "/" + string(e.name);
+        if (e.isTree)
+        {
+            count += indexFromTree(e.sha, path, previous, entries, cacheTree);
+            continue;
+        }
+        IndexEntry entry{path, e.sha, string(e.mode), FileStat()};
+        auto old = previous.find(path);
+        if (old != previous.end() && old->second.sha == e.sha && old->second.mode == entry.mode)
+            entry.stat = old->second.stat;
+        else
+            getFileStat(path, entry.stat);
+        entries.push_back(move(entry));
+        count++;
+    }
+    cacheTree[dir] = CacheTreeNode{static_cast<uint32_t>(count), treeSha};
+    return count;
+}
+
+// Reads the index into an IndexMap, normalizing paths written by older versions
+IndexMap loadIndexMap(CacheTree *cacheTree = nullptr)
+{
+    IndexMap index;
+    for (auto &entry : readIndex(cacheTree))
+    {
+        string key = normalizePath(entry.path);
+        entry.path = key;
+        index[key] = move(entry);
+    }
+    return index;
+}
+
+// Drops the index entries at or below path (in index form) whose files no longer exist, adding
+// their paths to removedKeys if given; returns true if any were removed. With skipVerified,
+// entries the file system monitor vouches for are kept without looking.
+bool removeMissingFromIndex(IndexMap &index, CacheTree &cacheTree, const string &key, bool skipVerified = false,
+                            vector<string> *removedKeys = nullptr)
+{
+    bool removed = false;
+    auto exists = [skipVerified](IndexMap::iterator it)
+    { return it->second.skipWorktree || (skipVerified && it->second.fsmonitorValid) || fileExists(it->first); };
+    auto drop = [&](IndexMap::iterator it)
+    {
+        invalidateCacheTree(cacheTree, it->first);
+        if (removedKeys)
+            removedKeys->push_back(it->first);
+        removed = true;
+        return index.erase(it);
+    };
+    if (key == ".")
+    {
+        for (auto it = index.begin(); it != index.end();)
+            it = exists(it) ? next(it) : drop(it);
+        return removed;
+    }
+    auto exact = index.find(key);
+    if (exact != index.end() && !exists(exact))
+        drop(exact);
+    // Entries below a directory sort together, but not directly after the directory's own name
+    string dirPrefix = key + "/";
+    for (auto it = index.lower_bound(dirPrefix); it != index.end() && it->first.compare(0, dirPrefix.size(), dirPrefix) == 0;)
+        it = exists(it) ? next(it) : drop(it);
+    return removed;
+}
+
+// ============= REFERENCE OPERATIONS =============
+
+// Retrieves the SHA of the commit currently pointed to by HEAD (e.g., the commit at refs/heads/master).
+// Returns the null ID if there is no commit yet.
+ObjectId getHEAD()
+{
+    string headPath = REPO_DIR + "\\HEAD";
+    if (!fileExists(headPath))
+        return ObjectId();
+
+    string content = readFile(headPath);
+    if (content.substr(0, 5) == "ref: ")
+    {
+        string refPath = REPO_DIR + "\\" + content.substr(5);
+        if (refPath.back() == '\n')
+            refPath.pop_back();
+        if (fileExists(refPath))
+        {
+            string sha = readFile(refPath);
+            if (!sha.empty() && sha.back() == '\n')
+                sha.pop_back();
+            ObjectId id;
+            ObjectId::fromHex(sha, id);
+            return id;
+        }
+    }
+    return ObjectId();
+}
+
+// Returns the commits HEAD, every branch under refs/heads and every remote-tracking branch under
+// refs/remotes (see fetch) point to, without duplicates
+vector<ObjectId> listRefTips()
+{
+    vector<ObjectId> tips;
+    ObjectId head = getHEAD();
+    if (!head.isNull())
+        tips.push_back(head);
+    for (const char *dir : {"\\refs\\heads", "\\refs\\remotes"})
+    {
+        string refsDir = REPO_DIR + dir;
+        error_code ec;
+        if (!isDirectory(refsDir))
+            continue;
+        for (const auto &entry : fs::recursive_directory_iterator(refsDir, ec))
+        {
+            if (!entry.is_regular_file())
+                continue;
+            ObjectId id;
+            string content = readFile(entry.path().string());
+            if (ObjectId::fromHex(content.substr(0, 2 * objectIdLength), id))
+                tips.push_back(id);
+        }
+    }
+    sort(tips.begin(), tips.end());
+    tips.erase(unique(tips.begin(), tips.end()), tips.end());
+    return tips;
+}
+
+// Returns the name of the branch HEAD points to (e.g. "master"), or "" if HEAD is not a branch.
+// init writes the ref with Windows separators, so both kinds are accepted.
+string currentBranch()
+{
+    string content = readFile(REPO_DIR + "\\HEAD");
+    replace(content.begin(), content.end(), '\\', '/');
+    const string prefix = "ref: refs/heads/";
+    if (content.compare(0, prefix.size(), prefix) != 0)
+        return "";
+    content.erase(0, prefix.size());
+    while (!content.empty() && (content.back() == '\n' || content.back() == '\r'))
+        content.pop_back();
+    return content;
+}
+
+// Updates the reference pointed to by HEAD (e.g., writes new commit SHA to refs/heads/master);
+// returns false if HEAD cannot be read or the ref cannot be written
+bool updateHEAD(const ObjectId &commitSha)
+{
+    string headPath = REPO_DIR + "\\HEAD";
+    string content = readFile(headPath);
+    if (content.empty())
+        return false;
+
+    if (content.substr(0, 5) == "ref: ")
+    {
+        string refPath = content.substr(5);
+        if (refPath.back() == '\n')
+            refPath.pop_back();
+        return writeFile(REPO_DIR + "\\" + refPath, commitSha.hex() + "\n");
+    }
+    return true;
+}
+
+// Appends commit details to the log file (.mygit/logs/HEAD)
+void updateLog(const ObjectId &commitSha, const ObjectId &parentSha, const string &message)
+{
+    string logPath = REPO_DIR + "\\logs\\HEAD";
+    ofstream file(logPath, ios::app);
+    time_t now = time(nullptr);
+    file << "commit " << commitSha << "\n";
+    if (!parentSha.isNull())
+    {
+        file << "parent " << parentSha << "\n";
+    }
+    file << "message " << message << "\n";
+    file << "timestamp " << now << "\n";
+    file << "---\n";
+}
+
+// Writes a buffer to a file with as few system calls as possible (no iostream buffering)
+bool writeFileDirect(const string &path, const char *data, size_t len)
+{
+#ifdef _WIN32
+    HANDLE h = CreateFileA(path.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    if (h == INVALID_HANDLE_VALUE)
+        return false;
+    bool ok = true;
+    while (ok && len > 0)
+    {
+        DWORD chunk = static_cast<DWORD>(min<size_t>(len, 64u << 20));
+        DWORD written = 0;
+        ok = WriteFile(h, data, chunk, &written, NULL) && written == chunk;
+        data += chunk;
+        len -= chunk;
+    }
+    CloseHandle(h);
+    return ok;
+#else
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0)
+        return false;
+    bool ok = true;
+    while (ok && len > 0)
+    {
+        ssize_t n = ::write(fd, data, min<size_t>(len, 1u << 30));
+        ok = n > 0;
+        if (ok)
+        {
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+    }
+    return close(fd) == 0 && ok;
+#endif
+}
+
+// Writes the content of a Blob object to a working-tree file whose parent directory exists.
+// Chunked blobs are written chunk by chunk. Returns the number of bytes written, or -1 on error.
+long long restoreFile(const ObjectId &blobSha, const string &fullPath)
+{
+    string blobData;
+    ChunkManifest manifest;
+    bool chunked;
+    if (!readObjectOrManifest(blobSha, blobData, manifest, chunked))
+        return -1;
+    if (chunked)
+    {
+        ofstream file(fullPath, ios::binary | ios::trunc);
+        bool ok = file && streamChunkedObject(manifest, [&file](const char *p, size_t n)
+                                              { return static_cast<bool>(file.write(p, n)); });
+        file.close();
+        if (!ok || !file)
+        {
+            cerr << "Error restoring file " << fullPath << endl;
+            return -1;
+        }
+        return static_cast<long long>(manifest.size);
+    }
+
+    // Write to file straight from the object buffer
+    size_t nullPos = blobData.find('\0');
+    if (nullPos == string::npos)
+        return -1;
+
+    size_t len = blobData.size() - nullPos - 1;
+    if (!writeFileDirect(fullPath, blobData.data() + nullPos + 1, len))
+    {
+        cerr << "Error restoring file " << fullPath << endl;
+        return -1;
+    }
+    return static_cast<long long>(len);
+}
+
+// Producer/consumer file writer used by checkout. The tree walk (the producer) creates
+// directories itself, in order, and queues one job per file; worker threads inflate the blobs
+// and write the files. The queue is bounded so the walk never runs far ahead of the writers.
+class CheckoutWriter
+{
+public:
+    explicit CheckoutWriter(unsigned workers) : jobs(workers * 64), start(chrono::steady_clock::now())
+    {
+        for (unsigned i = 0; i < max(1u, workers); i++)
+            threads.emplace_back([this]
+                                 { work(); });
+    }
+    ~CheckoutWriter() { finish(); }
+
+    // Creates a directory (and its parents) once; later requests for the same path are free
+    void ensureDirectory(const string &dir)
+    {
+        if (dir.empty() || dir == "." || !createdDirs.insert(dir).second)
+            return;
+        error_code ec;
+        fs::create_directories(dir, ec);
+        if (ec)
+        {
+            cerr << "Error creating directory " << dir << ": " << ec.message() << endl;
+            failures++;
+        }
+    }
+
+    // Queues a file; its parent directory is created before the job becomes visible to workers
+    void enqueue(const ObjectId &blobSha, const string &fullPath)
+    {
+        ensureDirectory(fs::path(fullPath).parent_path().string());
+        jobs.push(Job{blobSha, fullPath});
+    }
+
+    // Waits for all queued files to be written
+    void finish()
+    {
+        if (threads.empty())
+            return;
+        jobs.close();
+        for (auto &t : threads)
+            t.join();
+        threads.clear();
+    }
+
+    // Files and directories that could not be written (complete once finish() has returned)
+    uint64_t failed() const { return failures; }
+
+    // Throughput summary, printed with --stats
+    void report() const
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        double mb = bytes / (1024.0 * 1024.0);
+        if (seconds <= 0)
+            seconds = 1e-9;
+        cerr << "checkout: " << files << " files, " << fixed << setprecision(2) << mb << " MB in "
+             << seconds << " s (" << mb / seconds << " MB/s, " << files / seconds << " files/s)" << endl;
+    }
+
+private:
+    struct Job
+    {
+        ObjectId sha;
+        string path;
+    };
+
+    void work()
+    {
+        Job job;
+        while (jobs.pop(job))
+        {
+            long long n = restoreFile(job.sha, job.path);
+            if (n >= 0)
+            {
+                bytes += static_cast<uint64_t>(n);
+                files++;
+            }
+            else
+                failures++;
+        }
+    }
+
+    BoundedQueue<Job> jobs;
+    vector<thread> threads;
+    unordered_set<string> createdDirs; // Touched by the producer thread only
+    atomic<uint64_t> bytes{0};
+    atomic<uint64_t> files{0};
+    atomic<uint64_t> failures{0};
+    chrono::steady_clock::time_point start;
+};
+
+// Recursively restores the working directory based on the contents of a Tree object.
+// Directories are created during the walk; files are handed to the writer's workers. With a
+// sparse checkout, subtrees outside the patterns are not even read, and excluded files are
+// neither inflated nor written (key is the index-form path of prefix). Returns false if a tree
+// is missing.
+bool restoreTree(const ObjectId &treeSha, CheckoutWriter &writer, const string &prefix = "", const string &key = "")
+{
+    TraceScope trace(TRACE_RESTORE_TREE);
+    auto tree = loadTree(treeSha);
+    if (tree->empty() && !objectExists(treeSha))
+        return false;
+    const SparseCheckout &sparse = sparseCheckout();
+
+    for (TreeEntryView entry : *tree)
+    {
+        if (entry.name.empty())
+        {
+            continue;
+        }
+
+        string fullPath = prefix.empty() ? string(entry.name) : prefix + "\\" + string(entry.name);
+        string childKey = key.empty() ? string(entry.name) : key + "/" + string(entry.name);
+
+        if (entry.isTree)
+        {
+            if (!sparse.mayIncludeBelow(childKey))
+                continue;
+            // Create directory and recurse into it (sparse checkouts only create the directories
+            // of files they write)
+            if (!sparse.enabled())
+                writer.ensureDirectory(fullPath);
+            if (!restoreTree(entry.sha, writer, fullPath, childKey))
+                return false;
+        }
+        else if (sparse.includes(childKey))
+        {
+            writer.enqueue(entry.sha, fullPath);
+        }
+    }
+    return true;
+}
+
+// Removes directories left empty after deleting path, walking up towards the working directory root
+void removeEmptyParents(const string &path)
+{
+    error_code ec;
+    for (fs::path dir = fs::path(path).parent_path(); !dir.empty() && dir != "."; dir = dir.parent_path())
+    {
+        if (!fs::is_empty(dir, ec) || ec || !fs::remove(dir, ec))
+            break;
+    }
+}
+
+// Updates the working directory from one tree to another, touching only the paths that changed.
+// Refuses (returns false, with nothing touched) if a new file's path is a directory holding
+// anything the checkout does not delete itself, i.e. untracked files.
+bool applyTreeChanges(const vector<TreeChange> &changes, CheckoutWriter &writer)
+{
+    error_code ec;
+    unordered_set<string> deleted;
+    for (const auto &change : changes)
+        if (change.status == 'D')
+            deleted.insert(change.path);
+    for (const auto &change : changes)
+    {
+        if (change.status == 'D' || !sparseCheckout().includes(normalizePath(change.path)) ||
+            !fs::is_directory(change.path, ec))
+            continue;
+        for (const auto &entry : fs::recursive_directory_iterator(change.path, ec))
+        {
+            if (!entry.is_directory(ec) && !deleted.count(entry.path().string()))
+            {
+                cerr << "Error: The untracked file " << entry.path().string()
+                     << " would be overwritten by checkout of " << change.path << endl;
+                return false;
+            }
+        }
+    }
+
+    // Deletions first, so a file replaced by a directory (or vice versa) is out of the way
+    for (const auto &change : changes)
+    {
+        if (change.status != 'D')
+            continue;
+        if (fs::remove(change.path, ec))
+            removeEmptyParents(change.path);
+        else if (ec)
+            cerr << "Warning: Could not remove " << change.path << " during checkout: " << ec.message() << endl;
+    }
+    for (const auto &change : changes)
+    {
+        if (change.status == 'D' || !sparseCheckout().includes(normalizePath(change.path)))
+            continue;
+        // Only empty directories can be left where the new file goes (checked above)
+        if (fs::is_directory(change.path, ec))
+            fs::remove_all(change.path, ec);
+        writer.enqueue(change.newEntry.sha, change.path);
+    }
+    return true;
+}
+
+// ============= FILE SYSTEM MONITOR =============
+
+// `mygit fsmonitor start` runs a daemon that watches the working tree (inotify on Linux,
+// ReadDirectoryChangesW on Windows) and journals every path that changes. With core.fsmonitor =
+// true, status and add ask it what changed since the token stored in the index and look only at
+// those paths instead of listing and stat'ing the whole tree. One request per connection, over
+// the socket .mygit\fsmonitor.sock (a named pipe on Windows):
+//   "query <token>\n" -> "<new token>\0", then every changed path (index form) followed by "\0";
+//                        the single path "/" means anything may have changed (unknown or expired
+//                        token, or events were lost), so the caller has to scan everything
+//   "status\n"        -> one line describing the daemon
+//   "stop\n"          -> "ok\n", and the daemon exits
+// Tokens are "<daemon instance>:<sequence number>", so a restarted daemon never trusts old ones.
+// Before answering a query the daemon creates a cookie file in .mygit and waits for its event,
+// so every change made before the request is in the journal.
+const size_t FSMONITOR_JOURNAL_LIMIT = 100000;  // Paths kept; older tokens get "/"
+const int FSMONITOR_COOKIE_TIMEOUT_MS = 1000;   // Wait for the cookie event before answering "/"
+const int FSMONITOR_CLIENT_TIMEOUT_MS = 5000;   // Wait for the daemon's answer
+const int FSMONITOR_START_TIMEOUT_MS = 5000;    // Wait for a new daemon to answer
+const char FSMONITOR_COOKIE_PREFIX[] = "fsmonitor-cookie-";
+
+// True if commands should ask the daemon (core.fsmonitor = true)
+bool fsmonitorEnabled()
+{
+    static const bool enabled = getConfig("core.fsmonitor", "false") == "true";
+    return enabled;
+}
+
+// The daemon's record of changed paths. Entry i has sequence number firstSeq + i + 1, and a token
+// with sequence number s has seen every entry up to s.
+class FSMonitorJournal
+{
+public:
+    FSMonitorJournal()
+    {
+        random_device rd;
+        ostringstream id;
+        id << hex << rd() << rd();
+        instance = id.str();
+    }
+
+    void record(const string &path)
+    {
+        // A file being written reports many events; one entry is enough unless a token was
+        // handed out in between
+        if (lastSeq > issuedSeq && !paths.empty() && paths.back() == path)
+            return;
+        paths.push_back(path);
+        lastSeq++;
+        if (paths.size() > FSMONITOR_JOURNAL_LIMIT)
+        {
+            paths.pop_front();
+            firstSeq++;
+        }
+    }
+
+    // Forgets everything after events were lost: every token handed out so far becomes too old
+    void reset()
+    {
+        paths.clear();
+        firstSeq = ++lastSeq;
+    }
+
+    string token()
+    {
+        issuedSeq = lastSeq;
+        return instance + ":" + to_string(lastSeq);
+    }
+
+    // Collects the distinct paths changed after the token; false if the token cannot be answered
+    bool changedSince(const string &since, vector<string> &changed) const
+    {
+        size_t colon = since.find(':');
+        if (colon == string::npos || since.compare(0, colon, instance) != 0)
+            return false;
+        uint64_t seq = strtoull(since.c_str() + colon + 1, nullptr, 10);
+        if (seq < firstSeq || seq > lastSeq)
+            return false;
+        unordered_set<string> seen;
+        for (size_t i = static_cast<size_t>(seq - firstSeq); i < paths.size(); i++)
+        {
+            if (seen.insert(paths[i]).second)
+                changed.push_back(paths[i]);
+        }
+        return true;
+    }
+
+    size_t size() const { return paths.size(); }
+
+private:
+    string instance;
+    deque<string> paths;
+    uint64_t firstSeq = 0, lastSeq = 0, issuedSeq = 0;
+};
+
+// Answers one request. synced is false if the daemon cannot vouch that its journal is complete
+// (the cookie did not come back in time, or part of the tree is not watched).
+string fsmonitorReply(FSMonitorJournal &journal, const string &request, bool synced, const string &watching, bool &stop)
+{
+    if (request == "stop")
+    {
+        stop = true;
+        return "ok\n";
+    }
+    if (request == "status")
+        return "fsmonitor daemon " + watching + ", " + to_string(journal.size()) + " journaled paths, token " + journal.token() + "\n";
+    if (request.compare(0, 6, "query ") != 0)
+        return "error: unknown request\n";
+    vector<string> changed;
+    if (!synced || !journal.changedSince(request.substr(6), changed))
+        changed.assign(1, "/");
+    string reply = journal.token();
+    reply += '\0';
+    for (const auto &path : changed)
+    {
+        reply += path;
+        reply += '\0';
+    }
+    return reply;
+}
+
+#ifdef _WIN32
+// Name of the daemon's pipe; one per working tree
+string fsmonitorPipeName()
+{
+    string root = fs::absolute(".").string();
+    transform(root.begin(), root.end(), root.begin(), [](unsigned char c)
+              { return static_cast<char>(tolower(c)); });
+    ostringstream name;
+    name << "\\\\.\\pipe\\mygit-fsmonitor-" << hex << hash<string>()(root);
+    return name.str();
+}
+
+// Reads from a pipe opened for overlapped I/O, giving up after timeoutMs; returns the bytes read
+DWORD readPipe(HANDLE pipe, OVERLAPPED &ov, char *buffer, DWORD size, DWORD timeoutMs)
+{
+    DWORD n = 0;
+    ResetEvent(ov.hEvent);
+    if (ReadFile(pipe, buffer, size, &n, &ov))
+        return n;
+    if (GetLastError() != ERROR_IO_PENDING)
+        return 0;
+    if (WaitForSingleObject(ov.hEvent, timeoutMs) != WAIT_OBJECT_0)
+    {
+        CancelIo(pipe);
+        GetOverlappedResult(pipe, &ov, &n, TRUE);
+        return 0;
+    }
+    return GetOverlappedResult(pipe, &ov, &n, FALSE) ? n : 0;
+}
+
+// Writes all of data to a pipe opened for overlapped I/O
+bool writePipe(HANDLE pipe, OVERLAPPED &ov, const string &data)
+{
+    DWORD n = 0;
+    ResetEvent(ov.hEvent);
+    if (!WriteFile(pipe, data.data(), static_cast<DWORD>(data.size()), &n, &ov) && GetLastError() != ERROR_IO_PENDING)
+        return false;
+    return GetOverlappedResult(pipe, &ov, &n, TRUE) && n == data.size();
+}
+
+// Runs the daemon in the foreground until it is stopped. One ReadDirectoryChangesW call watches
+// the whole tree; the named pipe serves one client at a time between batches of changes.
+int runFSMonitorDaemon()
+{
+    HANDLE dir = CreateFileA(".", FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+                             OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+    if (dir == INVALID_HANDLE_VALUE)
+    {
+        cerr << "Error: Cannot watch the working tree (error " << GetLastError() << ")" << endl;
+        return 1;
+    }
+    const DWORD filter = FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_DIR_NAME | FILE_NOTIFY_CHANGE_ATTRIBUTES |
+                         FILE_NOTIFY_CHANGE_SIZE | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_CREATION;
+    vector<DWORD> buffer(16 * 1024); // 64 KiB, DWORD-aligned as ReadDirectoryChangesW requires
+    OVERLAPPED dirOv{};
+    dirOv.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    auto watch = [&]()
+    {
+        ResetEvent(dirOv.hEvent);
+        return ReadDirectoryChangesW(dir, buffer.data(), static_cast<DWORD>(buffer.size() * sizeof(DWORD)), TRUE,
+                                     filter, NULL, &dirOv, NULL) != 0;
+    };
+    if (!watch())
+    {
+        cerr << "Error: Cannot watch the working tree (error " << GetLastError() << ")" << endl;
+        CloseHandle(dir);
+        return 1;
+    }
+
+    FSMonitorJournal journal;
+    // Journals a completed batch of changes and starts the next one; true if the cookie appeared
+    auto drain = [&](const string &cookie)
+    {
+        bool seen = false;
+        DWORD bytes = 0;
+        if (!GetOverlappedResult(dir, &dirOv, &bytes, FALSE) || bytes == 0)
+            journal.reset(); // The buffer overflowed: changes were lost
+        const char *p = reinterpret_cast<const char *>(buffer.data());
+        while (bytes > 0)
+        {
+            auto info = reinterpret_cast<const FILE_NOTIFY_INFORMATION *>(p);
+            int wideLen = static_cast<int>(info->FileNameLength / sizeof(WCHAR));
+            int len = WideCharToMultiByte(CP_UTF8, 0, info->FileName, wideLen, NULL, 0, NULL, NULL);
+            string key(len, '\0');
+            WideCharToMultiByte(CP_UTF8, 0, info->FileName, wideLen, &key[0], len, NULL, NULL);
+            replace(key.begin(), key.end(), '\\', '/');
+            if (key.compare(0, REPO_DIR.size() + 1, REPO_DIR + "/") == 0)
+                seen |= !cookie.empty() && key.compare(REPO_DIR.size() + 1, string::npos, cookie) == 0;
+            else if (key != REPO_DIR)
+                journal.record(key);
+            if (info->NextEntryOffset == 0)
+                break;
+            p += info->NextEntryOffset;
+        }
+        watch();
+        return seen;
+    };
+
+    string pipeName = fsmonitorPipeName();
+    OVERLAPPED pipeOv{};
+    pipeOv.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+    unsigned cookieCount = 0;
+    int exitCode = 0;
+    for (bool stop = false; !stop;)
+    {
+        HANDLE pipe = CreateNamedPipeA(pipeName.c_str(), PIPE_ACCESS_DUPLEX | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, 64 * 1024, 64 * 1024, 0, NULL);
+        if (pipe == INVALID_HANDLE_VALUE)
+        {
+            cerr << "Error: Cannot create " << pipeName << " (error " << GetLastError() << ")" << endl;
+            exitCode = 1;
+            break;
+        }
+        ResetEvent(pipeOv.hEvent);
+        bool connected = ConnectNamedPipe(pipe, &pipeOv) != 0;
+        DWORD error = connected ? 0 : GetLastError();
+        connected |= error == ERROR_PIPE_CONNECTED;
+        while (!connected && error == ERROR_IO_PENDING)
+        {
+            HANDLE events[2] = {dirOv.hEvent, pipeOv.hEvent};
+            DWORD which = WaitForMultipleObjects(2, events, FALSE, INFINITE);
+            if (which == WAIT_OBJECT_0)
+                drain("");
+            else if (which == WAIT_OBJECT_0 + 1)
+            {
+                DWORD ignored;
+                connected = GetOverlappedResult(pipe, &pipeOv, &ignored, FALSE) != 0;
+                error = 0;
+            }
+            else
+                error = GetLastError();
+        }
+        if (!connected)
+        {
+            CloseHandle(pipe);
+            continue;
+        }
+
+        string request;
+        char chunk[4096];
+        while (request.find('\n') == string::npos && request.size() < 64 * 1024)
+        {
+            DWORD n = readPipe(pipe, pipeOv, chunk, sizeof(chunk), FSMONITOR_COOKIE_TIMEOUT_MS);
+            if (n == 0)
+                break;
+            request.append(chunk, n);
+        }
+        request = request.substr(0, request.find('\n'));
+
+        bool synced = true;
+        if (request.compare(0, 6, "query ") == 0)
+        {
+            string cookie = FSMONITOR_COOKIE_PREFIX + to_string(GetCurrentProcessId()) + "-" + to_string(++cookieCount);
+            string cookiePath = REPO_DIR + "\\" + cookie;
+            HANDLE file = CreateFileA(cookiePath.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+            synced = false;
+            if (file != INVALID_HANDLE_VALUE)
+            {
+                CloseHandle(file);
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(FSMONITOR_COOKIE_TIMEOUT_MS);
+                while (!synced)
+                {
+                    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                    if (left <= 0 || WaitForSingleObject(dirOv.hEvent, static_cast<DWORD>(left)) != WAIT_OBJECT_0)
+                        break;
+                    synced = drain(cookie);
+                }
+                DeleteFileA(cookiePath.c_str());
+            }
+        }
+        writePipe(pipe, pipeOv, fsmonitorReply(journal, request, synced, "watching the working tree", stop));
+        FlushFileBuffers(pipe);
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+    CancelIo(dir);
+    CloseHandle(dir);
+    CloseHandle(dirOv.hEvent);
+    CloseHandle(pipeOv.hEvent);
+    return exitCode;
+}
+#elif defined(__linux__)
+// The directories watched by the daemon, one inotify watch each
+class InotifyWatcher
+{
+public:
+    explicit InotifyWatcher(FSMonitorJournal &j) : journal(j)
+    {
+        fd = inotify_init1(IN_NONBLOCK);
+        if (fd >= 0)
+            repoWd = inotify_add_watch(fd, REPO_DIR.c_str(), IN_CREATE | IN_ONLYDIR);
+    }
+    ~InotifyWatcher()
+    {
+        if (fd >= 0)
+            close(fd);
+    }
+    InotifyWatcher(const InotifyWatcher &) = delete;
+    InotifyWatcher &operator=(const InotifyWatcher &) = delete;
+
+    bool valid() const { return fd >= 0 && repoWd >= 0; }
+    int descriptor() const { return fd; }
+    size_t size() const { return dirs.size(); }
+    bool complete() const { return !missedWatches; } // False once a directory could not be watched
+    bool repositoryGone() const { return repoGone; }
+
+    // Watches the directory (index form, "" = the top) and every directory below it
+    void addTree(const string &key)
+    {
+        string path = key.empty() ? "." : key;
+        int wd = inotify_add_watch(fd, path.c_str(), IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+        if (wd < 0)
+        {
+            if (errno == ENOSPC && !missedWatches)
+                cerr << "Error: Out of inotify watches (see /proc/sys/fs/inotify/max_user_watches)" << endl;
+            missedWatches |= errno != ENOENT && errno != ENOTDIR; // Already gone again: its parent reported it
+            return;
+        }
+        if (!dirs.emplace(wd, key).second)
+            return; // Already watched under another name (a symbolic link loop)
+        vector<DirEntry> entries;
+        readDirectory(path, entries);
+        for (const auto &entry : entries)
+        {
+            if (entry.isDirectory && !(key.empty() && entry.name == REPO_DIR))
+                addTree(key.empty() ? entry.name : key + "/" + entry.name);
+        }
+    }
+
+    // Journals the pending events; returns true if the cookie file appeared in .mygit
+    bool readEvents(const string &cookie)
+    {
+        alignas(inotify_event) char buffer[64 * 1024];
+        bool seen = false;
+        ssize_t n;
+        while ((n = read(fd, buffer, sizeof(buffer))) > 0)
+        {
+            for (char *p = buffer; p < buffer + n;)
+            {
+                auto event = reinterpret_cast<const inotify_event *>(p);
+                p += sizeof(inotify_event) + event->len;
+                if (event->mask & IN_Q_OVERFLOW)
+                    journal.reset(); // The kernel's queue overflowed: changes were lost
+                else if (event->wd == repoWd)
+                    seen |= event->len > 0 && cookie == event->name;
+                else if (event->mask & IN_IGNORED)
+                    dirs.erase(event->wd);
+                else if (event->len > 0)
+                    record(event->wd, event->name, event->mask);
+            }
+        }
+        return seen;
+    }
+
+private:
+    void record(int wd, const char *name, uint32_t mask)
+    {
+        auto dir = dirs.find(wd);
+        if (dir == dirs.end())
+            return;
+        string key = dir->second.empty() ? string(name) : dir->second + "/" + name;
+        if (key == REPO_DIR)
+        {
+            // Reported here rather than on .mygit itself, whose deletion the bound socket delays
+            repoGone |= (mask & (IN_DELETE | IN_MOVED_FROM)) != 0;
+            return;
+        }
+        journal.record(key);
+        if (!(mask & IN_ISDIR))
+            return;
+        // The watches below a directory that moved away would report their old paths
+        if (mask & IN_MOVED_FROM)
+        {
+            string prefix = key + "/";
+            for (auto it = dirs.begin(); it != dirs.end();)
+            {
+                if (it->second == key || it->second.compare(0, prefix.size(), prefix) == 0)
+                {
+                    inotify_rm_watch(fd, it->first);
+                    it = dirs.erase(it);
+                }
+                else
+                    ++it;
+            }
+        }
+        if (mask & (IN_CREATE | IN_MOVED_TO))
+            addTree(key);
+    }
+
+    FSMonitorJournal &journal;
+    int fd = -1;
+    int repoWd = -1;
+    unordered_map<int, string> dirs; // Watch descriptor -> index-form path
+    bool missedWatches = false;
+    bool repoGone = false;
+};
+
+// Runs the daemon in the foreground until it is stopped or the repository disappears
+int runFSMonitorDaemon()
+{
+    signal(SIGPIPE, SIG_IGN);
+    string socketPath = REPO_DIR + "/fsmonitor.sock";
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str()); // Left behind by a daemon that was killed (callers check that none answers)
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0 || listen(listener, 16) != 0)
+    {
+        cerr << "Error: Cannot listen on " << socketPath << ": " << strerror(errno) << endl;
+        if (listener >= 0)
+            close(listener);
+        return 1;
+    }
+
+    FSMonitorJournal journal;
+    InotifyWatcher watcher(journal);
+    if (!watcher.valid())
+    {
+        cerr << "Error: Cannot start inotify: " << strerror(errno) << endl;
+        close(listener);
+        unlink(socketPath.c_str());
+        return 1;
+    }
+    watcher.addTree("");
+
+    unsigned cookieCount = 0;
+    for (bool stop = false; !stop && !watcher.repositoryGone();)
+    {
+        pollfd fds[2] = {{watcher.descriptor(), POLLIN, 0}, {listener, POLLIN, 0}};
+        if (poll(fds, 2, -1) < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (fds[0].revents & POLLIN)
+            watcher.readEvents("");
+        if (!(fds[1].revents & POLLIN))
+            continue;
+        int client = accept(listener, nullptr, nullptr);
+        if (client < 0)
+            continue;
+        timeval timeout{FSMONITOR_COOKIE_TIMEOUT_MS / 1000, 0};
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        string request;
+        char chunk[4096];
+        while (request.find('\n') == string::npos && request.size() < 64 * 1024)
+        {
+            ssize_t n = recv(client, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                break;
+            request.append(chunk, static_cast<size_t>(n));
+        }
+        request = request.substr(0, request.find('\n'));
+
+        bool synced = true;
+        if (request.compare(0, 6, "query ") == 0)
+        {
+            string cookie = FSMONITOR_COOKIE_PREFIX + to_string(getpid()) + "-" + to_string(++cookieCount);
+            string cookiePath = REPO_DIR + "/" + cookie;
+            int cookieFd = open(cookiePath.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+            synced = false;
+            if (cookieFd >= 0)
+            {
+                close(cookieFd);
+                auto deadline = chrono::steady_clock::now() + chrono::milliseconds(FSMONITOR_COOKIE_TIMEOUT_MS);
+                while (!synced)
+                {
+                    auto left = chrono::duration_cast<chrono::milliseconds>(deadline - chrono::steady_clock::now()).count();
+                    pollfd events{watcher.descriptor(), POLLIN, 0};
+                    if (left <= 0 || poll(&events, 1, static_cast<int>(left)) <= 0)
+                        break;
+                    synced = watcher.readEvents(cookie);
+                }
+                unlink(cookiePath.c_str());
+            }
+        }
+        string watching = "watching " + to_string(watcher.size()) + " directories" + (watcher.complete() ? "" : " (incomplete)");
+        string reply = fsmonitorReply(journal, request, synced && watcher.complete(), watching, stop);
+        for (size_t sent = 0; sent < reply.size();)
+        {
+            ssize_t n = send(client, reply.data() + sent, reply.size() - sent, 0);
+            if (n <= 0)
+                break;
+            sent += static_cast<size_t>(n);
+        }
+        close(client);
+    }
+    close(listener);
+    unlink(socketPath.c_str());
+    return 0;
+}
+#else
+int runFSMonitorDaemon()
+{
+    cerr << "Error: The file system monitor is not supported on this platform" << endl;
+    return 1;
+}
+#endif
+
+// Sends one request to the daemon; false if none is running or it did not answer completely
+bool fsmonitorRequest(const string &request, string &reply)
+{
+    reply.clear();
+    string line = request + "\n";
+    char chunk[64 * 1024];
+#ifdef _WIN32
+    string name = fsmonitorPipeName();
+    HANDLE pipe = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE && GetLastError() == ERROR_PIPE_BUSY && WaitNamedPipeA(name.c_str(), FSMONITOR_CLIENT_TIMEOUT_MS))
+        pipe = CreateFileA(name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE)
+        return false;
+    DWORD n = 0;
+    bool ok = WriteFile(pipe, line.data(), static_cast<DWORD>(line.size()), &n, NULL) != 0;
+    while (ok && ReadFile(pipe, chunk, sizeof(chunk), &n, NULL) && n > 0)
+        reply.append(chunk, n);
+    ok = ok && GetLastError() == ERROR_BROKEN_PIPE; // The daemon closed its end after the reply
+    CloseHandle(pipe);
+    return ok;
+#else
+    string socketPath = REPO_DIR + "/fsmonitor.sock";
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, socketPath.c_str(), sizeof(addr.sun_path) - 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0)
+        return false;
+    if (connect(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+    {
+        close(sock);
+        return false;
+    }
+    timeval timeout{FSMONITOR_CLIENT_TIMEOUT_MS / 1000, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+#ifdef MSG_NOSIGNAL
+    bool ok = send(sock, line.data(), line.size(), MSG_NOSIGNAL) == static_cast<ssize_t>(line.size());
+#else
+    bool ok = send(sock, line.data(), line.size(), 0) == static_cast<ssize_t>(line.size());
+#endif
+    ssize_t n = 0;
+    while (ok && (n = recv(sock, chunk, sizeof(chunk), 0)) > 0)
+        reply.append(chunk, static_cast<size_t>(n));
+    close(sock);
+    return ok && n == 0; // The daemon closed the connection after the reply
+#endif
+}
+
+// Starts the daemon in the background and waits until it answers
+bool startFSMonitorDaemon()
+{
+#ifdef _WIN32
+    char exe[MAX_PATH];
+    if (!GetModuleFileNameA(NULL, exe, MAX_PATH))
+        return false;
+    string commandLine = "\"" + string(exe) + "\" fsmonitor run";
+    SetEnvironmentVariableA("MYGIT_TRACE", NULL); // The daemon must not overwrite this command's trace
+    STARTUPINFOA startup{};
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION process;
+    if (!CreateProcessA(NULL, &commandLine[0], NULL, NULL, FALSE, DETACHED_PROCESS | CREATE_NEW_PROCESS_GROUP, NULL, NULL, &startup, &process))
+        return false;
+    CloseHandle(process.hThread);
+    auto exited = [&process]()
+    { return WaitForSingleObject(process.hProcess, 0) == WAIT_OBJECT_0; };
+#else
+    cout.flush();
+    cerr.flush();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0)
+    {
+        // Detach from the terminal, and from the caller's files (such as a held index.lock)
+        setsid();
+        int null = open("/dev/null", O_RDWR);
+        dup2(null, 0);
+        dup2(null, 1);
+        dup2(null, 2);
+        for (int fd = 3; fd < 1024; fd++)
+            close(fd);
+        unsetenv("MYGIT_TRACE"); // The daemon must not overwrite this command's trace
+        execl("/proc/self/exe", "mygit", "fsmonitor", "run", static_cast<char *>(nullptr));
+        _exit(runFSMonitorDaemon()); // No /proc: keep running this copy of the program
+    }
+    auto exited = [pid]()
+    {
+        int status;
+        return waitpid(pid, &status, WNOHANG) == pid;
+    };
+#endif
+    bool started = false;
+    string reply;
+    auto deadline = chrono::steady_clock::now() + chrono::milliseconds(FSMONITOR_START_TIMEOUT_MS);
+    while (!started && !exited() && chrono::steady_clock::now() < deadline)
+    {
+        started = fsmonitorRequest("status", reply);
+        if (!started)
+            this_thread::sleep_for(chrono::milliseconds(20));
+    }
+#ifdef _WIN32
+    CloseHandle(process.hProcess);
+#endif
+    return started;
+}
+
+// What the daemon said about the changes since a token
+enum class FSMonitorAnswer
+{
+    UNAVAILABLE, // No daemon (and none could be started)
+    EVERYTHING,  // The token is unknown or too old: scan everything
+    CHANGES      // changed holds every path that changed since the token
+};
+
+// Asks the daemon what changed since the token (empty if there is none yet), starting it if it
+// is not running. token receives the daemon's current token.
+FSMonitorAnswer queryFSMonitor(const string &since, string &token, vector<string> &changed)
+{
+    static bool startAttempted = false;
+    string reply;
+    bool answered = fsmonitorRequest("query " + since, reply);
+    if (!answered && !startAttempted)
+    {
+        startAttempted = true;
+        answered = startFSMonitorDaemon() && fsmonitorRequest("query " + since, reply);
+    }
+    size_t end = reply.find('\0');
+    if (!answered || end == string::npos)
+        return FSMonitorAnswer::UNAVAILABLE;
+    token = reply.substr(0, end);
+    changed.clear();
+    for (size_t pos = end + 1, next; pos < reply.size() && (next = reply.find('\0', pos)) != string::npos; pos = next + 1)
+        changed.push_back(reply.substr(pos, next - pos));
+    if (changed.size() == 1 && changed[0] == "/")
+    {
+        changed.clear();
+        return FSMonitorAnswer::EVERYTHING;
+    }
+    return FSMonitorAnswer::CHANGES;
+}
+
+// ============= STATUS =============
+
+// Counters for status, printed with --stats
+struct StatusStats
+{
+    atomic<uint64_t> directories{0}; // Working tree directories listed
+    atomic<uint64_t> checked{0};     // Tracked files stat'ed
+    atomic<uint64_t> rehashed{0};    // Tracked files whose stat data did not match, so they were hashed
+};
+StatusStats statusStats;
+
+// Lists the staged changes: how the index entries [begin, end) below dir differ from the HEAD tree
+// treeSha (null = no commit yet). A directory whose cache tree node still matches the HEAD tree
+// is skipped without reading either side, so an index that was just committed costs one comparison.
+void diffTreeToIndex(const ObjectId &treeSha, const vector<IndexEntry> &entries, size_t begin, size_t end, const string &dir,
+                     const CacheTree &cacheTree, vector<TreeChange> &changes)
+{
+    auto cached = cacheTree.find(dir);
+    if (!treeSha.isNull() && cached != cacheTree.end() && cached->second.entryCount == end - begin && cached->second.sha == treeSha)
+        return;
+    static const auto emptyTree = make_shared<const TreeView>();
+    auto tree = treeSha.isNull() ? emptyTree : loadTree(treeSha);
+    vector<TreeEntryView> treeEntries = sortedTreeEntries(*tree);
+    vector<char> seen(treeEntries.size(), 0);
+    auto findEntry = [&treeEntries](const string &name) -> int
+    {
+        auto it = lower_bound(treeEntries.begin(), treeEntries.end(), name, [](const TreeEntryView &e, const string &n)
+                              { return e.name < n; });
+        return it != treeEntries.end() && it->name == name ? static_cast<int>(it - treeEntries.begin()) : -1;
+    };
+
+    size_t prefixLen = dir.empty() ? 0 : dir.size() + 1;
+    for (size_t i = begin; i < end;)
+    {
+        const IndexEntry &entry = entries[i];
+        size_t slash = entry.path.find('/', prefixLen);
+        string name = entry.path.substr(prefixLen, slash == string::npos ? string::npos : slash - prefixLen);
+        int k = findEntry(name);
+        const TreeEntryView *old = k >= 0 ? &treeEntries[k] : nullptr;
+        if (old)
+            seen[k] = 1;
+        if (slash == string::npos)
+        {
+            TreeEntry staged{entry.mode, name, entry.sha, false};
+            // A directory that became a file shows up as its files deleted and the file added
+            if (old && old->isTree)
+                diffTrees(old->sha, ObjectId(), entry.path, changes);
+            if (!old || old->isTree)
+                changes.push_back(TreeChange{'A', entry.path, TreeEntry(), staged});
+            else if (old->sha != entry.sha || old->mode != entry.mode)
+                changes.push_back(TreeChange{'M', entry.path, old->toEntry(), staged});
+            i++;
+            continue;
+        }
+        // All entries of a subdirectory are adjacent in the sorted index
+        size_t j = i + 1;
+        while (j < end && entries[j].path.compare(0, slash + 1, entry.path, 0, slash + 1) == 0)
+            j++;
+        string subdir = entry.path.substr(0, slash);
+        if (old && !old->isTree)
+            changes.push_back(TreeChange{'D', subdir, old->toEntry(), TreeEntry()});
+        diffTreeToIndex(old && old->isTree ? old->sha : ObjectId(), entries, i, j, subdir, cacheTree, changes);
+        i = j;
+    }
+
+    // What is left of the HEAD tree is no longer in the index
+    for (size_t k = 0; k < treeEntries.size(); k++)
+    {
+        if (seen[k])
+            continue;
+        string path = dir.empty() ? string(treeEntries[k].name) : dir + "/" + string(treeEntries[k].name);
+        if (treeEntries[k].isTree)
+            diffTrees(treeEntries[k].sha, ObjectId(), path, changes);
+        else
+            changes.push_back(TreeChange{'D', path, treeEntries[k].toEntry(), TreeEntry()});
+    }
+}
+
+// Reads the index with normalized paths, sorted by path (as the scans below need it)
+vector<IndexEntry> readSortedIndex(CacheTree &cacheTree, FSMonitorState *fsmonitor = nullptr)
+{
+    vector<IndexEntry> entries = readIndex(&cacheTree, fsmonitor);
+    for (auto &entry : entries)
+        entry.path = normalizePath(entry.path); // Only legacy text indexes differ
+    auto byPath = [](const IndexEntry &a, const IndexEntry &b)
+    { return a.path < b.path; };
+    if (!is_sorted(entries.begin(), entries.end(), byPath))
+        sort(entries.begin(), entries.end(), byPath);
+    return entries;
+}
+
+// How a tracked file compares with the working tree
+enum class WorktreeState : unsigned char
+{
+    MISSING,  // Not found in the working tree (every entry starts out like this)
+    SKIPPED,  // Skip-worktree entry (outside the sparse checkout): never compared
+    CLEAN,    // Stat data matches the index
+    MODIFIED, // Content or mode differs
+    REFRESHED // Stat data changed but the content did not; the index should get the new stat data
+};
+
+// State shared by the tasks of one working tree scan. Every index entry is visited by exactly one
+// task, so the per-entry vectors need no locking.
+struct WorktreeScan
+{
+    WorktreeScan(const vector<IndexEntry> &e, uint64_t timestamp)
+        : entries(e), indexTimestamp(timestamp), states(e.size(), WorktreeState::MISSING), stats(e.size())
+    {
+        for (size_t i = 0; i < e.size(); i++)
+            if (e[i].skipWorktree)
+                states[i] = WorktreeState::SKIPPED;
+    }
+
+    const vector<IndexEntry> &entries; // Sorted by path
+    uint64_t indexTimestamp;
+    vector<WorktreeState> states;
+    vector<FileStat> stats;   // New stat data of REFRESHED entries
+    bool listUntracked = true;
+    vector<string> untracked; // Index-form paths; a directory without tracked files is listed once, with a trailing '/'
+    mutex untrackedMutex;
+};
+
+// Compares a tracked file with its index entry. Matching stat data settles it; otherwise a mode
+// or size change does, and only files that might still be unchanged are hashed.
+void checkTrackedFile(WorktreeScan &scan, size_t i, const string &path)
+{
+    const IndexEntry &entry = scan.entries[i];
+    if (entry.skipWorktree)
+        return;
+    FileStat st;
+    statusStats.checked++;
+    if (!getFileStat(path, st))
+        return;
+    if (isStatUpToDate(entry, st, scan.indexTimestamp))
+    {
+        scan.states[i] = WorktreeState::CLEAN;
+        return;
+    }
+    bool sizeKnown = entry.stat.mtime != 0;
+    if (getPermissions(path) != entry.mode || (sizeKnown && st.size != entry.stat.size))
+    {
+        scan.states[i] = WorktreeState::MODIFIED;
+        return;
+    }
+    statusStats.rehashed++;
+    if (createBlob(path, false) != entry.sha)
+    {
+        scan.states[i] = WorktreeState::MODIFIED;
+        return;
+    }
+    scan.states[i] = WorktreeState::REFRESHED;
+    scan.stats[i] = st;
+}
+
+// True if the directory holds at least one file that is not ignored, at any depth
+bool hasUntrackedFiles(const string &path, const string &key)
+{
+    vector<DirEntry> dirEntries;
+    readDirectory(path, dirEntries);
+    for (const auto &dirEntry : dirEntries)
+    {
+        if (dirEntry.name == REPO_DIR)
+            continue;
+        string childKey = key + "/" + dirEntry.name;
+        if (ignoreRules().isIgnored(childKey, dirEntry.isDirectory))
+            continue;
+        if (!dirEntry.isDirectory || hasUntrackedFiles(path + "\\" + dirEntry.name, childKey))
+            return true;
+    }
+    return false;
+}
+
+// Lists one working tree directory (key is its index-form path, "" for the top). Its tracked files
+// (within the index entries [begin, end)) are checked, other files are untracked unless ignored.
+// Every subdirectory holding tracked files becomes a pool task, so directories are listed and
+// their files stat'ed in parallel.
+void scanWorktreeDirectory(WorktreeScan &scan, ThreadPool &pool, const string &path, const string &key, size_t begin, size_t end, bool inIgnoredDir)
+{
+    statusStats.directories++;
+    auto first = scan.entries.begin() + begin, last = scan.entries.begin() + end;
+    auto byPath = [](const IndexEntry &e, const string &k)
+    { return e.path < k; };
+    vector<string> untracked;
+    vector<DirEntry> dirEntries;
+    readDirectory(path, dirEntries);
+    TaskGroup group(pool);
+    for (const auto &dirEntry : dirEntries)
+    {
+        const string &name = dirEntry.name;
+        if (name == REPO_DIR)
+            continue;
+        string fullPath = (path == ".") ? name : path + "\\" + name;
+        string childKey = key.empty() ? name : key + "/" + name;
+        if (!dirEntry.isDirectory)
+        {
+            auto it = lower_bound(first, last, childKey, byPath);
+            if (it != last && it->path == childKey)
+                checkTrackedFile(scan, it - scan.entries.begin(), fullPath);
+            else if (scan.listUntracked && !inIgnoredDir && !ignoreRules().isIgnored(childKey, false))
+                untracked.push_back(childKey);
+            continue;
+        }
+
+        // The entries below childKey + "/" are exactly those from there up to childKey + "0"
+        // ('0' follows '/'), adjacent in the sorted index
+        size_t subBegin = lower_bound(first, last, childKey + "/", byPath) - scan.entries.begin();
+        size_t subEnd = lower_bound(first, last, childKey + "0", byPath) - scan.entries.begin();
+        bool ignored = inIgnoredDir || ignoreRules().isIgnored(childKey, true);
+        if (subBegin == subEnd)
+        {
+            if (scan.listUntracked && !ignored && hasUntrackedFiles(fullPath, childKey))
+                untracked.push_back(childKey + "/");
+            continue;
+        }
+        group.run([&scan, &pool, fullPath, childKey, subBegin, subEnd, ignored]
+                  { scanWorktreeDirectory(scan, pool, fullPath, childKey, subBegin, subEnd, ignored); });
+    }
+    group.wait();
+    if (!untracked.empty())
+    {
+        lock_guard<mutex> lk(scan.untrackedMutex);
+        scan.untracked.insert(scan.untracked.end(), untracked.begin(), untracked.end());
+    }
+}
+
+// Counters for the file system monitor, printed with --stats
+struct FSMonitorStats
+{
+    const char *result = "off"; // How the last query went
+    uint64_t changed = 0;       // Paths the daemon reported
+};
+FSMonitorStats fsmonitorStats;
+
+// True if the sorted index has the path itself
+bool isIndexed(const vector<IndexEntry> &entries, const string &key)
+{
+    auto it = lower_bound(entries.begin(), entries.end(), key, [](const IndexEntry &e, const string &k)
+                          { return e.path < k; });
+    return it != entries.end() && it->path == key;
+}
+
+// True if the sorted index has anything below the directory
+bool hasEntriesBelow(const vector<IndexEntry> &entries, const string &key)
+{
+    string prefix = key + "/";
+    auto it = lower_bound(entries.begin(), entries.end(), prefix, [](const IndexEntry &e, const string &k)
+                          { return e.path < k; });
+    return it != entries.end() && it->path.compare(0, prefix.size(), prefix) == 0;
+}
+
+// Lists the untracked paths at or below key the way a full status scan does: files, and
+// directories without tracked files as "dir/" if anything in them is not ignored
+void listUntrackedAt(const vector<IndexEntry> &entries, const string &key, vector<string> &untracked)
+{
+    if (key == REPO_DIR)
+        return;
+    if (!isDirectory(key))
+    {
+        if (fileExists(key) && !isIndexed(entries, key) && !ignoreRules().isIgnored(key, false))
+            untracked.push_back(key);
+        return;
+    }
+    if (ignoreRules().isIgnored(key, true))
+        return;
+    if (!hasEntriesBelow(entries, key))
+    {
+        if (hasUntrackedFiles(key, key))
+            untracked.push_back(key + "/");
+        return;
+    }
+    vector<DirEntry> dirEntries;
+    readDirectory(key, dirEntries);
+    for (const auto &dirEntry : dirEntries)
+        listUntrackedAt(entries, key + "/" + dirEntry.name, untracked);
+}
+
+// Brings the untracked list up to date for the changed paths, listing only those parts of the
+// working tree again. A change inside an untracked directory (or one that was untracked) redoes
+// the whole directory, since status reports it as a single entry.
+void updateUntrackedCache(FSMonitorState &fsmonitor, const vector<IndexEntry> &entries, const vector<string> &changed)
+{
+    vector<string> &untracked = fsmonitor.untracked;
+    unordered_set<string> roots;
+    for (const auto &path : changed)
+    {
+        string root = path;
+        for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1))
+        {
+            string dir = path.substr(0, slash);
+            if (!hasEntriesBelow(entries, dir) || binary_search(untracked.begin(), untracked.end(), dir + "/"))
+            {
+                root = dir;
+                break;
+            }
+        }
+        roots.insert(root);
+    }
+    // A path counts as covered if it or one of its directories is a root
+    auto covered = [&roots](const string &path, bool includeSelf)
+    {
+        if (includeSelf && roots.count(path))
+            return true;
+        for (size_t slash = path.find('/'); slash != string::npos; slash = path.find('/', slash + 1))
+        {
+            if (roots.count(path.substr(0, slash)))
+                return true;
+        }
+        return false;
+    };
+
+    untracked.erase(remove_if(untracked.begin(), untracked.end(), [&covered](const string &path)
+                              { return covered(path.back() == '/' ? path.substr(0, path.size() - 1) : path, true); }),
+                    untracked.end());
+    for (const auto &root : roots)
+    {
+        if (covered(root, false))
+            continue; // Listed with its directory
+        // Nothing below an ignored directory is listed
+        bool ignored = false;
+        for (size_t slash = root.find('/'); slash != string::npos && !ignored; slash = root.find('/', slash + 1))
+            ignored = ignoreRules().isIgnored(root.substr(0, slash), true);
+        if (!ignored)
+            listUntrackedAt(entries, root, untracked);
+    }
+    sort(untracked.begin(), untracked.end());
+}
+
+// Asks the file system monitor (core.fsmonitor = true) what changed since the token in the index.
+// Entries at or below a changed path lose their fsmonitorValid mark, and the untracked list is
+// updated for the changed paths. Returns true if the state is then complete, so only entries
+// without the mark need to be checked; otherwise the caller scans everything and stores
+// fsmonitor.token (empty if no daemon answered). Without changes the stored token is kept, so the
+// index need not be rewritten.
+bool refreshFSMonitor(FSMonitorState &fsmonitor, vector<IndexEntry> &entries)
+{
+    if (!fsmonitorEnabled())
+    {
+        fsmonitor = FSMonitorState();
+        return false;
+    }
+    string token;
+    vector<string> changed;
+    FSMonitorAnswer answer = queryFSMonitor(fsmonitor.token, token, changed);
+    if (answer != FSMonitorAnswer::CHANGES)
+    {
+        fsmonitorStats.result = answer == FSMonitorAnswer::EVERYTHING ? "full scan" : "daemon not running";
+        for (auto &entry : entries)
+            entry.fsmonitorValid = false;
+        fsmonitor = FSMonitorState();
+        if (answer == FSMonitorAnswer::EVERYTHING)
+            fsmonitor.token = token;
+        return false;
+    }
+    fsmonitorStats.result = "incremental";
+    fsmonitorStats.changed = changed.size();
+    if (changed.empty())
+        return fsmonitor.untrackedValid;
+
+    fsmonitor.token = token;
+    sort(changed.begin(), changed.end());
+    auto byPath = [](const IndexEntry &e, const string &k)
+    { return e.path < k; };
+    for (const auto &path : changed)
+    {
+        auto exact = lower_bound(entries.begin(), entries.end(), path, byPath);
+        if (exact != entries.end() && exact->path == path)
+            exact->fsmonitorValid = false;
+        // A directory that was created, removed or renamed affects everything below it
+        auto last = lower_bound(entries.begin(), entries.end(), path + "0", byPath);
+        for (auto it = lower_bound(entries.begin(), entries.end(), path + "/", byPath); it != last; ++it)
+            it->fsmonitorValid = false;
+    }
+    // Changed ignore rules can change the untracked state of any path
+    if (binary_search(changed.begin(), changed.end(), ".mygitignore"))
+        fsmonitor.untrackedValid = false;
+    if (!fsmonitor.untrackedValid)
+        return false;
+    updateUntrackedCache(fsmonitor, entries, changed);
+    return true;
+}
+
+// Checks the tracked files the file system monitor could not vouch for; the others are clean
+void checkUnverifiedFiles(WorktreeScan &scan, ThreadPool &pool)
+{
+    const size_t CHUNK = 256;
+    vector<size_t> pending;
+    for (size_t i = 0; i < scan.entries.size(); i++)
+    {
+        if (scan.entries[i].skipWorktree)
+            continue;
+        if (scan.entries[i].fsmonitorValid)
+            scan.states[i] = WorktreeState::CLEAN;
+        else
+            pending.push_back(i);
+    }
+    TaskGroup group(pool);
+    for (size_t begin = 0; begin < pending.size(); begin += CHUNK)
+    {
+        group.run([&scan, &pending, begin, CHUNK]
+                  {
+                      for (size_t k = begin; k < min(pending.size(), begin + CHUNK); k++)
+                          checkTrackedFile(scan, pending[k], scan.entries[pending[k]].path); });
+    }
+    group.wait();
+}
+
+// ============= DIFF =============
+
+const size_t BINARY_PROBE_SIZE = 8000;                   // Leading bytes checked for NUL, as git does
+const uint64_t DIFF_MEMORY_LIMIT = 64ull * 1024 * 1024; // Larger loose blobs are diffed from a mapped temp file
+
+// One side of a file diff. Working tree files are memory-mapped; blobs are inflated into memory,
+// except large loose ones, which are streamed into a temporary file that is mapped instead, so the
+// page cache rather than the heap holds them. An empty (or null) side is a missing file.
+class DiffContent
+{
+public:
+    DiffContent() = default;
+    DiffContent(const DiffContent &) = delete;
+    DiffContent &operator=(const DiffContent &) = delete;
+    ~DiffContent()
+    {
+        mapped.reset();
+        if (!tempPath.empty())
+        {
+            error_code ec;
+            fs::remove(tempPath, ec);
+        }
+    }
+
+    bool loadFile(const string &path)
+    {
+        mapped = make_unique<MappedFile>(path);
+        if (!mapped->valid())
+        {
+            cerr << "Error: Cannot read file " << path << endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool loadBlob(const ObjectId &sha)
+    {
+        if (sha.isNull())
+            return true;
+        string type;
+        uint64_t size;
+        if (!readObjectHeader(sha, type, size))
+            return false;
+        if (size > DIFF_MEMORY_LIMIT && !hasPackedObject(sha))
+        {
+            tempPath = getTempObjectPath();
+            ofstream out(tempPath, ios::binary);
+            bool ok = streamLooseObject(sha, type, size, [&out](const char *p, size_t n)
+                                        { out.write(p, static_cast<streamsize>(n));
+                                          return static_cast<bool>(out); });
+            out.close();
+            return ok && !out.fail() && loadFile(tempPath);
+        }
+        object = readObject(sha);
+        offset = object.find('\0') + 1;
+        return offset != 0;
+    }
+
+    const char *data() const { return mapped ? mapped->data() : object.data() + offset; }
+    size_t size() const { return mapped ? mapped->size() : object.size() - offset; }
+
+    // Git's test: a NUL byte among the leading bytes makes the file binary
+    bool isBinary() const
+    {
+        return memchr(data(), '\0', min(size(), BINARY_PROBE_SIZE)) != nullptr;
+    }
+
+private:
+    unique_ptr<MappedFile> mapped;
+    string tempPath;
+    string object;
+    size_t offset = 0;
+};
+
+inline unsigned countTrailingZeros(unsigned v)
+{
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, v);
+    return index;
+#else
+    return static_cast<unsigned>(__builtin_ctz(v));
+#endif
+}
+
+// Splits data into lines, each including its '\n' (the last one may lack it). Sixteen bytes are
+// compared against '\n' at once and every newline in the block is taken from the match mask.
+void splitLines(const char *data, size_t len, vector<string_view> &lines)
+{
+    size_t start = 0, i = 0;
+#if defined(MYGIT_X86_HASH) && (defined(__SSE2__) || defined(_M_X64))
+    const __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= len; i += 16)
+    {
+        __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+        unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        while (mask)
+        {
+            size_t end = i + countTrailingZeros(mask) + 1;
+            lines.emplace_back(data + start, end - start);
+            start = end;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    for (; i < len; i++)
+    {
+        if (data[i] == '\n')
+        {
+            lines.emplace_back(data + start, i + 1 - start);
+            start = i + 1;
+        }
+    }
+    if (start < len)
+        lines.emplace_back(data + start, len - start);
+}
+
+// 64-bit hash of a line, eight bytes per step
+uint64_t hashLine(string_view line)
+{
+    const uint64_t multiplier = 0xff51afd7ed558ccdull;
+    uint64_t h = 0x9e3779b97f4a7c15ull ^ line.size();
+    size_t i = 0;
+    for (; i + 8 <= line.size(); i += 8)
+    {
+        uint64_t word;
+        memcpy(&word, line.data() + i, 8);
+        h = (h ^ word) * multiplier;
+        h ^= h >> 29;
+    }
+    if (i < line.size())
+    {
+        uint64_t word = 0;
+        memcpy(&word, line.data() + i, line.size() - i);
+        h = (h ^ word) * multiplier;
+    }
+    h ^= h >> 32;
+    return h * multiplier;
+}
+
+// Gives equal lines (of both files) the same small integer, so the diff compares integers.
+// Open addressing on the line hash; the bytes are compared only when the hashes match.
+class LineInterner
+{
+public:
+    explicit LineInterner(size_t lineCount)
+    {
+        size_t capacity = 16;
+        while (capacity < 2 * lineCount)
+            capacity *= 2;
+        slots.assign(capacity, Slot{0, EMPTY});
+    }
+
+    uint32_t intern(string_view line)
+    {
+        uint64_t h = hashLine(line);
+        size_t mask = slots.size() - 1;
+        for (size_t i = h & mask;; i = (i + 1) & mask)
+        {
+            Slot &slot = slots[i];
+            if (slot.id == EMPTY)
+            {
+                slot = Slot{h, static_cast<uint32_t>(distinct.size())};
+                distinct.push_back(line);
+                return slot.id;
+            }
+            if (slot.hash == h && distinct[slot.id] == line)
+                return slot.id;
+        }
+    }
+
+private:
+    static const uint32_t EMPTY = UINT32_MAX;
+    struct Slot
+    {
+        uint64_t hash;
+        uint32_t id;
+    };
+    vector<Slot> slots;
+    vector<string_view> distinct;
+};
+
+// Myers' O(ND) difference algorithm in linear space (as in git's xdiff): the middle snake of a
+// box splits it into two smaller boxes, which are compared recursively. Past a cost limit the
+// furthest-reaching path is taken as the split, so pathological inputs give a larger but still
+// correct diff in bounded time. Marks removed lines of A and added lines of B.
+class MyersDiff
+{
+public:
+    MyersDiff(const vector<uint32_t> &a, const vector<uint32_t> &b)
+        : removed(a.size()), added(b.size()), A(a.data()), B(b.data())
+    {
+        size_t diagonals = a.size() + b.size() + 3;
+        forward.resize(diagonals);
+        backward.resize(diagonals);
+        // Diagonal k = x - y runs from -|B| to |A|
+        fwd = forward.data() + b.size() + 1;
+        bwd = backward.data() + b.size() + 1;
+        maxCost = 256;
+        while (maxCost * maxCost < diagonals)
+            maxCost *= 2;
+        compare(0, static_cast<ptrdiff_t>(a.size()), 0, static_cast<ptrdiff_t>(b.size()), false);
+    }
+
+    vector<char> removed, added;
+
+private:
+    struct Split
+    {
+        ptrdiff_t x, y;
+        bool minimalLow, minimalHigh;
+    };
+
+    void compare(ptrdiff_t x0, ptrdiff_t x1, ptrdiff_t y0, ptrdiff_t y1, bool needMinimal)
+    {
+        // Common leading and trailing lines are not part of the problem
+        while (x0 < x1 && y0 < y1 && A[x0] == B[y0])
+            x0++, y0++;
+        while (x0 < x1 && y0 < y1 && A[x1 - 1] == B[y1 - 1])
+            x1--, y1--;
+        if (x0 == x1)
+        {
+            fill(added.begin() + y0, added.begin() + y1, 1);
+            return;
+        }
+        if (y0 == y1)
+        {
+            fill(removed.begin() + x0, removed.begin() + x1, 1);
+            return;
+        }
+        Split split = middleSnake(x0, x1, y0, y1, needMinimal);
+        compare(x0, split.x, y0, split.y, split.minimalLow);
+        compare(split.x, x1, split.y, y1, split.minimalHigh);
+    }
+
+    Split middleSnake(ptrdiff_t x0, ptrdiff_t x1, ptrdiff_t y0, ptrdiff_t y1, bool needMinimal)
+    {
+        const ptrdiff_t kmin = x0 - y1, kmax = x1 - y0;
+        const ptrdiff_t fmid = x0 - y0, bmid = x1 - y1;
+        const bool odd = ((fmid - bmid) & 1) != 0;
+        ptrdiff_t fmin = fmid, fmax = fmid, bmin = bmid, bmax = bmid;
+        fwd[fmid] = x0;
+        bwd[bmid] = x1;
+        for (size_t cost = 1;; cost++)
+        {
+            // Widen the forward range by one diagonal on each side (or shrink it at the box
+            // edge), with sentinels just outside so the loop needs no bounds checks
+            if (fmin > kmin)
+                fwd[--fmin - 1] = -1;
+            else
+                ++fmin;
+            if (fmax < kmax)
+                fwd[++fmax + 1] = -1;
+            else
+                --fmax;
+            for (ptrdiff_t k = fmax; k >= fmin; k -= 2)
+            {
+                ptrdiff_t x = fwd[k - 1] >= fwd[k + 1] ? fwd[k - 1] + 1 : fwd[k + 1];
+                ptrdiff_t y = x - k;
+                while (x < x1 && y < y1 && A[x] == B[y])
+                    x++, y++;
+                fwd[k] = x;
+                if (odd && bmin <= k && k <= bmax && bwd[k] <= x)
+                    return Split{x, y, true, true};
+            }
+
+            if (bmin > kmin)
+                bwd[--bmin - 1] = PTRDIFF_MAX;
+            else
+                ++bmin;
+            if (bmax < kmax)
+                bwd[++bmax + 1] = PTRDIFF_MAX;
+            else
+                --bmax;
+            for (ptrdiff_t k = bmax; k >= bmin; k -= 2)
+            {
+                ptrdiff_t x = bwd[k - 1] < bwd[k + 1] ? bwd[k - 1] : bwd[k + 1] - 1;
+                ptrdiff_t y = x - k;
+                while (x > x0 && y > y0 && A[x - 1] == B[y - 1])
+                    x--, y--;
+                bwd[k] = x;
+                if (!odd && fmin <= k && k <= fmax && x <= fwd[k])
+                    return Split{x, y, true, true};
+            }
+
+            if (needMinimal || cost < maxCost)
+                continue;
+
+            // Too expensive: split at whichever path got furthest from its corner
+            ptrdiff_t fbest = -1, fbestX = -1;
+            for (ptrdiff_t k = fmax; k >= fmin; k -= 2)
+            {
+                ptrdiff_t x = min(fwd[k], x1), y = x - k;
+                if (y > y1)
+                    x = y1 + k, y = y1;
+                if (x + y > fbest)
+                    fbest = x + y, fbestX = x;
+            }
+            ptrdiff_t bbest = PTRDIFF_MAX, bbestX = PTRDIFF_MAX;
+            for (ptrdiff_t k = bmax; k >= bmin; k -= 2)
+            {
+                ptrdiff_t x = max(x0, bwd[k]), y = x - k;
+                if (y < y0)
+                    x = y0 + k, y = y0;
+                if (x + y < bbest)
+                    bbest = x + y, bbestX = x;
+            }
+            if ((x1 + y1) - bbest < fbest - (x0 + y0))
+                return Split{fbestX, fbest - fbestX, true, false};
+            return Split{bbestX, bbest - bbestX, false, true};
+        }
+    }
+
+    const uint32_t *A, *B;
+    vector<ptrdiff_t> forward, backward;
+    ptrdiff_t *fwd, *bwd;
+    size_t maxCost;
+};
+
+// git's default hunk header context: the nearest line at or above `from` (and below `limit`, where
+// the previous hunk's search started) beginning with a letter, '_' or '$', with trailing
+// whitespace removed and at most 80 bytes. function keeps its value if there is none.
+void findHunkFunction(const vector<string_view> &lines, ptrdiff_t from, ptrdiff_t limit, string &function)
+{
+    for (ptrdiff_t i = from; i > limit; i--)
+    {
+        string_view line = lines[i];
+        if (line.empty() || !(isalpha(static_cast<unsigned char>(line[0])) || line[0] == '_' || line[0] == '$'))
+            continue;
+        size_t len = min<size_t>(line.size(), 80);
+        while (len > 0 && isspace(static_cast<unsigned char>(line[len - 1])))
+            len--;
+        function.assign(line.data(), len);
+        return;
+    }
+}
+
+// Appends the unified diff hunks of two texts to out, with `context` unchanged lines around changes
+void appendLineDiff(string &out, const DiffContent &oldContent, const DiffContent &newContent, unsigned context)
+{
+    vector<string_view> a, b;
+    splitLines(oldContent.data(), oldContent.size(), a);
+    splitLines(newContent.data(), newContent.size(), b);
+    LineInterner interner(a.size() + b.size());
+    vector<uint32_t> ida(a.size()), idb(b.size());
+    for (size_t i = 0; i < a.size(); i++)
+        ida[i] = interner.intern(a[i]);
+    for (size_t i = 0; i < b.size(); i++)
+        idb[i] = interner.intern(b[i]);
+    MyersDiff diff(ida, idb);
+
+    // Changed regions, in order: lines [a0, a1) of A replaced by [b0, b1) of B. Unchanged lines
+    // pair up one to one between them.
+    struct Change
+    {
+        size_t a0, a1, b0, b1;
+    };
+    vector<Change> changes;
+    for (size_t i = 0, j = 0; i < a.size() || j < b.size();)
+    {
+        if ((i < a.size() && diff.removed[i]) || (j < b.size() && diff.added[j]))
+        {
+            Change c{i, i, j, j};
+            while (c.a1 < a.size() && diff.removed[c.a1])
+                c.a1++;
+            while (c.b1 < b.size() && diff.added[c.b1])
+                c.b1++;
+            changes.push_back(c);
+            i = c.a1;
+            j = c.b1;
+            continue;
+        }
+        i++;
+        j++;
+    }
+
+    auto appendLine = [&out](char prefix, string_view line)
+    {
+        out += prefix;
+        out.append(line.data(), line.size());
+        if (line.empty() || line.back() != '\n')
+            out += "\n\\ No newline at end of file\n";
+    };
+    auto range = [](size_t start, size_t count)
+    {
+        // A hunk that is empty on one side names the line before it
+        string s = to_string(count == 0 ? start : start + 1);
+        return count == 1 ? s : s + "," + to_string(count);
+    };
+    string function;
+    ptrdiff_t searched = -1;
+    for (size_t first = 0; first < changes.size();)
+    {
+        // Changes closer than twice the context share a hunk
+        size_t last = first;
+        while (last + 1 < changes.size() && changes[last + 1].a0 - changes[last].a1 <= 2 * context)
+            last++;
+        size_t aStart = changes[first].a0 - min<size_t>(context, changes[first].a0);
+        size_t bStart = changes[first].b0 - (changes[first].a0 - aStart);
+        size_t aEnd = min(a.size(), changes[last].a1 + context);
+        size_t bEnd = changes[last].b1 + (aEnd - changes[last].a1);
+
+        out += "@@ -" + range(aStart, aEnd - aStart) + " +" + range(bStart, bEnd - bStart) + " @@";
+        findHunkFunction(a, static_cast<ptrdiff_t>(aStart) - 1, searched, function);
+        searched = static_cast<ptrdiff_t>(aStart) - 1;
+        if (!function.empty())
+            out += " " + function;
+        out += "\n";
+        size_t i = aStart;
+        for (size_t c = first; c <= last; c++)
+        {
+            for (; i < changes[c].a0; i++)
+                appendLine(' ', a[i]);
+            for (; i < changes[c].a1; i++)
+                appendLine('-', a[i]);
+            for (size_t j = changes[c].b0; j < changes[c].b1; j++)
+                appendLine('+', b[j]);
+        }
+        for (; i < aEnd; i++)
+            appendLine(' ', a[i]);
+        first = last + 1;
+    }
+}
+
+// One file to show in a diff. A null ID on the old side means the file is new, on the new side
+// (without a working tree path) that it was deleted. Files from the working tree are read from
+// worktreePath; their ID is computed when the diff is printed.
+struct FileDiff
+{
+    string path; // Index form
+    string oldMode, newMode;
+    ObjectId oldSha, newSha;
+    string worktreePath;
+};
+
+// Abbreviated object ID for "index" lines
+string abbreviateId(const ObjectId &sha)
+{
+    return sha.hex().substr(0, 7);
+}
+
+// Prints one file's diff in git's format: "diff --git" header, mode lines, "index" line and the
+// hunks (or a note for binary files)
+void printFileDiff(FileDiff file, unsigned context)
+{
+    DiffContent oldContent, newContent;
+    bool deleted = file.newSha.isNull() && file.worktreePath.empty();
+    if (!file.worktreePath.empty())
+    {
+        file.newSha = createBlob(file.worktreePath, false);
+        if (file.newSha.isNull() || !newContent.loadFile(file.worktreePath))
+            return;
+    }
+    else if (!newContent.loadBlob(file.newSha))
+        return;
+    if (!oldContent.loadBlob(file.oldSha))
+        return;
+
+    string out = "diff --git a/" + file.path + " b/" + file.path + "\n";
+    if (file.oldSha.isNull())
+        out += "new file mode " + file.newMode + "\n";
+    else if (deleted)
+        out += "deleted file mode " + file.oldMode + "\n";
+    else if (file.oldMode != file.newMode)
+        out += "old mode " + file.oldMode + "\nnew mode " + file.newMode + "\n";
+    if (file.oldSha == file.newSha)
+    {
+        cout << out; // Mode change only
+        return;
+    }
+    string zeros(7, '0');
+    out += "index " + (file.oldSha.isNull() ? zeros : abbreviateId(file.oldSha)) + ".." + (deleted ? zeros : abbreviateId(file.newSha));
+    if (!file.oldSha.isNull() && !deleted && file.oldMode == file.newMode)
+        out += " " + file.oldMode;
+    out += "\n";
+    string oldName = file.oldSha.isNull() ? "/dev/null" : "a/" + file.path;
+    string newName = deleted ? "/dev/null" : "b/" + file.path;
+    if (oldContent.isBinary() || newContent.isBinary())
+        out += "Binary files " + oldName + " and " + newName + " differ\n";
+    else if (oldContent.size() > 0 || newContent.size() > 0)
+    {
+        out += "--- " + oldName + "\n+++ " + newName + "\n";
+        appendLineDiff(out, oldContent, newContent, context);
+    }
+    cout.write(out.data(), static_cast<streamsize>(out.size()));
+}
+
+// Turns a tree comparison (diffTrees or diffTreeToIndex) into file diffs
+vector<FileDiff> fileDiffsFromChanges(const vector<TreeChange> &changes)
+{
+    vector<FileDiff> files;
+    for (const auto &change : changes)
+    {
+        FileDiff file;
+        file.path = normalizePath(change.path);
+        if (change.status != 'A')
+        {
+            file.oldMode = change.oldEntry.mode;
+            file.oldSha = change.oldEntry.sha;
+        }
+        if (change.status != 'D')
+        {
+            file.newMode = change.newEntry.mode;
+            file.newSha = change.newEntry.sha;
+        }
+        files.push_back(move(file));
+    }
+    sort(files.begin(), files.end(), [](const FileDiff &x, const FileDiff &y)
+         { return x.path < y.path; });
+    return files;
+}
+
+// Prints the file diffs, one at a time (only the pair being compared is held in memory). With
+// nameStatus only "status<TAB>path" lines are printed.
+void printFileDiffs(const vector<FileDiff> &files, unsigned context, bool nameStatus)
+{
+    for (const auto &file : files)
+    {
+        if (nameStatus)
+        {
+            bool deleted = file.newSha.isNull() && file.worktreePath.empty();
+            cout << (file.oldSha.isNull() ? 'A' : deleted ? 'D' : 'M') << '\t' << file.path << "\n";
+            continue;
+        }
+        printFileDiff(file, context);
+    }
+}
+
+// ============= GARBAGE COLLECTION =============
+
+// gc keeps what the refs can reach and drops the rest: every object reachable from HEAD, the
+// branches, the commits recorded in logs/HEAD and the index (staged blobs and cached trees) is
+// packed into a single new pack, the loose copies are removed, and unreachable objects are
+// pruned once they are older than the grace period (gc.pruneExpire, default 2 weeks), so an
+// object a concurrent command has just written is never lost. Unreachable but recent objects
+// (and everything they reference) survive as loose objects.
+
+// Parses a prune expiry: "now", "never", "<n><s|m|h|d|w>" or "<n>.<unit>[.ago]" (e.g.
+// "2.weeks.ago"). seconds is -1 for "never".
+bool parseExpiry(const string &text, int64_t &seconds)
+{
+    string s = text;
+    if (s == "now")
+    {
+        seconds = 0;
+        return true;
+    }
+    if (s == "never")
+    {
+        seconds = -1;
+        return true;
+    }
+    replace(s.begin(), s.end(), '.', ' ');
+    istringstream in(s);
+    int64_t n;
+    string unit, ago;
+    if (!(in >> n) || n < 0)
+        return false;
+    in >> unit >> ago;
+    if (!ago.empty() && ago != "ago")
+        return false;
+    if (!unit.empty() && unit.back() == 's' && unit.size() > 1)
+        unit.pop_back();
+    static const map<string, int64_t> units = {
+        {"", 1}, {"s", 1}, {"second", 1}, {"m", 60}, {"minute", 60}, {"h", 3600}, {"hour", 3600},
+        {"d", 86400}, {"day", 86400}, {"w", 604800}, {"week", 604800}, {"month", 2592000}, {"year", 31536000}};
+    auto it = units.find(unit);
+    if (it == units.end())
+        return false;
+    seconds = n * it->second;
+    return true;
+}
+
+// Age of a file in seconds from its modification time (0 if it cannot be read)
+int64_t fileAge(const string &path)
+{
+    error_code ec;
+    auto mtime = fs::last_write_time(path, ec);
+    if (ec)
+        return 0;
+    return chrono::duration_cast<chrono::seconds>(fs::file_time_type::clock::now() - mtime).count();
+}
+
+// Reachability walk over commits, trees and blobs. Chunked blobs bring in their chunks. Roots
+// marked required must be complete: a missing object below them is recorded in missing, which
+// makes gc refuse to delete anything.
+class ReachabilityWalk
+{
+public:
+    enum Kind
+    {
+        ANY,
+        COMMIT,
+        TREE,
+        BLOB
+    };
+
+    // exists answers whether an object is stored; manifests maps loose chunked blobs to their chunks
+    ReachabilityWalk(function<bool(const ObjectId &)> exists, const unordered_map<ObjectId, vector<ObjectId>> &manifests)
+        : exists(move(exists)), manifests(manifests) {}
+
+    void add(const ObjectId &sha, Kind kind, bool required, const string &name = "")
+    {
+        if (!sha.isNull() && !names.count(sha))
+            pending.push_back(Item{sha, kind, required, name});
+    }
+
+    // Walks everything added so far; objects seen by earlier runs are not visited again
+    void run()
+    {
+        while (!pending.empty())
+        {
+            Item item = move(pending.back());
+            pending.pop_back();
+            if (names.count(item.sha))
+                continue;
+            if (!exists(item.sha))
+            {
+                if (item.required)
+                    missing.push_back(item.sha);
+                continue;
+            }
+            names[item.sha] = item.name;
+            order.push_back(item.sha);
+
+            Kind kind = item.kind;
+            if (kind == ANY)
+            {
+                string type;
+                uint64_t size;
+                if (!readObjectHeader(item.sha, type, size))
+                    continue;
+                kind = type == "commit" ? COMMIT : type == "tree" ? TREE : BLOB;
+            }
+            if (kind == COMMIT)
+            {
+                auto commit = loadCommit(item.sha);
+                if (commit->treeSha.isNull())
+                {
+                    if (item.required)
+                        missing.push_back(item.sha);
+                    continue;
+                }
+                add(commit->treeSha, TREE, item.required);
+                for (const auto &parent : commit->parents)
+                    add(parent, COMMIT, item.required);
+            }
+            else if (kind == TREE)
+            {
+                for (TreeEntryView entry : *loadTree(item.sha))
+                {
+                    if (entry.mode == "160000")
+                        continue; // Submodule commits live in another repository
+                    add(entry.sha, entry.isTree ? TREE : BLOB, item.required, string(entry.name));
+                }
+            }
+            else
+            {
+                auto it = manifests.find(item.sha);
+                if (it != manifests.end())
+                    for (const auto &chunk : it->second)
+                        add(chunk, BLOB, item.required, item.name);
+            }
+        }
+    }
+
+    bool contains(const ObjectId &sha) const { return names.count(sha) != 0; }
+
+    unordered_map<ObjectId, string> names; // Every object reached, with a file name hint
+    vector<ObjectId> order;                // The same objects in the order they were reached
+    vector<ObjectId> missing;
+
+private:
+    struct Item
+    {
+        ObjectId sha;
+        Kind kind;
+        bool required;
+        string name;
+    };
+    function<bool(const ObjectId &)> exists;
+    const unordered_map<ObjectId, vector<ObjectId>> &manifests;
+    vector<Item> pending;
+};
+
+// Loose chunk manifests and the chunks each one references
+unordered_map<ObjectId, vector<ObjectId>> listChunkManifests(const vector<ObjectId> &loose)
+{
+    unordered_map<ObjectId, vector<ObjectId>> manifests;
+    for (const auto &sha : loose)
+    {
+        if (!isChunkedLooseObject(sha))
+            continue;
+        FileView stored(getObjectPath(sha));
+        ChunkManifest manifest;
+        vector<ObjectId> &chunks = manifests[sha];
+        if (stored.valid() && parseChunkManifest(stored.data(), stored.size(), manifest))
+            for (const auto &chunk : manifest.chunks)
+                chunks.push_back(chunk.second);
+    }
+    return manifests;
+}
+
+// Adds the gc roots: HEAD and the branches, the commits in logs/HEAD, and the index
+void addReachabilityRoots(ReachabilityWalk &walk)
+{
+    for (const auto &tip : listRefTips())
+        walk.add(tip, ReachabilityWalk::COMMIT, true);
+
+    // The log may mention commits that are long gone, which is not an error; a new repository
+    // has no log at all
+    string logPath = REPO_DIR + "\\logs\\HEAD";
+    istringstream log(fileExists(logPath) ? readFile(logPath) : "");
+    string line;
+    while (getline(log, line))
+    {
+        ObjectId id;
+        if (line.compare(0, 7, "commit ") == 0 && ObjectId::fromHex(line.substr(7), id))
+            walk.add(id, ReachabilityWalk::COMMIT, false);
+    }
+
+    // Staged blobs are not in any commit yet, and commit reuses the cache tree's SHAs
+    CacheTree cacheTree;
+    for (const auto &entry : readIndex(&cacheTree))
+        if (entry.mode != "160000")
+            walk.add(entry.sha, ReachabilityWalk::BLOB, true, getFilename(entry.path));
+    for (const auto &node : cacheTree)
+        walk.add(node.second.sha, ReachabilityWalk::TREE, true);
+}
+
+// Reachability bitmaps (objects/pack/pack-<hex>.bitmap) record, for each branch tip, which
+// objects of the pack that tip reaches, so counting or sending reachable objects needs no
+// history walk. Bit i stands for the i-th SHA of the pack's idx; the bits are run-length
+// compressed as 64-bit words, EWAH-style: each marker word holds a run bit (63), the number of
+// words of all run bits that follow (62..32) and the number of literal words after that run
+// (31..0). Objects a tip reaches that are not in the pack (chunk manifests stay loose) are
+// listed by ID. All integers big-endian.
+//   "MGBM" | version u32 | pack object count u32 | entry count u32 | entries
+//   entry = commit ID | extra count u32 | extra IDs | word count u32 | words (u64)
+const char BITMAP_MAGIC[] = "MGBM";
+const uint32_t BITMAP_VERSION = 1;
+
+string bitmapPathFor(const string &packPath)
+{
+    return packPath.substr(0, packPath.size() - 5) + ".bitmap";
+}
+
+// Run-length compresses a bit vector
+vector<uint64_t> compressBitmap(const vector<uint64_t> &words)
+{
+    vector<uint64_t> out;
+    const uint64_t ones = ~uint64_t(0);
+    for (size_t i = 0; i < words.size();)
+    {
+        uint64_t runBit = words[i] == ones ? 1 : 0;
+        uint64_t runWord = runBit ? ones : 0;
+        size_t run = 0;
+        while (i < words.size() && words[i] == runWord && run < 0x7fffffff)
+        {
+            run++;
+            i++;
+        }
+        size_t start = i;
+        while (i < words.size() && words[i] != 0 && words[i] != ones && i - start < 0xffffffff)
+            i++;
+        out.push_back(runBit << 63 | uint64_t(run) << 32 | uint64_t(i - start));
+        out.insert(out.end(), words.begin() + start, words.begin() + i);
+    }
+    return out;
+}
+
+// Expands compressed words into bits set in result (which must hold the pack's bit count)
+bool expandBitmap(const char *p, size_t wordCount, vector<uint64_t> &result)
+{
+    size_t pos = 0;
+    for (size_t w = 0; w < wordCount;)
+    {
+        uint64_t marker = readU64(p + 8 * w++);
+        uint64_t run = (marker >> 32) & 0x7fffffff, literals = marker & 0xffffffff;
+        if (pos + run + literals > result.size() || w + literals > wordCount)
+            return false;
+        if (marker >> 63)
+            for (uint64_t k = 0; k < run; k++)
+                result[pos + k] = ~uint64_t(0);
+        pos += run;
+        for (uint64_t k = 0; k < literals; k++)
+            result[pos++] |= readU64(p + 8 * w++);
+    }
+    return true;
+}
+
+// Writes the bitmap of the given pack for every tip; each tip is walked on its own
+bool writeReachabilityBitmaps(const PackFile &pack, const vector<ObjectId> &tips,
+                              const unordered_map<ObjectId, vector<ObjectId>> &manifests, size_t &written)
+{
+    string data(BITMAP_MAGIC, 4);
+    appendU32(data, BITMAP_VERSION);
+    appendU32(data, pack.count);
+    appendU32(data, 0); // Entry count, filled in below
+    written = 0;
+    for (const auto &tip : tips)
+    {
+        ReachabilityWalk walk(objectExists, manifests);
+        walk.add(tip, ReachabilityWalk::COMMIT, true);
+        walk.run();
+        if (!walk.missing.empty())
+            continue;
+        vector<uint64_t> bits((pack.count + 63) / 64);
+        vector<ObjectId> extra;
+        for (const auto &sha : walk.order)
+        {
+            uint32_t index;
+            if (pack.position(sha, index))
+                bits[index / 64] |= uint64_t(1) << (index % 64);
+            else
+                extra.push_back(sha);
+        }
+        vector<uint64_t> words = compressBitmap(bits);
+        data.append(reinterpret_cast<const char *>(tip.bytes), objectIdLength);
+        appendU32(data, static_cast<uint32_t>(extra.size()));
+        for (const auto &sha : extra)
+            data.append(reinterpret_cast<const char *>(sha.bytes), objectIdLength);
+        appendU32(data, static_cast<uint32_t>(words.size()));
+        for (uint64_t word : words)
+            appendU64(data, word);
+        written++;
+    }
+    for (int i = 0; i < 4; i++)
+        data[12 + i] = static_cast<char>(written >> (24 - 8 * i));
+
+    string path = bitmapPathFor(pack.packPath);
+    string tempPath = path + ".tmp";
+    if (!writeFileDirect(tempPath, data.data(), data.size()))
+        return false;
+    error_code ec;
+    fs::rename(tempPath, path, ec);
+    return !ec;
+}
+
+// Collects the objects reachable from all the tips from a pack's bitmap, without walking.
+// Returns false (objects untouched) if no pack has a bitmap covering every tip.
+bool bitmapReachable(const vector<ObjectId> &tips, vector<ObjectId> &objects)
+{
+    for (const auto &pack : *getPacks())
+    {
+        FileView file(bitmapPathFor(pack->packPath));
+        if (!file.valid() || file.size() < 16 || memcmp(file.data(), BITMAP_MAGIC, 4) != 0 ||
+            readU32(file.data() + 4) != BITMAP_VERSION || readU32(file.data() + 8) != pack->count)
+            continue;
+
+        // Index the entries by tip ID
+        unordered_map<ObjectId, const char *> entries;
+        const char *p = file.data() + 16, *end = file.data() + file.size();
+        bool valid = true;
+        for (uint32_t n = readU32(file.data() + 12); n > 0 && valid; n--)
+        {
+            if (end - p < ptrdiff_t(objectIdLength + 8))
+            {
+                valid = false;
+                break;
+            }
+            const char *entry = p;
+            p += objectIdLength;
+            uint64_t extra = readU32(p);
+            p += 4;
+            if (uint64_t(end - p) < extra * objectIdLength + 4)
+                valid = false;
+            else
+            {
+                p += extra * objectIdLength;
+                uint64_t words = readU32(p);
+                p += 4;
+                valid = uint64_t(end - p) >= words * 8;
+                p += valid ? words * 8 : 0;
+            }
+            entries[ObjectId::fromRaw(entry)] = entry;
+        }
+        if (!valid)
+            continue;
+
+        vector<uint64_t> bits((pack->count + 63) / 64);
+        vector<ObjectId> extra;
+        for (const auto &tip : tips)
+        {
+            auto it = entries.find(tip);
+            if (it == entries.end())
+            {
+                valid = false;
+                break;
+            }
+            const char *q = it->second + objectIdLength;
+            uint32_t extraCount = readU32(q);
+            q += 4;
+            for (uint32_t k = 0; k < extraCount; k++, q += objectIdLength)
+                extra.push_back(ObjectId::fromRaw(q));
+            uint32_t wordCount = readU32(q);
+            if (!expandBitmap(q + 4, wordCount, bits))
+            {
+                valid = false;
+                break;
+            }
+        }
+        if (!valid)
+            continue;
+
+        objects.clear();
+        for (uint32_t i = 0; i < pack->count; i++)
+            if (bits[i / 64] >> (i % 64) & 1)
+                objects.push_back(pack->shaAt(i));
+        sort(extra.begin(), extra.end());
+        extra.erase(unique(extra.begin(), extra.end()), extra.end());
+        objects.insert(objects.end(), extra.begin(), extra.end());
+        return true;
+    }
+    return false;
+}
+
+// ============= REMOTE TRANSFER =============
+
+// fetch and push talk to a mygit process in the other repository over a pair of pipes: run
+// directly ("mygit upload-pack <path>") for a local path, or through ssh for "[user@]host:path"
+// and "ssh://[user@]host[:port]/path". The protocol is line based until the pack:
+//   server: "mygit <service> <sha1|sha256>", then "<id> <ref>" per ref (HEAD and refs/heads/*), "end"
+//   fetch (upload-pack):
+//     client: "want <id>" per missing tip, "end"; no wants ends the conversation
+//     client: up to HAVES_PER_ROUND "have <id>" lines, "end"    server: "ack <id>" per common have, "end"
+//     ... more rounds ...
+//     client: "done"                                            server: "pack <n>", pack stream
+//   push (receive-pack):
+//     client: "update <old id> <new id> <ref>" per branch, "end", then "pack <n>" and the pack stream
+//     server: "ok <ref>" or "ng <ref> <reason>" per update, "end"
+// The pack holds only what the receiver lacks: the objects reachable from the new tips but not
+// from the commits both sides have, found with the commit graph; it is thin, i.e. objects may be
+// deltas against the receiver's copies of the same files. The receiver indexes it while it
+// streams in and installs it as it came (see receivePack). The null ID stands for "no ref".
+const size_t CHANNEL_BUFFER_SIZE = 64 * 1024;
+const size_t MAX_PROTOCOL_LINE = 64 * 1024;
+const size_t HAVES_PER_ROUND = 32;
+const size_t MAX_HAVES_IN_VAIN = 256; // Haves without a new ack before the client gives up
+
+#ifdef _WIN32
+typedef HANDLE PipeHandle;
+#else
+typedef int PipeHandle;
+#endif
+
+// Buffered byte stream over a pair of pipes: the remote process's stdout and stdin, or (in the
+// server) this process's own stdin and stdout
+class Channel
+{
+public:
+    Channel(PipeHandle input, PipeHandle output) : in(input), out(output) {}
+    Channel(const Channel &) = delete;
+    Channel &operator=(const Channel &) = delete;
+
+    bool write(const char *data, size_t len)
+    {
+        if (outBuf.size() + len > CHANNEL_BUFFER_SIZE && !flush())
+            return false;
+        if (len >= CHANNEL_BUFFER_SIZE)
+            return writeRaw(data, len);
+        outBuf.append(data, len);
+        return true;
+    }
+
+    bool writeLine(const string &line)
+    {
+        return write(line.data(), line.size()) && write("\n", 1);
+    }
+
+    bool flush()
+    {
+        bool ok = writeRaw(outBuf.data(), outBuf.size());
+        outBuf.clear();
+        return ok;
+    }
+
+    // The buffered input (at least one byte), or nullptr at the end of the stream
+    const char *peek(size_t &available)
+    {
+        if (pos == inBuf.size() && !fill())
+        {
+            available = 0;
+            return nullptr;
+        }
+        available = inBuf.size() - pos;
+        return inBuf.data() + pos;
+    }
+
+    void consume(size_t n) { pos += n; }
+
+    // Reads exactly len bytes
+    bool read(char *data, size_t len)
+    {
+        while (len > 0)
+        {
+            size_t available;
+            const char *p = peek(available);
+            if (!p)
+                return false;
+            size_t n = min(available, len);
+            memcpy(data, p, n);
+            consume(n);
+            data += n;
+            len -= n;
+        }
+        return true;
+    }
+
+    // Reads one line without its newline; false at the end of the stream or for an overlong line
+    bool readLine(string &line)
+    {
+        line.clear();
+        for (;;)
+        {
+            size_t available;
+            const char *p = peek(available);
+            if (!p)
+                return false;
+            const char *newline = static_cast<const char *>(memchr(p, '\n', available));
+            size_t n = newline ? static_cast<size_t>(newline - p) : available;
+            if (line.size() + n > MAX_PROTOCOL_LINE)
+                return false;
+            line.append(p, n);
+            consume(newline ? n + 1 : n);
+            if (newline)
+                return true;
+        }
+    }
+
+private:
+    bool fill()
+    {
+        inBuf.resize(CHANNEL_BUFFER_SIZE);
+        pos = 0;
+#ifdef _WIN32
+        DWORD n = 0;
+        if (!ReadFile(in, &inBuf[0], static_cast<DWORD>(inBuf.size()), &n, NULL))
+            n = 0; // ERROR_BROKEN_PIPE: the other side closed its end
+#else
+        ssize_t n;
+        do
+            n = ::read(in, &inBuf[0], inBuf.size());
+        while (n < 0 && errno == EINTR);
+        if (n < 0)
+            n = 0;
+#endif
+        inBuf.resize(static_cast<size_t>(n));
+        return n > 0;
+    }
+
+    bool writeRaw(const char *data, size_t len)
+    {
+        while (len > 0)
+        {
+#ifdef _WIN32
+            DWORD n = 0;
+            if (!WriteFile(out, data, static_cast<DWORD>(min<size_t>(len, 1 << 30)), &n, NULL) || n == 0)
+                return false;
+#else
+            ssize_t n = ::write(out, data, len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+#endif
+            data += n;
+            len -= static_cast<size_t>(n);
+        }
+        return true;
+    }
+
+    PipeHandle in, out;
+    string inBuf, outBuf;
+    size_t pos = 0;
+};
+
+// Lets a PackWriter stream straight into a channel
+class ChannelStreamBuf : public streambuf
+{
+public:
+    explicit ChannelStreamBuf(Channel &channel) : channel(channel) {}
+
+protected:
+    int_type overflow(int_type c) override
+    {
+        if (traits_type::eq_int_type(c, traits_type::eof()))
+            return traits_type::not_eof(c);
+        char ch = traits_type::to_char_type(c);
+        return channel.write(&ch, 1) ? c : traits_type::eof();
+    }
+
+    streamsize xsputn(const char *s, streamsize n) override
+    {
+        return channel.write(s, static_cast<size_t>(n)) ? n : 0;
+    }
+
+private:
+    Channel &channel;
+};
+
+// A writer whose reader went away gets an error instead of SIGPIPE
+void ignoreBrokenPipes()
+{
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+// The server's end of the connection: stdin and stdout
+unique_ptr<Channel> openStdioChannel()
+{
+    ignoreBrokenPipes();
+#ifdef _WIN32
+    return make_unique<Channel>(GetStdHandle(STD_INPUT_HANDLE), GetStdHandle(STD_OUTPUT_HANDLE));
+#else
+    return make_unique<Channel>(0, 1);
+#endif
+}
+
+// Splits a remote URL into an ssh host (empty for a local repository), port and repository path.
+// "C:\repo" is a local path, not host "C". Returns false for a host that would pass as an ssh option.
+bool parseRemoteUrl(const string &url, string &host, string &port, string &path)
+{
+    host.clear();
+    port.clear();
+    if (url.compare(0, 7, "file://") == 0)
+    {
+        path = url.substr(7);
+        return !path.empty();
+    }
+    if (url.compare(0, 6, "ssh://") == 0)
+    {
+        size_t slash = url.find('/', 6);
+        if (slash == string::npos)
+            return false;
+        host = url.substr(6, slash - 6);
+        path = url.substr(slash);
+        size_t colon = host.rfind(':');
+        if (colon != string::npos && host.find(']') == string::npos)
+        {
+            port = host.substr(colon + 1);
+            host.erase(colon);
+        }
+        if (path.compare(0, 3, "/~/") == 0)
+            path.erase(0, 3); // Relative to the home directory
+    }
+    else
+    {
+        size_t colon = url.find(':');
+        size_t slash = url.find_first_of("/\\");
+        if (colon == string::npos || colon < 2 || (slash != string::npos && slash < colon))
+        {
+            path = url;
+            return !path.empty();
+        }
+        host = url.substr(0, colon);
+        path = url.substr(colon + 1);
+    }
+    if (host.empty() || host[0] == '-' || path.empty() || port.find_first_not_of("0123456789") != string::npos)
+    {
+        cerr << "Error: Invalid remote URL " << url << endl;
+        return false;
+    }
+    return true;
+}
+
+// Quotes a word for the remote shell ssh runs the command in
+string shellQuote(const string &word)
+{
+    string quoted = "'";
+    for (char c : word)
+        quoted += c == '\'' ? string("'\\''") : string(1, c);
+    return quoted + "'";
+}
+
+// The mygit process at the other end of a fetch or push
+class RemoteConnection
+{
+public:
+    RemoteConnection() = default;
+    RemoteConnection(const RemoteConnection &) = delete;
+    RemoteConnection &operator=(const RemoteConnection &) = delete;
+    ~RemoteConnection() { close(); }
+
+    // Starts "mygit <service> <path>" for the URL
+    bool open(const string &url, const string &service)
+    {
+        string host, port, path;
+        if (!parseRemoteUrl(url, host, port, path))
+            return false;
+        string remoteCommand = "mygit " + service + " " + shellQuote(path);
+        ignoreBrokenPipes();
+#ifdef _WIN32
+        string commandLine;
+        if (host.empty())
+        {
+            char exe[MAX_PATH];
+            if (!GetModuleFileNameA(NULL, exe, MAX_PATH))
+                return false;
+            commandLine = "\"" + string(exe) + "\" " + service + " \"" + path + "\"";
+        }
+        else
+            commandLine = "ssh " + (port.empty() ? string() : "-p " + port + " ") + host + " \"" + remoteCommand + "\"";
+        SECURITY_ATTRIBUTES inherit{sizeof(SECURITY_ATTRIBUTES), NULL, TRUE};
+        HANDLE childIn = NULL, childOut = NULL;
+        if (!CreatePipe(&childIn, &toChild, &inherit, 0) || !CreatePipe(&fromChild, &childOut, &inherit, 0))
+        {
+            cerr << "Error: Cannot create pipes for " << url << endl;
+            return false;
+        }
+        SetHandleInformation(toChild, HANDLE_FLAG_INHERIT, 0);
+        SetHandleInformation(fromChild, HANDLE_FLAG_INHERIT, 0);
+        STARTUPINFOA startup{};
+        startup.cb = sizeof(startup);
+        startup.dwFlags = STARTF_USESTDHANDLES;
+        startup.hStdInput = childIn;
+        startup.hStdOutput = childOut;
+        startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+        PROCESS_INFORMATION info;
+        bool started = CreateProcessA(NULL, &commandLine[0], NULL, NULL, TRUE, 0, NULL, NULL, &startup, &info);
+        CloseHandle(childIn);
+        CloseHandle(childOut);
+        if (!started)
+        {
+            cerr << "Error: Cannot run " << commandLine << endl;
+            return false;
+        }
+        CloseHandle(info.hThread);
+        process = info.hProcess;
+#else
+        int down[2], up[2];
+        if (pipe(down) != 0)
+            return false;
+        if (pipe(up) != 0)
+        {
+            ::close(down[0]);
+            ::close(down[1]);
+            return false;
+        }
+        cout.flush();
+        cerr.flush();
+        pid = fork();
+        if (pid == 0)
+        {
+            dup2(down[0], 0);
+            dup2(up[1], 1);
+            for (int fd : {down[0], down[1], up[0], up[1]})
+                ::close(fd);
+            if (host.empty())
+            {
+                execl("/proc/self/exe", "mygit", service.c_str(), path.c_str(), static_cast<char *>(nullptr));
+                execlp("mygit", "mygit", service.c_str(), path.c_str(), static_cast<char *>(nullptr));
+            }
+            else if (port.empty())
+                execlp("ssh", "ssh", host.c_str(), remoteCommand.c_str(), static_cast<char *>(nullptr));
+            else
+                execlp("ssh", "ssh", "-p", port.c_str(), host.c_str(), remoteCommand.c_str(), static_cast<char *>(nullptr));
+            cerr << "Error: Cannot run " << (host.empty() ? "mygit" : "ssh") << ": " << strerror(errno) << endl;
+            _exit(127);
+        }
+        ::close(down[0]);
+        ::close(up[1]);
+        toChild = down[1];
+        fromChild = up[0];
+        if (pid < 0)
+        {
+            cerr << "Error: Cannot start a process for " << url << endl;
+            return false;
+        }
+#endif
+        chan = make_unique<Channel>(fromChild, toChild);
+        return true;
+    }
+
+    Channel &channel() { return *chan; }
+
+    // Closes the pipes and waits for the process; true if it exited successfully
+    bool close()
+    {
+        chan.reset();
+        bool ok = false;
+#ifdef _WIN32
+        for (HANDLE *h : {&toChild, &fromChild})
+        {
+            if (*h)
+                CloseHandle(*h);
+            *h = NULL;
+        }
+        if (process)
+        {
+            DWORD code = 1;
+            WaitForSingleObject(process, INFINITE);
+            ok = GetExitCodeProcess(process, &code) && code == 0;
+            CloseHandle(process);
+            process = NULL;
+        }
+#else
+        for (int *fd : {&toChild, &fromChild})
+        {
+            if (*fd >= 0)
+                ::close(*fd);
+            *fd = -1;
+        }
+        if (pid > 0)
+        {
+            int status = 0;
+            while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+                ;
+            ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+            pid = -1;
+        }
+#endif
+        return ok;
+    }
+
+private:
+    unique_ptr<Channel> chan;
+#ifdef _WIN32
+    HANDLE process = NULL;
+    HANDLE toChild = NULL, fromChild = NULL;
+#else
+    pid_t pid = -1;
+    int toChild = -1, fromChild = -1;
+#endif
+};
+
+// The URL of a remote given by name (remote.<name>.url), or the argument itself if it is none
+string remoteUrl(const string &remote, bool &named)
+{
+    string url = getConfig("remote." + remote + ".url");
+    named = !url.empty();
+    return named ? url : remote;
+}
+
+// True for a ref a push may update: refs/heads/<name>, where no component is empty, starts with
+// a dot or ends in ".lock", and there is no "..", control character or character git forbids
+bool isValidBranchRef(const string &ref)
+{
+    const string prefix = "refs/heads/";
+    if (ref.compare(0, prefix.size(), prefix) != 0 || ref.size() == prefix.size() || ref.find("..") != string::npos)
+        return false;
+    for (unsigned char c : ref)
+        if (c < 0x20 || c == 0x7f || strchr(" ~^:?*[\\", c))
+            return false;
+    istringstream components(ref.substr(prefix.size()));
+    string component;
+    while (getline(components, component, '/'))
+    {
+        if (component.empty() || component[0] == '.' ||
+            (component.size() >= 5 && component.compare(component.size() - 5, 5, ".lock") == 0))
+            return false;
+    }
+    return ref.back() != '/';
+}
+
+// The commit a ref file points to, or the null ID if there is no such ref
+ObjectId readRefFile(const string &path)
+{
+    ObjectId id;
+    if (fs::is_regular_file(path))
+        ObjectId::fromHex(readFile(path).substr(0, 2 * objectIdLength), id);
+    return id;
+}
+
+// The refs a repository offers: HEAD (if it names a commit) and its branches, by name
+vector<pair<string, ObjectId>> listLocalRefs()
+{
+    vector<pair<string, ObjectId>> refs;
+    ObjectId head = getHEAD();
+    if (!head.isNull())
+        refs.emplace_back("HEAD", head);
+    string headsDir = REPO_DIR + "\\refs\\heads";
+    error_code ec;
+    if (isDirectory(headsDir))
+    {
+        for (const auto &entry : fs::recursive_directory_iterator(headsDir, ec))
+        {
+            ObjectId id;
+            string name = "refs/heads/" + fs::relative(entry.path(), headsDir, ec).generic_string();
+            if (entry.is_regular_file() && isValidBranchRef(name) &&
+                ObjectId::fromHex(readFile(entry.path().string()).substr(0, 2 * objectIdLength), id))
+                refs.emplace_back(name, id);
+        }
+    }
+    sort(refs.begin(), refs.end());
+    return refs;
+}
+
+const char *objectFormatName()
+{
+    return objectFormat == HashAlgorithm::SHA256 ? "sha256" : "sha1";
+}
+
+bool advertiseRefs(Channel &channel, const string &service)
+{
+    bool ok = channel.writeLine("mygit " + service + " " + objectFormatName());
+    for (const auto &ref : listLocalRefs())
+        ok = ok && channel.writeLine(ref.second.hex() + " " + ref.first);
+    return ok && channel.writeLine("end") && channel.flush();
+}
+
+// Reads the server's greeting and refs; checks that both repositories name objects alike and
+// that every ref is HEAD or a valid branch name
+bool readAdvertisement(Channel &channel, const string &service, map<string, ObjectId> &refs)
+{
+    string line;
+    if (!channel.readLine(line))
+    {
+        cerr << "Error: The remote did not answer (is it a mygit repository?)" << endl;
+        return false;
+    }
+    string expected = "mygit " + service + " ";
+    if (line.compare(0, expected.size(), expected) != 0)
+    {
+        cerr << "Error: Unexpected answer from the remote: " << line << endl;
+        return false;
+    }
+    if (line.substr(expected.size()) != objectFormatName())
+    {
+        cerr << "Error: The remote repository uses " << line.substr(expected.size()) << " object IDs, this one "
+             << objectFormatName() << endl;
+        return false;
+    }
+    while (channel.readLine(line))
+    {
+        if (line == "end")
+            return true;
+        ObjectId id;
+        size_t space = line.find(' ');
+        if (space == string::npos || !ObjectId::fromHex(line.substr(0, space), id))
+            break;
+        // The names become paths under refs/remotes and lines of FETCH_HEAD
+        string name = line.substr(space + 1);
+        if (name != "HEAD" && !isValidBranchRef(name))
+        {
+            cerr << "Error: The remote advertised an invalid ref name: " << name << endl;
+            return false;
+        }
+        refs[name] = id;
+    }
+    cerr << "Error: The remote sent a corrupt ref list" << endl;
+    return false;
+}
+
+// Parses "<keyword> <id>"
+bool parseIdLine(const string &line, const string &keyword, ObjectId &id)
+{
+    return line.size() > keyword.size() && line.compare(0, keyword.size() + 1, keyword + " ") == 0 &&
+           ObjectId::fromHex(line.substr(keyword.size() + 1), id);
+}
+
+// Finds the objects a pack must hold for a receiver that has the commits in haves to get wants:
+// those reachable from wants but not from haves. Commits are painted in decreasing generation
+// order as in mergeBases, and the walk stops once every queued commit is reachable from a have,
+// so only the new commits and the boundary below them are visited. The trees of the boundary
+// commits are walked to leave out what the receiver already has; their objects, by file name,
+// are the bases of the thin pack. Returns false if an object that must be sent is missing.
+bool findObjectsToSend(const vector<ObjectId> &wants, const vector<ObjectId> &haves, vector<PackInput> &objects,
+                       ThinPackBases &bases)
+{
+    enum
+    {
+        WANTED = 1,
+        HAVE = 2
+    };
+    struct Queued
+    {
+        CommitNode node;
+        bool have;
+    };
+    auto later = [](const Queued &x, const Queued &y)
+    {
+        if (x.node.generation != y.node.generation)
+            return x.node.generation < y.node.generation;
+        return x.node.time < y.node.time;
+    };
+    priority_queue<Queued, vector<Queued>, decltype(later)> queue(later);
+    unordered_map<ObjectId, int> flags;
+    size_t active = 0; // Queued entries that were pushed without HAVE
+
+    auto push = [&](const ObjectId &id, int flag)
+    {
+        int &f = flags[id];
+        if ((f & flag) == flag)
+            return;
+        f |= flag;
+        Queued q{CommitNode(), (f & HAVE) != 0};
+        if (!lookupCommitNode(id, q.node))
+            return;
+        if (!q.have)
+            active++;
+        queue.push(move(q));
+    };
+
+    for (const auto &have : haves)
+        if (objectExists(have))
+            push(have, HAVE);
+    for (const auto &want : wants)
+        push(want, WANTED);
+    unordered_set<ObjectId> visited, edges;
+    while (!queue.empty() && active > 0)
+    {
+        Queued q = queue.top();
+        queue.pop();
+        if (!q.have)
+            active--;
+        if (!visited.insert(q.node.id).second)
+            continue; // Its flags were final the first time
+        int f = flags[q.node.id];
+        if (!(f & HAVE))
+            edges.insert(q.node.parents.begin(), q.node.parents.end());
+        for (const auto &parent : q.node.parents)
+            push(parent, f);
+    }
+
+    // Everything in the trees of the commits the new ones build on
+    static const unordered_map<ObjectId, vector<ObjectId>> noManifests; // Chunked blobs go as whole blobs
+    ReachabilityWalk known(objectExists, noManifests);
+    for (const auto &edge : edges)
+    {
+        CommitNode node;
+        if ((flags[edge] & HAVE) && lookupCommitNode(edge, node))
+            known.add(node.tree, ReachabilityWalk::TREE, false);
+    }
+    known.run();
+    for (const auto &object : known.names)
+        bases[object.second] = object.first;
+
+    // Every commit the receiver has that the new ones lead to was painted HAVE
+    auto received = [&](const ObjectId &sha)
+    {
+        auto it = flags.find(sha);
+        return (it != flags.end() && (it->second & HAVE)) || known.contains(sha);
+    };
+    ReachabilityWalk walk([&](const ObjectId &sha)
+                          { return !received(sha) && objectExists(sha); },
+                          noManifests);
+    for (const auto &want : wants)
+        walk.add(want, ReachabilityWalk::COMMIT, true);
+    walk.run();
+    for (const auto &sha : walk.missing)
+    {
+        if (!received(sha))
+        {
+            cerr << "Error: Object " << sha << " is missing; cannot send " << wants.front() << endl;
+            return false;
+        }
+    }
+    objects.clear();
+    objects.reserve(walk.order.size());
+    for (const auto &sha : walk.order)
+        objects.push_back(PackInput{sha, walk.names[sha]});
+    return true;
+}
+
+// Announces and streams a thin pack of the objects
+bool sendPack(Channel &channel, const vector<PackInput> &objects, const ThinPackBases &bases)
+{
+    if (!channel.writeLine("pack " + to_string(objects.size())))
+        return false;
+    ChannelStreamBuf buffer(channel);
+    ostream out(&buffer);
+    ObjectId checksum;
+    vector<PackIndexEntry> entries;
+    if (!writePackStream(out, objects, PackOptions(), &bases, checksum, entries) || !channel.flush())
+    {
+        cerr << "Error: Cannot send the pack" << endl;
+        return false;
+    }
+    return true;
+}
+
+// Indexes a pack while it streams in from a channel. Every entry is written to the temporary
+// pack file as it arrives and inflated on the way to compute its ID: whole objects right away,
+// deltas against an earlier entry (recently resolved ones are kept in memory, older ones are
+// read back from the file) or, in a thin pack, against the repository's own object. When the
+// last entry is in, the index is already complete, so the pack is installed as it came, without
+// loose objects or a second pass over its data.
+class PackReceiver
+{
+public:
+    explicit PackReceiver(Channel &channel) : channel(channel) {}
+
+    ~PackReceiver()
+    {
+        if (!tempPath.empty())
+        {
+            file.close();
+            error_code ec;
+            fs::remove(tempPath, ec);
+        }
+    }
+
+    // Receives the pack; packName is "" for an empty one
+    bool receive(string &packName, uint32_t &count)
+    {
+        string packDir = REPO_DIR + "\\objects\\pack";
+        fs::create_directories(packDir);
+        tempPath = packDir + "\\tmp_pack_" + getFilename(getTempObjectPath());
+        file.open(tempPath, ios::binary);
+        char header[12];
+        if (!file || !channel.read(header, sizeof(header)) || memcmp(header, "PACK", 4) != 0 || readU32(header + 4) != PACK_VERSION)
+            return fail("not a pack");
+        emit(header, sizeof(header));
+        count = readU32(header + 8);
+        entries.reserve(min<uint32_t>(count, 1 << 16)); // The count is only a claim until the entries arrive
+        try
+        {
+            for (uint32_t i = 0; i < count; i++)
+                if (!receiveEntry())
+                    return false;
+        }
+        catch (const bad_alloc &)
+        {
+            return fail("an entry is too large to hold in memory");
+        }
+
+        char trailer[MAX_OBJECT_ID_LENGTH];
+        if (!channel.read(trailer, objectIdLength))
+            return fail("truncated pack");
+        ObjectId checksum = hasher.final();
+        if (memcmp(trailer, checksum.raw(), objectIdLength) != 0)
+            return fail("pack checksum mismatch");
+        file.write(trailer, objectIdLength);
+        file.close();
+        if (!file)
+            return fail("cannot write the pack file");
+        packName.clear();
+        if (count == 0)
+            return true;
+
+        vector<PackIndexEntry> index;
+        index.reserve(entries.size());
+        for (const auto &e : entries)
+            index.push_back(PackIndexEntry{e.sha, e.crc, e.offset});
+        packName = installPack(tempPath, buildPackIndex(move(index), checksum), checksum);
+        tempPath.clear(); // installPack moved or removed it
+        return !packName.empty();
+    }
+
+private:
+    struct Entry
+    {
+        uint64_t offset = 0, end = 0;
+        int kind = 0;            // Entry type (whole object type, OFS_DELTA or REF_DELTA)
+        int type = 0;            // Object type once resolved
+        uint32_t crc = 0;
+        size_t base = SIZE_MAX;  // In-pack delta base
+        ObjectId externalBase;   // REF_DELTA base outside the pack
+        ObjectId sha;
+    };
+
+    bool fail(const string &reason)
+    {
+        cerr << "Error: Cannot receive pack: " << reason << endl;
+        return false;
+    }
+
+    // Appends received bytes to the pack file and the checksums
+    void emit(const char *data, size_t len)
+    {
+        file.write(data, len);
+        hasher.update(data, len);
+        crc = static_cast<uint32_t>(crc32(crc, reinterpret_cast<const Bytef *>(data), static_cast<uInt>(len)));
+        written += len;
+    }
+
+    bool readByte(unsigned char &c)
+    {
+        char ch;
+        if (!channel.read(&ch, 1))
+            return false;
+        emit(&ch, 1);
+        c = static_cast<unsigned char>(ch);
+        return true;
+    }
+
+    // Inflates the zlib stream at the channel's position into exactly size bytes. The size comes
+    // from the sender, so the buffer grows with the data actually inflated instead of being
+    // allocated up front.
+    bool inflateEntry(uint64_t size, string &out)
+    {
+        out.resize(static_cast<size_t>(min<uint64_t>(size, STREAM_CHUNK_SIZE)));
+        z_stream stream{};
+        if (inflateInit(&stream) != Z_OK)
+            return false;
+        char spill[16]; // Output beyond size means a corrupt entry
+        stream.next_out = reinterpret_cast<Bytef *>(size ? &out[0] : spill);
+        stream.avail_out = static_cast<uInt>(size ? out.size() : sizeof(spill));
+        int result = Z_OK;
+        bool grown = false;
+        while (result != Z_STREAM_END)
+        {
+            // Right after the buffer grew, zlib may still hold output for input it has consumed
+            size_t available = 0;
+            const char *p = grown ? nullptr : channel.peek(available);
+            if (!p && !grown)
+                break;
+            stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(p));
+            stream.avail_in = static_cast<uInt>(min<size_t>(available, UINT32_MAX));
+            uInt before = stream.avail_in;
+            result = inflate(&stream, Z_NO_FLUSH);
+            size_t used = before - stream.avail_in;
+            if (used)
+            {
+                emit(p, used);
+                channel.consume(used);
+            }
+            grown = false;
+            if (result != Z_OK && result != Z_STREAM_END && result != Z_BUF_ERROR)
+                break;
+            if (stream.avail_out == 0 && result != Z_STREAM_END)
+            {
+                if (stream.total_out > size)
+                    break;
+                if (stream.total_out < size)
+                {
+                    out.resize(static_cast<size_t>(min<uint64_t>(size, 2 * uint64_t(out.size()))));
+                    stream.next_out = reinterpret_cast<Bytef *>(&out[stream.total_out]);
+                    stream.avail_out = static_cast<uInt>(min<size_t>(out.size() - stream.total_out, UINT32_MAX));
+                }
+                else
+                {
+                    stream.next_out = reinterpret_cast<Bytef *>(spill);
+                    stream.avail_out = sizeof(spill);
+                }
+                grown = true;
+            }
+        }
+        bool ok = result == Z_STREAM_END && stream.total_out == size;
+        inflateEnd(&stream);
+        return ok;
+    }
+
+    bool receiveEntry()
+    {
+        Entry e;
+        e.offset = written;
+        crc = 0;
+        string headerBytes;
+        unsigned char c;
+        do
+        {
+            if (!readByte(c))
+                return fail("truncated pack");
+            headerBytes.push_back(static_cast<char>(c));
+        } while (c & 0x80);
+        size_t pos = 0;
+        uint64_t size;
+        if (!decodePackEntryHeader(headerBytes.data(), headerBytes.size(), pos, e.kind, size))
+            return fail("corrupt entry header");
+
+        if (e.kind == OBJ_OFS_DELTA)
+        {
+            string distance;
+            do
+            {
+                if (!readByte(c))
+                    return fail("truncated pack");
+                distance.push_back(static_cast<char>(c));
+            } while (c & 0x80);
+            size_t p = 0;
+            uint64_t dist;
+            auto base = entryAt.end();
+            if (decodeOfsDeltaDistance(distance.data(), distance.size(), p, dist) && dist > 0 && dist <= e.offset)
+                base = entryAt.find(e.offset - dist);
+            if (base == entryAt.end())
+                return fail("delta base offset is not an entry");
+            e.base = base->second;
+        }
+        else if (e.kind == OBJ_REF_DELTA)
+        {
+            char raw[MAX_OBJECT_ID_LENGTH];
+            if (!channel.read(raw, objectIdLength))
+                return fail("truncated pack");
+            emit(raw, objectIdLength);
+            ObjectId baseSha = ObjectId::fromRaw(raw);
+            auto inPack = entryWithId.find(baseSha);
+            if (inPack != entryWithId.end())
+                e.base = inPack->second;
+            else if (objectExists(baseSha))
+                e.externalBase = baseSha;
+            else
+                return fail("delta base " + baseSha.hex() + " is missing");
+        }
+        else if (e.kind < OBJ_COMMIT || e.kind > OBJ_TAG)
+            return fail("unsupported entry type " + to_string(e.kind));
+
+        string data;
+        if (!inflateEntry(size, data))
+            return fail("corrupt or truncated entry at offset " + to_string(e.offset));
+        e.end = written;
+        e.crc = crc;
+        size_t index = entries.size();
+        entries.push_back(e);
+        shared_ptr<const string> content;
+        if (!resolve(index, move(data), content))
+            return false;
+        entryAt[e.offset] = index;
+        entryWithId[entries[index].sha] = index;
+        return true;
+    }
+
+    // Turns an entry's inflated data into its object, and computes the object's ID
+    bool resolve(size_t index, string &&data, shared_ptr<const string> &content)
+    {
+        Entry &e = entries[index];
+        if (e.kind == OBJ_OFS_DELTA || e.kind == OBJ_REF_DELTA)
+        {
+            shared_ptr<const string> base;
+            int baseType;
+            if (!e.externalBase.isNull())
+            {
+                string type, baseContent;
+                if (!splitObject(readObject(e.externalBase), type, baseContent))
+                    return fail("cannot read delta base " + e.externalBase.hex());
+                baseType = packTypeCode(type);
+                base = make_shared<const string>(move(baseContent));
+            }
+            else if (!load(e.base, baseType, base))
+                return false;
+            string result;
+            if (!applyDelta(*base, data.data(), data.size(), result))
+                return fail("corrupt delta at offset " + to_string(e.offset));
+            e.type = baseType;
+            data = move(result);
+        }
+        else
+            e.type = e.kind;
+
+        string header = packTypeName(e.type) + " " + to_string(data.size()) + '\0';
+        ObjectHasher objectHasher;
+        objectHasher.update(header.data(), header.size());
+        objectHasher.update(data.data(), data.size());
+        e.sha = objectHasher.final();
+        content = make_shared<const string>(move(data));
+        remember(index, content);
+        return true;
+    }
+
+    // An earlier entry's object: from memory, or read back from the pack file
+    bool load(size_t index, int &type, shared_ptr<const string> &content)
+    {
+        auto it = recent.find(index);
+        if (it != recent.end())
+        {
+            type = entries[index].type;
+            content = it->second;
+            return true;
+        }
+        const Entry &e = entries[index];
+        file.flush();
+        ifstream in(tempPath, ios::binary);
+        string raw(static_cast<size_t>(e.end - e.offset), '\0');
+        in.seekg(static_cast<streamoff>(e.offset));
+        if (!in.read(&raw[0], raw.size()))
+            return fail("cannot read back the pack file");
+
+        size_t pos = 0, consumed;
+        int kind;
+        uint64_t size, dist;
+        decodePackEntryHeader(raw.data(), raw.size(), pos, kind, size);
+        if (kind == OBJ_OFS_DELTA)
+            decodeOfsDeltaDistance(raw.data(), raw.size(), pos, dist);
+        else if (kind == OBJ_REF_DELTA)
+            pos += objectIdLength;
+        string data;
+        if (pos > raw.size() || !inflateKnownSize(raw.data() + pos, raw.size() - pos, static_cast<size_t>(size), data, consumed) ||
+            !resolve(index, move(data), content))
+            return fail("cannot read back the entry at offset " + to_string(e.offset));
+        type = entries[index].type;
+        return true;
+    }
+
+    // Keeps recently resolved objects (likely delta bases) up to DELTA_BASE_CACHE_LIMIT bytes
+    void remember(size_t index, const shared_ptr<const string> &content)
+    {
+        if (content->size() > DELTA_BASE_CACHE_LIMIT / 4 || recent.count(index))
+            return;
+        recent[index] = content;
+        recentOrder.push_back(index);
+        recentBytes += content->size();
+        while (recentBytes > DELTA_BASE_CACHE_LIMIT)
+        {
+            recentBytes -= recent[recentOrder.front()]->size();
+            recent.erase(recentOrder.front());
+            recentOrder.pop_front();
+        }
+    }
+
+    Channel &channel;
+    string tempPath;
+    ofstream file;
+    ObjectHasher hasher;
+    uint64_t written = 0;
+    uint32_t crc = 0;
+    vector<Entry> entries;
+    unordered_map<uint64_t, size_t> entryAt;
+    unordered_map<ObjectId, size_t> entryWithId;
+    unordered_map<size_t, shared_ptr<const string>> recent;
+    deque<size_t> recentOrder;
+    size_t recentBytes = 0;
+};
+
+// Reads "pack <n>" and the pack after it; packName is "" for an empty pack
+bool receivePack(Channel &channel, string &packName, uint32_t &count)
+{
+    string line;
+    if (!channel.readLine(line) || line.compare(0, 5, "pack ") != 0)
+    {
+        cerr << "Error: The remote ended the connection before sending a pack" << endl;
+        return false;
+    }
+    PackReceiver receiver(channel);
+    return receiver.receive(packName, count);
+}
+
+// Sends the haves of a fetch: the commits the local refs reach, newest first, HAVES_PER_ROUND
+// per round. Advertised tips that are here already go first, as they are certainly common. An
+// acknowledged commit makes all of its ancestors common, so they are never sent; the walk ends
+// when no uncommon commit is left, or after MAX_HAVES_IN_VAIN haves without a new
+// acknowledgement once something is common. Finishes with "done".
+bool negotiateFetch(Channel &channel, const map<string, ObjectId> &remoteRefs)
+{
+    struct Known
+    {
+        bool common = false;
+        vector<ObjectId> parents;
+    };
+    unordered_map<ObjectId, Known> known;
+    auto later = [](const CommitNode &x, const CommitNode &y)
+    {
+        if (x.generation != y.generation)
+            return x.generation < y.generation;
+        return x.time < y.time;
+    };
+    priority_queue<CommitNode, vector<CommitNode>, decltype(later)> queue(later);
+    auto push = [&](const ObjectId &id)
+    {
+        CommitNode node;
+        if (known.count(id) || !lookupCommitNode(id, node))
+            return;
+        known[id].parents = node.parents;
+        queue.push(move(node));
+    };
+    // Marks a commit and every ancestor seen so far as common
+    auto markCommon = [&](const ObjectId &id)
+    {
+        vector<ObjectId> stack{id};
+        while (!stack.empty())
+        {
+            auto it = known.find(stack.back());
+            stack.pop_back();
+            if (it == known.end() || it->second.common)
+                continue;
+            it->second.common = true;
+            stack.insert(stack.end(), it->second.parents.begin(), it->second.parents.end());
+        }
+    };
+
+    vector<ObjectId> round;
+    for (const auto &ref : remoteRefs)
+    {
+        if (!objectExists(ref.second) || known.count(ref.second))
+            continue;
+        push(ref.second);
+        if (known.count(ref.second))
+        {
+            round.push_back(ref.second);
+            markCommon(ref.second);
+        }
+    }
+    for (const auto &tip : listRefTips())
+        push(tip);
+
+    bool anyCommon = !round.empty();
+    size_t inVain = 0;
+    string line;
+    while (!round.empty() || !queue.empty())
+    {
+        while (round.size() < HAVES_PER_ROUND && !queue.empty() && !(anyCommon && inVain >= MAX_HAVES_IN_VAIN))
+        {
+            CommitNode node = queue.top();
+            queue.pop();
+            if (known[node.id].common)
+                continue;
+            round.push_back(node.id);
+            inVain++;
+            for (const auto &parent : node.parents)
+                push(parent);
+        }
+        if (round.empty())
+            break;
+        bool ok = true;
+        for (const auto &have : round)
+            ok = ok && channel.writeLine("have " + have.hex());
+        if (!ok || !channel.writeLine("end") || !channel.flush())
+            return false;
+        round.clear();
+        while (channel.readLine(line) && line != "end")
+        {
+            ObjectId id;
+            if (parseIdLine(line, "ack", id))
+            {
+                markCommon(id);
+                anyCommon = true;
+                inVain = 0;
+            }
+        }
+        if (line != "end")
+            return false;
+        if (anyCommon && inVain >= MAX_HAVES_IN_VAIN)
+            break;
+    }
+    return channel.writeLine("done") && channel.flush();
+}
+
+// ============= COMMAND IMPLEMENTATIONS =============
+
+// Resolves an object name given on the command line: a full hex object ID, HEAD, a branch name
+// or a remote-tracking branch ("origin/master"), optionally followed by ":<path>" for the object
+// at that path inside the tree. With quiet set, a name that does not resolve prints nothing.
+bool parseObjectName(const string &name, ObjectId &id, bool quiet = false)
+{
+    size_t colon = name.find(':');
+    string base = name.substr(0, colon);
+    string branch = REPO_DIR + "\\refs\\heads\\" + base;
+    string remoteBranch = REPO_DIR + "\\refs\\remotes\\" + base;
+    id = ObjectId();
+    if (base == "HEAD")
+        id = getHEAD();
+    else if (!base.empty() && base.find("..") == string::npos && fs::is_regular_file(branch))
+        ObjectId::fromHex(readFile(branch).substr(0, 2 * objectIdLength), id);
+    else if (!base.empty() && base.find("..") == string::npos && fs::is_regular_file(remoteBranch))
+        ObjectId::fromHex(readFile(remoteBranch).substr(0, 2 * objectIdLength), id);
+    else
+        ObjectId::fromHex(base, id);
+    if (id.isNull())
+    {
+        if (!quiet)
+            cerr << "Error: Not a valid object name " << name << endl;
+        return false;
+    }
+    if (colon == string::npos)
+        return true;
+
+    string type;
+    uint64_t size;
+    if ((quiet && !objectExists(id)) || !readObjectHeader(id, type, size))
+        return false;
+    if (type == "commit")
+    {
+        id = loadCommit(id)->treeSha;
+        type = "tree";
+    }
+    string path = normalizePath(name.substr(colon + 1));
+    if (type != "tree")
+    {
+        if (!quiet)
+            cerr << "Error: " << name.substr(0, colon) << " is not a tree" << endl;
+        return false;
+    }
+    if (path.empty())
+        return true; // "<tree>:" names the tree itself
+    TreeEntry entry;
+    if (!lookupPath(id, path, entry))
+    {
+        if (!quiet)
+            cerr << "Error: Path '" << path << "' does not exist in " << name.substr(0, colon) << endl;
+        return false;
+    }
+    id = entry.sha;
+    return true;
+}
+
+// Initializes the repository structure
+void cmdInit(HashAlgorithm format)
+{
+    if (fileExists(REPO_DIR))
+    {
+        cout << "Repository already initialized" << endl;
+        return;
+    }
+
+    fs::create_directories(REPO_DIR + "\\objects");
+    fs::create_directories(REPO_DIR + "\\refs");
+    fs::create_directories(REPO_DIR + "\\refs\\heads");
+    fs::create_directories(REPO_DIR + "\\logs");
+
+    writeFile(REPO_DIR + "\\HEAD", "ref: refs\\heads\\master\n");
+    writeFile(REPO_DIR + "\\index", "");
+    // New repositories store raw binary IDs in trees (git's format). Like git, a repository that
+    // needs an extension to be read declares format version 1.
+    string config = format == HashAlgorithm::SHA256 ? "[core]\n\trepositoryformatversion = 1\n\ttreeformat = binary\n"
+                                                      "[extensions]\n\tobjectformat = sha256\n"
+                                                    : "[core]\n\trepositoryformatversion = 0\n\ttreeformat = binary\n";
+    writeFile(REPO_DIR + "\\config", config);
+
+    cout << "Initialized empty repository in " << REPO_DIR << endl;
+}
+
+// Computes SHA-1 hash and optionally writes a Blob
+void cmdHashObject(const string &filepath, bool write)
+{
+    ObjectId sha = createBlob(filepath, write);
+    if (!sha.isNull())
+    {
+        cout << sha << endl;
+    }
+}
+
+// Hashes (and with write, stores) the files named on stdin, one path per line, printing each ID
+// as soon as it is known, so a caller can send a path and wait for its answer. Settings, pack
+// indexes and compressor contexts are set up once for the whole session. Stops at the first file
+// that cannot be read, as hash-object does, so answers never get out of step with requests.
+int cmdHashObjectBatch(bool write)
+{
+    string path;
+    while (getline(cin, path))
+    {
+        if (!path.empty() && path.back() == '\r')
+            path.pop_back();
+        ObjectId sha = createBlob(path, write);
+        if (sha.isNull())
+            return 1;
+        // With batched fsync the object is only renamed into place here; it must be readable
+        // by the time the caller sees its ID
+        if (write)
+            flushObjectWrites();
+        cout << sha << endl;
+    }
+    return 0;
+}
+
+// Displays object content or metadata
+void cmdCatFile(const string &name, char flag)
+{
+    ObjectId sha;
+    if (!parseObjectName(name, sha))
+        return;
+
+    // Type and size come from the header alone; the object body is never inflated for them
+    if (flag == 's' || flag == 't')
+    {
+        string type;
+        uint64_t size;
+        if (readObjectHeader(sha, type, size))
+            cout << (flag == 't' ? type : to_string(size)) << endl;
+        return;
+    }
+
+    string data;
+    if (hasPackedObject(sha))
+        data = readObject(sha);
+    else
+    {
+        // Loose objects are inflated straight to stdout in chunks, so memory use does not depend
+        // on their size; only trees are collected, to be formatted below
+        string type;
+        uint64_t size;
+        string tree;
+        bool ok = streamLooseObject(sha, type, size, [&type, &tree](const char *p, size_t n)
+                                    {
+                                        if (type == "tree")
+                                        {
+                                            tree.append(p, n);
+                                            return true;
+                                        }
+                                        return static_cast<bool>(cout.write(p, n)); });
+        if (!ok || type != "tree")
+            return;
+        data = "tree " + to_string(size) + string(1, '\0') + tree;
+    }
+    if (data.empty())
+        return;
+
+    size_t nullPos = data.find('\0');
+    if (nullPos == string::npos)
+        return;
+
+    if (data.compare(0, 5, "tree ") == 0 && flag == 'p')
+    {
+        // Tree entries hold binary SHAs, so print them the way ls-tree does
+        for (TreeEntryView entry : TreeView(move(data)))
+            cout << entry.mode << " " << (entry.isTree ? "tree" : "blob") << " " << entry.sha << "\t" << entry.name << endl;
+        return;
+    }
+
+    if (flag == 'p') // Print content without copying it out of the object buffer
+    {
+        cout.write(data.data() + nullPos + 1, static_cast<streamsize>(data.size() - nullPos - 1));
+    }
+}
+
+// Answers object requests read from stdin, one object name per line, until the end of input:
+// "<sha> <type> <size>" for each, followed by the raw content and a newline with withContent
+// (--batch), as git cat-file --batch and --batch-check print them; unknown names get
+// "<name> missing". Every answer is flushed, so the command can be driven interactively, and
+// the object cache and pack indexes stay loaded from one request to the next. Returns 1 if an
+// object cannot be read, since the output would no longer match the sizes already printed.
+int cmdCatFileBatch(bool withContent)
+{
+#ifdef _WIN32
+    _setmode(_fileno(stdout), _O_BINARY); // Content sizes must match the bytes written
+#endif
+    string name;
+    while (getline(cin, name))
+    {
+        if (!name.empty() && name.back() == '\r')
+            name.pop_back();
+        ObjectId sha;
+        string type;
+        uint64_t size;
+        if (name.empty() || !parseObjectName(name, sha, true) || !objectExists(sha) || !readObjectHeader(sha, type, size))
+        {
+            cout << name << " missing" << endl;
+            continue;
+        }
+        if (!withContent)
+        {
+            cout << sha << " " << type << " " << size << endl;
+            continue;
+        }
+        // Packed and small objects are read before the header promises their size; only large
+        // loose objects are streamed, and a failure part-way through ends the session
+        if (hasPackedObject(sha) || size <= STREAM_CHUNK_SIZE)
+        {
+            string data = readObject(sha);
+            size_t nullPos = data.find('\0');
+            if (nullPos == string::npos)
+                return 1;
+            cout << sha << " " << type << " " << size << "\n";
+            cout.write(data.data() + nullPos + 1, static_cast<streamsize>(data.size() - nullPos - 1));
+        }
+        else
+        {
+            cout << sha << " " << type << " " << size << "\n";
+            if (!streamLooseObject(sha, type, size, [](const char *p, size_t n)
+                                   { return static_cast<bool>(cout.write(p, static_cast<streamsize>(n))); }))
+            {
+                cout.flush();
+                cerr << "Error: Cannot read object " << sha << "; stopping the batch" << endl;
+                return 1;
+            }
+        }
+        cout << "\n";
+        cout.flush();
+    }
+    return 0;
+}
+
+// Creates a Tree object from the current working directory's state using `jobs` threads
+int cmdWriteTree(unsigned jobs)
+{
+    ObjectId treeSha = createTree(".", jobs);
+    if (treeSha.isNull())
+        return 1;
+    cout << treeSha << endl;
+    return 0;
+}
+
+// Lists the contents of a Tree object
+void cmdLsTree(const string &name, bool nameOnly)
+{
+    ObjectId treeSha;
+    if (!parseObjectName(name, treeSha))
+        return;
+    auto tree = loadTree(treeSha);
+
+    for (TreeEntryView entry : *tree)
+    {
+        if (nameOnly)
+        {
+            cout << entry.name << endl;
+        }
+        else
+        {
+            const char *type = entry.isTree ? "tree" : "blob";
+            cout << entry.mode << " " << type << " " << entry.sha << "\t" << entry.name << endl;
+        }
+    }
+}
+
+// Adds paths to the staging area (index). The index is loaded once, every path is applied in
+// memory, and the result is committed with a single atomic write while holding index.lock.
+void cmdAdd(const vector<string> &paths)
+{
+    LockFile lock(REPO_DIR + "\\index");
+    if (!lock.locked())
+        return;
+
+    CacheTree cacheTree;
+    FSMonitorState fsmonitor;
+    vector<IndexEntry> entries = readSortedIndex(cacheTree, &fsmonitor);
+    bool incremental = refreshFSMonitor(fsmonitor, entries);
+    IndexMap index;
+    for (auto &entry : entries)
+    {
+        string key = entry.path;
+        index.emplace(move(key), move(entry));
+    }
+    uint64_t indexTimestamp = getIndexTimestamp();
+
+    bool changed = false;
+    vector<FileToAdd> files;
+    vector<string> removedKeys;
+    for (const auto &path : paths)
+    {
+        string key = normalizePath(path);
+        // With a complete file system monitor state, a tracked directory needs only what changed
+        bool useMonitor = incremental && (key == "." || (isDirectory(path) && isTracked(index, key)));
+        // Staged files that were deleted from the working tree leave the index
+        bool removed = removeMissingFromIndex(index, cacheTree, key, useMonitor, &removedKeys);
+        if (useMonitor)
+            collectChangedFilesToAdd(index, fsmonitor, key == "." ? "" : key, indexTimestamp, files);
+        else if (fileExists(path))
+            collectFilesToAdd(index, path, indexTimestamp, files);
+        else if (!removed)
+            cerr << "Error: File " << path << " does not exist" << endl;
+        changed |= removed;
+    }
+    // The same file may be named twice (e.g. "dir" and "dir/file")
+    sort(files.begin(), files.end(), [](const FileToAdd &a, const FileToAdd &b)
+         { return a.key < b.key; });
+    files.erase(unique(files.begin(), files.end(), [](const FileToAdd &a, const FileToAdd &b)
+                       { return a.key == b.key; }),
+                files.end());
+    changed |= addFilesToIndex(index, cacheTree, files);
+    if (!changed)
+        return; // Nothing new; the lock is released without touching the index
+
+    entries.clear();
+    entries.reserve(index.size());
+    for (auto &kv : index)
+        entries.push_back(move(kv.second));
+    if (fsmonitor.untrackedValid)
+    {
+        // What was staged or removed may change what counts as untracked around it
+        for (const auto &file : files)
+            removedKeys.push_back(file.key);
+        updateUntrackedCache(fsmonitor, entries, removedKeys);
+    }
+    lock.commit(serializeIndex(entries, &cacheTree, &fsmonitor));
+}
+
+// Creates a new commit from the index. The index is kept, so the next commit only needs the
+// changes staged since; it is rewritten only to store the trees added to the cache tree.
+int cmdCommit(const string &message)
+{
+    LockFile lock(REPO_DIR + "\\index");
+    if (!lock.locked())
+        return 1;
+    CacheTree cacheTree;
+    FSMonitorState fsmonitor;
+    vector<IndexEntry> entries = readIndex(&cacheTree, &fsmonitor);
+    uint64_t indexTimestamp = getIndexTimestamp();
+
+    ObjectId treeSha = createTreeFromIndex(entries, cacheTree); // Create Trees from staged files
+    if (treeSha.isNull() && !entries.empty())
+        return 1; // A tree could not be written; the index keeps its old cache tree
+    if (cacheTreeStats.built > 0)
+    {
+        smudgeRacyEntries(entries, indexTimestamp);
+        lock.commit(serializeIndex(entries, &cacheTree, &fsmonitor));
+    }
+
+    ObjectId parentSha = getHEAD();
+    if (treeSha.isNull() || (!parentSha.isNull() && parseCommit(parentSha).treeSha == treeSha))
+    {
+        cout << "Nothing to commit" << endl;
+        return 0;
+    }
+    vector<ObjectId> parents;
+    if (!parentSha.isNull())
+        parents.push_back(parentSha);
+    ObjectId commitSha = createCommit(treeSha, parents, message);
+    if (commitSha.isNull())
+        return 1;
+
+    if (!updateHEAD(commitSha))
+        return 1;
+    updateLog(commitSha, parentSha, message);
+    updateCommitGraph({commitSha});
+
+    cout << commitSha << endl;
+    return 0;
+}
+
+// Displays the history reachable from start (HEAD if empty), newest commit first, stopping after
+// maxCount commits (0 = all). Only the printed commits are read in full; the walk itself uses
+// the commit graph.
+void cmdLog(size_t maxCount, const string &start)
+{
+    ObjectId tip;
+    if (start.empty())
+    {
+        tip = getHEAD();
+        if (tip.isNull())
+        {
+            cout << "No commits yet" << endl;
+            return;
+        }
+    }
+    else if (!parseObjectName(start, tip))
+        return;
+
+    auto older = [](const CommitNode &a, const CommitNode &b)
+    { return a.time < b.time; };
+    priority_queue<CommitNode, vector<CommitNode>, decltype(older)> queue(older);
+    unordered_set<ObjectId> seen{tip};
+    CommitNode node;
+    if (!lookupCommitNode(tip, node))
+    {
+        cerr << "Error: " << tip << " is not a commit" << endl;
+        return;
+    }
+    queue.push(node);
+    for (size_t shown = 0; !queue.empty() && (maxCount == 0 || shown < maxCount); shown++)
+    {
+        CommitNode current = queue.top();
+        queue.pop();
+        auto info = loadCommit(current.id);
+        string message = info->message;
+        while (!message.empty() && message.back() == '\n')
+            message.pop_back();
+        cout << "commit " << current.id << "\n";
+        for (const auto &parent : current.parents)
+            cout << "parent " << parent << "\n";
+        cout << "message " << message << "\n";
+        cout << "timestamp " << current.time << "\n";
+        cout << "---\n";
+        for (const auto &parent : current.parents)
+            if (seen.insert(parent).second && lookupCommitNode(parent, node))
+                queue.push(node);
+    }
+    cout.flush();
+}
+
+// Prints the best common ancestor(s) of two commits, or with isAncestorMode exits with 0 if the
+// first is an ancestor of the second and 1 otherwise
+int cmdMergeBase(const string &first, const string &second, bool all, bool isAncestorMode)
+{
+    ObjectId a, b;
+    if (!parseObjectName(first, a) || !parseObjectName(second, b))
+        return 128;
+    if (isAncestorMode)
+        return isAncestor(a, b) ? 0 : 1;
+    vector<ObjectId> bases = mergeBases(a, b);
+    if (bases.empty())
+        return 1;
+    for (size_t i = 0; i < (all ? bases.size() : 1); i++)
+        cout << bases[i] << endl;
+    return 0;
+}
+
+// Rebuilds the commit graph from every branch and HEAD
+void cmdCommitGraphWrite()
+{
+    vector<ObjectId> tips = listRefTips();
+    fs::remove(getCommitGraphPath());
+    reloadCommitGraph();
+    if (!updateCommitGraph(tips))
+        return;
+    auto graph = getCommitGraph();
+    cout << "Wrote commit graph with " << (graph ? graph->size() : 0) << " commits" << endl;
+}
+
+// Restores the working directory to the state of a specific commit. If any file cannot be
+// written, the index and HEAD are left as they were and 1 is returned.
+int cmdCheckout(const string &name, unsigned jobs)
+{
+    ObjectId commitSha;
+    if (!parseObjectName(name, commitSha))
+        return 1;
+    CommitInfo info = parseCommit(commitSha);
+    if (info.treeSha.isNull())
+    {
+        cerr << "Error: Invalid commit " << commitSha << endl;
+        return 1;
+    }
+
+    LockFile lock(REPO_DIR + "\\index");
+    if (!lock.locked())
+        return 1;
+    IndexMap previousIndex = loadIndexMap();
+    uint64_t indexTimestamp = getIndexTimestamp();
+
+    ObjectId currentSha = getHEAD();
+    ObjectId currentTree = currentSha.isNull() ? ObjectId() : parseCommit(currentSha).treeSha;
+    CheckoutWriter writer(jobs);
+    bool complete = true;
+    if (currentTree.isNull())
+    {
+        // Nothing checked out yet: materialize the whole target tree
+        complete = restoreTree(info.treeSha, writer);
+    }
+    else
+    {
+        // Only files that differ between the current and the target tree are written or removed;
+        // untracked files are left alone. A missing tree is found before anything is touched.
+        vector<TreeChange> changes;
+        bool missing = false;
+        diffTrees(currentTree, info.treeSha, "", changes, &missing);
+        if (missing)
+        {
+            cerr << "Error: A tree of " << commitSha << " or of HEAD is missing; nothing was checked out" << endl;
+            return 1;
+        }
+        if (!applyTreeChanges(changes, writer))
+            return 1;
+    }
+    writer.finish();
+    if (showStats)
+        writer.report();
+    if (!complete || writer.failed() > 0)
+    {
+        cerr << "Error: Checkout of " << commitSha << " is incomplete (" << writer.failed()
+             << (writer.failed() == 1 ? " file" : " files") << " could not be written" << (complete ? "" : ", a tree is missing")
+             << "); the index and HEAD were left unchanged" << endl;
+        return 1;
+    }
+
+    // The index now describes the checked out tree, with a complete cache tree
+    vector<IndexEntry> entries;
+    CacheTree cacheTree;
+    indexFromTree(info.treeSha, "", previousIndex, entries, cacheTree);
+    for (auto &entry : entries)
+        entry.skipWorktree = !sparseCheckout().includes(entry.path);
+    smudgeRacyEntries(entries, indexTimestamp);
+
+    // Update HEAD to point to the checked out commit; the index lock is still held, so a failure
+    // here leaves the old index in place too
+    if (!updateHEAD(commitSha) || !lock.commit(serializeIndex(entries, &cacheTree)))
+        return 1;
+
+    cout << "Checked out commit " << commitSha << endl;
+    return 0;
+}
+
+// Brings the working tree in line with the sparse checkout patterns: files that are no longer
+// included are removed (unless they have unstaged changes) and marked skip-worktree, and
+// skip-worktree files that are included again are written
+int applySparseCheckout(const SparseCheckout &sparse, unsigned jobs)
+{
+    LockFile lock(REPO_DIR + "\\index");
+    if (!lock.locked())
+        return 1;
+    CacheTree cacheTree;
+    FSMonitorState fsmonitor;
+    vector<IndexEntry> entries = readSortedIndex(cacheTree, &fsmonitor);
+    uint64_t indexTimestamp = getIndexTimestamp();
+
+    size_t written = 0, removed = 0, skipped = 0;
+    error_code ec;
+    {
+        CheckoutWriter writer(jobs);
+        for (auto &entry : entries)
+        {
+            string path = entry.path;
+            replace(path.begin(), path.end(), '/', '\\');
+            bool include = sparse.includes(entry.path);
+            if (include && entry.skipWorktree)
+            {
+                entry.skipWorktree = false;
+                entry.fsmonitorValid = false;
+                if (!fileExists(path))
+                {
+                    writer.enqueue(entry.sha, path);
+                    entry.stat = FileStat(); // The next status rehashes it once and records the stat data
+                    written++;
+                }
+            }
+            else if (!include && !entry.skipWorktree)
+            {
+                FileStat st;
+                if (getFileStat(path, st) && !isStatUpToDate(entry, st, indexTimestamp) && createBlob(path, false) != entry.sha)
+                {
+                    cerr << "Warning: Not removing " << entry.path << ", which has unstaged changes" << endl;
+                    continue;
+                }
+                if (fs::remove(path, ec))
+                    removeEmptyParents(path);
+                entry.skipWorktree = true;
+                entry.fsmonitorValid = false;
+                removed++;
+            }
+            skipped += entry.skipWorktree ? 1 : 0;
+        }
+        writer.finish();
+    }
+    smudgeRacyEntries(entries, indexTimestamp);
+    lock.commit(serializeIndex(entries, &cacheTree, &fsmonitor));
+    cout << "Sparse checkout: " << entries.size() - skipped << " of " << entries.size() << " files in the working tree ("
+         << written << " written, " << removed << " removed)" << endl;
+    return 0;
+}
+
+// Manages the sparse checkout patterns (see SPARSE CHECKOUT): set or add patterns, list them,
+// reapply them after editing the file by hand, or disable the sparse checkout
+int cmdSparseCheckout(const string &action, const vector<string> &patterns, unsigned jobs)
+{
+    string path = getSparseCheckoutPath();
+    if (action == "list")
+    {
+        if (!SparseCheckout(path).enabled())
+        {
+            cerr << "Error: This working tree is not sparse" << endl;
+            return 1;
+        }
+        cout << readFile(path);
+        return 0;
+    }
+    if (action == "set" || action == "add")
+    {
+        if (patterns.empty())
+        {
+            cerr << "Error: No patterns given" << endl;
+            return 1;
+        }
+        string content = action == "add" && fileExists(path) ? readFile(path) : "";
+        if (!content.empty() && content.back() != '\n')
+            content += "\n";
+        for (const auto &pattern : patterns)
+            content += pattern + "\n";
+        writeFile(path, content);
+    }
+    else if (action == "disable")
+    {
+        error_code ec;
+        fs::remove(path, ec);
+    }
+    else if (action != "reapply")
+    {
+        cerr << "Usage: mygit sparse-checkout set|add <pattern>... | list | reapply | disable" << endl;
+        return 1;
+    }
+    return applySparseCheckout(SparseCheckout(path), jobs);
+}
+
+// Shows the changes staged for the next commit (HEAD tree vs index), the changes not staged
+// (index vs working tree) and the untracked files; shortFormat prints "XY path" lines instead, as
+// git status --short does. Tracked files whose stat data matches the index are never read. Files
+// that had to be hashed and turned out unchanged get their new stat data written to the index
+// (unless another command holds it), so the next status can skip them as well. With
+// core.fsmonitor, only the paths the daemon reports changed are looked at.
+void cmdStatus(bool shortFormat, unsigned jobs)
+{
+    CacheTree cacheTree;
+    FSMonitorState fsmonitor;
+    vector<IndexEntry> entries = readSortedIndex(cacheTree, &fsmonitor);
+    uint64_t indexTimestamp = getIndexTimestamp();
+    string storedToken = fsmonitor.token;
+    bool incremental = refreshFSMonitor(fsmonitor, entries);
+
+    ObjectId head = getHEAD();
+    ObjectId headTree = head.isNull() ? ObjectId() : parseCommit(head).treeSha;
+    vector<TreeChange> staged;
+    diffTreeToIndex(headTree, entries, 0, entries.size(), "", cacheTree, staged);
+    for (auto &change : staged)
+        change.path = normalizePath(change.path);
+    sort(staged.begin(), staged.end(), [](const TreeChange &a, const TreeChange &b)
+         { return a.path < b.path; });
+
+    WorktreeScan scan(entries, indexTimestamp);
+    {
+        ThreadPool pool(jobs);
+        if (incremental)
+        {
+            checkUnverifiedFiles(scan, pool);
+            scan.untracked = fsmonitor.untracked;
+        }
+        else
+            scanWorktreeDirectory(scan, pool, ".", "", 0, entries.size(), false);
+    }
+    sort(scan.untracked.begin(), scan.untracked.end());
+
+    vector<pair<char, string>> unstaged;
+    bool refreshed = false;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        WorktreeState state = scan.states[i];
+        if (state == WorktreeState::MISSING || state == WorktreeState::MODIFIED)
+            unstaged.emplace_back(state == WorktreeState::MISSING ? 'D' : 'M', entries[i].path);
+        refreshed |= state == WorktreeState::REFRESHED;
+        entries[i].fsmonitorValid = state == WorktreeState::CLEAN || state == WorktreeState::REFRESHED;
+    }
+    if (!fsmonitor.token.empty() && !incremental)
+    {
+        fsmonitor.untracked = scan.untracked;
+        fsmonitor.untrackedValid = true;
+    }
+
+    // Only if no other command changed the index in between
+    if ((refreshed || fsmonitor.token != storedToken) && !fileExists(REPO_DIR + "\\index.lock"))
+    {
+        LockFile lock(REPO_DIR + "\\index");
+        if (lock.locked() && getIndexTimestamp() == indexTimestamp)
+        {
+            for (size_t i = 0; i < entries.size(); i++)
+                if (scan.states[i] == WorktreeState::REFRESHED)
+                    entries[i].stat = scan.stats[i];
+            smudgeRacyEntries(entries, indexTimestamp);
+            lock.commit(serializeIndex(entries, &cacheTree, &fsmonitor));
+        }
+    }
+
+    if (shortFormat)
+    {
+        map<string, pair<char, char>> codes;
+        for (const auto &change : staged)
+            codes.emplace(change.path, make_pair(' ', ' ')).first->second.first = change.status;
+        for (const auto &change : unstaged)
+            codes.emplace(change.second, make_pair(' ', ' ')).first->second.second = change.first;
+        for (const auto &code : codes)
+            cout << code.second.first << code.second.second << ' ' << code.first << "\n";
+        for (const auto &path : scan.untracked)
+            cout << "?? " << path << "\n";
+        return;
+    }
+
+    auto label = [](char status)
+    { return status == 'A' ? "new file:" : status == 'D' ? "deleted:" : "modified:"; };
+    string branch = currentBranch();
+    cout << (branch.empty() ? "Not on any branch" : "On branch " + branch) << "\n";
+    if (head.isNull())
+        cout << "\nNo commits yet\n";
+    if (!staged.empty())
+    {
+        cout << "\nChanges to be committed:\n";
+        for (const auto &change : staged)
+            cout << "\t" << left << setw(12) << label(change.status) << change.path << "\n";
+    }
+    if (!unstaged.empty())
+    {
+        cout << "\nChanges not staged for commit:\n";
+        for (const auto &change : unstaged)
+            cout << "\t" << left << setw(12) << label(change.first) << change.second << "\n";
+    }
+    if (!scan.untracked.empty())
+    {
+        cout << "\nUntracked files:\n";
+        for (const auto &path : scan.untracked)
+            cout << "\t" << path << "\n";
+    }
+    if (staged.empty() && unstaged.empty())
+        cout << "\n" << (scan.untracked.empty() ? "nothing to commit, working tree clean" : "nothing added to commit but untracked files present") << "\n";
+}
+
+// Resolves a commit or tree name to a tree ID
+bool resolveTree(const string &name, ObjectId &tree)
+{
+    ObjectId id;
+    string type;
+    uint64_t size;
+    if (!parseObjectName(name, id) || !readObjectHeader(id, type, size))
+        return false;
+    if (type == "commit")
+        tree = parseCommit(id).treeSha;
+    else if (type == "tree")
+        tree = id;
+    else
+    {
+        cerr << "Error: " << name << " is a " << type << ", not a commit or tree" << endl;
+        return false;
+    }
+    return !tree.isNull();
+}
+
+// Shows changes as unified diffs with `context` lines around each change:
+//   no names:       the working tree against the index (what status lists as not staged)
+//   cached:         the index against HEAD, or against the named commit
+//   two names:      one commit or tree against the other
+// Identical subtrees are skipped by ID and tracked files with matching stat data are not read.
+int cmdDiff(const vector<string> &names, bool cached, unsigned context, bool nameStatus, unsigned jobs)
+{
+    vector<FileDiff> files;
+    if (names.size() == 2 && !cached)
+    {
+        ObjectId oldTree, newTree;
+        if (!resolveTree(names[0], oldTree) || !resolveTree(names[1], newTree))
+            return 1;
+        vector<TreeChange> changes;
+        diffTrees(oldTree, newTree, "", changes);
+        files = fileDiffsFromChanges(changes);
+    }
+    else if (cached && names.size() <= 1)
+    {
+        ObjectId tree;
+        if (!names.empty() && !resolveTree(names[0], tree))
+            return 1;
+        ObjectId head = getHEAD();
+        if (names.empty() && !head.isNull())
+            tree = parseCommit(head).treeSha;
+        CacheTree cacheTree;
+        vector<IndexEntry> entries = readSortedIndex(cacheTree);
+        vector<TreeChange> changes;
+        diffTreeToIndex(tree, entries, 0, entries.size(), "", cacheTree, changes);
+        files = fileDiffsFromChanges(changes);
+    }
+    else if (names.empty())
+    {
+        CacheTree cacheTree;
+        vector<IndexEntry> entries = readSortedIndex(cacheTree);
+        WorktreeScan scan(entries, getIndexTimestamp());
+        scan.listUntracked = false;
+        {
+            ThreadPool pool(jobs);
+            scanWorktreeDirectory(scan, pool, ".", "", 0, entries.size(), false);
+        }
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (scan.states[i] != WorktreeState::MISSING && scan.states[i] != WorktreeState::MODIFIED)
+                continue;
+            FileDiff file{entries[i].path, entries[i].mode, "", entries[i].sha, ObjectId(), ""};
+            if (scan.states[i] == WorktreeState::MODIFIED)
+            {
+                file.newMode = getPermissions(entries[i].path);
+                file.worktreePath = entries[i].path;
+            }
+            files.push_back(move(file));
+        }
+    }
+    else
+    {
+        cerr << "Usage: mygit diff [-U<n>] [--name-status] [--cached [<commit>] | <commit> <commit>]" << endl;
+        return 1;
+    }
+    printFileDiffs(files, context, nameStatus);
+    return 0;
+}
+
+// Controls the file system monitor daemon: start (in the background), run (in the foreground),
+// stop, or status
+int cmdFSMonitor(const string &action)
+{
+    string reply;
+    bool running = fsmonitorRequest("status", reply);
+    if (action == "status")
+    {
+        cout << (running ? reply : "fsmonitor daemon is not running\n");
+        return running ? 0 : 1;
+    }
+    if (action == "stop")
+    {
+        if (!running || !fsmonitorRequest("stop", reply))
+        {
+            cerr << "Error: fsmonitor daemon is not running" << endl;
+            return 1;
+        }
+        // It exits after answering; wait until it no longer does
+        for (int i = 0; i < 250 && fsmonitorRequest("status", reply); i++)
+            this_thread::sleep_for(chrono::milliseconds(20));
+        cout << "Stopped fsmonitor daemon" << endl;
+        return 0;
+    }
+    if (action != "start" && action != "run")
+    {
+        cerr << "Usage: mygit fsmonitor <start|run|stop|status>" << endl;
+        return 1;
+    }
+    if (running)
+    {
+        cerr << "Error: fsmonitor daemon is already running" << endl;
+        return 1;
+    }
+    if (action == "run")
+        return runFSMonitorDaemon();
+    if (!startFSMonitorDaemon())
+    {
+        cerr << "Error: fsmonitor daemon did not start" << endl;
+        return 1;
+    }
+    cout << "Started fsmonitor daemon" << endl;
+    return 0;
+}
+
+// Packs all loose objects into one new pack; with removeLoose the loose copies are deleted afterwards
+void cmdRepack(bool removeLoose, const PackOptions &options)
+{
+    vector<ObjectId> loose = listLooseObjects();
+    vector<PackInput> toPack;
+    unordered_map<ObjectId, size_t> position;
+    for (const auto &sha : loose)
+    {
+        // Chunk manifests stay loose (their chunks are packed like any blob), so the chunks
+        // remain shared between versions of the file
+        if (!hasPackedObject(sha) && !isChunkedLooseObject(sha))
+        {
+            position[sha] = toPack.size();
+            toPack.push_back(PackInput{sha, ""});
+        }
+    }
+
+    // Name hints: the trees being packed tell us what their entries are called
+    for (const auto &obj : vector<PackInput>(toPack))
+    {
+        string type;
+        uint64_t size;
+        if (!readObjectHeader(obj.sha, type, size) || type != "tree")
+            continue;
+        for (TreeEntryView entry : *loadTree(obj.sha))
+        {
+            auto it = position.find(entry.sha);
+            if (it != position.end() && toPack[it->second].name.empty())
+                toPack[it->second].name = string(entry.name);
+        }
+    }
+
+    if (!toPack.empty())
+    {
+        string name = writePack(toPack, options);
+        if (name.empty())
+            return;
+        cout << "Packed " << toPack.size() << " objects into " << name << ".pack" << endl;
+    }
+    else
+    {
+        cout << "Nothing new to pack" << endl;
+    }
+
+    if (!removeLoose)
+        return;
+    size_t removed = 0;
+    error_code ec;
+    for (const auto &sha : loose)
+    {
+        // Only drop loose copies the packs can actually serve
+        if (!hasPackedObject(sha))
+            continue;
+        string path = getObjectPath(sha);
+        if (fs::remove(path, ec))
+            removed++;
+        fs::remove(fs::path(path).parent_path(), ec); // Succeeds only once the directory is empty
+    }
+    cout << "Removed " << removed << " loose objects" << endl;
+}
+
+// Packs everything reachable into one pack with reachability bitmaps, removes the loose copies
+// and prunes unreachable objects older than the grace period (see GARBAGE COLLECTION)
+int cmdGc(const string &pruneOption, const PackOptions &options)
+{
+    int64_t grace;
+    string expiry = !pruneOption.empty() ? pruneOption : getConfig("gc.pruneexpire", "2.weeks.ago");
+    if (!parseExpiry(expiry, grace))
+    {
+        cerr << "Error: Invalid prune expiry '" << expiry << "'" << endl;
+        return 1;
+    }
+    auto expired = [grace](const string &path)
+    { return grace >= 0 && fileAge(path) >= grace; };
+
+    vector<ObjectId> loose = listLooseObjects();
+    unordered_set<ObjectId> looseSet(loose.begin(), loose.end());
+    auto manifests = listChunkManifests(loose);
+    auto exists = [&looseSet](const ObjectId &sha)
+    { return looseSet.count(sha) || hasPackedObject(sha); };
+
+    // Everything the roots reach must be present, or deleting anything would be unsafe
+    ReachabilityWalk walk(exists, manifests);
+    addReachabilityRoots(walk);
+    walk.run();
+    if (!walk.missing.empty())
+    {
+        cerr << "Error: Object " << walk.missing.front() << " is reachable but missing; nothing was removed" << endl;
+        return 1;
+    }
+    size_t reachableCount = walk.order.size();
+    unordered_set<ObjectId> reachable(walk.order.begin(), walk.order.end());
+
+    // Recent unreachable objects are kept, with everything they reference
+    auto packs = getPacks();
+    vector<string> oldPacks;
+    for (const auto &sha : loose)
+        if (!reachable.count(sha) && !expired(getObjectPath(sha)))
+            walk.add(sha, ReachabilityWalk::ANY, false);
+    for (const auto &pack : *packs)
+    {
+        oldPacks.push_back(pack->packPath);
+        if (expired(pack->packPath))
+            continue;
+        for (uint32_t i = 0; i < pack->count; i++)
+            if (!reachable.count(pack->shaAt(i)))
+                walk.add(pack->shaAt(i), ReachabilityWalk::ANY, false);
+    }
+    walk.run();
+
+    // Reachable objects go into the new pack; manifests stay loose (see cmdRepack)
+    vector<PackInput> toPack;
+    for (size_t i = 0; i < reachableCount; i++)
+    {
+        const ObjectId &sha = walk.order[i];
+        if (!manifests.count(sha))
+            toPack.push_back(PackInput{sha, walk.names[sha]});
+    }
+    sort(toPack.begin(), toPack.end(), [](const PackInput &a, const PackInput &b)
+         { return a.sha < b.sha; });
+
+    // Kept unreachable objects that only exist in a pack about to be deleted become loose again,
+    // with the pack's time so they still expire
+    size_t loosened = 0;
+    for (size_t i = reachableCount; i < walk.order.size(); i++)
+    {
+        const ObjectId &sha = walk.order[i];
+        if (looseSet.count(sha))
+            continue;
+        string object;
+        string compressed;
+        if (!readPackedObject(sha, object) || (compressed = encodeLooseObject(object)).empty())
+        {
+            cerr << "Error: Cannot read packed object " << sha << endl;
+            return 1;
+        }
+        string tempPath = getTempObjectPath();
+        if (!writeFileDirect(tempPath, compressed.data(), compressed.size()) || !renameTempObject(tempPath, sha))
+            return 1;
+        for (const auto &pack : *packs)
+        {
+            uint32_t index;
+            error_code ec;
+            if (pack->position(sha, index))
+            {
+                fs::last_write_time(getObjectPath(sha), fs::last_write_time(pack->packPath, ec), ec);
+                break;
+            }
+        }
+        loosened++;
+    }
+
+    // A single pack holding exactly the reachable objects is already what gc would write
+    string packName;
+    bool rewrite = true;
+    if (packs->size() == 1 && packs->front()->count == toPack.size())
+    {
+        rewrite = false;
+        for (uint32_t i = 0; i < toPack.size() && !rewrite; i++)
+            rewrite = !(packs->front()->shaAt(i) == toPack[i].sha);
+        if (!rewrite)
+            packName = getFilename(packs->front()->packPath);
+    }
+    if (rewrite && !toPack.empty())
+    {
+        packName = writePack(toPack, options);
+        if (packName.empty())
+            return 1;
+        packName += ".pack";
+        cout << "Packed " << toPack.size() << " objects into " << packName << endl;
+    }
+    else
+    {
+        cout << "Nothing new to pack" << endl;
+    }
+
+    // Unmap the packs before deleting the ones that were replaced
+    packs.reset();
+    forgetPacks();
+    error_code ec;
+    if (rewrite)
+    {
+        for (const auto &packPath : oldPacks)
+        {
+            if (getFilename(packPath) == packName)
+                continue;
+            string base = packPath.substr(0, packPath.size() - 5);
+            fs::remove(base + ".idx", ec); // First, so the pack disappears as a whole
+            fs::remove(packPath, ec);
+            fs::remove(base + ".bitmap", ec);
+        }
+    }
+
+    size_t removed = 0, pruned = 0;
+    for (const auto &sha : loose)
+    {
+        bool keep = walk.contains(sha) && (!reachable.count(sha) || manifests.count(sha) || !hasPackedObject(sha));
+        if (keep)
+            continue;
+        string path = getObjectPath(sha);
+        if (fs::remove(path, ec))
+        {
+            removed++;
+            pruned += reachable.count(sha) ? 0 : 1;
+        }
+        fs::remove(fs::path(path).parent_path(), ec); // Succeeds only once the directory is empty
+    }
+
+    // Leftovers of interrupted writes
+    for (const string &dir : {REPO_DIR + "\\objects", REPO_DIR + "\\objects\\pack"})
+    {
+        for (const auto &entry : fs::directory_iterator(dir, ec))
+        {
+            string name = entry.path().filename().string();
+            if ((name.compare(0, 8, "tmp_obj_") == 0 || name.compare(0, 9, "tmp_pack_") == 0) && expired(entry.path().string()))
+                fs::remove(entry.path(), ec);
+        }
+    }
+    cout << "Removed " << removed << " loose objects (" << pruned << " unreachable)";
+    if (loosened > 0)
+        cout << ", kept " << loosened << " recent unreachable objects loose";
+    cout << endl;
+
+    if (!packName.empty())
+    {
+        auto current = getPacks();
+        for (const auto &pack : *current)
+        {
+            if (getFilename(pack->packPath) != packName)
+                continue;
+            size_t written;
+            if (!writeReachabilityBitmaps(*pack, listRefTips(), manifests, written))
+            {
+                cerr << "Error: Cannot write reachability bitmaps" << endl;
+                return 1;
+            }
+            cout << "Wrote bitmaps for " << written << " commits" << endl;
+        }
+    }
+    return 0;
+}
+
+// Prints object database statistics like git count-objects -v, plus the number of objects
+// reachable from the branches (from the bitmaps when they cover every tip)
+void cmdCountObjects()
+{
+    vector<ObjectId> loose = listLooseObjects();
+    uint64_t looseSize = 0, packSize = 0, inPack = 0;
+    error_code ec;
+    for (const auto &sha : loose)
+    {
+        uint64_t size = fs::file_size(getObjectPath(sha), ec);
+        looseSize += ec ? 0 : size;
+    }
+    auto packs = getPacks();
+    for (const auto &pack : *packs)
+    {
+        inPack += pack->count;
+        packSize += pack->pack->size() + pack->idx->size();
+    }
+    vector<ObjectId> tips = listRefTips();
+    vector<ObjectId> reachable;
+    const char *source = "bitmap";
+    if (!bitmapReachable(tips, reachable))
+    {
+        source = "walk";
+        auto manifests = listChunkManifests(loose);
+        ReachabilityWalk walk(objectExists, manifests);
+        for (const auto &tip : tips)
+            walk.add(tip, ReachabilityWalk::COMMIT, false);
+        walk.run();
+        reachable = move(walk.order);
+    }
+    cout << "count: " << loose.size() << endl;
+    cout << "size: " << looseSize / 1024 << endl;
+    cout << "in-pack: " << inPack << endl;
+    cout << "packs: " << packs->size() << endl;
+    cout << "size-pack: " << packSize / 1024 << endl;
+    cout << "reachable: " << reachable.size() << " (" << source << ")" << endl;
+}
+
+// Manages the remotes in .mygit/config: "add <name> <url>" records one, no action lists them
+int cmdRemote(const vector<string> &args)
+{
+    if (args.empty() || args[0] == "-v")
+    {
+        const string prefix = "remote.", suffix = ".url";
+        for (const auto &kv : readConfig())
+        {
+            const string &key = kv.first;
+            if (key.size() > prefix.size() + suffix.size() && key.compare(0, prefix.size(), prefix) == 0 &&
+                key.compare(key.size() - suffix.size(), suffix.size(), suffix) == 0)
+            {
+                string name = key.substr(prefix.size(), key.size() - prefix.size() - suffix.size());
+                cout << name;
+                if (!args.empty())
+                    cout << "\t" << kv.second;
+                cout << endl;
+            }
+        }
+        return 0;
+    }
+    if (args[0] != "add" || args.size() != 3)
+    {
+        cerr << "Usage: mygit remote [-v] | remote add <name> <url>" << endl;
+        return 1;
+    }
+    const string &name = args[1];
+    if (name.empty() || name.find_first_of("\"/\\ \t\n") != string::npos || !isValidBranchRef("refs/heads/" + name))
+    {
+        cerr << "Error: Invalid remote name " << name << endl;
+        return 1;
+    }
+    if (!getConfig("remote." + name + ".url").empty())
+    {
+        cerr << "Error: Remote " << name << " already exists" << endl;
+        return 1;
+    }
+    ofstream config(REPO_DIR + "\\config", ios::app);
+    config << "[remote \"" << name << "\"]\n\turl = " << args[2] << "\n";
+    if (!config)
+    {
+        cerr << "Error: Cannot write " << REPO_DIR << "\\config" << endl;
+        return 1;
+    }
+    return 0;
+}
+
+// Serves a fetch over stdin/stdout (run by 'mygit fetch' in the remote repository): advertises
+// the refs, acknowledges the client's haves round by round, and streams one thin pack with what
+// the client lacks
+int cmdUploadPack()
+{
+    auto channel = openStdioChannel();
+    if (!advertiseRefs(*channel, "upload-pack"))
+        return 1;
+    vector<ObjectId> wants, common;
+    string line;
+    while (channel->readLine(line) && line != "end")
+    {
+        ObjectId id;
+        if (!parseIdLine(line, "want", id) || !objectExists(id))
+        {
+            cerr << "Error: Invalid request " << line << endl;
+            return 1;
+        }
+        wants.push_back(id);
+    }
+    if (line != "end")
+        return 1;
+    if (wants.empty())
+        return 0; // Nothing to send
+
+    while (channel->readLine(line) && line != "done")
+    {
+        ObjectId id;
+        CommitNode node;
+        if (line == "end")
+        {
+            if (!channel->writeLine("end") || !channel->flush())
+                return 1;
+        }
+        else if (parseIdLine(line, "have", id) && objectExists(id) && lookupCommitNode(id, node))
+        {
+            common.push_back(id);
+            if (!channel->writeLine("ack " + id.hex()))
+                return 1;
+        }
+    }
+    if (line != "done")
+        return 1;
+
+    vector<PackInput> objects;
+    ThinPackBases bases;
+    if (!findObjectsToSend(wants, common, objects, bases) || !sendPack(*channel, objects, bases))
+        return 1;
+    return 0;
+}
+
+// Serves a push over stdin/stdout (run by 'mygit push' in the remote repository): advertises the
+// refs, receives the pack and updates each branch whose current value is still the one the
+// client started from. The branch HEAD points to is refused unless receive.denyCurrentBranch is
+// "ignore" (or "warn"), as its working tree would no longer match.
+int cmdReceivePack()
+{
+    auto channel = openStdioChannel();
+    if (!advertiseRefs(*channel, "receive-pack"))
+        return 1;
+    struct Update
+    {
+        ObjectId oldId, newId;
+        string ref;
+    };
+    vector<Update> updates;
+    string line;
+    while (channel->readLine(line) && line != "end")
+    {
+        istringstream in(line);
+        string keyword, oldHex, newHex;
+        Update update;
+        in >> keyword >> oldHex >> newHex >> update.ref;
+        if (keyword != "update" || !isValidBranchRef(update.ref) ||
+            (oldHex != string(2 * objectIdLength, '0') && !ObjectId::fromHex(oldHex, update.oldId)) ||
+            !ObjectId::fromHex(newHex, update.newId) || update.newId.isNull())
+        {
+            cerr << "Error: Invalid request " << line << endl;
+            return 1;
+        }
+        updates.push_back(update);
+    }
+    if (line != "end")
+        return 1;
+    if (updates.empty())
+        return 0;
+
+    string packName;
+    uint32_t count;
+    if (!receivePack(*channel, packName, count))
+        return 1;
+
+    vector<ObjectId> existing = listRefTips(), updated;
+    string denyCurrent = getConfig("receive.denycurrentbranch", "refuse");
+    string current = currentBranch();
+    bool ok = true;
+    for (const auto &update : updates)
+    {
+        string refPath = REPO_DIR + "\\" + update.ref;
+        ObjectId currentId = readRefFile(refPath);
+        vector<PackInput> unused;
+        ThinPackBases unusedBases;
+        string reason;
+        if (currentId != update.oldId)
+            reason = "fetch first";
+        else if (!current.empty() && update.ref == "refs/heads/" + current && denyCurrent != "ignore" && denyCurrent != "warn")
+            reason = "branch is currently checked out";
+        else if (!findObjectsToSend({update.newId}, existing, unused, unusedBases))
+            reason = "missing objects";
+        else
+        {
+            // Connected: everything the new tip reaches is here
+            fs::create_directories(fs::path(refPath).parent_path());
+            LockFile lock(refPath);
+            if (!lock.locked() || !lock.commit(update.newId.hex() + "\n"))
+                reason = "cannot lock ref";
+        }
+        if (reason.empty())
+            updated.push_back(update.newId);
+        ok = ok && channel->writeLine(reason.empty() ? "ok " + update.ref : "ng " + update.ref + " " + reason);
+    }
+    if (!updated.empty())
+        updateCommitGraph(updated);
+    return ok && channel->writeLine("end") && channel->flush() ? 0 : 1;
+}
+
+// Fetches branches (all of them by default) from a remote into this repository's object
+// database. Only the missing objects come over, as one pack that is indexed as it arrives. For a
+// named remote (see 'remote add'), refs/remotes/<remote>/<branch> is updated; FETCH_HEAD always.
+int cmdFetch(const string &remote, const vector<string> &branches)
+{
+    bool named;
+    string url = remoteUrl(remote, named);
+    RemoteConnection connection;
+    map<string, ObjectId> refs;
+    if (!connection.open(url, "upload-pack") || !readAdvertisement(connection.channel(), "upload-pack", refs))
+        return 1;
+    Channel &channel = connection.channel();
+
+    vector<pair<string, ObjectId>> fetched; // Branch name, tip
+    for (const auto &ref : refs)
+    {
+        const string prefix = "refs/heads/";
+        if (ref.first.compare(0, prefix.size(), prefix) != 0)
+            continue;
+        string branch = ref.first.substr(prefix.size());
+        if (branches.empty() || find(branches.begin(), branches.end(), branch) != branches.end())
+            fetched.emplace_back(branch, ref.second);
+    }
+    for (const auto &branch : branches)
+    {
+        if (!refs.count("refs/heads/" + branch))
+        {
+            cerr << "Error: The remote has no branch " << branch << endl;
+            return 1;
+        }
+    }
+
+    vector<ObjectId> wants;
+    for (const auto &branch : fetched)
+        if (!objectExists(branch.second) && find(wants.begin(), wants.end(), branch.second) == wants.end())
+            wants.push_back(branch.second);
+    bool ok = true;
+    for (const auto &want : wants)
+        ok = ok && channel.writeLine("want " + want.hex());
+    if (!ok || !channel.writeLine("end") || !channel.flush())
+    {
+        cerr << "Error: Lost the connection to " << url << endl;
+        return 1;
+    }
+    if (!wants.empty())
+    {
+        string packName;
+        uint32_t count = 0;
+        if (!negotiateFetch(channel, refs) || !receivePack(channel, packName, count))
+            return 1;
+        cout << "Received " << count << " objects" << (packName.empty() ? "" : " into " + packName) << endl;
+    }
+    if (!connection.close())
+    {
+        cerr << "Error: The remote side failed" << endl;
+        return 1;
+    }
+
+    string fetchHead;
+    vector<ObjectId> tips;
+    for (const auto &branch : fetched)
+    {
+        if (!objectExists(branch.second))
+        {
+            cerr << "Error: The remote did not send " << branch.second << " (" << branch.first << ")" << endl;
+            return 1;
+        }
+        fetchHead += branch.second.hex() + "\tbranch '" + branch.first + "' of " + url + "\n";
+        tips.push_back(branch.second);
+        if (!named)
+            continue;
+        string refPath = REPO_DIR + "\\refs\\remotes\\" + remote + "\\" + branch.first;
+        ObjectId oldId = readRefFile(refPath);
+        if (oldId == branch.second)
+            continue;
+        fs::create_directories(fs::path(refPath).parent_path());
+        writeFile(refPath, branch.second.hex() + "\n");
+        string range = oldId.isNull() ? "* [new branch]" : oldId.hex().substr(0, 7) + ".." + branch.second.hex().substr(0, 7);
+        cout << "   " << range << "  " << branch.first << " -> " << remote << "/" << branch.first << endl;
+    }
+    writeFile(REPO_DIR + "\\FETCH_HEAD", fetchHead);
+    if (!tips.empty())
+        updateCommitGraph(tips);
+    return 0;
+}
+
+// Pushes branches (the current one by default) to a remote. The pack holds what the remote's
+// branches do not already reach. A branch that has moved on the remote so that the push would
+// lose its commits is rejected unless force is set.
+int cmdPush(const string &remote, vector<string> branches, bool force)
+{
+    if (branches.empty())
+    {
+        string branch = currentBranch();
+        if (branch.empty())
+        {
+            cerr << "Error: HEAD is not on a branch; name the branch to push" << endl;
+            return 1;
+        }
+        branches.push_back(branch);
+    }
+    vector<pair<string, ObjectId>> local;
+    for (const auto &branch : branches)
+    {
+        string ref = "refs/heads/" + branch;
+        ObjectId id = isValidBranchRef(ref) ? readRefFile(REPO_DIR + "\\" + ref) : ObjectId();
+        if (id.isNull())
+        {
+            cerr << "Error: No branch named " << branch << endl;
+            return 1;
+        }
+        local.emplace_back(ref, id);
+    }
+
+    bool named;
+    string url = remoteUrl(remote, named);
+    RemoteConnection connection;
+    map<string, ObjectId> refs;
+    if (!connection.open(url, "receive-pack") || !readAdvertisement(connection.channel(), "receive-pack", refs))
+        return 1;
+    Channel &channel = connection.channel();
+
+    // The remote's tips that are known here are what it certainly has
+    vector<ObjectId> haves, wants;
+    for (const auto &ref : refs)
+        if (objectExists(ref.second))
+            haves.push_back(ref.second);
+
+    int exitCode = 0;
+    map<string, ObjectId> oldIds;
+    bool ok = true;
+    for (const auto &ref : local)
+    {
+        ObjectId oldId = refs.count(ref.first) ? refs[ref.first] : ObjectId();
+        string branch = ref.first.substr(11);
+        if (oldId == ref.second)
+        {
+            cout << "Everything up-to-date (" << branch << ")" << endl;
+            continue;
+        }
+        if (!oldId.isNull() && !force && !(objectExists(oldId) && isAncestor(oldId, ref.second)))
+        {
+            cerr << " ! [rejected] " << branch << " -> " << branch << " (non-fast-forward; fetch first or use --force)" << endl;
+            exitCode = 1;
+            continue;
+        }
+        oldIds[ref.first] = oldId;
+        wants.push_back(ref.second);
+        ok = ok && channel.writeLine("update " + oldId.hex() + " " + ref.second.hex() + " " + ref.first);
+    }
+    ok = ok && channel.writeLine("end");
+    if (ok && !wants.empty())
+    {
+        vector<PackInput> objects;
+        ThinPackBases bases;
+        if (!findObjectsToSend(wants, haves, objects, bases))
+            return 1;
+        ok = sendPack(channel, objects, bases);
+        if (ok)
+            cout << "Sent " << objects.size() << " objects" << endl;
+    }
+    if (!ok || !channel.flush())
+    {
+        cerr << "Error: Lost the connection to " << url << endl;
+        return 1;
+    }
+
+    string line;
+    while (!wants.empty() && channel.readLine(line) && line != "end")
+    {
+        istringstream in(line);
+        string status, ref, reason;
+        in >> status >> ref;
+        getline(in, reason);
+        auto old = oldIds.find(ref);
+        if (old == oldIds.end())
+            continue;
+        string branch = ref.substr(11);
+        ObjectId newId;
+        for (const auto &l : local)
+            if (l.first == ref)
+                newId = l.second;
+        if (status != "ok")
+        {
+            cerr << " ! [remote rejected] " << branch << " -> " << branch << " (" << (reason.empty() ? reason : reason.substr(1)) << ")" << endl;
+            exitCode = 1;
+            continue;
+        }
+        string range = old->second.isNull() ? "* [new branch]" : old->second.hex().substr(0, 7) + ".." + newId.hex().substr(0, 7);
+        cout << "   " << range << "  " << branch << " -> " << branch << endl;
+        if (named)
+        {
+            string refPath = REPO_DIR + "\\refs\\remotes\\" + remote + "\\" + branch;
+            fs::create_directories(fs::path(refPath).parent_path());
+            writeFile(refPath, newId.hex() + "\n");
+        }
+    }
+    if (!wants.empty() && line != "end")
+    {
+        cerr << "Error: The remote did not confirm the push" << endl;
+        exitCode = 1;
+    }
+    if (!connection.close())
+        exitCode = 1;
+    return exitCode;
+}
+
+// Measures every hash backend the CPU supports: throughput on one large buffer, and on a batch
+// of small objects hashed one by one and with the multi-buffer path. The backend repositories
+// use is marked with '*'.
+int cmdHashBench(size_t smallSize)
+{
+    const size_t largeSize = 64 * 1024 * 1024;
+    const size_t maxSmallSize = 16 * 1024 * 1024; // The small objects are slices of the large buffer
+    if (smallSize == 0 || smallSize > maxSmallSize)
+    {
+        cerr << "Error: --size must be between 1 and " << maxSmallSize << " bytes" << endl;
+        return 1;
+    }
+    const size_t smallCount = max<size_t>(1, 16 * 1024 * 1024 / max<size_t>(smallSize, 1));
+    string data(largeSize, '\0');
+    mt19937_64 random(42);
+    for (size_t i = 0; i + 8 <= data.size(); i += 8)
+    {
+        uint64_t v = random();
+        memcpy(&data[i], &v, 8);
+    }
+    vector<string_view> smalls;
+    for (size_t i = 0; i < smallCount; i++)
+        smalls.emplace_back(data.data() + (i * smallSize) % (largeSize - smallSize), smallSize);
+    vector<ObjectId> ids(smallCount);
+
+    // Repeats a run until it has taken a measurable time; returns GB/s
+    auto measure = [](size_t bytesPerRun, const function<void()> &run)
+    {
+        size_t runs = 0;
+        auto start = chrono::steady_clock::now();
+        double seconds = 0;
+        do
+        {
+            run();
+            runs++;
+            seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        } while (seconds < 0.25);
+        return double(bytesPerRun) * runs / seconds / 1e9;
+    };
+
+    HashAlgorithm format = objectFormat;
+    cout << left << setw(10) << "algorithm" << setw(10) << "backend" << right << setw(12) << "64 MiB"
+         << setw(14) << (to_string(smallSize) + " B") << setw(14) << "batched" << "  (GB/s)" << endl;
+    for (const auto &backend : HASH_BACKENDS)
+    {
+        if (!backend.supported())
+            continue;
+        setObjectFormat(backend.algorithm);
+        bool active = &activeHashBackend() == &backend;
+        double large = measure(largeSize, [&]
+                               { hashWithBackend(backend, data.data(), data.size()); });
+        double single = measure(smallSize * smallCount, [&]
+                                { for (size_t i = 0; i < smallCount; i++)
+                                      ids[i] = hashWithBackend(backend, smalls[i].data(), smalls[i].size()); });
+        double batched = measure(smallSize * smallCount, [&]
+                                 { computeHashes(backend, smalls.data(), smalls.size(), ids.data()); });
+        cout << left << setw(10) << hashAlgorithmName(backend.algorithm) << setw(10) << (string(backend.name) + (active ? "*" : ""))
+             << right << fixed << setprecision(2) << setw(12) << large << setw(14) << single << setw(14) << batched << endl;
+    }
+    setObjectFormat(format);
+    return 0;
+}
+
+// Trains a zstd dictionary of about dictSize bytes on the repository's objects (small ones, loose
+// and packed) and stores it as objects/info/zstd-<id>.dict. Small objects share most of what they
+// have in common with each other, which zstd alone cannot exploit one object at a time.
+int cmdTrainDictionary(size_t dictSize)
+{
+#ifdef MYGIT_USE_ZSTD
+    const size_t maxSample = 128 * 1024; // Larger objects compress well on their own
+    const size_t sampleBudget = 100 * dictSize; // zstd's advice: about 100 times the dictionary size
+    vector<ObjectId> ids = listLooseObjects();
+    for (const auto &pack : *getPacks())
+        for (uint32_t i = 0; i < pack->count; i++)
+            ids.push_back(ObjectId::fromRaw(pack->shas + size_t(i) * objectIdLength));
+    mt19937_64 random(42);
+    shuffle(ids.begin(), ids.end(), random);
+
+    string samples;
+    vector<size_t> sampleSizes;
+    for (const auto &sha : ids)
+    {
+        if (samples.size() >= sampleBudget)
+            break;
+        string type;
+        uint64_t size;
+        if (!readObjectHeader(sha, type, size) || size > maxSample)
+            continue;
+        string object = readObject(sha);
+        samples += object;
+        sampleSizes.push_back(object.size());
+    }
+
+    string dict(dictSize, '\0');
+    size_t n = sampleSizes.empty() ? 0 : ZDICT_trainFromBuffer(&dict[0], dict.size(), samples.data(), sampleSizes.data(), static_cast<unsigned>(sampleSizes.size()));
+    if (sampleSizes.empty() || ZDICT_isError(n))
+    {
+        cerr << "Error: Cannot train a dictionary from " << sampleSizes.size() << " objects"
+             << (sampleSizes.empty() ? "" : string(": ") + ZDICT_getErrorName(n)) << endl;
+        return 1;
+    }
+    dict.resize(n);
+    uint32_t id = ZDICT_getDictID(dict.data(), dict.size());
+    writeFile(getZstdDictionaryPath(id), dict);
+    cout << "Trained dictionary " << id << " (" << n << " bytes) on " << sampleSizes.size() << " objects" << endl;
+    cout << "Enable it with: [core] codec = zstd, zstdDictionary = " << id << endl;
+    return 0;
+#else
+    (void)dictSize;
+    cerr << "Error: This build has no zstd support (compile with -DMYGIT_USE_ZSTD -lzstd)" << endl;
+    return 1;
+#endif
+}
+
+// ============= MAIN =============
+
+// Prints the counters collected while the command ran
+void printStats()
+{
+    Codec codec = compressionSettings().codec;
+    cerr << "objects: " << objectStats.written << " written, " << objectStats.skipped << " skipped" << endl;
+    cerr << "compression: " << CODEC_NAMES[static_cast<int>(codec)] << ", "
+         << compressionStats.rawBytes << " -> " << compressionStats.compressedBytes << " bytes, "
+         << compressionStats.stored << " stored uncompressed, "
+         << fixed << setprecision(1) << compressionStats.nanoseconds / 1e6 << " ms" << endl;
+    cerr << "status: " << statusStats.directories << " directories listed, " << statusStats.checked << " files checked, "
+         << statusStats.rehashed << " rehashed" << endl;
+    cerr << "fsmonitor: " << fsmonitorStats.result << ", " << fsmonitorStats.changed << " changed paths reported" << endl;
+    if (chunkStats.blobs > 0)
+        cerr << "chunked blobs: " << chunkStats.blobs << ", " << chunkStats.written << " chunks written, "
+             << chunkStats.reused << " reused (" << chunkStats.reusedBytes << " bytes)" << endl;
+    if (pipelineStats.files > 0)
+        cerr << "pipeline: " << pipelineStats.files << " files, " << pipelineStats.written << " objects in "
+             << pipelineStats.batches << " write batches, " << pipelineStats.memoryWaits << " memory waits, "
+             << pipelineStats.queueWaits << " queue waits" << endl;
+    cerr << "cache tree: " << cacheTreeStats.built << " trees built, " << cacheTreeStats.reused << " reused" << endl;
+    objectCache.report();
+}
+
+int main(int argc, char *argv[])
+{
+    // ... (argument parsing logic) ...
+    if (argc < 2)
+    {
+        cerr << "Usage: mygit <command> [options]" << endl;
+        return 1;
+    }
+
+    // Global options may appear anywhere on the command line
+    int kept = 1;
+    const char *traceOption = getenv("MYGIT_TRACE");
+    for (int i = 1; i < argc; i++)
+    {
+        string arg = argv[i];
+        if (arg == "--stats")
+            showStats = true;
+        else if (arg == "--trace")
+            traceOption = "summary";
+        else if (arg.compare(0, 8, "--trace=") == 0)
+            traceOption = argv[i] + 8;
+        else
+            argv[kept++] = argv[i];
+    }
+    argc = kept;
+    if (argc < 2)
+    {
+        cerr << "Usage: mygit [--stats] [--trace[=<file.json>]] <command> [options]" << endl;
+        return 1;
+    }
+    if (traceOption && *traceOption && string(traceOption) != "0")
+        startTracing(traceOption);
+    TraceReport traceReport;
+
+    string command = argv[1];
+    int exitCode = 0;
+    PendingObjectFlush pendingObjectFlush;
+
+    // The serving side of fetch and push runs in the repository it is given
+    if (command == "upload-pack" || command == "receive-pack")
+    {
+        error_code ec;
+        if (argc != 3)
+        {
+            cerr << "Usage: mygit " << command << " <directory>" << endl;
+            return 1;
+        }
+        fs::current_path(argv[2], ec);
+        if (ec || !isDirectory(REPO_DIR))
+        {
+            cerr << "Error: Not a mygit repository: " << argv[2] << endl;
+            return 1;
+        }
+    }
+    if (command != "init" && command != "hash-bench" && !loadObjectFormat())
+        return 1;
+
+    if (command == "init")
+    {
+        HashAlgorithm format = HashAlgorithm::SHA1;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--object-format=sha256")
+                format = HashAlgorithm::SHA256;
+            else if (arg != "--object-format=sha1")
+            {
+                cerr << "Usage: mygit init [--object-format=sha1|sha256]" << endl;
+                return 1;
+            }
+        }
+        cmdInit(format);
+    }
+    else if (command == "hash-object")
+    {
+        bool write = false, stdinPaths = false;
+        string filepath;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-w")
+                write = true;
+            else if (arg == "--stdin-paths")
+                stdinPaths = true;
+            else
+                filepath = arg;
+        }
+        if (stdinPaths)
+            exitCode = cmdHashObjectBatch(write);
+        else
+            cmdHashObject(filepath, write);
+    }
+    else if (command == "cat-file")
+    {
+        string flag = argc > 2 ? argv[2] : "";
+        if (argc == 3 && (flag == "--batch" || flag == "--batch-check"))
+            exitCode = cmdCatFileBatch(flag == "--batch");
+        else if (argc < 4)
+        {
+            cerr << "Usage: mygit cat-file <-p|-s|-t> <sha> | --batch | --batch-check" << endl;
+            return 1;
+        }
+        else
+            cmdCatFile(argv[3], flag[1]);
+    }
+    else if (command == "write-tree")
+    {
+        unsigned jobs = ThreadPool::defaultJobs();
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc)
+                jobs = max(1, atoi(argv[++i]));
+            else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+                jobs = max(1, atoi(arg.c_str() + 2));
+        }
+        exitCode = cmdWriteTree(jobs);
+    }
+    else if (command == "ls-tree")
+    {
+        bool nameOnly = false;
+        string sha;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--name-only")
+                nameOnly = true;
+            else
+                sha = arg;
+        }
+        cmdLsTree(sha, nameOnly);
+    }
+    else if (command == "add")
+    {
+        vector<string> paths;
+        for (int i = 2; i < argc; i++)
+        {
+            paths.push_back(argv[i]);
+        }
+        cmdAdd(paths);
+    }
+    else if (command == "commit")
+    {
+        string message = "Initial commit";
+        for (int i = 2; i < argc; i++)
+        {
+            if (string(argv[i]) == "-m" && i + 1 < argc)
+            {
+                message = argv[i + 1];
+                break;
+            }
+        }
+        exitCode = cmdCommit(message);
+    }
+    else if (command == "log")
+    {
+        size_t maxCount = 0;
+        string start;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-n" && i + 1 < argc)
+                maxCount = static_cast<size_t>(max(0, atoi(argv[++i])));
+            else if (arg.size() > 1 && arg[0] == '-' && isdigit(static_cast<unsigned char>(arg[1])))
+                maxCount = static_cast<size_t>(atoi(arg.c_str() + 1));
+            else
+                start = arg;
+        }
+        cmdLog(maxCount, start);
+    }
+    else if (command == "status")
+    {
+        bool shortFormat = false;
+        unsigned jobs = ThreadPool::defaultJobs();
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-s" || arg == "--short")
+                shortFormat = true;
+            else if (arg == "-j" && i + 1 < argc)
+                jobs = max(1, atoi(argv[++i]));
+            else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+                jobs = max(1, atoi(arg.c_str() + 2));
+            else
+            {
+                cerr << "Usage: mygit status [-s | --short] [-j N]" << endl;
+                return 1;
+            }
+        }
+        cmdStatus(shortFormat, jobs);
+    }
+    else if (command == "diff")
+    {
+        vector<string> names;
+        bool cached = false, nameStatus = false;
+        unsigned context = 3;
+        unsigned jobs = ThreadPool::defaultJobs();
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--cached" || arg == "--staged")
+                cached = true;
+            else if (arg == "--name-status")
+                nameStatus = true;
+            else if (arg.compare(0, 2, "-U") == 0 && arg.size() > 2)
+                context = static_cast<unsigned>(max(0, atoi(arg.c_str() + 2)));
+            else if (arg.compare(0, 10, "--unified=") == 0)
+                context = static_cast<unsigned>(max(0, atoi(arg.c_str() + 10)));
+            else if (arg == "-j" && i + 1 < argc)
+                jobs = max(1, atoi(argv[++i]));
+            else
+                names.push_back(arg);
+        }
+        exitCode = cmdDiff(names, cached, context, nameStatus, jobs);
+    }
+    else if (command == "checkout")
+    {
+        unsigned jobs = ThreadPool::defaultJobs();
+        string sha;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-j" && i + 1 < argc)
+                jobs = max(1, atoi(argv[++i]));
+            else if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+                jobs = max(1, atoi(arg.c_str() + 2));
+            else
+                sha = arg;
+        }
+        if (sha.empty())
+        {
+            cerr << "Usage: mygit checkout [-j N] <commit-sha>" << endl;
+            return 1;
+        }
+        exitCode = cmdCheckout(sha, jobs);
+    }
+    else if (command == "sparse-checkout")
+    {
+        unsigned jobs = ThreadPool::defaultJobs();
+        vector<string> patterns;
+        for (int i = 3; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg.compare(0, 2, "-j") == 0 && arg.size() > 2)
+                jobs = max(1, atoi(arg.c_str() + 2));
+            else
+                patterns.push_back(arg);
+        }
+        exitCode = cmdSparseCheckout(argc > 2 ? argv[2] : "", patterns, jobs);
+    }
+    else if (command == "merge-base")
+    {
+        bool all = false, isAncestorMode = false;
+        vector<string> names;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--all")
+                all = true;
+            else if (arg == "--is-ancestor")
+                isAncestorMode = true;
+            else
+                names.push_back(arg);
+        }
+        if (names.size() != 2)
+        {
+            cerr << "Usage: mygit merge-base [--all | --is-ancestor] <commit> <commit>" << endl;
+            return 1;
+        }
+        exitCode = cmdMergeBase(names[0], names[1], all, isAncestorMode);
+    }
+    else if (command == "commit-graph")
+    {
+        if (argc < 3 || string(argv[2]) != "write")
+        {
+            cerr << "Usage: mygit commit-graph write" << endl;
+            return 1;
+        }
+        cmdCommitGraphWrite();
+    }
+    else if (command == "hash-bench")
+    {
+        size_t smallSize = 1024;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg.compare(0, 7, "--size=") == 0)
+                smallSize = static_cast<size_t>(strtoull(arg.c_str() + 7, nullptr, 10));
+        }
+        exitCode = cmdHashBench(smallSize);
+    }
+    else if (command == "train-dictionary")
+    {
+        size_t dictSize = 112640; // zstd's default dictionary size
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg.compare(0, 7, "--size=") == 0)
+                dictSize = static_cast<size_t>(max(1024, atoi(arg.c_str() + 7)));
+        }
+        exitCode = cmdTrainDictionary(dictSize);
+    }
+    else if (command == "fsmonitor")
+    {
+        exitCode = cmdFSMonitor(argc > 2 ? argv[2] : "");
+    }
+    else if (command == "repack")
+    {
+        bool removeLoose = false;
+        PackOptions options;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "-d")
+                removeLoose = true;
+            else if (arg.compare(0, 9, "--window=") == 0)
+                options.window = max(0, atoi(arg.c_str() + 9));
+            else if (arg.compare(0, 8, "--depth=") == 0)
+                options.depth = max(1, atoi(arg.c_str() + 8));
+        }
+        cmdRepack(removeLoose, options);
+    }
+    else if (command == "gc")
+    {
+        string prune;
+        PackOptions options;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg.compare(0, 8, "--prune=") == 0)
+                prune = arg.substr(8);
+            else if (arg.compare(0, 9, "--window=") == 0)
+                options.window = max(0, atoi(arg.c_str() + 9));
+            else if (arg.compare(0, 8, "--depth=") == 0)
+                options.depth = max(1, atoi(arg.c_str() + 8));
+        }
+        exitCode = cmdGc(prune, options);
+    }
+    else if (command == "count-objects")
+    {
+        cmdCountObjects();
+    }
+    else if (command == "remote")
+    {
+        exitCode = cmdRemote(vector<string>(argv + 2, argv + argc));
+    }
+    else if (command == "fetch")
+    {
+        string remote = argc > 2 ? argv[2] : "origin";
+        exitCode = cmdFetch(remote, vector<string>(argv + min(argc, 3), argv + argc));
+    }
+    else if (command == "push")
+    {
+        bool force = false;
+        vector<string> args;
+        for (int i = 2; i < argc; i++)
+        {
+            string arg = argv[i];
+            if (arg == "--force" || arg == "-f")
+                force = true;
+            else
+                args.push_back(arg);
+        }
+        string remote = args.empty() ? "origin" : args[0];
+        exitCode = cmdPush(remote, vector<string>(args.begin() + min<size_t>(args.size(), 1), args.end()), force);
+    }
+    else if (command == "upload-pack")
+    {
+        exitCode = cmdUploadPack();
+    }
+    else if (command == "receive-pack")
+    {
+        exitCode = cmdReceivePack();
+    }
+    else
+    {
+        cerr << "Unknown command: " << command << endl;
+        return 1;
+    }
+
+    flushObjectWrites();
+    if (showStats)
+        printStats();
+    finishTracing();
+
+    return exitCode;
+}